@@ -0,0 +1,276 @@
+#include "avio_sink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+}
+
+namespace
+{
+// Seven TS packets: the usual unit for anything carrying a transport stream.
+constexpr std::size_t g_nTsBlockUnit = 188 * 7;
+
+// Size of the AVIOContext's own staging buffer, copied into our blocks.
+constexpr int g_nAvioBufferSize = 188 * 7 * 16;
+}
+
+//////////////////////////////////////////////////////////////////////////
+AvioFileSink::AvioFileSink(const AvioSinkConfig &config)
+    : m_config(config)
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+AvioFileSink::~AvioFileSink()
+{
+    if (m_fd >= 0)
+    {
+        close();
+    }
+
+    for (Block &block : m_vecBlocks)
+    {
+        std::free(block.pData);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool AvioFileSink::open(const std::string &strPath)
+{
+    m_nAlignment = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+
+    // O_DIRECT needs page-multiple writes, so the block must be a multiple of both.
+    const std::size_t nUnit = m_config.bDirectIo ? std::lcm(g_nTsBlockUnit, m_nAlignment) : g_nTsBlockUnit;
+    m_nBlockSize = std::max<std::size_t>((m_config.nBufferSize + nUnit - 1) / nUnit, 1) * nUnit;
+
+    int nFlags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (m_config.bDirectIo)
+    {
+        nFlags |= O_DIRECT;
+    }
+
+    m_fd = ::open(strPath.c_str(), nFlags, 0644);
+    if (m_fd < 0 && m_config.bDirectIo && errno == EINVAL)
+    {
+        std::cerr << "O_DIRECT not supported for '" << strPath << "', falling back to buffered I/O" << std::endl;
+        m_config.bDirectIo = false;
+        m_fd = ::open(strPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (m_fd < 0)
+    {
+        std::cerr << "Could not open output file '" << strPath << "': " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    m_vecBlocks.resize(std::max<std::size_t>(m_config.nBufferCount, 2));
+    for (Block &block : m_vecBlocks)
+    {
+        void *pData = nullptr;
+        if (posix_memalign(&pData, m_nAlignment, m_nBlockSize) != 0)
+        {
+            std::cerr << "Could not allocate " << m_nBlockSize << " byte output buffer" << std::endl;
+            return false;
+        }
+        block.pData = static_cast<uint8_t *>(pData);
+        m_vecFree.push_back(&block);
+    }
+
+    auto *pAvioBuffer = static_cast<uint8_t *>(av_malloc(g_nAvioBufferSize));
+    if (pAvioBuffer == nullptr)
+    {
+        return false;
+    }
+
+    m_pAvioCtx = avio_alloc_context(pAvioBuffer, g_nAvioBufferSize, 1, this, nullptr, &AvioFileSink::write_packet, nullptr);
+    if (m_pAvioCtx == nullptr)
+    {
+        av_free(pAvioBuffer);
+        std::cerr << "Could not allocate output AVIOContext" << std::endl;
+        return false;
+    }
+
+    m_pFilling = m_vecFree.back();
+    m_vecFree.pop_back();
+
+    m_thWriter = std::thread{&AvioFileSink::writer_thread, this};
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool AvioFileSink::close()
+{
+    if (m_pAvioCtx != nullptr)
+    {
+        avio_flush(m_pAvioCtx);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{m_mtx};
+        if (m_pFilling != nullptr && m_pFilling->nUsed > 0)
+        {
+            m_dqFull.push_back(m_pFilling);
+            m_pFilling = nullptr;
+        }
+        m_bClosing = true;
+    }
+    m_cvFull.notify_one();
+
+    if (m_thWriter.joinable())
+    {
+        m_thWriter.join();
+    }
+
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+
+    if (m_pAvioCtx != nullptr)
+    {
+        av_freep(&m_pAvioCtx->buffer);
+        avio_context_free(&m_pAvioCtx);
+    }
+
+    std::lock_guard<std::mutex> lock{m_mtx};
+    return !m_bError;
+}
+
+//////////////////////////////////////////////////////////////////////////
+AvioSinkStats AvioFileSink::stats() const
+{
+    std::lock_guard<std::mutex> lock{m_mtx};
+    return m_stats;
+}
+
+//////////////////////////////////////////////////////////////////////////
+int AvioFileSink::write_packet(void *pOpaque, uint8_t *pBuf, const int nBufSize)
+{
+    return static_cast<AvioFileSink *>(pOpaque)->write(pBuf, static_cast<std::size_t>(nBufSize));
+}
+
+//////////////////////////////////////////////////////////////////////////
+int AvioFileSink::write(const uint8_t *pBuf, const std::size_t nSize)
+{
+    std::size_t nDone = 0;
+    while (nDone < nSize)
+    {
+        if (m_pFilling == nullptr && !next_block())
+        {
+            return AVERROR(EIO);
+        }
+
+        const std::size_t nCopy = std::min(nSize - nDone, m_nBlockSize - m_pFilling->nUsed);
+        std::memcpy(m_pFilling->pData + m_pFilling->nUsed, pBuf + nDone, nCopy);
+        m_pFilling->nUsed += nCopy;
+        nDone += nCopy;
+
+        if (m_pFilling->nUsed == m_nBlockSize)
+        {
+            {
+                std::lock_guard<std::mutex> lock{m_mtx};
+                m_dqFull.push_back(m_pFilling);
+            }
+            m_pFilling = nullptr;
+            m_cvFull.notify_one();
+        }
+    }
+
+    return static_cast<int>(nSize);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool AvioFileSink::next_block()
+{
+    std::unique_lock<std::mutex> lock{m_mtx};
+    if (m_vecFree.empty() && !m_bError)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        m_cvFree.wait(lock, [this] { return !m_vecFree.empty() || m_bError; });
+        m_stats.blockedTime += std::chrono::steady_clock::now() - start;
+    }
+    if (m_bError)
+    {
+        return false;
+    }
+
+    m_pFilling = m_vecFree.back();
+    m_vecFree.pop_back();
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void AvioFileSink::writer_thread()
+{
+    std::unique_lock<std::mutex> lock{m_mtx};
+    while (true)
+    {
+        m_cvFull.wait(lock, [this] { return !m_dqFull.empty() || m_bClosing; });
+        if (m_dqFull.empty())
+        {
+            return;
+        }
+
+        Block *pBlock = m_dqFull.front();
+        m_dqFull.pop_front();
+
+        lock.unlock();
+        const bool bOk = write_block(*pBlock);
+        lock.lock();
+
+        pBlock->nUsed = 0;
+        m_vecFree.push_back(pBlock);
+        if (!bOk)
+        {
+            m_bError = true;
+        }
+        m_cvFree.notify_one();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool AvioFileSink::write_block(const Block &block)
+{
+    if (m_config.bDirectIo && block.nUsed % m_nAlignment != 0)
+    {
+        // Only the final block can be short; finish it without O_DIRECT.
+        fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::size_t nDone = 0;
+    while (nDone < block.nUsed)
+    {
+        const ssize_t nRet = ::write(m_fd, block.pData + nDone, block.nUsed - nDone);
+        if (nRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cerr << "Write to output file failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        nDone += static_cast<std::size_t>(nRet);
+    }
+
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    std::lock_guard<std::mutex> lock{m_mtx};
+    m_stats.writeTime += elapsed;
+    m_stats.nBytesWritten += nDone;
+    ++m_stats.nWrites;
+    return true;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include <libavformat/avio.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+struct AvioSinkConfig
+{
+    // Rounded up to a whole number of 7 x 188 byte blocks (and, for direct
+    // I/O, to a whole number of pages as well).
+    std::size_t nBufferSize{188 * 7 * 512};
+
+    // Two buffers gives classic double buffering: the muxer fills one while
+    // the writer thread drains the other.
+    std::size_t nBufferCount{2};
+
+    // Open the file with O_DIRECT, bypassing the page cache.
+    bool bDirectIo{false};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct AvioSinkStats
+{
+    uint64_t nBytesWritten{0};
+    uint64_t nWrites{0};
+
+    // Time the muxing thread spent waiting for a free buffer. Non-zero
+    // means the disk could not keep up.
+    std::chrono::nanoseconds blockedTime{0};
+
+    // Time the writer thread spent inside write().
+    std::chrono::nanoseconds writeTime{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Output AVIOContext that hands full, page-aligned buffers to a background
+// writer thread, so the muxer only waits on disk once every buffer is
+// already queued for writing.
+class AvioFileSink
+{
+public:
+    explicit AvioFileSink(const AvioSinkConfig &config);
+    ~AvioFileSink();
+
+    AvioFileSink(const AvioFileSink &) = delete;
+    AvioFileSink &operator=(const AvioFileSink &) = delete;
+
+    bool open(const std::string &strPath);
+
+    // Flushes the AVIOContext, waits for the writer and closes the file.
+    // Returns false if any write failed.
+    bool close();
+
+    AVIOContext *context() const { return m_pAvioCtx; }
+
+    AvioSinkStats stats() const;
+
+private:
+    struct Block
+    {
+        uint8_t *pData{nullptr};
+        std::size_t nUsed{0};
+    };
+
+    static int write_packet(void *pOpaque, uint8_t *pBuf, int nBufSize);
+
+    int write(const uint8_t *pBuf, std::size_t nSize);
+    bool next_block();
+    void writer_thread();
+    bool write_block(const Block &block);
+
+    AvioSinkConfig m_config;
+    std::size_t m_nBlockSize{0};
+    std::size_t m_nAlignment{0};
+
+    int m_fd{-1};
+    AVIOContext *m_pAvioCtx{nullptr};
+
+    std::vector<Block> m_vecBlocks;
+    Block *m_pFilling{nullptr};
+
+    mutable std::mutex m_mtx;
+    std::condition_variable m_cvFull;
+    std::condition_variable m_cvFree;
+    std::deque<Block *> m_dqFull;
+    std::vector<Block *> m_vecFree;
+    bool m_bClosing{false};
+    bool m_bError{false};
+
+    AvioSinkStats m_stats;
+    std::thread m_thWriter;
+};
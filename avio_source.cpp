@@ -0,0 +1,144 @@
+#include "avio_source.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+extern "C"
+{
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+}
+
+namespace
+{
+// Size of the AVIOContext's own read buffer.
+constexpr int g_nAvioBufferSize = 256 * 1024;
+
+// How far ahead of the read position readahead is requested.
+constexpr std::size_t g_nReadahead = 16 * 1024 * 1024;
+}
+
+//////////////////////////////////////////////////////////////////////////
+AvioMemorySource::~AvioMemorySource()
+{
+    if (m_pAvioCtx != nullptr)
+    {
+        av_freep(&m_pAvioCtx->buffer);
+        avio_context_free(&m_pAvioCtx);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool AvioMemorySource::open(const std::string &strPath, const Mode eMode)
+{
+    if (eMode == Mode::Mmap)
+    {
+        if (!m_file.open(strPath))
+        {
+            return false;
+        }
+        m_pData = m_file.data();
+        m_nSize = m_file.size();
+    }
+    else
+    {
+        std::ifstream file{strPath, std::ios::binary | std::ios::ate};
+        if (!file)
+        {
+            std::cerr << "Could not open '" << strPath << "'" << std::endl;
+            return false;
+        }
+
+        m_vecRam.resize(static_cast<std::size_t>(file.tellg()));
+        file.seekg(0);
+        if (!file.read(reinterpret_cast<char *>(m_vecRam.data()), static_cast<std::streamsize>(m_vecRam.size())))
+        {
+            std::cerr << "Could not pre-load '" << strPath << "'" << std::endl;
+            return false;
+        }
+        m_pData = m_vecRam.data();
+        m_nSize = m_vecRam.size();
+    }
+
+    auto *pAvioBuffer = static_cast<uint8_t *>(av_malloc(g_nAvioBufferSize));
+    if (pAvioBuffer == nullptr)
+    {
+        return false;
+    }
+
+    m_pAvioCtx = avio_alloc_context(pAvioBuffer,
+                                    g_nAvioBufferSize,
+                                    0,
+                                    this,
+                                    &AvioMemorySource::read_packet,
+                                    nullptr,
+                                    &AvioMemorySource::seek);
+    if (m_pAvioCtx == nullptr)
+    {
+        av_free(pAvioBuffer);
+        std::cerr << "Could not allocate input AVIOContext" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+int AvioMemorySource::read_packet(void *pOpaque, uint8_t *pBuf, const int nBufSize)
+{
+    auto *pThis = static_cast<AvioMemorySource *>(pOpaque);
+    if (pThis->m_nPos >= pThis->m_nSize)
+    {
+        return AVERROR_EOF;
+    }
+
+    const std::size_t nCopy = std::min(static_cast<std::size_t>(nBufSize), pThis->m_nSize - pThis->m_nPos);
+
+    // Keep readahead a window in front of us (mapped mode only); the kernel
+    // also sees MADV_SEQUENTIAL on the mapping as a whole.
+    if (pThis->m_vecRam.empty() && pThis->m_nPos + nCopy + g_nReadahead / 2 >= pThis->m_nAdvisedEnd)
+    {
+        pThis->m_file.will_need(pThis->m_nPos, g_nReadahead);
+        pThis->m_nAdvisedEnd = pThis->m_nPos + g_nReadahead;
+    }
+
+    std::memcpy(pBuf, pThis->m_pData + pThis->m_nPos, nCopy);
+    pThis->m_nPos += nCopy;
+    return static_cast<int>(nCopy);
+}
+
+//////////////////////////////////////////////////////////////////////////
+int64_t AvioMemorySource::seek(void *pOpaque, const int64_t nOffset, const int nWhence)
+{
+    auto *pThis = static_cast<AvioMemorySource *>(pOpaque);
+    const int64_t nSize = static_cast<int64_t>(pThis->m_nSize);
+
+    int64_t nTarget{};
+    switch (nWhence & ~AVSEEK_FORCE)
+    {
+        case AVSEEK_SIZE:
+            return nSize;
+        case SEEK_SET:
+            nTarget = nOffset;
+            break;
+        case SEEK_CUR:
+            nTarget = static_cast<int64_t>(pThis->m_nPos) + nOffset;
+            break;
+        case SEEK_END:
+            nTarget = nSize + nOffset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+
+    if (nTarget < 0 || nTarget > nSize)
+    {
+        return AVERROR(EINVAL);
+    }
+
+    pThis->m_nPos = static_cast<std::size_t>(nTarget);
+    pThis->m_nAdvisedEnd = 0;
+    return nTarget;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+extern "C"
+{
+#include <libavformat/avio.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Input AVIOContext served from memory rather than through the file
+// protocol: either a read-only mapping of the file (no read() syscalls,
+// readahead driven by madvise) or the whole file pre-loaded into RAM, which
+// takes the disk out of benchmarks altogether.
+class AvioMemorySource
+{
+public:
+    enum class Mode
+    {
+        Mmap,
+        Ram
+    };
+
+    AvioMemorySource() = default;
+    ~AvioMemorySource();
+
+    AvioMemorySource(const AvioMemorySource &) = delete;
+    AvioMemorySource &operator=(const AvioMemorySource &) = delete;
+
+    bool open(const std::string &strPath, Mode eMode);
+
+    AVIOContext *context() const { return m_pAvioCtx; }
+
+private:
+    static int read_packet(void *pOpaque, uint8_t *pBuf, int nBufSize);
+    static int64_t seek(void *pOpaque, int64_t nOffset, int nWhence);
+
+    MappedFile m_file;
+    std::vector<uint8_t> m_vecRam;
+
+    const uint8_t *m_pData{nullptr};
+    std::size_t m_nSize{0};
+    std::size_t m_nPos{0};
+
+    // End of the range already advised as WILLNEED.
+    std::size_t m_nAdvisedEnd{0};
+
+    AVIOContext *m_pAvioCtx{nullptr};
+};
@@ -0,0 +1,258 @@
+#include "batch_scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+//////////////////////////////////////////////////////////////////////////
+bool load_batch_jobs(const std::string &strPath, std::vector<BatchJob> &out_vecJobs)
+{
+    std::ifstream file{strPath};
+    if (!file)
+    {
+        std::cerr << "Could not open job list "
+                  << strPath
+                  << std::endl;
+        return false;
+    }
+
+    out_vecJobs.clear();
+    std::string strLine;
+    for (int nLine = 1; std::getline(file, strLine); ++nLine)
+    {
+        std::istringstream line{strLine};
+        BatchJob job;
+        if (!(line >> job.strInput) || job.strInput[0] == '#')
+        {
+            continue;
+        }
+
+        std::string strBitRate;
+        std::string strExtra;
+        if (!(line >> job.strOutput) || ((line >> strBitRate) && (line >> strExtra)))
+        {
+            std::cerr << strPath
+                      << ":"
+                      << nLine
+                      << ": expected \"input output [bitrate]\""
+                      << std::endl;
+            return false;
+        }
+
+        if (!strBitRate.empty())
+        {
+            char *pszEnd = nullptr;
+            job.nBitRate = std::strtoll(strBitRate.c_str(), &pszEnd, 10);
+            if (*pszEnd != '\0' || job.nBitRate <= 0)
+            {
+                std::cerr << strPath
+                          << ":"
+                          << nLine
+                          << ": invalid bitrate "
+                          << strBitRate
+                          << std::endl;
+                return false;
+            }
+        }
+
+        out_vecJobs.push_back(std::move(job));
+    }
+
+    if (out_vecJobs.empty())
+    {
+        std::cerr << "Job list "
+                  << strPath
+                  << " is empty"
+                  << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+BatchScheduler::BatchScheduler(const BatchSchedulerConfig &config)
+    : m_config{config}
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool BatchScheduler::run(const std::vector<BatchJob> &vecJobs, const JobFunction &fnRun, std::vector<BatchJobResult> &out_vecResults)
+{
+    const std::size_t nWorkers = std::max<std::size_t>(1, std::min(m_config.nWorkers, vecJobs.size()));
+
+    m_vecQueues.clear();
+    for (std::size_t i = 0; i < nWorkers; ++i)
+    {
+        m_vecQueues.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (std::size_t i = 0; i < vecJobs.size(); ++i)
+    {
+        m_vecQueues[i % nWorkers]->jobs.push_back(i);
+    }
+
+    m_nFreeThreads = std::max(m_config.nThreadBudget, 1);
+    m_nUnstarted = vecJobs.size();
+    m_nBusyWorkers = 0;
+
+    out_vecResults.assign(vecJobs.size(), BatchJobResult{});
+
+    std::vector<std::thread> vecThreads;
+    for (std::size_t i = 0; i < nWorkers; ++i)
+    {
+        vecThreads.emplace_back(&BatchScheduler::worker, this, i, std::cref(vecJobs), std::cref(fnRun), std::ref(out_vecResults));
+    }
+    for (auto &thread : vecThreads)
+    {
+        thread.join();
+    }
+
+    return std::all_of(out_vecResults.begin(), out_vecResults.end(), [](const BatchJobResult &result) { return result.bOk; });
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool BatchScheduler::next_job(const std::size_t nWorker, std::size_t &out_nJob)
+{
+    {
+        WorkerQueue &own = *m_vecQueues[nWorker];
+        std::lock_guard<std::mutex> lock{own.mtx};
+        if (!own.jobs.empty())
+        {
+            out_nJob = own.jobs.front();
+            own.jobs.pop_front();
+            return true;
+        }
+    }
+
+    // Steal from the back of the longest other queue. The sizes may change
+    // before we lock the victim, so retry until every queue is empty.
+    while (true)
+    {
+        std::size_t nVictim = nWorker;
+        std::size_t nLongest = 0;
+        for (std::size_t i = 0; i < m_vecQueues.size(); ++i)
+        {
+            std::lock_guard<std::mutex> lock{m_vecQueues[i]->mtx};
+            if (i != nWorker && m_vecQueues[i]->jobs.size() > nLongest)
+            {
+                nVictim = i;
+                nLongest = m_vecQueues[i]->jobs.size();
+            }
+        }
+        if (nLongest == 0)
+        {
+            return false;
+        }
+
+        WorkerQueue &victim = *m_vecQueues[nVictim];
+        std::lock_guard<std::mutex> lock{victim.mtx};
+        if (!victim.jobs.empty())
+        {
+            out_nJob = victim.jobs.back();
+            victim.jobs.pop_back();
+            return true;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+int BatchScheduler::acquire_threads()
+{
+    std::lock_guard<std::mutex> lock{m_mtxBudget};
+
+    // The calling worker is idle and its job is still counted as unstarted.
+    const std::size_t nIdleWorkers = m_vecQueues.size() - m_nBusyWorkers;
+    const auto nStarting = static_cast<int>(std::max<std::size_t>(1, std::min(nIdleWorkers, m_nUnstarted)));
+
+    // With a budget smaller than the worker count every job still gets a
+    // thread; the pool then runs overdrawn until enough jobs finish.
+    const int nThreads = std::max(1, m_nFreeThreads / nStarting);
+    m_nFreeThreads -= nThreads;
+    --m_nUnstarted;
+    ++m_nBusyWorkers;
+    return nThreads;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void BatchScheduler::release_threads(const int nThreads)
+{
+    std::lock_guard<std::mutex> lock{m_mtxBudget};
+    m_nFreeThreads += nThreads;
+    --m_nBusyWorkers;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void BatchScheduler::worker(const std::size_t nWorker, const std::vector<BatchJob> &vecJobs, const JobFunction &fnRun, std::vector<BatchJobResult> &inout_vecResults)
+{
+    std::size_t nJob = 0;
+    while (next_job(nWorker, nJob))
+    {
+        BatchJobResult &result = inout_vecResults[nJob];
+        result.nThreads = acquire_threads();
+
+        const auto start = std::chrono::steady_clock::now();
+        result.bOk = fnRun(vecJobs[nJob], result.nThreads, result);
+        result.dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        release_threads(result.nThreads);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_batch_summary(const std::vector<BatchJob> &vecJobs, const std::vector<BatchJobResult> &vecResults, const double dWallSeconds)
+{
+    uint64_t nTotalFrames = 0;
+    std::size_t nOk = 0;
+
+    std::cout << std::fixed << std::setprecision(2);
+    for (std::size_t i = 0; i < vecJobs.size(); ++i)
+    {
+        const BatchJobResult &result = vecResults[i];
+        std::cout << "Job "
+                  << i + 1
+                  << " "
+                  << vecJobs[i].strInput
+                  << " -> "
+                  << vecJobs[i].strOutput
+                  << ": ";
+        if (!result.bOk)
+        {
+            std::cout << "FAILED after "
+                      << result.dSeconds
+                      << " s"
+                      << std::endl;
+            continue;
+        }
+
+        ++nOk;
+        nTotalFrames += result.nFrames;
+        std::cout << result.nFrames
+                  << " frames in "
+                  << result.dSeconds
+                  << " s ("
+                  << (result.dSeconds > 0.0 ? static_cast<double>(result.nFrames) / result.dSeconds : 0.0)
+                  << " fps), "
+                  << result.nThreads
+                  << " encoder threads"
+                  << std::endl;
+    }
+
+    std::cout << "Batch: "
+              << nOk
+              << "/"
+              << vecJobs.size()
+              << " jobs, "
+              << nTotalFrames
+              << " frames in "
+              << dWallSeconds
+              << " s, aggregate "
+              << (dWallSeconds > 0.0 ? static_cast<double>(nTotalFrames) / dWallSeconds : 0.0)
+              << " fps"
+              << std::endl;
+    std::cout << std::defaultfloat;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////
+struct BatchJob
+{
+    std::string strInput;
+    std::string strOutput;
+
+    // Video bitrate; 0 = the batch default.
+    int64_t nBitRate{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct BatchJobResult
+{
+    bool bOk{false};
+    int nThreads{0};
+    uint64_t nFrames{0};
+    double dSeconds{0.0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Reads a job list: one "input output [bitrate]" per line, whitespace
+// separated. Blank lines and lines starting with '#' are skipped.
+bool load_batch_jobs(const std::string &strPath, std::vector<BatchJob> &out_vecJobs);
+
+//////////////////////////////////////////////////////////////////////////
+struct BatchSchedulerConfig
+{
+    // Jobs running at once.
+    std::size_t nWorkers{1};
+
+    // Encoder threads shared by all running jobs.
+    int nThreadBudget{1};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Runs a job list on a fixed set of workers under one encoder thread
+// budget.
+//
+// Jobs are dealt round-robin onto per-worker deques. A worker takes from the
+// front of its own deque and, once that is empty, steals from the back of
+// the fullest other one, so a worker stuck with long jobs does not hold up
+// the rest.
+//
+// x264 cannot resize its thread pool once open, so the budget is divided
+// as each job starts: it gets an equal share of the threads not held by
+// running jobs, split between the idle workers that still have jobs to
+// start. While the queue is long every job gets budget / workers. As the
+// list drains, the threads of finished jobs go to the ones started last.
+class BatchScheduler
+{
+public:
+    using JobFunction = std::function<bool(const BatchJob &job, int nThreads, BatchJobResult &out_result)>;
+
+    explicit BatchScheduler(const BatchSchedulerConfig &config);
+
+    // Runs every job; out_vecResults is indexed like vecJobs. Returns false
+    // if any job failed.
+    bool run(const std::vector<BatchJob> &vecJobs, const JobFunction &fnRun, std::vector<BatchJobResult> &out_vecResults);
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mtx;
+        std::deque<std::size_t> jobs;
+    };
+
+    bool next_job(std::size_t nWorker, std::size_t &out_nJob);
+    int acquire_threads();
+    void release_threads(int nThreads);
+    void worker(std::size_t nWorker, const std::vector<BatchJob> &vecJobs, const JobFunction &fnRun, std::vector<BatchJobResult> &inout_vecResults);
+
+    const BatchSchedulerConfig m_config;
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_vecQueues;
+
+    // Thread budget; guarded by m_mtxBudget.
+    std::mutex m_mtxBudget;
+    int m_nFreeThreads{0};
+    std::size_t m_nUnstarted{0};
+    std::size_t m_nBusyWorkers{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+void print_batch_summary(const std::vector<BatchJob> &vecJobs, const std::vector<BatchJobResult> &vecResults, double dWallSeconds);
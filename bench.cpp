@@ -0,0 +1,888 @@
+#include "encoder_settings.hpp"
+#include "frame_pool.hpp"
+#include "media_utils.hpp"
+#include "pixel_convert.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Throughput benchmark: encodes synthetic frames generated in memory
+// through the same encoder configuration and TS mux path as x264_cbr, over
+// a matrix of resolutions, presets, thread counts and bitrates. The TS is
+// counted rather than written, so no disk I/O is involved.
+//
+// With --convert, it instead times the conversion of decoded pictures to
+// 8-bit 4:2:0: PixelConverter's SIMD kernels against its sws_scale path,
+// for the same source formats and resolutions.
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+//////////////////////////////////////////////////////////////////////////
+struct BenchResolution
+{
+    std::string strName;
+    int nWidth;
+    int nHeight;
+    bool bInterlaced;
+};
+
+const std::vector<BenchResolution> g_vecResolutions = {
+    {"576i", 720, 576, true},
+    {"720p", 1280, 720, false},
+    {"1080i", 1920, 1080, true},
+    {"1080p", 1920, 1080, false},
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct BenchOptions
+{
+    std::vector<BenchResolution> vecResolutions;
+    std::vector<std::string> vecPresets{"faster"};
+    std::vector<int> vecThreads{0};
+    std::vector<int64_t> vecBitRates{6000000};
+    int nFrames{250};
+    uint32_t nSeed{1};
+
+    // Source formats for the conversion benchmark; empty runs the encode
+    // matrix.
+    std::vector<AVPixelFormat> vecConvertFormats;
+
+    bool bJson{false};
+    std::string strOutputPath;
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct BenchResult
+{
+    BenchResolution resolution;
+    std::string strPreset;
+    int nThreads{0};
+    int64_t nBitRate{0};
+
+    bool bOk{false};
+    int nFrames{0};
+    double dSeconds{0.0};
+
+    // Accumulated stage times.
+    int64_t nGenerateNs{0};
+    int64_t nEncodeNs{0};
+    int64_t nMuxNs{0};
+
+    uint64_t nBytesWritten{0};
+    uint64_t nVideoBytes{0};
+
+    // Video bitrate over consecutive one second windows.
+    double dMeanBps{0.0};
+    double dStdDevBps{0.0};
+
+    double fps() const { return dSeconds > 0.0 ? nFrames / dSeconds : 0.0; }
+    double ns_per_frame(const int64_t nNs) const { return nFrames > 0 ? static_cast<double>(nNs) / nFrames : 0.0; }
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct ConvertResult
+{
+    BenchResolution resolution;
+    AVPixelFormat eSrcFmt{AV_PIX_FMT_NONE};
+
+    // "pixel_convert" with the kernels it ran, or "sws_scale".
+    std::string strMethod;
+    std::string strKernels;
+
+    bool bOk{false};
+    int nFrames{0};
+    double dSeconds{0.0};
+
+    double fps() const { return dSeconds > 0.0 ? nFrames / dSeconds : 0.0; }
+    double ns_per_frame() const { return nFrames > 0 ? dSeconds * 1e9 / nFrames : 0.0; }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Deterministic test pattern: a moving diagonal gradient with a panning
+// noise texture on top (so motion search and residual coding have real
+// work to do), and slowly cycling chroma.
+class SyntheticSource
+{
+public:
+    SyntheticSource(const int nWidth, const int nHeight, const uint32_t nSeed)
+        : m_pool(nWidth, nHeight, AV_PIX_FMT_YUV420P),
+          m_nWidth(nWidth),
+          m_nHeight(nHeight),
+          m_vecTexture(static_cast<std::size_t>(nWidth) * nHeight)
+    {
+        // xorshift32; any fixed seed gives the same frames on every run.
+        uint32_t nState = nSeed != 0 ? nSeed : 1;
+        for (uint8_t &nTexel : m_vecTexture)
+        {
+            nState ^= nState << 13;
+            nState ^= nState >> 17;
+            nState ^= nState << 5;
+            nTexel = static_cast<uint8_t>(nState >> 24);
+        }
+    }
+
+    bool valid() const { return m_pool.valid(); }
+
+    bool next(AVFrame *pFrame, const int nIndex)
+    {
+        if (!m_pool.get_buffer(pFrame))
+        {
+            return false;
+        }
+
+        for (int y = 0; y < m_nHeight; ++y)
+        {
+            uint8_t *pRow = pFrame->data[0] + static_cast<std::ptrdiff_t>(y) * pFrame->linesize[0];
+            const uint8_t *pTexRow = m_vecTexture.data() + static_cast<std::size_t>(y) * m_nWidth;
+            for (int x = 0; x < m_nWidth; ++x)
+            {
+                const int nTex = pTexRow[(x + 4 * nIndex) % m_nWidth] >> 2;
+                pRow[x] = static_cast<uint8_t>(16 + (((x + y + 2 * nIndex) & 0x7F) + nTex) % 220);
+            }
+        }
+
+        for (int y = 0; y < m_nHeight / 2; ++y)
+        {
+            uint8_t *pRowU = pFrame->data[1] + static_cast<std::ptrdiff_t>(y) * pFrame->linesize[1];
+            uint8_t *pRowV = pFrame->data[2] + static_cast<std::ptrdiff_t>(y) * pFrame->linesize[2];
+            for (int x = 0; x < m_nWidth / 2; ++x)
+            {
+                pRowU[x] = static_cast<uint8_t>(112 + ((x + nIndex) & 0x1F));
+                pRowV[x] = static_cast<uint8_t>(112 + ((y - nIndex) & 0x1F));
+            }
+        }
+
+        return true;
+    }
+
+private:
+    VideoBufferPool m_pool;
+    const int m_nWidth;
+    const int m_nHeight;
+    std::vector<uint8_t> m_vecTexture;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Write-only AVIOContext that just counts what the muxer produces.
+class CountingOutput
+{
+public:
+    CountingOutput()
+    {
+        constexpr int nBufferSize = 188 * 7 * 64;
+        auto *pBuffer = static_cast<uint8_t *>(av_malloc(nBufferSize));
+        if (pBuffer != nullptr)
+        {
+            m_pAvioCtx = avio_alloc_context(pBuffer, nBufferSize, 1, this, nullptr, &CountingOutput::write_packet, nullptr);
+            if (m_pAvioCtx == nullptr)
+            {
+                av_free(pBuffer);
+            }
+        }
+    }
+
+    ~CountingOutput()
+    {
+        if (m_pAvioCtx != nullptr)
+        {
+            av_freep(&m_pAvioCtx->buffer);
+            avio_context_free(&m_pAvioCtx);
+        }
+    }
+
+    CountingOutput(const CountingOutput &) = delete;
+    CountingOutput &operator=(const CountingOutput &) = delete;
+
+    AVIOContext *context() const { return m_pAvioCtx; }
+    uint64_t bytes() const { return m_nBytes; }
+
+private:
+    static int write_packet(void *pOpaque, uint8_t *, const int nBufSize)
+    {
+        static_cast<CountingOutput *>(pOpaque)->m_nBytes += static_cast<uint64_t>(nBufSize);
+        return nBufSize;
+    }
+
+    AVIOContext *m_pAvioCtx{nullptr};
+    uint64_t m_nBytes{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Receives every packet the encoder has ready and muxes it.
+int mux_encoded_packets(AVCodecContext *pCdcCtxOut,
+                        AVFormatContext *pFmtCtxOut,
+                        AVStream *pStVideoOut,
+                        AVPacket *pPkt,
+                        std::vector<uint64_t> &inout_vecSecondBytes,
+                        BenchResult &inout_result)
+{
+    while (true)
+    {
+        const Clock::time_point tEncode = Clock::now();
+        int ret = avcodec_receive_packet(pCdcCtxOut, pPkt);
+        inout_result.nEncodeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - tEncode).count();
+        if (ret != 0)
+        {
+            return ret;
+        }
+
+        // One-second buckets by DTS (encoder time base is 1/fps).
+        const int64_t nSecond = std::max<int64_t>(pPkt->dts, 0) * pCdcCtxOut->time_base.num / pCdcCtxOut->time_base.den;
+        if (static_cast<std::size_t>(nSecond) >= inout_vecSecondBytes.size())
+        {
+            inout_vecSecondBytes.resize(static_cast<std::size_t>(nSecond) + 1, 0);
+        }
+        inout_vecSecondBytes[static_cast<std::size_t>(nSecond)] += static_cast<uint64_t>(pPkt->size);
+        inout_result.nVideoBytes += static_cast<uint64_t>(pPkt->size);
+
+        av_packet_rescale_ts(pPkt, pCdcCtxOut->time_base, pStVideoOut->time_base);
+        pPkt->stream_index = pStVideoOut->index;
+
+        const Clock::time_point tMux = Clock::now();
+        ret = av_interleaved_write_frame(pFmtCtxOut, pPkt);
+        inout_result.nMuxNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - tMux).count();
+        if (ret != 0)
+        {
+            std::cerr << "Unexpected error writing packet: "
+                      << error_code_to_string(ret)
+                      << std::endl;
+            return ret;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool run_bench_case(const BenchOptions &options, BenchResult &inout_result)
+{
+    const BenchResolution &resolution = inout_result.resolution;
+
+    // configure_cbr_encoder() takes the picture geometry from the decoder.
+    CodecContextPtr apCdcCtxSource{avcodec_alloc_context3(nullptr)};
+    if (!apCdcCtxSource)
+    {
+        return false;
+    }
+    apCdcCtxSource->width = resolution.nWidth;
+    apCdcCtxSource->height = resolution.nHeight;
+
+    CbrEncoderSettings settings{};
+    settings.strPreset = inout_result.strPreset;
+    settings.nThreads = inout_result.nThreads;
+    settings.nBitRate = inout_result.nBitRate;
+
+    OutputFormatContextPtr apFmtCtxOut;
+    if (!open_output_format_context("bench.ts", apFmtCtxOut))
+    {
+        return false;
+    }
+
+    CountingOutput output;
+    if (output.context() == nullptr)
+    {
+        return false;
+    }
+    apFmtCtxOut->pb = output.context();
+
+    AVStream *pStVideoOut{};
+    CodecContextPtr apCdcCtxOut;
+    if (!open_encoder_context(apFmtCtxOut.get(),
+                              apCdcCtxOut,
+                              pStVideoOut,
+                              "libx264",
+                              [&settings, &resolution, pCdcCtxIn=apCdcCtxSource.get()](AVStream *, AVCodecContext *pCdcCtxOut, AVDictionary *&pDict) -> bool
+                              {
+                                  if (!configure_cbr_encoder(settings, pCdcCtxIn, pCdcCtxOut, pDict))
+                                  {
+                                      return false;
+                                  }
+                                  if (!resolution.bInterlaced)
+                                  {
+                                      pCdcCtxOut->field_order = AV_FIELD_PROGRESSIVE;
+                                      pCdcCtxOut->flags &= ~(AV_CODEC_FLAG_INTERLACED_DCT | AV_CODEC_FLAG_INTERLACED_ME);
+                                  }
+                                  return true;
+                              }))
+    {
+        apFmtCtxOut->pb = nullptr;
+        return false;
+    }
+
+    AVDictionary *pDict{};
+    av_dict_set_int(&pDict, "muxrate", cbr_mux_rate(settings), 0);
+    av_dict_set_int(&pDict, "max_delay", cbr_mux_max_delay(settings), 0);
+    const int retHeader = avformat_write_header(apFmtCtxOut.get(), &pDict);
+    av_dict_free(&pDict);
+    if (retHeader < 0)
+    {
+        std::cerr << "Could not write TS header: "
+                  << error_code_to_string(retHeader)
+                  << std::endl;
+        apFmtCtxOut->pb = nullptr;
+        return false;
+    }
+
+    SyntheticSource source{resolution.nWidth, resolution.nHeight, options.nSeed};
+    FramePtr apFrame{av_frame_alloc()};
+    PacketPtr apPkt{av_packet_alloc()};
+    if (!source.valid() || !apFrame || !apPkt)
+    {
+        apFmtCtxOut->pb = nullptr;
+        return false;
+    }
+
+    std::vector<uint64_t> vecSecondBytes;
+    bool bOk{true};
+
+    const Clock::time_point tStart = Clock::now();
+    for (int i = 0; bOk && i <= options.nFrames; ++i)
+    {
+        // One extra pass with a null frame flushes the encoder.
+        AVFrame *pSend{nullptr};
+        if (i < options.nFrames)
+        {
+            const Clock::time_point tGenerate = Clock::now();
+            if (!source.next(apFrame.get(), i))
+            {
+                bOk = false;
+                break;
+            }
+            inout_result.nGenerateNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - tGenerate).count();
+
+            apFrame->pts = static_cast<int64_t>(i) * apCdcCtxOut->time_base.num;
+            apFrame->interlaced_frame = resolution.bInterlaced ? 1 : 0;
+            apFrame->top_field_first = resolution.bInterlaced ? 1 : 0;
+            pSend = apFrame.get();
+        }
+
+        const Clock::time_point tEncode = Clock::now();
+        int ret = avcodec_send_frame(apCdcCtxOut.get(), pSend);
+        inout_result.nEncodeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - tEncode).count();
+        av_frame_unref(apFrame.get());
+        if (ret < 0)
+        {
+            std::cerr << "Unexpected error sending frame to encoder: "
+                      << error_code_to_string(ret)
+                      << std::endl;
+            bOk = false;
+            break;
+        }
+
+        ret = mux_encoded_packets(apCdcCtxOut.get(), apFmtCtxOut.get(), pStVideoOut, apPkt.get(), vecSecondBytes, inout_result);
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+        {
+            bOk = false;
+        }
+    }
+
+    if (bOk)
+    {
+        av_write_trailer(apFmtCtxOut.get());
+    }
+    avio_flush(apFmtCtxOut->pb);
+    inout_result.dSeconds = std::chrono::duration<double>(Clock::now() - tStart).count();
+
+    // CountingOutput owns the AVIOContext.
+    apFmtCtxOut->pb = nullptr;
+
+    inout_result.nFrames = options.nFrames;
+    inout_result.nBytesWritten = output.bytes();
+
+    // Only complete seconds count towards the variance.
+    const std::size_t nFullSeconds = static_cast<std::size_t>(options.nFrames) * apCdcCtxOut->time_base.num / apCdcCtxOut->time_base.den;
+    if (nFullSeconds > 0 && vecSecondBytes.size() >= nFullSeconds)
+    {
+        double dSum = 0.0;
+        double dSumSq = 0.0;
+        for (std::size_t i = 0; i < nFullSeconds; ++i)
+        {
+            const double dBps = static_cast<double>(vecSecondBytes[i]) * 8.0;
+            dSum += dBps;
+            dSumSq += dBps * dBps;
+        }
+        inout_result.dMeanBps = dSum / nFullSeconds;
+        inout_result.dStdDevBps = std::sqrt(std::max(0.0, dSumSq / nFullSeconds - inout_result.dMeanBps * inout_result.dMeanBps));
+    }
+
+    return bOk;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Random samples in every plane of pFrame; 10-bit formats get 10-bit
+// values.
+void fill_convert_source(AVFrame *pFrame, const uint32_t nSeed)
+{
+    const auto ePixFmt = static_cast<AVPixelFormat>(pFrame->format);
+    const AVPixFmtDescriptor *pDesc = av_pix_fmt_desc_get(ePixFmt);
+    const bool b10Bit = ePixFmt == AV_PIX_FMT_YUV420P10LE || ePixFmt == AV_PIX_FMT_YUV422P10LE;
+
+    uint32_t nState = nSeed != 0 ? nSeed : 1;
+    for (int nPlane = 0; nPlane < 4 && pFrame->data[nPlane] != nullptr; ++nPlane)
+    {
+        const int nRows = nPlane == 0 ? pFrame->height : AV_CEIL_RSHIFT(pFrame->height, pDesc->log2_chroma_h);
+        for (int y = 0; y < nRows; ++y)
+        {
+            uint8_t *pRow = pFrame->data[nPlane] + static_cast<std::ptrdiff_t>(y) * pFrame->linesize[nPlane];
+            for (int x = 0; x < pFrame->linesize[nPlane]; ++x)
+            {
+                nState ^= nState << 13;
+                nState ^= nState >> 17;
+                nState ^= nState << 5;
+                pRow[x] = static_cast<uint8_t>(nState >> 24);
+                if (b10Bit && (x & 1) != 0)
+                {
+                    pRow[x] &= 0x03;
+                }
+            }
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Converts the same source picture options.nFrames times with
+// PixelConverter's kernels and then with its sws_scale path, and adds a
+// result for each. Both downsample interlaced chroma per field, and both
+// write into pooled pictures, as in the pipeline.
+bool run_convert_case(const BenchOptions &options,
+                      const BenchResolution &resolution,
+                      const AVPixelFormat eSrcFmt,
+                      std::vector<ConvertResult> &inout_vecResults)
+{
+    FramePtr apSrc{av_frame_alloc()};
+    FramePtr apDst{av_frame_alloc()};
+    if (!apSrc || !apDst)
+    {
+        return false;
+    }
+    apSrc->format = eSrcFmt;
+    apSrc->width = resolution.nWidth;
+    apSrc->height = resolution.nHeight;
+    apSrc->interlaced_frame = resolution.bInterlaced ? 1 : 0;
+    apSrc->top_field_first = resolution.bInterlaced ? 1 : 0;
+    if (int ret = av_frame_get_buffer(apSrc.get(), 0); ret < 0)
+    {
+        std::cerr << "Could not allocate source picture: "
+                  << error_code_to_string(ret)
+                  << std::endl;
+        return false;
+    }
+    fill_convert_source(apSrc.get(), options.nSeed);
+
+    for (const ConvertMethod eMethod : {ConvertMethod::Kernels, ConvertMethod::Swscale})
+    {
+        PixelConverter converter{resolution.nWidth, resolution.nHeight, resolution.bInterlaced, eMethod};
+
+        ConvertResult result{};
+        result.resolution = resolution;
+        result.eSrcFmt = eSrcFmt;
+        result.strMethod = eMethod == ConvertMethod::Kernels ? "pixel_convert" : "sws_scale";
+        result.strKernels = eMethod == ConvertMethod::Kernels ? simd_level_name(converter.simd_level()) : "bilinear";
+        result.nFrames = options.nFrames;
+        result.bOk = true;
+
+        const Clock::time_point tStart = Clock::now();
+        for (int i = 0; result.bOk && i < options.nFrames; ++i)
+        {
+            result.bOk = converter.convert(apSrc.get(), apDst.get());
+            av_frame_unref(apDst.get());
+        }
+        result.dSeconds = std::chrono::duration<double>(Clock::now() - tStart).count();
+        inout_vecResults.push_back(result);
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void write_convert_csv(std::ostream &stream, const std::vector<ConvertResult> &vecResults)
+{
+    stream << "resolution,width,height,interlaced,pix_fmt,method,kernels,ok,frames,seconds,fps,ns_per_frame\n";
+
+    stream << std::fixed << std::setprecision(3);
+    for (const ConvertResult &result : vecResults)
+    {
+        stream << result.resolution.strName << ','
+               << result.resolution.nWidth << ','
+               << result.resolution.nHeight << ','
+               << (result.resolution.bInterlaced ? 1 : 0) << ','
+               << av_get_pix_fmt_name(result.eSrcFmt) << ','
+               << result.strMethod << ','
+               << result.strKernels << ','
+               << (result.bOk ? 1 : 0) << ','
+               << result.nFrames << ','
+               << result.dSeconds << ','
+               << result.fps() << ','
+               << result.ns_per_frame() << '\n';
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void write_convert_json(std::ostream &stream, const std::vector<ConvertResult> &vecResults)
+{
+    stream << std::fixed << std::setprecision(3) << "[";
+
+    bool bFirst = true;
+    for (const ConvertResult &result : vecResults)
+    {
+        stream << (bFirst ? "\n" : ",\n")
+               << "  {\"resolution\": \"" << result.resolution.strName << "\""
+               << ", \"width\": " << result.resolution.nWidth
+               << ", \"height\": " << result.resolution.nHeight
+               << ", \"interlaced\": " << (result.resolution.bInterlaced ? "true" : "false")
+               << ", \"pix_fmt\": \"" << av_get_pix_fmt_name(result.eSrcFmt) << "\""
+               << ", \"method\": \"" << result.strMethod << "\""
+               << ", \"kernels\": \"" << result.strKernels << "\""
+               << ", \"ok\": " << (result.bOk ? "true" : "false")
+               << ", \"frames\": " << result.nFrames
+               << ", \"seconds\": " << result.dSeconds
+               << ", \"fps\": " << result.fps()
+               << ", \"ns_per_frame\": " << result.ns_per_frame() << "}";
+        bFirst = false;
+    }
+
+    stream << "\n]\n";
+}
+
+//////////////////////////////////////////////////////////////////////////
+void write_results_csv(std::ostream &stream, const std::vector<BenchResult> &vecResults)
+{
+    stream << "resolution,width,height,preset,threads,bitrate,ok,frames,seconds,fps,"
+              "generate_ns_per_frame,encode_ns_per_frame,mux_ns_per_frame,"
+              "bytes_written,video_bytes,video_bps_mean,video_bps_stddev\n";
+
+    stream << std::fixed << std::setprecision(3);
+    for (const BenchResult &result : vecResults)
+    {
+        stream << result.resolution.strName << ','
+               << result.resolution.nWidth << ','
+               << result.resolution.nHeight << ','
+               << result.strPreset << ','
+               << result.nThreads << ','
+               << result.nBitRate << ','
+               << (result.bOk ? 1 : 0) << ','
+               << result.nFrames << ','
+               << result.dSeconds << ','
+               << result.fps() << ','
+               << result.ns_per_frame(result.nGenerateNs) << ','
+               << result.ns_per_frame(result.nEncodeNs) << ','
+               << result.ns_per_frame(result.nMuxNs) << ','
+               << result.nBytesWritten << ','
+               << result.nVideoBytes << ','
+               << result.dMeanBps << ','
+               << result.dStdDevBps << '\n';
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void write_results_json(std::ostream &stream, const std::vector<BenchResult> &vecResults)
+{
+    stream << std::fixed << std::setprecision(3) << "[";
+
+    bool bFirst = true;
+    for (const BenchResult &result : vecResults)
+    {
+        stream << (bFirst ? "\n" : ",\n")
+               << "  {\"resolution\": \"" << result.resolution.strName << "\""
+               << ", \"width\": " << result.resolution.nWidth
+               << ", \"height\": " << result.resolution.nHeight
+               << ", \"preset\": \"" << result.strPreset << "\""
+               << ", \"threads\": " << result.nThreads
+               << ", \"bitrate\": " << result.nBitRate
+               << ", \"ok\": " << (result.bOk ? "true" : "false")
+               << ", \"frames\": " << result.nFrames
+               << ", \"seconds\": " << result.dSeconds
+               << ", \"fps\": " << result.fps()
+               << ", \"generate_ns_per_frame\": " << result.ns_per_frame(result.nGenerateNs)
+               << ", \"encode_ns_per_frame\": " << result.ns_per_frame(result.nEncodeNs)
+               << ", \"mux_ns_per_frame\": " << result.ns_per_frame(result.nMuxNs)
+               << ", \"bytes_written\": " << result.nBytesWritten
+               << ", \"video_bytes\": " << result.nVideoBytes
+               << ", \"video_bps_mean\": " << result.dMeanBps
+               << ", \"video_bps_stddev\": " << result.dStdDevBps << "}";
+        bFirst = false;
+    }
+
+    stream << "\n]\n";
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_usage()
+{
+    std::cerr << "Usage: ./x264_cbr_bench [options]" << std::endl
+              << "Options:" << std::endl
+              << "  --resolutions=A,B  Any of 576i, 720p, 1080i, 1080p (default 576i,1080i)" << std::endl
+              << "  --presets=A,B      x264 presets (default faster)" << std::endl
+              << "  --threads=A,B      Encoder thread counts, 0 = auto (default 0)" << std::endl
+              << "  --bitrates=A,B     Bitrates in bit/s (default 6000000)" << std::endl
+              << "  --frames=N         Frames per run (default 250)" << std::endl
+              << "  --seed=N           Synthetic pattern seed (default 1)" << std::endl
+              << "  --convert[=A,B]    Time the conversion from these source formats to" << std::endl
+              << "                     yuv420p, against sws_scale, instead of encoding" << std::endl
+              << "                     (default all of yuv422p, yuv420p10le, yuv422p10le," << std::endl
+              << "                     yuyv422, uyvy422)" << std::endl
+              << "  --format=FMT       'csv' (default) or 'json'" << std::endl
+              << "  --output=PATH      Write results to PATH instead of stdout" << std::endl;
+}
+
+//////////////////////////////////////////////////////////////////////////
+std::vector<std::string> split_list(const std::string &strValue)
+{
+    std::vector<std::string> vecItems;
+    std::size_t nStart = 0;
+    while (nStart <= strValue.size())
+    {
+        const auto nComma = std::min(strValue.find(',', nStart), strValue.size());
+        vecItems.push_back(strValue.substr(nStart, nComma - nStart));
+        nStart = nComma + 1;
+    }
+    return vecItems;
+}
+
+//////////////////////////////////////////////////////////////////////////
+template <typename T>
+bool parse_number_list(const std::string &strName, const std::string &strValue, std::vector<T> &out_vecValues, const bool bAllowZero)
+{
+    out_vecValues.clear();
+    for (const std::string &strItem : split_list(strValue))
+    {
+        char *pEnd = nullptr;
+        const unsigned long long nValue = std::strtoull(strItem.c_str(), &pEnd, 10);
+        if (strItem.empty() || *pEnd != '\0' || (nValue == 0 && !bAllowZero))
+        {
+            std::cerr << "Invalid " << strName << ": '" << strItem << "'" << std::endl;
+            return false;
+        }
+        out_vecValues.push_back(static_cast<T>(nValue));
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool parse_arguments(int argc, char *argv[], BenchOptions &out_options)
+{
+    std::string strResolutions = "576i,1080i";
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string strArg = argv[i];
+        const auto nEq = strArg.find('=');
+        const std::string strKey = strArg.substr(0, nEq);
+        const std::string strValue = nEq == std::string::npos ? std::string{} : strArg.substr(nEq + 1);
+
+        if (strKey == "--resolutions")
+        {
+            strResolutions = strValue;
+        }
+        else if (strKey == "--presets")
+        {
+            out_options.vecPresets = split_list(strValue);
+        }
+        else if (strKey == "--threads")
+        {
+            if (!parse_number_list("thread count", strValue, out_options.vecThreads, true))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--bitrates")
+        {
+            if (!parse_number_list("bitrate", strValue, out_options.vecBitRates, false))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--frames")
+        {
+            std::vector<int> vecFrames;
+            if (!parse_number_list("frame count", strValue, vecFrames, false) || vecFrames.size() != 1)
+            {
+                return false;
+            }
+            out_options.nFrames = vecFrames.front();
+        }
+        else if (strKey == "--seed")
+        {
+            std::vector<uint32_t> vecSeed;
+            if (!parse_number_list("seed", strValue, vecSeed, true) || vecSeed.size() != 1)
+            {
+                return false;
+            }
+            out_options.nSeed = vecSeed.front();
+        }
+        else if (strKey == "--convert")
+        {
+            const std::string strFormats = strValue.empty() ? "yuv422p,yuv420p10le,yuv422p10le,yuyv422,uyvy422" : strValue;
+            for (const std::string &strFormat : split_list(strFormats))
+            {
+                const AVPixelFormat ePixFmt = av_get_pix_fmt(strFormat.c_str());
+                if (ePixFmt == AV_PIX_FMT_YUV420P || !PixelConverter::supported(ePixFmt))
+                {
+                    std::cerr << "Unsupported conversion source format: '" << strFormat << "'" << std::endl;
+                    return false;
+                }
+                out_options.vecConvertFormats.push_back(ePixFmt);
+            }
+        }
+        else if (strKey == "--format")
+        {
+            if (strValue != "csv" && strValue != "json")
+            {
+                std::cerr << "Invalid format: '" << strValue << "'" << std::endl;
+                return false;
+            }
+            out_options.bJson = strValue == "json";
+        }
+        else if (strKey == "--output")
+        {
+            out_options.strOutputPath = strValue;
+        }
+        else
+        {
+            std::cerr << "Unknown option: " << strArg << std::endl;
+            return false;
+        }
+    }
+
+    for (const std::string &strName : split_list(strResolutions))
+    {
+        const auto it = std::find_if(g_vecResolutions.begin(),
+                                     g_vecResolutions.end(),
+                                     [&strName](const BenchResolution &resolution) { return resolution.strName == strName; });
+        if (it == g_vecResolutions.end())
+        {
+            std::cerr << "Unknown resolution: '" << strName << "'" << std::endl;
+            return false;
+        }
+        out_options.vecResolutions.push_back(*it);
+    }
+
+    return true;
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+int main(int argc, char *argv[])
+{
+    BenchOptions options{};
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage();
+        return 1;
+    }
+
+    std::vector<BenchResult> vecResults;
+    std::vector<ConvertResult> vecConvertResults;
+    bool bAllOk{true};
+
+    if (!options.vecConvertFormats.empty())
+    {
+        for (const BenchResolution &resolution : options.vecResolutions)
+        {
+            for (const AVPixelFormat eSrcFmt : options.vecConvertFormats)
+            {
+                const std::size_t nFirst = vecConvertResults.size();
+                bAllOk = run_convert_case(options, resolution, eSrcFmt, vecConvertResults) && bAllOk;
+                for (std::size_t i = nFirst; i < vecConvertResults.size(); ++i)
+                {
+                    const ConvertResult &result = vecConvertResults[i];
+                    bAllOk = bAllOk && result.bOk;
+                    std::cerr << resolution.strName
+                              << " " << av_get_pix_fmt_name(eSrcFmt)
+                              << " " << result.strMethod << " (" << result.strKernels << ")"
+                              << ": " << (result.bOk ? "" : "FAILED ")
+                              << std::fixed << std::setprecision(1) << result.fps() << " fps"
+                              << std::defaultfloat << std::endl;
+                }
+            }
+        }
+    }
+    else
+    {
+        for (const BenchResolution &resolution : options.vecResolutions)
+        {
+            for (const std::string &strPreset : options.vecPresets)
+            {
+                for (const int nThreads : options.vecThreads)
+                {
+                    for (const int64_t nBitRate : options.vecBitRates)
+                    {
+                        BenchResult result{};
+                        result.resolution = resolution;
+                        result.strPreset = strPreset;
+                        result.nThreads = nThreads;
+                        result.nBitRate = nBitRate;
+
+                        result.bOk = run_bench_case(options, result);
+                        bAllOk = bAllOk && result.bOk;
+
+                        // Progress on stderr; stdout is reserved for the results.
+                        std::cerr << resolution.strName
+                                  << " " << strPreset
+                                  << " threads=" << nThreads
+                                  << " bitrate=" << nBitRate
+                                  << ": " << (result.bOk ? "" : "FAILED ")
+                                  << std::fixed << std::setprecision(1) << result.fps() << " fps"
+                                  << std::defaultfloat << std::endl;
+
+                        vecResults.push_back(result);
+                    }
+                }
+            }
+        }
+    }
+
+    std::ofstream file;
+    if (!options.strOutputPath.empty())
+    {
+        file.open(options.strOutputPath);
+        if (!file)
+        {
+            std::cerr << "Could not open output '" << options.strOutputPath << "'" << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &stream = options.strOutputPath.empty() ? std::cout : file;
+
+    if (!options.vecConvertFormats.empty())
+    {
+        if (options.bJson)
+        {
+            write_convert_json(stream, vecConvertResults);
+        }
+        else
+        {
+            write_convert_csv(stream, vecConvertResults);
+        }
+    }
+    else if (options.bJson)
+    {
+        write_results_json(stream, vecResults);
+    }
+    else
+    {
+        write_results_csv(stream, vecResults);
+    }
+
+    return bAllOk ? 0 : 1;
+}
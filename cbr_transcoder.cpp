@@ -0,0 +1,422 @@
+#include "cbr_transcoder.hpp"
+#include "media_utils.hpp"
+#include "pixel_convert.hpp"
+
+#include <deque>
+#include <iostream>
+#include <string>
+
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+struct CbrTranscoder::Impl
+{
+    CodecContextPtr apDecoder;
+    CodecContextPtr apEncoder;
+    std::unique_ptr<PixelConverter> apConverter;
+
+    FramePtr apDecoded;
+    FramePtr apLocal;
+    PacketPtr apEncoded;
+    std::deque<PacketPtr> dqPending;
+};
+
+//////////////////////////////////////////////////////////////////////////
+CbrTranscoder::CbrTranscoder(const CbrTranscoderConfig &config)
+    : m_config(config),
+      m_apImpl(std::make_unique<Impl>())
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+CbrTranscoder::~CbrTranscoder() = default;
+
+//////////////////////////////////////////////////////////////////////////
+bool CbrTranscoder::open(const AVCodecParameters *in_pDecoderPar, const AVRational in_timeBase)
+{
+    if (m_eState != State::Closed)
+    {
+        return false;
+    }
+
+    const AVCodec *pCdc = avcodec_find_decoder(in_pDecoderPar->codec_id);
+    if (pCdc == nullptr)
+    {
+        std::cerr << "Failed to find decoder for codec " << avcodec_get_name(in_pDecoderPar->codec_id) << std::endl;
+        return false;
+    }
+
+    CodecContextPtr apDecoder{avcodec_alloc_context3(pCdc)};
+    if (!apDecoder)
+    {
+        std::cerr << "Failed to allocate the decoder codec context." << std::endl;
+        return false;
+    }
+
+    if (int ret = avcodec_parameters_to_context(apDecoder.get(), in_pDecoderPar); ret < 0)
+    {
+        std::cerr << "Failed to copy decoder codec parameters to decoder context: "
+                  << error_code_to_string(ret)
+                  << std::endl;
+        return false;
+    }
+    apDecoder->pkt_timebase = in_timeBase;
+    if (m_config.nDecodeThreads > 0)
+    {
+        apDecoder->thread_count = m_config.nDecodeThreads;
+    }
+
+    AVDictionary *pOpts = nullptr;
+    av_dict_set(&pOpts, "refcounted_frames", "1", 0);
+    const int ret = avcodec_open2(apDecoder.get(), pCdc, &pOpts);
+    av_dict_free(&pOpts);
+    if (ret < 0)
+    {
+        std::cerr << "Failed to open decoder codec: "
+                  << error_code_to_string(ret)
+                  << std::endl;
+        return false;
+    }
+
+    m_apImpl->apDecoded.reset(av_frame_alloc());
+    if (!m_apImpl->apDecoded || !open_encoder(apDecoder.get()))
+    {
+        return false;
+    }
+
+    m_apImpl->apDecoder = std::move(apDecoder);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool CbrTranscoder::open(const int in_nWidth, const int in_nHeight)
+{
+    if (m_eState != State::Closed)
+    {
+        return false;
+    }
+
+    // configure_cbr_encoder() takes the picture size from a decoder context.
+    CodecContextPtr apShape{avcodec_alloc_context3(nullptr)};
+    if (!apShape)
+    {
+        return false;
+    }
+    apShape->width = in_nWidth;
+    apShape->height = in_nHeight;
+
+    return open_encoder(apShape.get());
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool CbrTranscoder::open_encoder(const AVCodecContext *pShape)
+{
+    AVStream *pNoStream{};
+    const CbrEncoderSettings &settings = m_config.encoder;
+    if (!open_encoder_context(nullptr,
+                              m_apImpl->apEncoder,
+                              pNoStream,
+                              "libx264",
+                              [&settings, pShape](AVStream *, AVCodecContext *pCdcCtxOut, AVDictionary *&pDict) -> bool
+                              {
+                                  return configure_cbr_encoder(settings, pShape, pCdcCtxOut, pDict);
+                              }))
+    {
+        return false;
+    }
+
+    m_apImpl->apLocal.reset(av_frame_alloc());
+    m_apImpl->apEncoded.reset(av_packet_alloc());
+    if (!m_apImpl->apLocal || !m_apImpl->apEncoded)
+    {
+        return false;
+    }
+
+    m_eState = State::Open;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void CbrTranscoder::set_sink(PacketSink fnSink)
+{
+    m_fnSink = std::move(fnSink);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool CbrTranscoder::writable() const
+{
+    return m_eState == State::Open && (m_fnSink || m_apImpl->dqPending.size() < m_config.nMaxPendingPackets);
+}
+
+//////////////////////////////////////////////////////////////////////////
+std::size_t CbrTranscoder::pending() const
+{
+    return m_apImpl->dqPending.size();
+}
+
+//////////////////////////////////////////////////////////////////////////
+const AVCodecContext *CbrTranscoder::encoder() const
+{
+    return m_apImpl->apEncoder.get();
+}
+
+//////////////////////////////////////////////////////////////////////////
+AVRational CbrTranscoder::time_base() const
+{
+    return m_apImpl->apEncoder ? m_apImpl->apEncoder->time_base : AVRational{0, 1};
+}
+
+//////////////////////////////////////////////////////////////////////////
+CbrTranscoderStatus CbrTranscoder::fail()
+{
+    m_eState = State::Failed;
+    return CbrTranscoderStatus::Error;
+}
+
+//////////////////////////////////////////////////////////////////////////
+CbrTranscoderStatus CbrTranscoder::push(const AVPacket *in_pPkt)
+{
+    if (m_eState != State::Open || !m_apImpl->apDecoder || in_pPkt == nullptr)
+    {
+        return CbrTranscoderStatus::Error;
+    }
+    if (!writable())
+    {
+        return CbrTranscoderStatus::Again;
+    }
+
+    int ret = avcodec_send_packet(m_apImpl->apDecoder.get(), in_pPkt);
+    while (ret == AVERROR(EAGAIN))
+    {
+        // Decoder is full; make room and try again.
+        if (int retRecv = receive_frames(); retRecv != AVERROR(EAGAIN))
+        {
+            ret = retRecv;
+            break;
+        }
+        ret = avcodec_send_packet(m_apImpl->apDecoder.get(), in_pPkt);
+    }
+    if (ret < 0)
+    {
+        std::cerr << "Unexpected error received from decoder (avcodec_send_packet): "
+                  << error_code_to_string(ret)
+                  << std::endl;
+        return fail();
+    }
+
+    if (ret = receive_frames(); ret != AVERROR(EAGAIN))
+    {
+        std::cerr << "Unexpected error while transcoding packet: "
+                  << error_code_to_string(ret)
+                  << std::endl;
+        return fail();
+    }
+    return CbrTranscoderStatus::Ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+CbrTranscoderStatus CbrTranscoder::push(const AVFrame *in_pFrame)
+{
+    if (m_eState != State::Open || in_pFrame == nullptr)
+    {
+        return CbrTranscoderStatus::Error;
+    }
+    if (!writable())
+    {
+        return CbrTranscoderStatus::Again;
+    }
+
+    if (int ret = encode_frame(in_pFrame, !m_apImpl->apDecoder); ret != AVERROR(EAGAIN))
+    {
+        std::cerr << "Unexpected error while encoding frame: "
+                  << error_code_to_string(ret)
+                  << std::endl;
+        return fail();
+    }
+    return CbrTranscoderStatus::Ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+CbrTranscoderStatus CbrTranscoder::flush()
+{
+    if (m_eState == State::Flushed)
+    {
+        return CbrTranscoderStatus::Ok;
+    }
+    if (m_eState != State::Open)
+    {
+        return CbrTranscoderStatus::Error;
+    }
+
+    if (m_apImpl->apDecoder)
+    {
+        // Tell our decoder EOF, and encode what it still holds.
+        int ret = avcodec_send_packet(m_apImpl->apDecoder.get(), nullptr);
+        if (ret == 0)
+        {
+            ret = receive_frames();
+        }
+        if (ret != AVERROR_EOF)
+        {
+            std::cerr << "Unexpected error flushing decoder: "
+                      << error_code_to_string(ret)
+                      << std::endl;
+            return fail();
+        }
+    }
+
+    // A null frame signals EOF to the encoder.
+    int ret = avcodec_send_frame(m_apImpl->apEncoder.get(), nullptr);
+    if (ret == 0)
+    {
+        ret = drain_encoder();
+    }
+    if (ret != AVERROR_EOF)
+    {
+        std::cerr << "Unexpected error flushing encoder: "
+                  << error_code_to_string(ret)
+                  << std::endl;
+        return fail();
+    }
+
+    m_eState = State::Flushed;
+    return CbrTranscoderStatus::Ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+CbrTranscoderStatus CbrTranscoder::pull(AVPacket *out_pPkt)
+{
+    if (m_eState == State::Failed || m_eState == State::Closed)
+    {
+        return CbrTranscoderStatus::Error;
+    }
+    if (m_apImpl->dqPending.empty())
+    {
+        return m_eState == State::Flushed ? CbrTranscoderStatus::Eof : CbrTranscoderStatus::Again;
+    }
+
+    av_packet_move_ref(out_pPkt, m_apImpl->dqPending.front().get());
+    m_apImpl->dqPending.pop_front();
+    return CbrTranscoderStatus::Ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Encodes every frame the decoder has ready. Returns AVERROR(EAGAIN) when
+// the decoder needs more input, AVERROR_EOF once fully flushed.
+int CbrTranscoder::receive_frames()
+{
+    while (true)
+    {
+        if (int ret = avcodec_receive_frame(m_apImpl->apDecoder.get(), m_apImpl->apDecoded.get()); ret != 0)
+        {
+            return ret;
+        }
+
+        const int ret = encode_frame(m_apImpl->apDecoded.get(), false);
+        av_frame_unref(m_apImpl->apDecoded.get());
+        if (ret != AVERROR(EAGAIN))
+        {
+            return ret;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Sends one frame to the encoder and drains it. Returns AVERROR(EAGAIN)
+// when the encoder is waiting for more input.
+int CbrTranscoder::encode_frame(const AVFrame *pFrame, const bool bKeepPts)
+{
+    AVFrame *pLocal = m_apImpl->apLocal.get();
+    if (pFrame->format != AV_PIX_FMT_YUV420P)
+    {
+        if (!m_apImpl->apConverter)
+        {
+            const auto ePixFmt = static_cast<AVPixelFormat>(pFrame->format);
+            if (!PixelConverter::supported(ePixFmt))
+            {
+                const char *pszName = av_get_pix_fmt_name(ePixFmt);
+                std::cerr << "Unsupported pixel format: " << (pszName != nullptr ? pszName : "unknown") << std::endl;
+                return AVERROR(EINVAL);
+            }
+
+            const AVCodecContext *pCdcCtxOut = m_apImpl->apEncoder.get();
+            const bool bInterlaced = pCdcCtxOut->field_order != AV_FIELD_PROGRESSIVE && pCdcCtxOut->field_order != AV_FIELD_UNKNOWN;
+            m_apImpl->apConverter = std::make_unique<PixelConverter>(pFrame->width,
+                                                                     pFrame->height,
+                                                                     bInterlaced,
+                                                                     m_config.bConvertKernels ? ConvertMethod::Kernels : ConvertMethod::Swscale);
+        }
+        if (!m_apImpl->apConverter->convert(pFrame, pLocal))
+        {
+            return AVERROR(EINVAL);
+        }
+    }
+    else if (int ret = av_frame_ref(pLocal, pFrame); ret < 0)
+    {
+        return ret;
+    }
+
+    // The encoder decides the frame types itself.
+    pLocal->pts = bKeepPts && pFrame->pts != AV_NOPTS_VALUE ? pFrame->pts : m_nNextPts;
+    pLocal->key_frame = 0;
+    pLocal->pict_type = AV_PICTURE_TYPE_NONE;
+    m_nNextPts = pLocal->pts + m_apImpl->apEncoder->time_base.num;
+
+    int ret = avcodec_send_frame(m_apImpl->apEncoder.get(), pLocal);
+    while (ret == AVERROR(EAGAIN))
+    {
+        if (int retRecv = drain_encoder(); retRecv != AVERROR(EAGAIN))
+        {
+            ret = retRecv;
+            break;
+        }
+        ret = avcodec_send_frame(m_apImpl->apEncoder.get(), pLocal);
+    }
+    av_frame_unref(pLocal);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ++m_nFrames;
+    return drain_encoder();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Hands out every packet the encoder has ready, rather than one per frame
+// sent.
+int CbrTranscoder::drain_encoder()
+{
+    while (true)
+    {
+        AVPacket *pPkt = m_apImpl->apEncoded.get();
+        if (int ret = avcodec_receive_packet(m_apImpl->apEncoder.get(), pPkt); ret != 0)
+        {
+            return ret;
+        }
+        ++m_nPackets;
+
+        if (m_fnSink)
+        {
+            const bool bTaken = m_fnSink(pPkt);
+            av_packet_unref(pPkt);
+            if (!bTaken)
+            {
+                return AVERROR_EXIT;
+            }
+            continue;
+        }
+
+        PacketPtr apPending{av_packet_alloc()};
+        if (!apPending)
+        {
+            av_packet_unref(pPkt);
+            return AVERROR(ENOMEM);
+        }
+        av_packet_move_ref(apPending.get(), pPkt);
+        m_apImpl->dqPending.push_back(std::move(apPending));
+    }
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "encoder_settings.hpp"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+// Installed with libx264cbr together with encoder_settings.hpp, and needs
+// nothing else of this tree: the FFmpeg objects the transcoder owns are
+// held in CbrTranscoder::Impl, in the .cpp.
+
+//////////////////////////////////////////////////////////////////////////
+struct CbrTranscoderConfig
+{
+    CbrEncoderSettings encoder;
+
+    // Decoder threads for packet input; 0 leaves it to FFmpeg.
+    int nDecodeThreads{0};
+
+    // Convert non-4:2:0 input with the SIMD kernels rather than sws_scale.
+    bool bConvertKernels{false};
+
+    // Encoded packets waiting for pull() at which push() starts returning
+    // Again. Unused with a sink, which is handed every packet as soon as
+    // the encoder has it.
+    std::size_t nMaxPendingPackets{16};
+};
+
+//////////////////////////////////////////////////////////////////////////
+enum class CbrTranscoderStatus
+{
+    // push()/flush(): input taken. pull(): a packet was returned.
+    Ok,
+
+    // push(): pull() first; nothing was taken. pull(): no packet ready yet.
+    Again,
+
+    // pull(): flushed and every packet handed out.
+    Eof,
+
+    // Any call after a failure (reported on std::cerr).
+    Error
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Embeddable CBR encoder (libx264cbr), driven from the caller's thread.
+//
+// Input is either compressed packets of one video stream, decoded here, or
+// raw frames. After every push() the encoder is drained of every packet it
+// has ready, so nothing waits inside it for the next call. Those packets go
+// to the sink if one is set, otherwise into a queue for pull(); once that
+// queue holds nMaxPendingPackets, push() refuses input until the caller
+// pulls. flush() ends the input and drains the encoder completely.
+//
+// Packets carry timestamps in time_base(). Frames are numbered on at the
+// encoder's constant frame rate; pushed raw frames may instead give their
+// PTS in time_base() themselves. Non-4:2:0 input is converted as in the
+// pipeline (pixel_convert.hpp).
+class X264CBR_API CbrTranscoder
+{
+public:
+    // Receives each packet as it is encoded. The sink may take the payload
+    // with av_packet_move_ref(); returning false fails the transcoder.
+    using PacketSink = std::function<bool(AVPacket *pPkt)>;
+
+    explicit CbrTranscoder(const CbrTranscoderConfig &config);
+    ~CbrTranscoder();
+
+    CbrTranscoder(const CbrTranscoder &) = delete;
+    CbrTranscoder &operator=(const CbrTranscoder &) = delete;
+
+    // Packet input: opens a decoder for the stream described by
+    // in_pDecoderPar, whose packets are timed in in_timeBase.
+    bool open(const AVCodecParameters *in_pDecoderPar, AVRational in_timeBase);
+
+    // Frame input of in_nWidth x in_nHeight.
+    bool open(int in_nWidth, int in_nHeight);
+
+    // Call before the first push().
+    void set_sink(PacketSink fnSink);
+
+    CbrTranscoderStatus push(const AVPacket *in_pPkt);
+    CbrTranscoderStatus push(const AVFrame *in_pFrame);
+    CbrTranscoderStatus flush();
+
+    // Moves the next encoded packet into out_pPkt, which must be empty.
+    CbrTranscoderStatus pull(AVPacket *out_pPkt);
+
+    // Whether push() would currently take input.
+    bool writable() const;
+    std::size_t pending() const;
+
+    // The opened encoder, e.g. for avcodec_parameters_from_context().
+    const AVCodecContext *encoder() const;
+    AVRational time_base() const;
+
+    uint64_t frames_encoded() const { return m_nFrames; }
+    uint64_t packets_encoded() const { return m_nPackets; }
+
+private:
+    enum class State
+    {
+        Closed,
+        Open,
+        Flushed,
+        Failed
+    };
+
+    bool open_encoder(const AVCodecContext *pShape);
+    CbrTranscoderStatus fail();
+
+    int receive_frames();
+    int encode_frame(const AVFrame *pFrame, bool bKeepPts);
+    int drain_encoder();
+
+    // Codec contexts, frames and the pending packets.
+    struct Impl;
+
+    CbrTranscoderConfig m_config;
+    State m_eState{State::Closed};
+    PacketSink m_fnSink;
+    std::unique_ptr<Impl> m_apImpl;
+
+    int64_t m_nNextPts{0};
+    uint64_t m_nFrames{0};
+    uint64_t m_nPackets{0};
+};
@@ -0,0 +1,417 @@
+#include "cbr_ts_muxer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include <libavutil/mathematics.h>
+}
+
+namespace
+{
+
+constexpr std::size_t g_nTsPayloadSize = g_nTsPacketSize - 4;
+constexpr int64_t g_nTsClock = 27000000;
+constexpr int64_t g_nMask33 = (int64_t{1} << 33) - 1;
+
+// Bits of TS/PES overhead per second allowed on top of the video's own
+// share of 188/184: PES headers, AUDs, PES tail stuffing and PCRs.
+constexpr int64_t g_nVideoOverheadRate = 128000;
+
+// Video packets the leaky bucket lets out back to back after an idle spell.
+constexpr int64_t g_nVideoBurstPackets = 4;
+
+constexpr uint8_t g_arrAud[] = {0x00, 0x00, 0x00, 0x01, 0x09, 0xF0};
+
+//////////////////////////////////////////////////////////////////////////
+// CRC-32/MPEG-2: polynomial 0x04C11DB7, MSB first, no final XOR.
+uint32_t mpeg2_crc32(const uint8_t *pData, const std::size_t nSize)
+{
+    uint32_t nCrc = 0xFFFFFFFF;
+    for (std::size_t i = 0; i < nSize; ++i)
+    {
+        nCrc ^= static_cast<uint32_t>(pData[i]) << 24;
+        for (int nBit = 0; nBit < 8; ++nBit)
+        {
+            nCrc = (nCrc & 0x80000000) ? (nCrc << 1) ^ 0x04C11DB7 : nCrc << 1;
+        }
+    }
+    return nCrc;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Wraps a PSI section (without CRC) into a TS packet with
+// payload_unit_start_indicator set, a zero pointer_field and the CRC.
+void write_psi_packet(const uint16_t nPid, const std::vector<uint8_t> &vecSection, std::array<uint8_t, g_nTsPacketSize> &out_arrPacket)
+{
+    out_arrPacket.fill(0xFF);
+    out_arrPacket[0] = g_nTsSyncByte;
+    out_arrPacket[1] = static_cast<uint8_t>(0x40 | ((nPid >> 8) & 0x1F));
+    out_arrPacket[2] = static_cast<uint8_t>(nPid & 0xFF);
+    out_arrPacket[3] = 0x10;
+    out_arrPacket[4] = 0x00;
+
+    std::memcpy(out_arrPacket.data() + 5, vecSection.data(), vecSection.size());
+    const uint32_t nCrc = mpeg2_crc32(vecSection.data(), vecSection.size());
+    uint8_t *pCrc = out_arrPacket.data() + 5 + vecSection.size();
+    pCrc[0] = static_cast<uint8_t>(nCrc >> 24);
+    pCrc[1] = static_cast<uint8_t>(nCrc >> 16);
+    pCrc[2] = static_cast<uint8_t>(nCrc >> 8);
+    pCrc[3] = static_cast<uint8_t>(nCrc);
+}
+
+//////////////////////////////////////////////////////////////////////////
+void write_timestamp(uint8_t *pField, const uint8_t nPrefix, const int64_t nTs90)
+{
+    const int64_t nTs = nTs90 & g_nMask33;
+    pField[0] = static_cast<uint8_t>((nPrefix << 4) | ((nTs >> 29) & 0x0E) | 0x01);
+    pField[1] = static_cast<uint8_t>(nTs >> 22);
+    pField[2] = static_cast<uint8_t>(((nTs >> 14) & 0xFE) | 0x01);
+    pField[3] = static_cast<uint8_t>(nTs >> 7);
+    pField[4] = static_cast<uint8_t>(((nTs << 1) & 0xFE) | 0x01);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool starts_with_aud(const uint8_t *pData, const int nSize)
+{
+    if (nSize >= 5 && pData[0] == 0 && pData[1] == 0 && pData[2] == 0 && pData[3] == 1)
+    {
+        return (pData[4] & 0x1F) == 9;
+    }
+    if (nSize >= 4 && pData[0] == 0 && pData[1] == 0 && pData[2] == 1)
+    {
+        return (pData[3] & 0x1F) == 9;
+    }
+    return false;
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+CbrTsMuxer::CbrTsMuxer(const CbrTsMuxerConfig &config, AVIOContext *pIoCtx)
+    : m_config(config),
+      m_pIoCtx(pIoCtx),
+      m_nPcrInterval27(int64_t{config.nPcrIntervalMs} * (g_nTsClock / 1000)),
+      m_nPsiInterval27(int64_t{config.nPsiIntervalMs} * (g_nTsClock / 1000)),
+      m_nMuxDelay27(int64_t{config.nMuxDelayMs} * (g_nTsClock / 1000)),
+      m_nVideoCreditPerSlot(static_cast<int64_t>(g_nTsPacketSize) * 8
+                            * (config.nVideoRate > 0
+                                   ? config.nVideoRate * 188 / 184 + g_nVideoOverheadRate
+                                   : config.nMuxRate)),
+      m_nVideoCreditMax(static_cast<int64_t>(g_nTsPacketSize) * 8 * config.nMuxRate
+                        * (config.nVideoRate > 0 ? g_nVideoBurstPackets : 1))
+{
+    m_nVideoCredit = m_nVideoCreditMax;
+    build_psi_packets();
+
+    m_arrNull.fill(0xFF);
+    m_arrNull[0] = g_nTsSyncByte;
+    m_arrNull[1] = static_cast<uint8_t>(g_nTsNullPid >> 8);
+    m_arrNull[2] = static_cast<uint8_t>(g_nTsNullPid & 0xFF);
+    m_arrNull[3] = 0x10;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void CbrTsMuxer::build_psi_packets()
+{
+    const uint16_t nPmtPid = m_config.nPmtPid;
+    const uint16_t nVideoPid = m_config.nVideoPid;
+
+    // PAT: one program. section_length counts everything after it, CRC included.
+    const std::vector<uint8_t> vecPat = {
+        0x00,
+        0xB0, 13,
+        static_cast<uint8_t>(m_config.nTransportStreamId >> 8), static_cast<uint8_t>(m_config.nTransportStreamId),
+        0xC1, 0x00, 0x00,
+        static_cast<uint8_t>(m_config.nProgramNumber >> 8), static_cast<uint8_t>(m_config.nProgramNumber),
+        static_cast<uint8_t>(0xE0 | (nPmtPid >> 8)), static_cast<uint8_t>(nPmtPid),
+    };
+    write_psi_packet(0x0000, vecPat, m_arrPat);
+
+    // PMT: H.264 video, which also carries the PCR.
+    const std::vector<uint8_t> vecPmt = {
+        0x02,
+        0xB0, 18,
+        static_cast<uint8_t>(m_config.nProgramNumber >> 8), static_cast<uint8_t>(m_config.nProgramNumber),
+        0xC1, 0x00, 0x00,
+        static_cast<uint8_t>(0xE0 | (nVideoPid >> 8)), static_cast<uint8_t>(nVideoPid),
+        0xF0, 0x00,
+        0x1B,
+        static_cast<uint8_t>(0xE0 | (nVideoPid >> 8)), static_cast<uint8_t>(nVideoPid),
+        0xF0, 0x00,
+    };
+    write_psi_packet(nPmtPid, vecPmt, m_arrPmt);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Arrival time, on the 27 MHz system clock, of byte nByte of slot nSlot.
+int64_t CbrTsMuxer::slot_time_27(const uint64_t nSlot, const std::size_t nByte) const
+{
+    const int64_t nBits = static_cast<int64_t>(nSlot * g_nTsPacketSize + nByte) * 8;
+    return av_rescale(nBits, g_nTsClock, m_config.nMuxRate);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// program_clock_reference for the current slot: the arrival time of byte 10,
+// which holds the last bit of program_clock_reference_base.
+std::size_t CbrTsMuxer::write_pcr(uint8_t *pField) const
+{
+    const int64_t nPcr = slot_time_27(m_nSlot, 10);
+    const int64_t nBase = (nPcr / 300) & g_nMask33;
+    const int64_t nExt = nPcr % 300;
+
+    pField[0] = static_cast<uint8_t>(nBase >> 25);
+    pField[1] = static_cast<uint8_t>(nBase >> 17);
+    pField[2] = static_cast<uint8_t>(nBase >> 9);
+    pField[3] = static_cast<uint8_t>(nBase >> 1);
+    pField[4] = static_cast<uint8_t>(((nBase & 1) << 7) | 0x7E | (nExt >> 8));
+    pField[5] = static_cast<uint8_t>(nExt);
+    return 6;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void CbrTsMuxer::write_video_packet(uint8_t *pTs, const bool bPcr)
+{
+    AccessUnit &au = m_queue.front();
+    const bool bStart = au.nOffset == 0;
+    const bool bRandomAccess = bStart && au.bKey;
+
+    // The adaptation field grows to fill whatever the payload leaves.
+    const std::size_t nAfMin = bPcr ? 8 : (bRandomAccess ? 2 : 0);
+    const std::size_t nPayload = std::min(au.vecPes.size() - au.nOffset, g_nTsPayloadSize - nAfMin);
+    const std::size_t nAf = g_nTsPayloadSize - nPayload;
+
+    const uint16_t nPid = m_config.nVideoPid;
+    pTs[0] = g_nTsSyncByte;
+    pTs[1] = static_cast<uint8_t>((bStart ? 0x40 : 0x00) | ((nPid >> 8) & 0x1F));
+    pTs[2] = static_cast<uint8_t>(nPid & 0xFF);
+    pTs[3] = static_cast<uint8_t>((nAf > 0 ? 0x30 : 0x10) | m_nVideoCc);
+    m_nVideoCc = (m_nVideoCc + 1) & 0x0F;
+
+    if (nAf > 0)
+    {
+        pTs[4] = static_cast<uint8_t>(nAf - 1);
+        std::size_t nUsed = 5;
+        if (nAf > 1)
+        {
+            pTs[5] = static_cast<uint8_t>((bRandomAccess ? 0x40 : 0x00) | (bPcr ? 0x10 : 0x00));
+            nUsed = 6;
+            if (bPcr)
+            {
+                nUsed += write_pcr(pTs + 6);
+            }
+        }
+        std::memset(pTs + nUsed, 0xFF, 4 + nAf - nUsed);
+        m_stats.nStuffingBytes += 4 + nAf - nUsed;
+    }
+
+    std::memcpy(pTs + 4 + nAf, au.vecPes.data() + au.nOffset, nPayload);
+    au.nOffset += nPayload;
+    m_nQueuedBytes -= nPayload;
+
+    if (au.nOffset == au.vecPes.size())
+    {
+        ++m_stats.nAccessUnits;
+        if (slot_time_27(m_nSlot + 1, 0) > au.nDts27)
+        {
+            ++m_stats.nLateAccessUnits;
+        }
+
+        au.vecPes.clear();
+        m_vecFreeBuffers.push_back(std::move(au.vecPes));
+        m_queue.pop_front();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Adaptation field only, so the continuity counter stays where it was.
+void CbrTsMuxer::write_pcr_packet(uint8_t *pTs)
+{
+    const uint16_t nPid = m_config.nVideoPid;
+    pTs[0] = g_nTsSyncByte;
+    pTs[1] = static_cast<uint8_t>((nPid >> 8) & 0x1F);
+    pTs[2] = static_cast<uint8_t>(nPid & 0xFF);
+    pTs[3] = static_cast<uint8_t>(0x20 | ((m_nVideoCc + 0x0F) & 0x0F));
+    pTs[4] = static_cast<uint8_t>(g_nTsPayloadSize - 1);
+    pTs[5] = 0x10;
+    const std::size_t nUsed = 6 + write_pcr(pTs + 6);
+    std::memset(pTs + nUsed, 0xFF, g_nTsPacketSize - nUsed);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool CbrTsMuxer::emit_slot()
+{
+    const int64_t nNow27 = slot_time_27(m_nSlot, 0);
+    const int64_t nVideoCost = static_cast<int64_t>(g_nTsPacketSize) * 8 * m_config.nMuxRate;
+    m_nVideoCredit = std::min(m_nVideoCredit + m_nVideoCreditPerSlot, m_nVideoCreditMax);
+
+    const uint8_t *pOut = m_arrPacket.data();
+    if (nNow27 >= m_nNextPsi27)
+    {
+        m_arrPat[3] = static_cast<uint8_t>(0x10 | m_nPatCc);
+        m_nPatCc = (m_nPatCc + 1) & 0x0F;
+        m_nNextPsi27 += m_nPsiInterval27;
+        m_bPmtPending = true;
+        ++m_stats.nPsiPackets;
+        pOut = m_arrPat.data();
+    }
+    else if (m_bPmtPending)
+    {
+        m_arrPmt[3] = static_cast<uint8_t>(0x10 | m_nPmtCc);
+        m_nPmtCc = (m_nPmtCc + 1) & 0x0F;
+        m_bPmtPending = false;
+        ++m_stats.nPsiPackets;
+        pOut = m_arrPmt.data();
+    }
+    else
+    {
+        const bool bPcr = nNow27 >= m_nNextPcr27;
+        const bool bVideo = !m_queue.empty()
+            && m_nVideoCredit >= nVideoCost
+            && nNow27 >= m_queue.front().nDts27 - m_nMuxDelay27;
+
+        if (bVideo)
+        {
+            write_video_packet(m_arrPacket.data(), bPcr);
+            m_nVideoCredit -= nVideoCost;
+            ++m_stats.nVideoPackets;
+        }
+        else if (bPcr)
+        {
+            write_pcr_packet(m_arrPacket.data());
+            ++m_stats.nPcrOnlyPackets;
+        }
+        else
+        {
+            pOut = m_arrNull.data();
+            ++m_stats.nNullPackets;
+        }
+
+        if (bPcr)
+        {
+            const int64_t nPcr27 = slot_time_27(m_nSlot, 10);
+            if (m_nLastPcr27 >= 0)
+            {
+                m_stats.nMaxPcrIntervalNs = std::max(m_stats.nMaxPcrIntervalNs, (nPcr27 - m_nLastPcr27) * 1000 / 27);
+            }
+            m_nLastPcr27 = nPcr27;
+            m_nNextPcr27 += m_nPcrInterval27;
+            ++m_stats.nPcrs;
+        }
+    }
+
+    avio_write(m_pIoCtx, pOut, static_cast<int>(g_nTsPacketSize));
+    ++m_nSlot;
+    ++m_stats.nPackets;
+    return m_pIoCtx->error == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool CbrTsMuxer::write_packet(const AVPacket *pPkt, const AVRational tbPkt)
+{
+    if (pPkt->dts == AV_NOPTS_VALUE)
+    {
+        std::cerr << "CBR TS muxer needs a DTS on every packet" << std::endl;
+        return false;
+    }
+    if (m_nFirstDts == AV_NOPTS_VALUE)
+    {
+        m_nFirstDts = pPkt->dts;
+    }
+
+    const AVRational tb27{1, static_cast<int>(g_nTsClock)};
+    const int64_t nDts27 = av_rescale_q(pPkt->dts - m_nFirstDts, tbPkt, tb27) + m_nMuxDelay27;
+    const int64_t nPts27 = pPkt->pts == AV_NOPTS_VALUE
+        ? nDts27
+        : av_rescale_q(pPkt->pts - m_nFirstDts, tbPkt, tb27) + m_nMuxDelay27;
+
+    // Run the clock up to the first slot this access unit may go out in.
+    while (slot_time_27(m_nSlot, 0) < nDts27 - m_nMuxDelay27)
+    {
+        if (!emit_slot())
+        {
+            return false;
+        }
+    }
+
+    AccessUnit au{};
+    if (!m_vecFreeBuffers.empty())
+    {
+        au.vecPes = std::move(m_vecFreeBuffers.back());
+        m_vecFreeBuffers.pop_back();
+    }
+    au.nDts27 = nDts27;
+    au.bKey = (pPkt->flags & AV_PKT_FLAG_KEY) != 0;
+
+    // PES header: video stream_id, unbounded length, data_alignment_indicator.
+    const bool bDts = nDts27 != nPts27;
+    uint8_t arrHeader[19] = {0x00, 0x00, 0x01, 0xE0, 0x00, 0x00, 0x84};
+    arrHeader[7] = bDts ? 0xC0 : 0x80;
+    arrHeader[8] = bDts ? 10 : 5;
+    write_timestamp(arrHeader + 9, bDts ? 0x3 : 0x2, nPts27 / 300);
+    if (bDts)
+    {
+        write_timestamp(arrHeader + 14, 0x1, nDts27 / 300);
+    }
+    const std::size_t nHeader = bDts ? 19 : 14;
+
+    // H.264 in TS wants each access unit to open with an access unit delimiter.
+    const bool bAud = !starts_with_aud(pPkt->data, pPkt->size);
+
+    au.vecPes.reserve(nHeader + sizeof(g_arrAud) + static_cast<std::size_t>(pPkt->size));
+    au.vecPes.insert(au.vecPes.end(), arrHeader, arrHeader + nHeader);
+    if (bAud)
+    {
+        au.vecPes.insert(au.vecPes.end(), std::begin(g_arrAud), std::end(g_arrAud));
+    }
+    au.vecPes.insert(au.vecPes.end(), pPkt->data, pPkt->data + pPkt->size);
+
+    m_nQueuedBytes += au.vecPes.size();
+    m_stats.nMaxQueuedBytes = std::max(m_stats.nMaxQueuedBytes, m_nQueuedBytes);
+    m_queue.push_back(std::move(au));
+    return m_pIoCtx->error == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool CbrTsMuxer::flush()
+{
+    while (!m_queue.empty())
+    {
+        if (!emit_slot())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_cbr_ts_muxer_stats(const CbrTsMuxerStats &stats)
+{
+    std::cout << "CBR TS muxer: "
+              << stats.nPackets
+              << " packets ("
+              << stats.nVideoPackets
+              << " video, "
+              << stats.nPcrOnlyPackets
+              << " PCR only, "
+              << stats.nPsiPackets
+              << " PAT/PMT, "
+              << stats.nNullPackets
+              << " null), "
+              << stats.nStuffingBytes
+              << " stuffing bytes, "
+              << stats.nPcrs
+              << " PCRs (max interval "
+              << stats.nMaxPcrIntervalNs / 1000
+              << " us), "
+              << stats.nLateAccessUnits
+              << " of "
+              << stats.nAccessUnits
+              << " access units late, max "
+              << stats.nMaxQueuedBytes
+              << " bytes queued"
+              << std::endl;
+}
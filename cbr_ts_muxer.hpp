@@ -0,0 +1,150 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "ts_constants.hpp"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avio.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+struct CbrTsMuxerConfig
+{
+    // Transport stream rate; every 188-byte slot at this rate carries a packet.
+    int64_t nMuxRate{6300000};
+
+    // Video elementary stream rate. Video packets are released no faster
+    // than this plus TS/PES overhead (188/184 + 128 kbit/s), so the
+    // decoder's buffer fills as the encoder's HRD assumed. 0 sends video as
+    // soon as a slot is free.
+    int64_t nVideoRate{0};
+
+    int nPcrIntervalMs{20};
+    int nPsiIntervalMs{100};
+
+    // Decode time stamps run this far behind the first slot an access unit
+    // may be sent in, i.e. the longest an access unit may wait in the
+    // decoder's buffer. Should cover the VBV buffer.
+    int nMuxDelayMs{1000};
+
+    uint16_t nTransportStreamId{1};
+    uint16_t nProgramNumber{1};
+    uint16_t nPmtPid{0x1000};
+    uint16_t nVideoPid{0x100};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct CbrTsMuxerStats
+{
+    uint64_t nPackets{0};
+    uint64_t nVideoPackets{0};
+    uint64_t nPcrOnlyPackets{0};
+    uint64_t nPsiPackets{0};
+    uint64_t nNullPackets{0};
+
+    // Adaptation field bytes used to pad the last packet of each PES.
+    uint64_t nStuffingBytes{0};
+
+    uint64_t nPcrs{0};
+    int64_t nMaxPcrIntervalNs{0};
+
+    // Access units whose last byte left after their DTS.
+    uint64_t nAccessUnits{0};
+    uint64_t nLateAccessUnits{0};
+    std::size_t nMaxQueuedBytes{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Single-program H.264 transport stream muxer with its own fixed packet
+// clock, in place of libavformat's mpegts muxer and its muxrate heuristics.
+//
+// Slot n of the output starts at byte n * 188, i.e. at n * 188 * 8 /
+// nMuxRate seconds, and every slot is filled by exactly one of (in order of
+// priority): PAT, PMT, the next video packet (carrying a PCR if one is due),
+// a PCR-only packet on the video PID, or a null packet. PAT/PMT and PCR are
+// scheduled on exact intervals of that clock, and each PCR is the arrival
+// time of its own byte 10 (the last bit of program_clock_reference_base).
+// The short last packet of each PES is padded with adaptation field
+// stuffing. Picking and building a packet takes constant time.
+//
+// Access units go in through write_packet() in decode order. Before one is
+// queued, the clock is run up to the earliest slot it may use, which is
+// nMuxDelayMs before its DTS. The output is therefore a pure function of the
+// encoded packets and the configuration.
+class CbrTsMuxer
+{
+public:
+    CbrTsMuxer(const CbrTsMuxerConfig &config, AVIOContext *pIoCtx);
+
+    CbrTsMuxer(const CbrTsMuxer &) = delete;
+    CbrTsMuxer &operator=(const CbrTsMuxer &) = delete;
+
+    // pPkt holds one Annex B access unit with time stamps in tbPkt.
+    bool write_packet(const AVPacket *pPkt, AVRational tbPkt);
+
+    // Sends everything still queued.
+    bool flush();
+
+    const CbrTsMuxerStats &stats() const { return m_stats; }
+
+private:
+    struct AccessUnit
+    {
+        std::vector<uint8_t> vecPes;
+        std::size_t nOffset{0};
+        int64_t nDts27{0};
+        bool bKey{false};
+    };
+
+    int64_t slot_time_27(uint64_t nSlot, std::size_t nByte) const;
+    void build_psi_packets();
+    bool emit_slot();
+    void write_video_packet(uint8_t *pTs, bool bPcr);
+    void write_pcr_packet(uint8_t *pTs);
+    std::size_t write_pcr(uint8_t *pField) const;
+
+    const CbrTsMuxerConfig m_config;
+    AVIOContext *const m_pIoCtx;
+
+    const int64_t m_nPcrInterval27;
+    const int64_t m_nPsiInterval27;
+    const int64_t m_nMuxDelay27;
+
+    // Leaky bucket for the video PID, in bits scaled by the mux rate.
+    const int64_t m_nVideoCreditPerSlot;
+    const int64_t m_nVideoCreditMax;
+    int64_t m_nVideoCredit{0};
+
+    uint64_t m_nSlot{0};
+    int64_t m_nNextPcr27{0};
+    int64_t m_nNextPsi27{0};
+    int64_t m_nLastPcr27{-1};
+    bool m_bPmtPending{false};
+
+    int64_t m_nFirstDts{AV_NOPTS_VALUE};
+
+    std::array<uint8_t, g_nTsPacketSize> m_arrPat{};
+    std::array<uint8_t, g_nTsPacketSize> m_arrPmt{};
+    std::array<uint8_t, g_nTsPacketSize> m_arrNull{};
+    std::array<uint8_t, g_nTsPacketSize> m_arrPacket{};
+    uint8_t m_nPatCc{0};
+    uint8_t m_nPmtCc{0};
+    uint8_t m_nVideoCc{0};
+
+    // Queued access units; sent ones hand their buffer back for reuse.
+    std::deque<AccessUnit> m_queue;
+    std::vector<std::vector<uint8_t>> m_vecFreeBuffers;
+    std::size_t m_nQueuedBytes{0};
+
+    CbrTsMuxerStats m_stats;
+};
+
+//////////////////////////////////////////////////////////////////////////
+void print_cbr_ts_muxer_stats(const CbrTsMuxerStats &stats);
@@ -0,0 +1,523 @@
+#include "cpu_topology.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+
+constexpr const char *g_pszCpuRoot = "/sys/devices/system/cpu/";
+constexpr const char *g_pszNodeRoot = "/sys/devices/system/node/";
+
+constexpr const char *g_apszStageNames[] = {"demux", "decode", "encode", "mux"};
+
+//////////////////////////////////////////////////////////////////////////
+bool read_line(const std::string &strPath, std::string &out_strLine)
+{
+    std::ifstream file{strPath};
+    return static_cast<bool>(std::getline(file, out_strLine));
+}
+
+//////////////////////////////////////////////////////////////////////////
+int read_int(const std::string &strPath, const int nDefault)
+{
+    std::string strLine;
+    return read_line(strPath, strLine) ? std::atoi(strLine.c_str()) : nDefault;
+}
+
+//////////////////////////////////////////////////////////////////////////
+int64_t thread_cpu_ns()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+//////////////////////////////////////////////////////////////////////////
+std::set<pid_t> list_threads()
+{
+    std::set<pid_t> setTids;
+    if (DIR *pDir = opendir("/proc/self/task"); pDir != nullptr)
+    {
+        while (const dirent *pEntry = readdir(pDir))
+        {
+            if (pEntry->d_name[0] != '.')
+            {
+                setTids.insert(static_cast<pid_t>(std::atoi(pEntry->d_name)));
+            }
+        }
+        closedir(pDir);
+    }
+    return setTids;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// utime + stime of a thread of this process; 0 once it has exited.
+int64_t task_cpu_ns(const pid_t nTid)
+{
+    std::string strStat;
+    if (!read_line("/proc/self/task/" + std::to_string(nTid) + "/stat", strStat))
+    {
+        return 0;
+    }
+
+    // The command name may contain spaces; the fields after it do not.
+    const auto nParen = strStat.rfind(')');
+    if (nParen == std::string::npos)
+    {
+        return 0;
+    }
+    std::istringstream fields{strStat.substr(nParen + 2)};
+
+    // Fields 3..13 (state .. cmajflt), then utime and stime.
+    std::string strSkip;
+    for (int i = 3; i <= 13; ++i)
+    {
+        fields >> strSkip;
+    }
+    int64_t nUtime{};
+    int64_t nStime{};
+    fields >> nUtime >> nStime;
+
+    const long nTicks = sysconf(_SC_CLK_TCK);
+    return (nUtime + nStime) * (1000000000LL / (nTicks > 0 ? nTicks : 100));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// nNode < 0 restores the default policy.
+void set_preferred_node(const int nNode)
+{
+    if (nNode < 0)
+    {
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+        return;
+    }
+
+    constexpr std::size_t nBitsPerWord = sizeof(unsigned long) * 8;
+    std::vector<unsigned long> vecMask(static_cast<std::size_t>(nNode) / nBitsPerWord + 1, 0);
+    vecMask[static_cast<std::size_t>(nNode) / nBitsPerWord] |= 1UL << (static_cast<std::size_t>(nNode) % nBitsPerWord);
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, vecMask.data(), vecMask.size() * nBitsPerWord + 1) != 0)
+    {
+        std::cerr << "Could not prefer NUMA node " << nNode << ": " << std::strerror(errno) << std::endl;
+    }
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+bool parse_cpu_list(const std::string &strList, std::vector<int> &out_vecIds)
+{
+    out_vecIds.clear();
+
+    std::istringstream ranges{strList};
+    std::string strRange;
+    while (std::getline(ranges, strRange, ','))
+    {
+        if (strRange.empty())
+        {
+            continue;
+        }
+
+        char *pEnd = nullptr;
+        const long nFirst = std::strtol(strRange.c_str(), &pEnd, 10);
+        long nLast = nFirst;
+        if (*pEnd == '-')
+        {
+            nLast = std::strtol(pEnd + 1, &pEnd, 10);
+        }
+        if (*pEnd != '\0' || nFirst < 0 || nLast < nFirst)
+        {
+            return false;
+        }
+
+        for (long nId = nFirst; nId <= nLast; ++nId)
+        {
+            out_vecIds.push_back(static_cast<int>(nId));
+        }
+    }
+
+    std::sort(out_vecIds.begin(), out_vecIds.end());
+    out_vecIds.erase(std::unique(out_vecIds.begin(), out_vecIds.end()), out_vecIds.end());
+    return !out_vecIds.empty();
+}
+
+//////////////////////////////////////////////////////////////////////////
+std::string format_cpu_list(const std::vector<int> &vecIds)
+{
+    std::string strList;
+    for (std::size_t i = 0; i < vecIds.size();)
+    {
+        std::size_t j = i;
+        while (j + 1 < vecIds.size() && vecIds[j + 1] == vecIds[j] + 1)
+        {
+            ++j;
+        }
+
+        strList += (strList.empty() ? "" : ",") + std::to_string(vecIds[i]);
+        if (j > i)
+        {
+            strList += "-" + std::to_string(vecIds[j]);
+        }
+        i = j + 1;
+    }
+    return strList;
+}
+
+//////////////////////////////////////////////////////////////////////////
+const char *thread_stage_name(const ThreadStage eStage)
+{
+    return eStage < ThreadStage::Count ? g_apszStageNames[static_cast<std::size_t>(eStage)] : "unknown";
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool CpuTopology::discover()
+{
+    m_vecCpus.clear();
+
+    std::string strOnline;
+    std::vector<int> vecOnline;
+    if (!read_line(std::string{g_pszCpuRoot} + "online", strOnline) || !parse_cpu_list(strOnline, vecOnline))
+    {
+        std::cerr << "Could not read the online CPUs from " << g_pszCpuRoot << std::endl;
+        return false;
+    }
+
+    std::set<int> setPackages;
+    std::set<std::pair<int, int>> setCores;
+    for (const int nCpu : vecOnline)
+    {
+        const std::string strTopology = std::string{g_pszCpuRoot} + "cpu" + std::to_string(nCpu) + "/topology/";
+
+        CpuInfo info{};
+        info.nCpu = nCpu;
+        info.nPackage = read_int(strTopology + "physical_package_id", 0);
+        info.nCore = read_int(strTopology + "core_id", nCpu);
+        m_vecCpus.push_back(info);
+
+        setPackages.insert(info.nPackage);
+        setCores.insert({info.nPackage, info.nCore});
+    }
+
+    std::set<int> setNodes{0};
+    std::string strNodes;
+    std::vector<int> vecNodes;
+    if (read_line(std::string{g_pszNodeRoot} + "online", strNodes) && parse_cpu_list(strNodes, vecNodes))
+    {
+        setNodes.clear();
+        for (const int nNode : vecNodes)
+        {
+            std::string strCpus;
+            std::vector<int> vecCpus;
+            if (!read_line(std::string{g_pszNodeRoot} + "node" + std::to_string(nNode) + "/cpulist", strCpus)
+                || !parse_cpu_list(strCpus, vecCpus))
+            {
+                // Memory-only node.
+                continue;
+            }
+
+            setNodes.insert(nNode);
+            for (CpuInfo &info : m_vecCpus)
+            {
+                if (std::binary_search(vecCpus.begin(), vecCpus.end(), info.nCpu))
+                {
+                    info.nNode = nNode;
+                }
+            }
+        }
+    }
+
+    m_nPackages = static_cast<int>(setPackages.size());
+    m_nCores = static_cast<int>(setCores.size());
+    m_nNodes = static_cast<int>(setNodes.size());
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool CpuTopology::parse_cpu_set(const std::string &strSpec, std::vector<int> &out_vecCpus) const
+{
+    out_vecCpus.clear();
+
+    if (strSpec == "all")
+    {
+        for (const CpuInfo &info : m_vecCpus)
+        {
+            out_vecCpus.push_back(info.nCpu);
+        }
+        return !out_vecCpus.empty();
+    }
+
+    if (strSpec.rfind("node:", 0) == 0)
+    {
+        std::vector<int> vecNodes;
+        if (!parse_cpu_list(strSpec.substr(5), vecNodes))
+        {
+            return false;
+        }
+        for (const CpuInfo &info : m_vecCpus)
+        {
+            if (std::binary_search(vecNodes.begin(), vecNodes.end(), info.nNode))
+            {
+                out_vecCpus.push_back(info.nCpu);
+            }
+        }
+        return !out_vecCpus.empty();
+    }
+
+    std::vector<int> vecCpus;
+    if (!parse_cpu_list(strSpec, vecCpus))
+    {
+        return false;
+    }
+    for (const int nCpu : vecCpus)
+    {
+        const bool bOnline = std::any_of(m_vecCpus.begin(), m_vecCpus.end(), [nCpu](const CpuInfo &info) { return info.nCpu == nCpu; });
+        if (!bOnline || nCpu >= CPU_SETSIZE)
+        {
+            std::cerr << "CPU " << nCpu << " is not online" << std::endl;
+            return false;
+        }
+    }
+    out_vecCpus = vecCpus;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+int CpuTopology::common_node(const std::vector<int> &vecCpus) const
+{
+    int nNode = -1;
+    for (const CpuInfo &info : m_vecCpus)
+    {
+        if (!std::binary_search(vecCpus.begin(), vecCpus.end(), info.nCpu))
+        {
+            continue;
+        }
+        if (nNode >= 0 && info.nNode != nNode)
+        {
+            return -1;
+        }
+        nNode = info.nNode;
+    }
+    return nNode;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool ThreadPlacement::init(const ThreadPlacementConfig &config)
+{
+    m_bReport = config.bReport;
+    m_arrNodes.fill(-1);
+
+    const bool bAnyPinned = std::any_of(config.arrCpuSpecs.begin(), config.arrCpuSpecs.end(),
+                                        [](const std::string &strSpec) { return !strSpec.empty(); });
+    m_bEnabled = bAnyPinned || m_bReport;
+    if (!bAnyPinned)
+    {
+        return true;
+    }
+
+    if (!m_topology.discover())
+    {
+        return false;
+    }
+
+    std::cout << "CPU topology: "
+              << m_topology.package_count()
+              << " packages, "
+              << m_topology.node_count()
+              << " NUMA nodes, "
+              << m_topology.core_count()
+              << " cores, "
+              << m_topology.cpus().size()
+              << " CPUs"
+              << std::endl;
+
+    for (std::size_t i = 0; i < config.arrCpuSpecs.size(); ++i)
+    {
+        const std::string &strSpec = config.arrCpuSpecs[i];
+        if (strSpec.empty())
+        {
+            continue;
+        }
+
+        const auto eStage = static_cast<ThreadStage>(i);
+        if (!m_topology.parse_cpu_set(strSpec, m_arrCpus[i]))
+        {
+            std::cerr << "Invalid CPU set for the " << thread_stage_name(eStage) << " stage: '" << strSpec << "'" << std::endl;
+            return false;
+        }
+        m_arrNodes[i] = m_topology.common_node(m_arrCpus[i]);
+
+        std::cout << "  "
+                  << thread_stage_name(eStage)
+                  << ": CPUs "
+                  << format_cpu_list(m_arrCpus[i]);
+        if (m_arrNodes[i] >= 0)
+        {
+            std::cout << " (node " << m_arrNodes[i] << ", local memory)";
+        }
+        std::cout << std::endl;
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void ThreadPlacement::place_current_thread(const ThreadStage eStage) const
+{
+    const std::vector<int> &vecCpus = m_arrCpus[index(eStage)];
+    if (vecCpus.empty())
+    {
+        return;
+    }
+
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for (const int nCpu : vecCpus)
+    {
+        CPU_SET(nCpu, &cpuSet);
+    }
+    if (int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet); ret != 0)
+    {
+        std::cerr << "Could not pin " << thread_stage_name(eStage) << " thread: " << std::strerror(ret) << std::endl;
+    }
+
+    set_preferred_node(m_arrNodes[index(eStage)]);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool ThreadPlacement::run_placed(const ThreadStage eStage, const std::function<bool()> &fnCreate)
+{
+    if (!m_bEnabled)
+    {
+        return fnCreate();
+    }
+
+    cpu_set_t savedAffinity;
+    pthread_getaffinity_np(pthread_self(), sizeof(savedAffinity), &savedAffinity);
+
+    const std::set<pid_t> setBefore = list_threads();
+    place_current_thread(eStage);
+
+    const bool bResult = fnCreate();
+
+    pthread_setaffinity_np(pthread_self(), sizeof(savedAffinity), &savedAffinity);
+    if (pinned(eStage))
+    {
+        set_preferred_node(-1);
+    }
+
+    const std::set<pid_t> setAfter = list_threads();
+    std::lock_guard<std::mutex> lock{m_mtx};
+    for (const pid_t nTid : setAfter)
+    {
+        if (setBefore.count(nTid) == 0)
+        {
+            m_arrLibraryThreads[index(eStage)].push_back(nTid);
+        }
+    }
+    return bResult;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool run_placed(ThreadPlacement *pPlacement, const ThreadStage eStage, const std::function<bool()> &fnCreate)
+{
+    return pPlacement != nullptr ? pPlacement->run_placed(eStage, fnCreate) : fnCreate();
+}
+
+//////////////////////////////////////////////////////////////////////////
+void ThreadPlacement::print_utilisation(const double dWallSeconds) const
+{
+    if (!m_bReport || dWallSeconds <= 0.0)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock{m_mtx};
+    std::cout << "CPU utilisation over "
+              << std::fixed << std::setprecision(2)
+              << dWallSeconds
+              << " s:"
+              << std::endl;
+
+    const auto nHardwareCpus = static_cast<std::size_t>(std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L));
+    for (std::size_t i = 0; i < static_cast<std::size_t>(ThreadStage::Count); ++i)
+    {
+        int64_t nCpuNs = m_arrFinishedCpuNs[i];
+        for (const pid_t nTid : m_arrLibraryThreads[i])
+        {
+            nCpuNs += task_cpu_ns(nTid);
+        }
+
+        const double dCpuSeconds = static_cast<double>(nCpuNs) / 1e9;
+        const double dCoresBusy = dCpuSeconds / dWallSeconds;
+        const std::size_t nSetSize = m_arrCpus[i].empty() ? nHardwareCpus : m_arrCpus[i].size();
+
+        std::cout << "  "
+                  << std::left << std::setw(7) << thread_stage_name(static_cast<ThreadStage>(i)) << std::right
+                  << " CPUs "
+                  << (m_arrCpus[i].empty() ? "any" : format_cpu_list(m_arrCpus[i]))
+                  << ", "
+                  << m_arrOwnThreads[i] + m_arrLibraryThreads[i].size()
+                  << " threads: "
+                  << dCpuSeconds
+                  << " CPU s, "
+                  << dCoresBusy
+                  << " cores busy ("
+                  << std::setprecision(1)
+                  << 100.0 * dCoresBusy / static_cast<double>(nSetSize)
+                  << "% of "
+                  << nSetSize
+                  << ")"
+                  << std::setprecision(2)
+                  << std::endl;
+    }
+    std::cout << std::defaultfloat;
+}
+
+//////////////////////////////////////////////////////////////////////////
+ThreadPlacement::Scope::Scope(ThreadPlacement *pPlacement, const ThreadStage eStage)
+    : m_pPlacement(pPlacement != nullptr && pPlacement->enabled() ? pPlacement : nullptr),
+      m_eStage(eStage)
+{
+    if (m_pPlacement == nullptr)
+    {
+        return;
+    }
+
+    pthread_getaffinity_np(pthread_self(), sizeof(m_savedAffinity), &m_savedAffinity);
+    m_pPlacement->place_current_thread(eStage);
+    m_nStartCpuNs = thread_cpu_ns();
+}
+
+//////////////////////////////////////////////////////////////////////////
+ThreadPlacement::Scope::~Scope()
+{
+    if (m_pPlacement == nullptr)
+    {
+        return;
+    }
+
+    const int64_t nCpuNs = thread_cpu_ns() - m_nStartCpuNs;
+    pthread_setaffinity_np(pthread_self(), sizeof(m_savedAffinity), &m_savedAffinity);
+    if (m_pPlacement->pinned(m_eStage))
+    {
+        set_preferred_node(-1);
+    }
+
+    std::lock_guard<std::mutex> lock{m_pPlacement->m_mtx};
+    m_pPlacement->m_arrFinishedCpuNs[index(m_eStage)] += nCpuNs;
+    ++m_pPlacement->m_arrOwnThreads[index(m_eStage)];
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+#include <sys/types.h>
+
+//////////////////////////////////////////////////////////////////////////
+struct CpuInfo
+{
+    int nCpu{0};
+    int nPackage{0};
+    int nCore{0};
+    int nNode{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Online CPUs with their package, core and NUMA node, read from
+// /sys/devices/system/{cpu,node}. Machines without a node directory are
+// treated as a single node.
+class CpuTopology
+{
+public:
+    bool discover();
+
+    const std::vector<CpuInfo> &cpus() const { return m_vecCpus; }
+    int package_count() const { return m_nPackages; }
+    int node_count() const { return m_nNodes; }
+    int core_count() const { return m_nCores; }
+
+    // "node:0", "node:0,1", a CPU list such as "0-7,16-23", or "all".
+    bool parse_cpu_set(const std::string &strSpec, std::vector<int> &out_vecCpus) const;
+
+    // NUMA node shared by every CPU in vecCpus, or -1.
+    int common_node(const std::vector<int> &vecCpus) const;
+
+private:
+    std::vector<CpuInfo> m_vecCpus;
+    int m_nPackages{0};
+    int m_nNodes{0};
+    int m_nCores{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Parses a sysfs-style CPU/node list ("0-3,8,10-11").
+bool parse_cpu_list(const std::string &strList, std::vector<int> &out_vecIds);
+
+std::string format_cpu_list(const std::vector<int> &vecIds);
+
+//////////////////////////////////////////////////////////////////////////
+enum class ThreadStage
+{
+    Demux,
+    Decode,
+    Encode,
+    Mux,
+    Count
+};
+
+const char *thread_stage_name(ThreadStage eStage);
+
+//////////////////////////////////////////////////////////////////////////
+struct ThreadPlacementConfig
+{
+    // CPU set per stage (see CpuTopology::parse_cpu_set); empty leaves the
+    // stage unpinned. Mux covers the output I/O threads as well.
+    std::array<std::string, static_cast<std::size_t>(ThreadStage::Count)> arrCpuSpecs;
+
+    // Print per-stage CPU time and utilisation at the end.
+    bool bReport{false};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Places the transcoder's threads on chosen CPUs and accounts their CPU
+// time per stage.
+//
+// Our own stage threads are pinned directly. Threads that FFmpeg and x264
+// start themselves (frame/slice threads, the x264 lookahead and frame
+// threads, the output writer threads) cannot be reached that way. So the
+// call that creates them runs through run_placed(): new threads inherit the
+// creating thread's affinity and memory policy, and the threads that
+// appear during the call are attributed to the stage.
+//
+// When a stage's CPUs all sit on one NUMA node, that node also becomes the
+// preferred memory node of its threads. Frame buffers and x264's internal
+// buffers are then allocated on the node that uses them.
+class ThreadPlacement
+{
+public:
+    bool init(const ThreadPlacementConfig &config);
+
+    bool enabled() const { return m_bEnabled; }
+    bool pinned(ThreadStage eStage) const { return !m_arrCpus[index(eStage)].empty(); }
+
+    // Runs fnCreate with the calling thread placed on eStage, then restores
+    // the calling thread.
+    bool run_placed(ThreadStage eStage, const std::function<bool()> &fnCreate);
+
+    // Prints CPU seconds, cores busy and utilisation of each stage's CPU set
+    // over dWallSeconds. Library threads are read while still running, so
+    // call this before closing the codecs and outputs.
+    void print_utilisation(double dWallSeconds) const;
+
+    //////////////////////////////////////////////////////////////////////////
+    // Places the calling thread on a stage for its lifetime and adds its CPU
+    // time to the stage when it goes out of scope, restoring the thread's
+    // previous placement. Does nothing with a null placement.
+    class Scope
+    {
+    public:
+        Scope(ThreadPlacement *pPlacement, ThreadStage eStage);
+        ~Scope();
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        ThreadPlacement *const m_pPlacement;
+        const ThreadStage m_eStage;
+        cpu_set_t m_savedAffinity{};
+        int64_t m_nStartCpuNs{0};
+    };
+
+private:
+    static std::size_t index(ThreadStage eStage) { return static_cast<std::size_t>(eStage); }
+
+    void place_current_thread(ThreadStage eStage) const;
+
+    CpuTopology m_topology;
+    bool m_bEnabled{false};
+    bool m_bReport{false};
+
+    std::array<std::vector<int>, static_cast<std::size_t>(ThreadStage::Count)> m_arrCpus;
+    std::array<int, static_cast<std::size_t>(ThreadStage::Count)> m_arrNodes{};
+
+    // Per-stage accounting; guarded by m_mtx.
+    mutable std::mutex m_mtx;
+    std::array<int64_t, static_cast<std::size_t>(ThreadStage::Count)> m_arrFinishedCpuNs{};
+    std::array<std::size_t, static_cast<std::size_t>(ThreadStage::Count)> m_arrOwnThreads{};
+    std::array<std::vector<pid_t>, static_cast<std::size_t>(ThreadStage::Count)> m_arrLibraryThreads;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// ThreadPlacement::run_placed(), or just fnCreate() with a null placement.
+bool run_placed(ThreadPlacement *pPlacement, ThreadStage eStage, const std::function<bool()> &fnCreate);
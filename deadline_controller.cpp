@@ -0,0 +1,177 @@
+#include "deadline_controller.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+namespace
+{
+
+// superfast..medium all default to bframes=3 and b-pyramid=normal.
+const std::vector<EncoderLevel> g_vecLevels = {
+    {"superfast", 10, 1},
+    {"veryfast", 10, 2},
+    {"faster", 20, 4},
+    {"faster", 25, 4},
+    {"fast", 30, 6},
+    {"medium", 40, 7},
+};
+
+// preset=faster, rc-lookahead=25: the original configuration.
+constexpr std::size_t g_nDefaultLevel = 3;
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+DeadlineController::DeadlineController(const DeadlineConfig &config, const AVRational frameRate)
+    : m_config(config),
+      m_nBudgetNs(frameRate.num > 0 ? 1000000000LL * frameRate.den / frameRate.num : 40000000LL),
+      m_nStartLevel(g_nDefaultLevel),
+      m_nLevel(g_nDefaultLevel),
+      m_vecLevelCostNs(g_vecLevels.size(), 0.0)
+{
+    m_stats.vecFramesPerLevel.resize(g_vecLevels.size(), 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+const std::vector<EncoderLevel> &DeadlineController::levels()
+{
+    return g_vecLevels;
+}
+
+//////////////////////////////////////////////////////////////////////////
+std::size_t DeadlineController::default_level()
+{
+    return g_nDefaultLevel;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void DeadlineController::apply_level(const std::size_t nLevel, CbrEncoderSettings &inout_settings)
+{
+    const EncoderLevel &level = g_vecLevels[std::min(nLevel, g_vecLevels.size() - 1)];
+    inout_settings.strPreset = level.pszPreset;
+    inout_settings.nLookahead = level.nLookahead;
+    inout_settings.nSubme = level.nSubme;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void DeadlineController::add_frame(const int64_t nEncodeNs)
+{
+    ++m_stats.nFrames;
+    ++m_stats.vecFramesPerLevel[m_nLevel];
+
+    m_nGopNs += nEncodeNs;
+    ++m_nGopFrames;
+
+    // Frames arrive every m_nBudgetNs; a backlog of more than one interval
+    // means this frame missed its slot.
+    m_nBacklogNs = std::max<int64_t>(0, m_nBacklogNs + nEncodeNs - m_nBudgetNs);
+    if (m_nBacklogNs > m_nBudgetNs)
+    {
+        ++m_stats.nMisses;
+    }
+
+    double dProjectedNs = static_cast<double>(nEncodeNs);
+    const double dStartCost = m_vecLevelCostNs[m_nStartLevel];
+    const double dLevelCost = m_vecLevelCostNs[m_nLevel];
+    if (m_nLevel != m_nStartLevel && dStartCost > 0.0 && dLevelCost > 0.0)
+    {
+        dProjectedNs *= dStartCost / dLevelCost;
+    }
+    m_dProjectedBacklogNs = std::max(0.0, m_dProjectedBacklogNs + dProjectedNs - static_cast<double>(m_nBudgetNs));
+    if (m_dProjectedBacklogNs > static_cast<double>(m_nBudgetNs))
+    {
+        ++m_stats.nProjectedMisses;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool DeadlineController::on_gop_boundary()
+{
+    if (m_nGopFrames == 0)
+    {
+        return false;
+    }
+
+    const double dMeanNs = static_cast<double>(m_nGopNs) / static_cast<double>(m_nGopFrames);
+    m_vecLevelCostNs[m_nLevel] = dMeanNs;
+    m_nGopNs = 0;
+    m_nGopFrames = 0;
+
+    const double dLoad = dMeanNs / static_cast<double>(m_nBudgetNs);
+    const std::size_t nPrevLevel = m_nLevel;
+
+    if ((dLoad > m_config.dStepDownLoad || m_nBacklogNs > 0) && m_nLevel > 0)
+    {
+        --m_nLevel;
+        ++m_stats.nStepsDown;
+        m_nCalmGops = 0;
+    }
+    else if (dLoad < m_config.dStepUpLoad)
+    {
+        ++m_nCalmGops;
+
+        // Don't go back up to a level already known to be too slow.
+        const bool bNextKnownSlow = m_nLevel + 1 < g_vecLevels.size()
+            && m_vecLevelCostNs[m_nLevel + 1] > m_config.dStepDownLoad * static_cast<double>(m_nBudgetNs);
+        if (m_nCalmGops >= m_config.nStepUpGops && m_nLevel + 1 < g_vecLevels.size() && !bNextKnownSlow)
+        {
+            ++m_nLevel;
+            ++m_stats.nStepsUp;
+            m_nCalmGops = 0;
+        }
+    }
+    else
+    {
+        m_nCalmGops = 0;
+    }
+
+    return m_nLevel != nPrevLevel;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_deadline_stats(const DeadlineController &controller)
+{
+    const DeadlineStats &stats = controller.stats();
+    const uint64_t nAvoided = stats.nProjectedMisses > stats.nMisses ? stats.nProjectedMisses - stats.nMisses : 0;
+
+    std::cout << "Deadline: "
+              << stats.nFrames
+              << " frames at "
+              << controller.budget_ns() / 1000
+              << " us/frame, "
+              << stats.nMisses
+              << " misses ("
+              << stats.nProjectedMisses
+              << " projected at the start level, "
+              << nAvoided
+              << " avoided), "
+              << stats.nStepsDown + stats.nStepsUp
+              << " level changes ("
+              << stats.nStepsDown
+              << " down, "
+              << stats.nStepsUp
+              << " up)"
+              << std::endl;
+
+    const auto &vecLevels = DeadlineController::levels();
+    for (std::size_t i = 0; i < vecLevels.size(); ++i)
+    {
+        if (stats.vecFramesPerLevel[i] == 0)
+        {
+            continue;
+        }
+
+        std::cout << "  level "
+                  << i
+                  << " ("
+                  << vecLevels[i].pszPreset
+                  << ", rc-lookahead="
+                  << vecLevels[i].nLookahead
+                  << ", subme="
+                  << vecLevels[i].nSubme
+                  << "): "
+                  << stats.vecFramesPerLevel[i]
+                  << " frames"
+                  << std::endl;
+    }
+}
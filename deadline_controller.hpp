@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "encoder_settings.hpp"
+
+extern "C"
+{
+#include <libavutil/rational.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Real-time deadline control for live use.
+//
+// The wall time spent encoding each frame is compared with the frame
+// interval. At every GOP boundary the controller may move the encoder one
+// step along a fixed ladder of speed/quality levels: down (faster) as soon
+// as the last GOP ran close to the budget or a backlog built up, up (better)
+// only after several GOPs with plenty of headroom. FFmpeg's libx264 wrapper
+// cannot change the preset of a running encoder, so a level change is an
+// encoder swap on the closed GOP boundary (see PipelineOutput).
+//
+// Every level keeps x264's default 3 B-frames with a normal pyramid, so the
+// DTS offset does not change across a swap.
+struct EncoderLevel
+{
+    const char *pszPreset;
+    int nLookahead;
+    int nSubme;
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct DeadlineConfig
+{
+    bool bEnabled{false};
+
+    // Step down once a GOP averages more than this share of the frame
+    // interval.
+    double dStepDownLoad{0.85};
+
+    // Step up once nStepUpGops GOPs in a row averaged less than this share.
+    double dStepUpLoad{0.55};
+    std::size_t nStepUpGops{3};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct DeadlineStats
+{
+    uint64_t nFrames{0};
+
+    // Frames finished more than one frame interval behind the real-time
+    // schedule.
+    uint64_t nMisses{0};
+
+    // The same count for a model of the encode staying at the start level
+    // (each frame's time scaled by the measured cost of the start level over
+    // the level actually used).
+    uint64_t nProjectedMisses{0};
+
+    uint64_t nStepsDown{0};
+    uint64_t nStepsUp{0};
+
+    std::vector<uint64_t> vecFramesPerLevel;
+};
+
+//////////////////////////////////////////////////////////////////////////
+class DeadlineController
+{
+public:
+    DeadlineController(const DeadlineConfig &config, AVRational frameRate);
+
+    // Fastest first.
+    static const std::vector<EncoderLevel> &levels();
+
+    // The level matching the default CbrEncoderSettings.
+    static std::size_t default_level();
+
+    // Applies a level to the encoder settings.
+    static void apply_level(std::size_t nLevel, CbrEncoderSettings &inout_settings);
+
+    // Wall time spent encoding one frame at the current level.
+    void add_frame(int64_t nEncodeNs);
+
+    // Called before the first frame of each GOP; returns true if the level
+    // changed and the encoder has to be swapped.
+    bool on_gop_boundary();
+
+    std::size_t level() const { return m_nLevel; }
+    int64_t budget_ns() const { return m_nBudgetNs; }
+    const DeadlineStats &stats() const { return m_stats; }
+
+private:
+    const DeadlineConfig m_config;
+    const int64_t m_nBudgetNs;
+    const std::size_t m_nStartLevel;
+    std::size_t m_nLevel;
+
+    // Mean per-frame encode time last measured at each level (0 = unknown).
+    std::vector<double> m_vecLevelCostNs;
+
+    int64_t m_nGopNs{0};
+    uint64_t m_nGopFrames{0};
+    std::size_t m_nCalmGops{0};
+
+    // How far behind the real-time schedule we are, actual and projected.
+    int64_t m_nBacklogNs{0};
+    double m_dProjectedBacklogNs{0.0};
+
+    DeadlineStats m_stats;
+};
+
+//////////////////////////////////////////////////////////////////////////
+void print_deadline_stats(const DeadlineController &controller);
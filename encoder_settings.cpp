@@ -0,0 +1,82 @@
+#include "encoder_settings.hpp"
+
+#include <algorithm>
+
+//////////////////////////////////////////////////////////////////////////
+bool configure_cbr_encoder(const CbrEncoderSettings &settings,
+                           const AVCodecContext *pCdcCtxIn,
+                           AVCodecContext *pCdcCtxOut,
+                           AVDictionary *&pDict)
+{
+    // x264 takes one psy tune plus zerolatency.
+    const std::string strTune = settings.bLowLatency ? settings.strTune + ",zerolatency" : settings.strTune;
+    av_dict_set(&pDict, "preset", settings.strPreset.c_str(), 0);
+    av_dict_set(&pDict, "tune", strTune.c_str(), 0);
+    av_dict_set_int(&pDict, "rc-lookahead", settings.bLowLatency ? 0 : settings.nLookahead, 0);
+
+    pCdcCtxOut->width = pCdcCtxIn->width;
+    pCdcCtxOut->height = pCdcCtxIn->height;
+    pCdcCtxOut->pix_fmt = AV_PIX_FMT_YUV420P;
+    pCdcCtxOut->gop_size = settings.nGopSize;
+    if (settings.nThreads > 0)
+    {
+        pCdcCtxOut->thread_count = settings.nThreads;
+    }
+
+    pCdcCtxOut->bit_rate = settings.nBitRate;
+    //pCdcCtxOut->rc_min_rate = pCdcCtxOut->bit_rate;
+    pCdcCtxOut->rc_max_rate = pCdcCtxOut->bit_rate;
+    const int64_t nBufferBits = cbr_vbv_buffer_bits(settings);
+    pCdcCtxOut->rc_buffer_size = static_cast<int>(nBufferBits);
+    pCdcCtxOut->rc_initial_buffer_occupancy = settings.nInitialOccupancy < 0
+        ? static_cast<int>((nBufferBits * 9) / 10)
+        : static_cast<int>(std::clamp<int64_t>(settings.nInitialOccupancy, 1, pCdcCtxOut->rc_buffer_size));
+
+    std::string strParams = "vbv-maxrate="
+                            + std::to_string(pCdcCtxOut->bit_rate / 1000)
+                            + ":vbv-bufsize="
+                            + std::to_string(nBufferBits / 1000)
+                            + (settings.bStatmux ? ":force-cfr=1" : ":force-cfr=1:nal-hrd=cbr");
+    if (settings.nSubme >= 0)
+    {
+        strParams += ":subme=" + std::to_string(settings.nSubme);
+    }
+    if (settings.bLowLatency)
+    {
+        // Spread the intra coding of each gop_size period over every frame
+        // rather than sending one large IDR.
+        strParams += ":sliced-threads=1:sync-lookahead=0:bframes=0:intra-refresh=1";
+    }
+
+    av_dict_set(&pDict, "x264-params", strParams.c_str(), 0);
+
+    pCdcCtxOut->field_order = AV_FIELD_TT;
+    pCdcCtxOut->flags = (AV_CODEC_FLAG_INTERLACED_DCT | AV_CODEC_FLAG_INTERLACED_ME | AV_CODEC_FLAG_CLOSED_GOP);
+
+    // WARN: Make some assumptions here!
+    pCdcCtxOut->time_base = AVRational{1,25};
+    pCdcCtxOut->framerate = AVRational{25,1};
+    pCdcCtxOut->sample_aspect_ratio = AVRational{64,45};
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+int64_t cbr_mux_rate(const CbrEncoderSettings &settings)
+{
+    return settings.nBitRate + settings.nBitRate / 20;
+}
+
+//////////////////////////////////////////////////////////////////////////
+int64_t cbr_vbv_buffer_bits(const CbrEncoderSettings &settings)
+{
+    // One second, or 100 ms at low latency: its delay is part of the
+    // end-to-end latency.
+    return settings.bLowLatency ? settings.nBitRate / 10 : settings.nBitRate;
+}
+
+//////////////////////////////////////////////////////////////////////////
+int64_t cbr_mux_max_delay(const CbrEncoderSettings &settings)
+{
+    return settings.bLowLatency ? 100000 : 6000000;
+}
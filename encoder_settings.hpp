@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+// Symbols exported from libx264cbr; everything else stays hidden. This
+// header is installed with cbr_transcoder.hpp.
+#define X264CBR_API __attribute__((visibility("default")))
+
+//////////////////////////////////////////////////////////////////////////
+// The x264 CBR configuration under test, mirroring the FFmpeg CLI
+// command line in the README.
+struct CbrEncoderSettings
+{
+    std::string strPreset{"faster"};
+    std::string strTune{"film"};
+    int nLookahead{25};
+    int nGopSize{25};
+
+    // x264 subpixel motion estimation level; negative keeps the preset's.
+    int nSubme{-1};
+
+    // Going for 6Mbit/s
+    int64_t nBitRate{6000000};
+
+    // VBV occupancy (bits) the encoder assumes at its first frame; negative
+    // means the default of 90% of the buffer.
+    int64_t nInitialOccupancy{-1};
+
+    // Encoder threads; 0 leaves the choice to x264.
+    int nThreads{0};
+
+    // Low-latency profile: tune zerolatency (no lookahead or B-frames),
+    // sliced threads, periodic intra refresh every nGopSize frames instead
+    // of IDRs, and a 100 ms VBV buffer. Still CBR with nal-hrd=cbr.
+    bool bLowLatency{false};
+
+    // Statmux channel (statmux.hpp): the rate is changed while encoding,
+    // which x264 refuses under NAL HRD, so there is no HRD signalling or
+    // filler; the multiplex pads with null packets instead.
+    bool bStatmux{false};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Fills in an (unopened) libx264 encoder context and its private options.
+X264CBR_API bool configure_cbr_encoder(const CbrEncoderSettings &settings,
+                           const AVCodecContext *pCdcCtxIn,
+                           AVCodecContext *pCdcCtxOut,
+                           AVDictionary *&pDict);
+
+//////////////////////////////////////////////////////////////////////////
+// TS mux rate for the encode: the video rate plus 5% for TS/PES overhead
+// and PSI (6.3 Mbit/s for the 6 Mbit/s encode).
+X264CBR_API int64_t cbr_mux_rate(const CbrEncoderSettings &settings);
+
+//////////////////////////////////////////////////////////////////////////
+// VBV buffer size: one second of video, 100 ms for the low-latency profile.
+X264CBR_API int64_t cbr_vbv_buffer_bits(const CbrEncoderSettings &settings);
+
+//////////////////////////////////////////////////////////////////////////
+// TS muxer max_delay (microseconds): 6 s normally, 100 ms for the
+// low-latency profile.
+X264CBR_API int64_t cbr_mux_max_delay(const CbrEncoderSettings &settings);
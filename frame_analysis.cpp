@@ -0,0 +1,332 @@
+#include "frame_analysis.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X264CBR_X86_KERNELS 1
+#endif
+
+namespace
+{
+
+constexpr int g_nMbSize = 16;
+
+//////////////////////////////////////////////////////////////////////////
+// Sum, sum of squares and (with a previous frame) zero-motion SAD of one
+// 16x16 block.
+struct MbStats
+{
+    uint32_t nSum{0};
+    uint32_t nSsq{0};
+    uint32_t nSad{0};
+};
+
+using MbStatsKernel = void (*)(const uint8_t *pCur, int nCurStride, const uint8_t *pPrev, int nPrevStride, MbStats &out_stats);
+
+//////////////////////////////////////////////////////////////////////////
+void mb_stats_c(const uint8_t *pCur, const int nCurStride, const uint8_t *pPrev, const int nPrevStride, MbStats &out_stats)
+{
+    MbStats stats{};
+    for (int y = 0; y < g_nMbSize; ++y)
+    {
+        const uint8_t *pRow = pCur + static_cast<std::ptrdiff_t>(y) * nCurStride;
+        for (int x = 0; x < g_nMbSize; ++x)
+        {
+            stats.nSum += pRow[x];
+            stats.nSsq += static_cast<uint32_t>(pRow[x]) * pRow[x];
+        }
+        if (pPrev != nullptr)
+        {
+            const uint8_t *pPrevRow = pPrev + static_cast<std::ptrdiff_t>(y) * nPrevStride;
+            for (int x = 0; x < g_nMbSize; ++x)
+            {
+                stats.nSad += static_cast<uint32_t>(std::abs(pRow[x] - pPrevRow[x]));
+            }
+        }
+    }
+    out_stats = stats;
+}
+
+#if defined(X264CBR_X86_KERNELS)
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse4.1")))
+uint32_t horizontal_sum_epi32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4E));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xB1));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(v));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// psadbw leaves two 64-bit partial sums.
+__attribute__((target("sse4.1")))
+uint32_t horizontal_sum_sad(const __m128i v)
+{
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(v) + _mm_extract_epi32(v, 2));
+}
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse4.1")))
+void mb_stats_sse41(const uint8_t *pCur, const int nCurStride, const uint8_t *pPrev, const int nPrevStride, MbStats &out_stats)
+{
+    const __m128i vZero = _mm_setzero_si128();
+    __m128i vSum = vZero;
+    __m128i vSsq = vZero;
+    __m128i vSad = vZero;
+    for (int y = 0; y < g_nMbSize; ++y)
+    {
+        const __m128i vCur = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pCur + static_cast<std::ptrdiff_t>(y) * nCurStride));
+        const __m128i vLo = _mm_unpacklo_epi8(vCur, vZero);
+        const __m128i vHi = _mm_unpackhi_epi8(vCur, vZero);
+        vSum = _mm_add_epi64(vSum, _mm_sad_epu8(vCur, vZero));
+        vSsq = _mm_add_epi32(vSsq, _mm_add_epi32(_mm_madd_epi16(vLo, vLo), _mm_madd_epi16(vHi, vHi)));
+        if (pPrev != nullptr)
+        {
+            const __m128i vPrev = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pPrev + static_cast<std::ptrdiff_t>(y) * nPrevStride));
+            vSad = _mm_add_epi64(vSad, _mm_sad_epu8(vCur, vPrev));
+        }
+    }
+
+    out_stats.nSum = horizontal_sum_sad(vSum);
+    out_stats.nSsq = horizontal_sum_epi32(vSsq);
+    out_stats.nSad = horizontal_sum_sad(vSad);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Two rows per iteration, one in each 128-bit lane.
+__attribute__((target("avx2")))
+__m256i load_row_pair(const uint8_t *pRow, const int nStride)
+{
+    const __m128i vTop = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pRow));
+    const __m128i vBottom = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pRow + nStride));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(vTop), vBottom, 1);
+}
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2")))
+void mb_stats_avx2(const uint8_t *pCur, const int nCurStride, const uint8_t *pPrev, const int nPrevStride, MbStats &out_stats)
+{
+    const __m256i vZero = _mm256_setzero_si256();
+    __m256i vSum = vZero;
+    __m256i vSsq = vZero;
+    __m256i vSad = vZero;
+    for (int y = 0; y < g_nMbSize; y += 2)
+    {
+        const __m256i vCur = load_row_pair(pCur + static_cast<std::ptrdiff_t>(y) * nCurStride, nCurStride);
+        const __m256i vLo = _mm256_unpacklo_epi8(vCur, vZero);
+        const __m256i vHi = _mm256_unpackhi_epi8(vCur, vZero);
+        vSum = _mm256_add_epi64(vSum, _mm256_sad_epu8(vCur, vZero));
+        vSsq = _mm256_add_epi32(vSsq, _mm256_add_epi32(_mm256_madd_epi16(vLo, vLo), _mm256_madd_epi16(vHi, vHi)));
+        if (pPrev != nullptr)
+        {
+            const __m256i vPrev = load_row_pair(pPrev + static_cast<std::ptrdiff_t>(y) * nPrevStride, nPrevStride);
+            vSad = _mm256_add_epi64(vSad, _mm256_sad_epu8(vCur, vPrev));
+        }
+    }
+
+    out_stats.nSum = horizontal_sum_sad(_mm_add_epi64(_mm256_castsi256_si128(vSum), _mm256_extracti128_si256(vSum, 1)));
+    out_stats.nSsq = horizontal_sum_epi32(_mm_add_epi32(_mm256_castsi256_si128(vSsq), _mm256_extracti128_si256(vSsq, 1)));
+    out_stats.nSad = horizontal_sum_sad(_mm_add_epi64(_mm256_castsi256_si128(vSad), _mm256_extracti128_si256(vSad, 1)));
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+MbStatsKernel kernel_for(const SimdLevel eLevel)
+{
+#if defined(X264CBR_X86_KERNELS)
+    switch (eLevel)
+    {
+    case SimdLevel::Avx2:
+        return mb_stats_avx2;
+    case SimdLevel::Sse41:
+        return mb_stats_sse41;
+    default:
+        break;
+    }
+#endif
+    (void)eLevel;
+    return mb_stats_c;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Roughly what the block would cost as a residual: intra against its own
+// mean, or inter against the co-located block, whichever is cheaper.
+uint32_t mb_cost(const MbStats &stats, const bool bInter)
+{
+    const double dDeviation = static_cast<double>(stats.nSsq)
+        - static_cast<double>(stats.nSum) * static_cast<double>(stats.nSum) / (g_nMbSize * g_nMbSize);
+    const auto nIntra = static_cast<uint32_t>(g_nMbSize * std::sqrt(std::max(dDeviation, 0.0)));
+    return bInter ? std::min(nIntra, stats.nSad) : nIntra;
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+FrameAnalyzer::FrameAnalyzer(const int nWidth, const int nHeight, const FrameAnalysisConfig &config)
+    : m_config(config),
+      m_nWidth(nWidth),
+      m_nHeight(nHeight),
+      m_nMbWidth(nWidth / g_nMbSize),
+      m_nMbHeight(nHeight / g_nMbSize),
+      m_eSimd(detect_simd_level()),
+      m_apPrev(av_frame_alloc())
+{
+    m_vecMbQp.resize(static_cast<std::size_t>(m_nMbWidth) * m_nMbHeight);
+}
+
+//////////////////////////////////////////////////////////////////////////
+void FrameAnalyzer::analyze(const AVFrame *pFrame, FrameComplexity &out_complexity)
+{
+    const MbStatsKernel pfnStats = kernel_for(m_eSimd);
+    const bool bInter = m_apPrev && m_apPrev->data[0] != nullptr;
+
+    out_complexity.nCost = 0;
+    out_complexity.vecMbCost.resize(m_vecMbQp.size());
+    for (int nMbY = 0; nMbY < m_nMbHeight; ++nMbY)
+    {
+        const std::ptrdiff_t nCurRow = static_cast<std::ptrdiff_t>(nMbY) * g_nMbSize * pFrame->linesize[0];
+        const std::ptrdiff_t nPrevRow = bInter ? static_cast<std::ptrdiff_t>(nMbY) * g_nMbSize * m_apPrev->linesize[0] : 0;
+        for (int nMbX = 0; nMbX < m_nMbWidth; ++nMbX)
+        {
+            MbStats stats{};
+            pfnStats(pFrame->data[0] + nCurRow + nMbX * g_nMbSize,
+                     pFrame->linesize[0],
+                     bInter ? m_apPrev->data[0] + nPrevRow + nMbX * g_nMbSize : nullptr,
+                     bInter ? m_apPrev->linesize[0] : 0,
+                     stats);
+
+            const uint32_t nCost = mb_cost(stats, bInter);
+            out_complexity.vecMbCost[static_cast<std::size_t>(nMbY) * m_nMbWidth + nMbX] = nCost;
+            out_complexity.nCost += nCost;
+        }
+    }
+
+    // Keep a reference rather than a copy; the picture is read-only.
+    if (m_apPrev)
+    {
+        av_frame_unref(m_apPrev.get());
+        if (av_frame_ref(m_apPrev.get(), pFrame) < 0)
+        {
+            av_frame_unref(m_apPrev.get());
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool FrameAnalyzer::attach_hints(AVFrame *inout_pFrame, const FrameComplexity &in_complexity, const double dComingCost)
+{
+    const double dCost = static_cast<double>(in_complexity.nCost);
+    if (m_stats.nFrames == 0)
+    {
+        // Nothing has been released yet; the first frame stands in for the past.
+        m_dAverageCost = dCost;
+    }
+
+    double dFrameQp{0.0};
+    if (m_dAverageCost > 0.0 && dComingCost > 0.0)
+    {
+        dFrameQp = std::clamp(m_config.dStrength * std::log2(dComingCost / m_dAverageCost),
+                              -static_cast<double>(m_config.nMaxQpOffset),
+                              static_cast<double>(m_config.nMaxQpOffset));
+    }
+    m_dAverageCost += (dCost - m_dAverageCost) / std::max(m_config.nAverageFrames, 1);
+
+    const int nFrameQp = static_cast<int>(std::lround(dFrameQp));
+    m_stats.nMinQpOffset = m_stats.nFrames == 0 ? nFrameQp : std::min(m_stats.nMinQpOffset, nFrameQp);
+    m_stats.nMaxQpOffset = m_stats.nFrames == 0 ? nFrameQp : std::max(m_stats.nMaxQpOffset, nFrameQp);
+    m_stats.dSumQpOffset += dFrameQp;
+    ++m_stats.nFrames;
+
+    if (m_vecMbQp.empty())
+    {
+        return true;
+    }
+
+    // Busy macroblocks take more of the offset, static ones less.
+    const double dMeanMbCost = dCost / static_cast<double>(m_vecMbQp.size());
+    std::size_t nRegions{0};
+    for (std::size_t i = 0; i < m_vecMbQp.size(); ++i)
+    {
+        const double dWeight = dMeanMbCost > 0.0 ? std::clamp(in_complexity.vecMbCost[i] / dMeanMbCost, 0.5, 2.0) : 1.0;
+        m_vecMbQp[i] = std::clamp(static_cast<int>(std::lround(dFrameQp * dWeight)), -m_config.nMaxQpOffset, m_config.nMaxQpOffset);
+
+        const bool bRunStart = i % static_cast<std::size_t>(m_nMbWidth) == 0 || m_vecMbQp[i] != m_vecMbQp[i - 1];
+        if (m_vecMbQp[i] != 0 && bRunStart)
+        {
+            ++nRegions;
+        }
+    }
+    if (nRegions == 0)
+    {
+        return true;
+    }
+
+    AVFrameSideData *pSideData = av_frame_new_side_data(inout_pFrame,
+                                                        AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                                        static_cast<int>(nRegions * sizeof(AVRegionOfInterest)));
+    if (pSideData == nullptr)
+    {
+        std::cerr << "Could not allocate region of interest side data" << std::endl;
+        return false;
+    }
+
+    // libx264 scales qoffset by 25 into a QP offset. Regions on the last
+    // macroblock row/column also cover the partial macroblocks past them.
+    auto *pRegion = reinterpret_cast<AVRegionOfInterest *>(pSideData->data);
+    for (int nMbY = 0; nMbY < m_nMbHeight; ++nMbY)
+    {
+        const int *pRow = m_vecMbQp.data() + static_cast<std::size_t>(nMbY) * m_nMbWidth;
+        for (int nMbX = 0; nMbX < m_nMbWidth;)
+        {
+            int nEnd = nMbX + 1;
+            while (nEnd < m_nMbWidth && pRow[nEnd] == pRow[nMbX])
+            {
+                ++nEnd;
+            }
+            if (pRow[nMbX] != 0)
+            {
+                pRegion->self_size = sizeof(AVRegionOfInterest);
+                pRegion->top = nMbY * g_nMbSize;
+                pRegion->bottom = nMbY + 1 == m_nMbHeight ? m_nHeight : (nMbY + 1) * g_nMbSize;
+                pRegion->left = nMbX * g_nMbSize;
+                pRegion->right = nEnd == m_nMbWidth ? m_nWidth : nEnd * g_nMbSize;
+                pRegion->qoffset = AVRational{pRow[nMbX], 25};
+                ++pRegion;
+            }
+            nMbX = nEnd;
+        }
+    }
+    m_stats.nRegions += nRegions;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_frame_analysis_stats(const FrameAnalysisStats &stats)
+{
+    if (stats.nFrames == 0)
+    {
+        return;
+    }
+
+    std::cout << "Pre-analysis: "
+              << stats.nFrames
+              << " frames, frame QP offset min/mean/max "
+              << stats.nMinQpOffset
+              << "/"
+              << std::fixed << std::setprecision(2)
+              << stats.dSumQpOffset / static_cast<double>(stats.nFrames)
+              << std::defaultfloat
+              << "/"
+              << stats.nMaxQpOffset
+              << ", "
+              << stats.nRegions
+              << " regions"
+              << std::endl;
+}
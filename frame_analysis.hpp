@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "media_utils.hpp"
+#include "pixel_convert.hpp"
+
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Pre-analysis of decoded frames ahead of the encoders.
+//
+// Each 16x16 luma macroblock is costed as the smaller of an intra estimate
+// (16 x the square root of its summed squared deviation, roughly its SAD
+// against its own mean) and its zero-motion SAD against the previous frame.
+// The frame cost is the sum over its macroblocks.
+//
+// Frames are held nLookahead frames back. When the oldest is released, its
+// QP offset is set by how the mean cost of the frames after it in the
+// window compares with the running average cost of the frames released
+// before it: strength x log2(coming / average) QP, clamped to
+// +/-nMaxQpOffset. The released frame itself is on neither side, so a
+// steady clip gets no offset. A coming rise in complexity therefore raises
+// QP on the frames before it, so the VBV buffer has filled up by the time
+// the rise arrives. Likewise, a coming fall lowers QP early, instead of
+// leaving x264's rate control to react once the sawtooth has already
+// started.
+// Macroblocks get the frame offset scaled by their share of the frame
+// cost (0.5x to 2x), so static areas are left alone.
+//
+// The offsets reach x264 as AV_FRAME_DATA_REGIONS_OF_INTEREST side data:
+// one region per run of equal offsets in a macroblock row. libx264 applies
+// them as quant offsets on top of its adaptive quantisation, so aq-mode
+// must not be 0.
+struct FrameAnalysisConfig
+{
+    // Frames analysed ahead of the one handed to the encoders; 0 disables
+    // the pre-analysis.
+    int nLookahead{0};
+
+    // Frame QP offset: dStrength * log2(mean cost of the coming frames in
+    // the window / running average cost), clamped to +-nMaxQpOffset.
+    double dStrength{1.0};
+    int nMaxQpOffset{4};
+
+    // Frames the running average cost spans.
+    int nAverageFrames{25};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct FrameComplexity
+{
+    uint64_t nCost{0};
+    std::vector<uint32_t> vecMbCost;
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct FrameAnalysisStats
+{
+    uint64_t nFrames{0};
+    uint64_t nRegions{0};
+    int nMinQpOffset{0};
+    int nMaxQpOffset{0};
+    double dSumQpOffset{0.0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Analyses 8-bit 4:2:0 frames of one size, in display order.
+class FrameAnalyzer
+{
+public:
+    FrameAnalyzer(int nWidth, int nHeight, const FrameAnalysisConfig &config);
+
+    FrameAnalyzer(const FrameAnalyzer &) = delete;
+    FrameAnalyzer &operator=(const FrameAnalyzer &) = delete;
+
+    // Costs pFrame against the previously analysed frame.
+    void analyze(const AVFrame *pFrame, FrameComplexity &out_complexity);
+
+    // Attaches the QP offsets for inout_pFrame, analysed as in_complexity,
+    // with dComingCost the mean cost of the frames after it in the window
+    // (its own cost once none are left).
+    bool attach_hints(AVFrame *inout_pFrame, const FrameComplexity &in_complexity, double dComingCost);
+
+    SimdLevel simd_level() const { return m_eSimd; }
+    const FrameAnalysisStats &stats() const { return m_stats; }
+
+private:
+    const FrameAnalysisConfig m_config;
+    const int m_nWidth;
+    const int m_nHeight;
+    const int m_nMbWidth;
+    const int m_nMbHeight;
+    const SimdLevel m_eSimd;
+
+    // The last analysed frame, by reference.
+    FramePtr m_apPrev;
+
+    double m_dAverageCost{0.0};
+
+    std::vector<int> m_vecMbQp;
+    FrameAnalysisStats m_stats;
+};
+
+//////////////////////////////////////////////////////////////////////////
+void print_frame_analysis_stats(const FrameAnalysisStats &stats);
@@ -0,0 +1,97 @@
+#include "frame_pool.hpp"
+
+#include <iostream>
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+}
+
+namespace
+{
+// Plane alignment suitable for the SIMD paths in libavcodec/x264.
+constexpr int g_nBufferAlign = 64;
+}
+
+//////////////////////////////////////////////////////////////////////////
+VideoBufferPool::VideoBufferPool(const int nWidth, const int nHeight, const AVPixelFormat ePixFmt)
+    : m_nWidth(nWidth),
+      m_nHeight(nHeight),
+      m_ePixFmt(ePixFmt)
+{
+    m_nBufferSize = av_image_get_buffer_size(m_ePixFmt, m_nWidth, m_nHeight, g_nBufferAlign);
+    if (m_nBufferSize <= 0)
+    {
+        std::cerr << "Unsupported picture geometry for buffer pool: "
+                  << m_nWidth << "x" << m_nHeight
+                  << std::endl;
+        return;
+    }
+
+    m_pPool = av_buffer_pool_init2(m_nBufferSize, this, &VideoBufferPool::alloc_buffer, nullptr);
+}
+
+//////////////////////////////////////////////////////////////////////////
+VideoBufferPool::~VideoBufferPool()
+{
+    // The pool itself is only freed once every outstanding buffer is returned.
+    av_buffer_pool_uninit(&m_pPool);
+}
+
+//////////////////////////////////////////////////////////////////////////
+AVBufferRef *VideoBufferPool::alloc_buffer(void *pOpaque, const int nSize)
+{
+    auto *pThis = static_cast<VideoBufferPool *>(pOpaque);
+    pThis->m_stats.nBufferAllocs.fetch_add(1, std::memory_order_relaxed);
+    return av_buffer_alloc(nSize);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool VideoBufferPool::get_buffer(AVFrame *pFrame)
+{
+    if (m_pPool == nullptr || pFrame == nullptr)
+    {
+        return false;
+    }
+
+    AVBufferRef *pBuf = av_buffer_pool_get(m_pPool);
+    if (pBuf == nullptr)
+    {
+        return false;
+    }
+    m_stats.nAcquires.fetch_add(1, std::memory_order_relaxed);
+
+    pFrame->buf[0] = pBuf;
+    pFrame->width = m_nWidth;
+    pFrame->height = m_nHeight;
+    pFrame->format = m_ePixFmt;
+
+    if (int ret = av_image_fill_arrays(pFrame->data,
+                                       pFrame->linesize,
+                                       pBuf->data,
+                                       m_ePixFmt,
+                                       m_nWidth,
+                                       m_nHeight,
+                                       g_nBufferAlign); ret < 0)
+    {
+        av_frame_unref(pFrame);
+        return false;
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_pool_stats(const char *pszName, const PoolStats &stats)
+{
+    std::cout << pszName
+              << ": acquisitions="
+              << stats.nAcquires.load()
+              << ", shell allocations="
+              << stats.nShellAllocs.load()
+              << ", buffer allocations="
+              << stats.nBufferAllocs.load()
+              << ", waits="
+              << stats.nWaits.load()
+              << std::endl;
+}
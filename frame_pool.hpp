@@ -0,0 +1,255 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Allocation counters. In steady state only nAcquires should move; the
+// allocation counts stop growing once the pools have warmed up.
+struct PoolStats
+{
+    std::atomic<uint64_t> nShellAllocs{0};
+    std::atomic<uint64_t> nBufferAllocs{0};
+    std::atomic<uint64_t> nAcquires{0};
+    std::atomic<uint64_t> nWaits{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+template <typename T>
+struct PoolTraits;
+
+template <>
+struct PoolTraits<AVFrame>
+{
+    static AVFrame *alloc() { return av_frame_alloc(); }
+    static void unref(AVFrame *p) { av_frame_unref(p); }
+    static void free(AVFrame *p) { av_frame_free(&p); }
+};
+
+template <>
+struct PoolTraits<AVPacket>
+{
+    static AVPacket *alloc() { return av_packet_alloc(); }
+    static void unref(AVPacket *p) { av_packet_unref(p); }
+    static void free(AVPacket *p) { av_packet_free(&p); }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Fixed-capacity pool of AVFrame/AVPacket shells. Every shell is allocated
+// up front; acquire() hands one out wrapped in an intrusively refcounted Ref
+// and the last Ref to go away unreferences the payload and returns the shell.
+//
+// acquire() blocks while the pool is exhausted, which doubles as
+// backpressure on whichever stage is producing too quickly. All Refs must be
+// released before the pool is destroyed.
+template <typename T>
+class MediaPool
+{
+    struct Entry
+    {
+        T *pObj{nullptr};
+        std::atomic<int> nRefs{0};
+        MediaPool *pOwner{nullptr};
+    };
+
+public:
+    class Ref
+    {
+    public:
+        Ref() = default;
+
+        Ref(const Ref &other)
+            : m_pEntry(other.m_pEntry)
+        {
+            if (m_pEntry != nullptr)
+            {
+                m_pEntry->nRefs.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        Ref(Ref &&other) noexcept
+            : m_pEntry(other.m_pEntry)
+        {
+            other.m_pEntry = nullptr;
+        }
+
+        Ref &operator=(Ref other) noexcept
+        {
+            std::swap(m_pEntry, other.m_pEntry);
+            return *this;
+        }
+
+        ~Ref()
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            if (m_pEntry != nullptr && m_pEntry->nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                m_pEntry->pOwner->release(m_pEntry);
+            }
+            m_pEntry = nullptr;
+        }
+
+        T *get() const { return m_pEntry != nullptr ? m_pEntry->pObj : nullptr; }
+        T *operator->() const { return get(); }
+        explicit operator bool() const { return m_pEntry != nullptr; }
+
+    private:
+        friend class MediaPool;
+
+        explicit Ref(Entry *pEntry)
+            : m_pEntry(pEntry)
+        {
+        }
+
+        Entry *m_pEntry{nullptr};
+    };
+
+    explicit MediaPool(const std::size_t nCapacity)
+        : m_apEntries(new Entry[nCapacity > 0 ? nCapacity : 1]),
+          m_nCapacity(nCapacity > 0 ? nCapacity : 1)
+    {
+        m_vecFree.reserve(m_nCapacity);
+        for (std::size_t i = 0; i < m_nCapacity; ++i)
+        {
+            Entry &entry = m_apEntries[i];
+            entry.pObj = PoolTraits<T>::alloc();
+            entry.pOwner = this;
+            if (entry.pObj != nullptr)
+            {
+                m_stats.nShellAllocs.fetch_add(1, std::memory_order_relaxed);
+                m_vecFree.push_back(&entry);
+            }
+        }
+    }
+
+    MediaPool(const MediaPool &) = delete;
+    MediaPool &operator=(const MediaPool &) = delete;
+
+    ~MediaPool()
+    {
+        for (std::size_t i = 0; i < m_nCapacity; ++i)
+        {
+            PoolTraits<T>::free(m_apEntries[i].pObj);
+        }
+    }
+
+    // Returns an empty Ref if the pool was aborted while waiting.
+    Ref acquire()
+    {
+        std::unique_lock<std::mutex> lock{m_mtx};
+        if (m_vecFree.empty())
+        {
+            m_stats.nWaits.fetch_add(1, std::memory_order_relaxed);
+            m_cv.wait(lock, [this] { return !m_vecFree.empty() || m_bAborted; });
+        }
+        if (m_vecFree.empty())
+        {
+            return Ref{};
+        }
+
+        Entry *pEntry = m_vecFree.back();
+        m_vecFree.pop_back();
+        lock.unlock();
+
+        pEntry->nRefs.store(1, std::memory_order_relaxed);
+        m_stats.nAcquires.fetch_add(1, std::memory_order_relaxed);
+        return Ref{pEntry};
+    }
+
+    void abort()
+    {
+        {
+            std::lock_guard<std::mutex> lock{m_mtx};
+            m_bAborted = true;
+        }
+        m_cv.notify_all();
+    }
+
+    std::size_t capacity() const
+    {
+        return m_nCapacity;
+    }
+
+    const PoolStats &stats() const
+    {
+        return m_stats;
+    }
+
+private:
+    void release(Entry *pEntry)
+    {
+        PoolTraits<T>::unref(pEntry->pObj);
+        {
+            std::lock_guard<std::mutex> lock{m_mtx};
+            m_vecFree.push_back(pEntry);
+        }
+        m_cv.notify_one();
+    }
+
+    std::unique_ptr<Entry[]> m_apEntries;
+    const std::size_t m_nCapacity;
+
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::vector<Entry *> m_vecFree;
+    bool m_bAborted{false};
+
+    PoolStats m_stats;
+};
+
+using FramePool = MediaPool<AVFrame>;
+using FrameRef = FramePool::Ref;
+using PacketPool = MediaPool<AVPacket>;
+using PacketRef = PacketPool::Ref;
+
+//////////////////////////////////////////////////////////////////////////
+// Picture buffers of a single fixed geometry, recycled through an
+// AVBufferPool. Used for frames we fill ourselves (as opposed to frames the
+// decoder hands back, which libavcodec already pools internally).
+class VideoBufferPool
+{
+public:
+    VideoBufferPool(int nWidth, int nHeight, AVPixelFormat ePixFmt);
+    ~VideoBufferPool();
+
+    VideoBufferPool(const VideoBufferPool &) = delete;
+    VideoBufferPool &operator=(const VideoBufferPool &) = delete;
+
+    bool valid() const { return m_pPool != nullptr; }
+
+    // Attaches a pooled buffer to an empty frame and fills in its geometry.
+    bool get_buffer(AVFrame *pFrame);
+
+    const PoolStats &stats() const { return m_stats; }
+
+private:
+    static AVBufferRef *alloc_buffer(void *pOpaque, int nSize);
+
+    const int m_nWidth;
+    const int m_nHeight;
+    const AVPixelFormat m_ePixFmt;
+    int m_nBufferSize{0};
+
+    AVBufferPool *m_pPool{nullptr};
+    PoolStats m_stats;
+};
+
+//////////////////////////////////////////////////////////////////////////
+void print_pool_stats(const char *pszName, const PoolStats &stats);
@@ -0,0 +1,309 @@
+#include "keyframe_index.hpp"
+#include "media_utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+#include <sys/stat.h>
+
+namespace
+{
+
+constexpr char g_szIndexMagic[8] = {'X', '2', '6', '4', 'K', 'F', 'I', '2'};
+
+//////////////////////////////////////////////////////////////////////////
+// Size and modification time of strPath, or -1 for both if it cannot be
+// read.
+void stat_file(const std::string &strPath, int64_t &out_nSize, int64_t &out_nModifiedNs)
+{
+    struct stat st{};
+    if (stat(strPath.c_str(), &st) != 0)
+    {
+        out_nSize = -1;
+        out_nModifiedNs = -1;
+        return;
+    }
+    out_nSize = static_cast<int64_t>(st.st_size);
+    out_nModifiedNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+//////////////////////////////////////////////////////////////////////////
+template <typename T>
+void write_value(std::ofstream &file, const T value)
+{
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+//////////////////////////////////////////////////////////////////////////
+template <typename T>
+bool read_value(std::ifstream &file, T &out_value)
+{
+    return static_cast<bool>(file.read(reinterpret_cast<char *>(&out_value), sizeof(out_value)));
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+const KeyframeIndexEntry *KeyframeIndex::keyframe_before(const int64_t nPts) const
+{
+    // Keyframes are presented in decode order.
+    const auto it = std::upper_bound(vecKeyframes.begin(),
+                                     vecKeyframes.end(),
+                                     nPts,
+                                     [](const int64_t nValue, const KeyframeIndexEntry &entry) { return nValue < entry.nPts; });
+    return it == vecKeyframes.begin() ? nullptr : &*(it - 1);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool build_keyframe_index(const std::string &strInputPath, KeyframeIndex &out_index)
+{
+    InputFormatContextPtr apFmtCtx;
+    if (!open_input_format_context(strInputPath, apFmtCtx))
+    {
+        std::cerr << "Could not open source file " << strInputPath << std::endl;
+        return false;
+    }
+
+    const int nStreamIdx = av_find_best_stream(apFmtCtx.get(), AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (nStreamIdx < 0)
+    {
+        std::cerr << "No video stream to index in " << strInputPath << std::endl;
+        return false;
+    }
+
+    // Only the video packets' headers are needed; the demuxer need not
+    // hand out anything else.
+    for (unsigned int i = 0; i < apFmtCtx->nb_streams; ++i)
+    {
+        apFmtCtx->streams[i]->discard = static_cast<int>(i) == nStreamIdx ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    const AVStream *pStream = apFmtCtx->streams[nStreamIdx];
+    out_index = KeyframeIndex{};
+    out_index.nStreamIndex = nStreamIdx;
+    out_index.timeBase = pStream->time_base;
+    out_index.nStartTime = pStream->start_time;
+    stat_file(strInputPath, out_index.nFileSize, out_index.nModifiedNs);
+
+    PacketPtr apPkt{av_packet_alloc()};
+    if (!apPkt)
+    {
+        return false;
+    }
+
+    int ret{};
+    while ((ret = av_read_frame(apFmtCtx.get(), apPkt.get())) >= 0)
+    {
+        if (apPkt->stream_index == nStreamIdx)
+        {
+            const int64_t nPts = apPkt->pts != AV_NOPTS_VALUE ? apPkt->pts : apPkt->dts;
+            ++out_index.nPackets;
+            if (nPts != AV_NOPTS_VALUE)
+            {
+                out_index.nLastPts = out_index.nLastPts == AV_NOPTS_VALUE ? nPts : std::max(out_index.nLastPts, nPts);
+                if (apPkt->flags & AV_PKT_FLAG_KEY)
+                {
+                    out_index.vecKeyframes.push_back(KeyframeIndexEntry{apPkt->pos, nPts, apPkt->dts});
+                }
+            }
+        }
+        av_packet_unref(apPkt.get());
+    }
+
+    if (ret != AVERROR_EOF)
+    {
+        std::cerr << "Indexing stopped early: "
+                  << error_code_to_string(ret)
+                  << std::endl;
+        return false;
+    }
+    if (out_index.vecKeyframes.empty())
+    {
+        std::cerr << "No keyframes found in " << strInputPath << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool save_keyframe_index(const KeyframeIndex &index, const std::string &strIndexPath)
+{
+    std::ofstream file{strIndexPath, std::ios::binary | std::ios::trunc};
+    if (!file)
+    {
+        std::cerr << "Could not open index file " << strIndexPath << std::endl;
+        return false;
+    }
+
+    file.write(g_szIndexMagic, sizeof(g_szIndexMagic));
+    write_value<int32_t>(file, index.nStreamIndex);
+    write_value<int32_t>(file, index.timeBase.num);
+    write_value<int32_t>(file, index.timeBase.den);
+    write_value<int64_t>(file, index.nStartTime);
+    write_value<int64_t>(file, index.nFileSize);
+    write_value<int64_t>(file, index.nModifiedNs);
+    write_value<int64_t>(file, index.nPackets);
+    write_value<int64_t>(file, index.nLastPts);
+    write_value<int64_t>(file, static_cast<int64_t>(index.vecKeyframes.size()));
+    file.write(reinterpret_cast<const char *>(index.vecKeyframes.data()),
+               static_cast<std::streamsize>(index.vecKeyframes.size() * sizeof(KeyframeIndexEntry)));
+
+    if (!file.flush())
+    {
+        std::cerr << "Could not write index file " << strIndexPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool load_keyframe_index(const std::string &strIndexPath, KeyframeIndex &out_index)
+{
+    std::ifstream file{strIndexPath, std::ios::binary};
+    if (!file)
+    {
+        return false;
+    }
+
+    char szMagic[sizeof(g_szIndexMagic)]{};
+    int32_t nStreamIndex{};
+    int32_t nNum{};
+    int32_t nDen{};
+    int64_t nKeyframes{};
+    out_index = KeyframeIndex{};
+    if (!file.read(szMagic, sizeof(szMagic))
+        || std::memcmp(szMagic, g_szIndexMagic, sizeof(szMagic)) != 0
+        || !read_value(file, nStreamIndex)
+        || !read_value(file, nNum)
+        || !read_value(file, nDen)
+        || !read_value(file, out_index.nStartTime)
+        || !read_value(file, out_index.nFileSize)
+        || !read_value(file, out_index.nModifiedNs)
+        || !read_value(file, out_index.nPackets)
+        || !read_value(file, out_index.nLastPts)
+        || !read_value(file, nKeyframes)
+        || nKeyframes <= 0
+        || nDen <= 0)
+    {
+        std::cerr << "Ignoring malformed index file " << strIndexPath << std::endl;
+        return false;
+    }
+
+    // The count must fit in what is left of the file before anything is
+    // allocated for it.
+    int64_t nIndexBytes{};
+    int64_t nIndexModifiedNs{};
+    stat_file(strIndexPath, nIndexBytes, nIndexModifiedNs);
+    const int64_t nRemaining = nIndexBytes - static_cast<int64_t>(file.tellg());
+    if (nRemaining < 0 || nKeyframes > nRemaining / static_cast<int64_t>(sizeof(KeyframeIndexEntry)))
+    {
+        std::cerr << "Ignoring truncated index file " << strIndexPath << std::endl;
+        return false;
+    }
+
+    out_index.nStreamIndex = nStreamIndex;
+    out_index.timeBase = AVRational{nNum, nDen};
+    out_index.vecKeyframes.resize(static_cast<std::size_t>(nKeyframes));
+    if (!file.read(reinterpret_cast<char *>(out_index.vecKeyframes.data()),
+                   static_cast<std::streamsize>(out_index.vecKeyframes.size() * sizeof(KeyframeIndexEntry))))
+    {
+        std::cerr << "Ignoring truncated index file " << strIndexPath << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+std::string keyframe_index_path(const std::string &strInputPath)
+{
+    return strInputPath + ".kfi";
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool open_keyframe_index(const std::string &strInputPath, const std::string &strIndexPath, KeyframeIndex &out_index)
+{
+    if (load_keyframe_index(strIndexPath, out_index))
+    {
+        int64_t nFileSize{};
+        int64_t nModifiedNs{};
+        stat_file(strInputPath, nFileSize, nModifiedNs);
+        if (out_index.nFileSize == nFileSize && out_index.nModifiedNs == nModifiedNs)
+        {
+            return true;
+        }
+        std::cout << "Index "
+                  << strIndexPath
+                  << " is out of date"
+                  << std::endl;
+    }
+
+    const auto tStart = std::chrono::steady_clock::now();
+    if (!build_keyframe_index(strInputPath, out_index))
+    {
+        return false;
+    }
+    std::cout << "Indexed "
+              << strInputPath
+              << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tStart).count()
+              << " ms"
+              << std::endl;
+
+    // Not being able to keep the index only costs the next run a rescan.
+    save_keyframe_index(out_index, strIndexPath);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool seek_to_keyframe(AVFormatContext *pFmtCtx, const int nStreamIdx, const KeyframeIndexEntry &entry)
+{
+    int ret{};
+    if (entry.nPos >= 0 && !(pFmtCtx->iformat->flags & AVFMT_NO_BYTE_SEEK))
+    {
+        ret = av_seek_frame(pFmtCtx, nStreamIdx, entry.nPos, AVSEEK_FLAG_BYTE);
+    }
+    else
+    {
+        const int64_t nTs = entry.nDts != AV_NOPTS_VALUE ? entry.nDts : entry.nPts;
+        ret = av_seek_frame(pFmtCtx, nStreamIdx, nTs, AVSEEK_FLAG_BACKWARD);
+    }
+
+    if (ret < 0)
+    {
+        std::cerr << "Could not seek to keyframe at PTS "
+                  << entry.nPts
+                  << ": "
+                  << error_code_to_string(ret)
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_keyframe_index(const KeyframeIndex &index)
+{
+    const int64_t nStart = index.nStartTime != AV_NOPTS_VALUE ? index.nStartTime : 0;
+    const double dDuration = index.nLastPts != AV_NOPTS_VALUE
+        ? static_cast<double>(index.nLastPts - nStart) * av_q2d(index.timeBase)
+        : 0.0;
+
+    std::cout << "Stream "
+              << index.nStreamIndex
+              << ": "
+              << index.nPackets
+              << " packets, "
+              << index.vecKeyframes.size()
+              << " keyframes over "
+              << std::fixed << std::setprecision(3)
+              << dDuration
+              << " s"
+              << std::defaultfloat
+              << std::endl;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+struct KeyframeIndexEntry
+{
+    // Byte position of the packet in the file, or -1 if the demuxer does
+    // not report one.
+    int64_t nPos{-1};
+    int64_t nPts{AV_NOPTS_VALUE};
+    int64_t nDts{AV_NOPTS_VALUE};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Keyframes of an input's video stream, found by demuxing it once without
+// decoding.
+//
+// Sidecar file layout: the 8-byte magic "X264KFI2", then int32_t stream
+// index, time base numerator and denominator, int64_t stream start time,
+// file size, file modification time (ns), packet count, last PTS and
+// keyframe count, then that many KeyframeIndexEntry, all in host byte
+// order.
+struct KeyframeIndex
+{
+    int nStreamIndex{-1};
+    AVRational timeBase{0, 1};
+    int64_t nStartTime{AV_NOPTS_VALUE};
+
+    // Size and modification time (ns since the epoch) of the indexed file;
+    // an index whose size or time no longer matches is rebuilt.
+    int64_t nFileSize{0};
+    int64_t nModifiedNs{0};
+
+    int64_t nPackets{0};
+    int64_t nLastPts{AV_NOPTS_VALUE};
+
+    // In decode order.
+    std::vector<KeyframeIndexEntry> vecKeyframes;
+
+    // The last keyframe presented at or before nPts, or null.
+    const KeyframeIndexEntry *keyframe_before(int64_t nPts) const;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Demuxes the best video stream of strInputPath and records its keyframes.
+bool build_keyframe_index(const std::string &strInputPath, KeyframeIndex &out_index);
+
+bool save_keyframe_index(const KeyframeIndex &index, const std::string &strIndexPath);
+bool load_keyframe_index(const std::string &strIndexPath, KeyframeIndex &out_index);
+
+//////////////////////////////////////////////////////////////////////////
+// "in.ts" -> "in.ts.kfi"
+std::string keyframe_index_path(const std::string &strInputPath);
+
+//////////////////////////////////////////////////////////////////////////
+// Loads the index at strIndexPath if it matches strInputPath; otherwise
+// builds one and saves it there.
+bool open_keyframe_index(const std::string &strInputPath, const std::string &strIndexPath, KeyframeIndex &out_index);
+
+//////////////////////////////////////////////////////////////////////////
+// Positions pFmtCtx so that the next packet read from stream nStreamIdx is
+// keyframe entry, or an earlier keyframe. Byte positions are used where the
+// demuxer supports them, DTS otherwise.
+bool seek_to_keyframe(AVFormatContext *pFmtCtx, int nStreamIdx, const KeyframeIndexEntry &entry);
+
+//////////////////////////////////////////////////////////////////////////
+void print_keyframe_index(const KeyframeIndex &index);
@@ -1,641 +1,1757 @@
-
-#include <functional>
+#include "avio_sink.hpp"
+#include "avio_source.hpp"
+#include "batch_scheduler.hpp"
+#include "cbr_ts_muxer.hpp"
+#include "cpu_topology.hpp"
+#include "deadline_controller.hpp"
+#include "encoder_settings.hpp"
+#include "keyframe_index.hpp"
+#include "media_utils.hpp"
+#include "paced_output.hpp"
+#include "pipeline.hpp"
+#include "segment_encoder.hpp"
+#include "shm_frame_ring.hpp"
+#include "statmux.hpp"
+#include "ts_analyzer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 extern "C"
 {
-#include <libavformat/avformat.h>
-#include <libavcodec/avcodec.h>
-#include <libavutil/avutil.h>
+#include <libavutil/parseutils.h>
 }
 
 //////////////////////////////////////////////////////////////////////////
-std::string error_code_to_string(const int nErrCode)
+void print_usage()
 {
-    char chArray[AV_ERROR_MAX_STRING_SIZE];
+    std::cerr << "Usage: ./x264_cbr [options] [file_in] [file_out]" << std::endl
+              << "       [file_out] may be udp://host:port or - (stdout) for a paced live MPEG-TS stream" << std::endl
+              << "       ./x264_cbr analyze [analyze options] [file.ts]" << std::endl
+              << "       ./x264_cbr batch [batch options] [options] [jobs.txt]" << std::endl
+              << "       ./x264_cbr index [file_in] [index_out]   (default index_out: [file_in].kfi)" << std::endl
+              << "       ./x264_cbr shm-produce [shm options] shm:NAME   (test pattern into a frame ring)" << std::endl
+              << "       ./x264_cbr mpts [mpts options] [options] [file_in] [file_in]... [file_out]" << std::endl
+              << "       (one program per input in a single constant-rate TS, statistically multiplexed)" << std::endl
+              << "       [file_in] may be shm:NAME to encode raw frames from a capture process's ring" << std::endl
+              << "       [jobs.txt] lists one 'file_in file_out [bitrate]' per line; # starts a comment" << std::endl
+              << "Options:" << std::endl
+              << "  --demux-queue=N    Depth of the demux -> decode packet queue" << std::endl
+              << "  --frame-queue=N    Depth of the decode -> encode frame queue" << std::endl
+              << "  --packet-queue=N   Depth of the encode -> mux packet queue" << std::endl
+              << "  --vbv-log=PATH     Write per-frame VBV buffer fullness as CSV" << std::endl
+              << "  --vbv-fail-fast    Abort on the first VBV underflow/overflow" << std::endl
+              << "  --deadline         Live mode: adapt preset/lookahead/subme per GOP to hold real time" << std::endl
+              << "  --low-latency      Zerolatency encode (sliced threads, intra refresh, 100 ms VBV and mux delay)," << std::endl
+              << "                     frame/packet queues of 2 unless given, and --frame-latency" << std::endl
+              << "  --frame-latency    Print p50/p99/max latency from decoder input to TS written" << std::endl
+              << "  --telemetry=PATH   Write binary per-frame telemetry records" << std::endl
+              << "  --latency-histograms  Print per-stage latency histograms at exit" << std::endl
+              << "  --io-buffer=BYTES  Output buffer size, rounded up to 7 x 188 bytes" << std::endl
+              << "  --io-buffers=N     Number of output buffers (default 2)" << std::endl
+              << "  --direct-io        Write the output with O_DIRECT" << std::endl
+              << "  --sync-io          Write the output synchronously via avio_open" << std::endl
+              << "  --udp-batch=N      Datagrams per paced send for live output (default 1)" << std::endl
+              << "  --ts-mux=MUXER     'lavf' (default): libavformat's mpegts muxer; 'native': built-in CBR TS muxer" << std::endl
+              << "  --pcr-interval=MS  PCR interval of the native muxer (default 20)" << std::endl
+              << "  --psi-interval=MS  PAT/PMT interval of the native muxer (default 100)" << std::endl
+              << "  --input-io=MODE    Read the input via 'file' (default), 'mmap' or 'ram'" << std::endl
+              << "  --decode-threads=N Decoder threads (default: FFmpeg's choice)" << std::endl
+              << "  --encode-threads=N x264 threads (default: x264's choice)" << std::endl
+              << "  --pixel-convert=M  Convert input that is not 8-bit 4:2:0 with 'swscale' (default) or the SIMD 'kernels'" << std::endl
+              << "  --cpus-demux=SET, --cpus-decode=SET, --cpus-encode=SET, --cpus-mux=SET" << std::endl
+              << "                     Pin a stage and the library threads it starts to a CPU list (0-7,16)," << std::endl
+              << "                     NUMA node(s) (node:0) or all; single-node sets also allocate on that node" << std::endl
+              << "  --cpu-report       Print per-stage CPU time and utilisation" << std::endl
+              << "  --pre-analysis[=N] Cost each frame N frames (default 4) ahead of the encoder and pass" << std::endl
+              << "                     per-macroblock QP offsets to x264 as regions of interest" << std::endl
+              << "  --pre-analysis-strength=X" << std::endl
+              << "                     QP offset per doubling of coming complexity (default 1.0, max 4 QP)" << std::endl
+              << "  --quality[=N]      Decode the output as it is encoded and print PSNR/SSIM of every Nth frame" << std::endl
+              << "                     (default 1) against its source" << std::endl
+              << "  --quality-log=PATH Write per-frame and per-GOP bits, PSNR and SSIM as CSV" << std::endl
+              << "  --start=TIME, --end=TIME" << std::endl
+              << "                     Encode only this range ([HH:]MM:SS[.m...] or seconds), entering the input" << std::endl
+              << "                     at the keyframe before --start through its keyframe index" << std::endl
+              << "  --index=PATH       Keyframe index to use, built there if missing or stale (default [file_in].kfi)" << std::endl
+              << "  --passthrough      Remux the input's audio, subtitle and data streams into every output" << std::endl
+              << "  --parallel-segments[=N]" << std::endl
+              << "                     Encode GOP segments in parallel on N workers (default: one per CPU)" << std::endl
+              << "  --segment-gops=N   GOPs per parallel segment (default 10)" << std::endl
+              << "  --ladder=R1,R2,..  Encode one CBR rendition per bitrate (bit/s) from a single decode," << std::endl
+              << "                     writing [file_out] with '_<kbit/s>k' added before the extension" << std::endl
+              << "Batch options:" << std::endl
+              << "  --jobs=N           Jobs encoding at once (default: --threads / 4)" << std::endl
+              << "  --threads=N        Encoder threads shared by the running jobs (default: one per CPU)" << std::endl
+              << "  --verbose          Print every job's reports, not just the summary" << std::endl
+              << "Mpts options:" << std::endl
+              << "  --mux-rate=BPS     TS rate of the multiplex (default: the 6.3 Mbit/s CBR mux rate per program)" << std::endl
+              << "  --statmux-min=BPS, --statmux-max=BPS" << std::endl
+              << "                     Video rate limits per program (default: a third of, and three times, an equal share)" << std::endl
+              << "Shm options:" << std::endl
+              << "  --size=WxH         Picture size (default 720x576, interlaced top field first, 25 fps)" << std::endl
+              << "  --slots=N          Frame slots in the ring (default 8)" << std::endl
+              << "  --frames=N         Frames to publish (default: until interrupted)" << std::endl
+              << "Analyze options:" << std::endl
+              << "  --windows=A,B,..   Bitrate window lengths in ms (default 10,100,1000)" << std::endl
+              << "  --step=N           Window slide step in ms (default 10)" << std::endl
+              << "  --pcr-pid=N        PID carrying the reference PCR (default: first seen)" << std::endl
+              << "  --csv=PATH         Write per-window bitrate series as CSV" << std::endl
+              << "  --json=PATH        Write the summary as JSON" << std::endl;
+}
 
-    // Probably better to be on the safe size and initialise the array.
-    // The docs do not state if the string is null terminated :(
-    std::fill(std::begin(chArray), std::end(chArray), '\0');
+//////////////////////////////////////////////////////////////////////////
+void split_option(const std::string &strArg, std::string &out_strKey, std::string &out_strValue)
+{
+    const auto nEq = strArg.find('=');
+    out_strKey = strArg.substr(0, nEq);
+    out_strValue = nEq == std::string::npos ? std::string{} : strArg.substr(nEq + 1);
+}
 
-    if (av_strerror(nErrCode, chArray, AV_ERROR_MAX_STRING_SIZE) != 0)
+//////////////////////////////////////////////////////////////////////////
+template <typename T>
+bool parse_unsigned(const std::string &strName, const std::string &strValue, T &out_nValue, const bool bAllowZero = false)
+{
+    char *pEnd = nullptr;
+    const unsigned long long nValue = std::strtoull(strValue.c_str(), &pEnd, 10);
+    if (strValue.empty() || *pEnd != '\0' || (nValue == 0 && !bAllowZero))
     {
-        return "[Unknown]";
+        std::cerr << "Invalid " << strName << ": '" << strValue << "'" << std::endl;
+        return false;
     }
 
-    return std::string(chArray);
+    out_nValue = static_cast<T>(nValue);
+    return true;
 }
 
-///////////////////////////////////////////////////////////////////////////
-bool open_input_format_context(const std::string &strPath,
-                               std::unique_ptr<AVFormatContext, std::function<void (AVFormatContext*)>> &out_apFmtCtx)
+//////////////////////////////////////////////////////////////////////////
+struct TranscodeOptions
 {
-    out_apFmtCtx.reset();
+    std::vector<std::string> vecPositional;
+    PipelineConfig pipeline;
+    AvioSinkConfig sink;
+    CbrEncoderSettings encoder;
+
+    // Write the output with a plain avio_open() rather than the write-behind sink.
+    bool bSyncIo{false};
+
+    // Low-latency encoder profile and the smaller buffers that go with it.
+    bool bLowLatency{false};
 
-    AVFormatContext *pFmtCtx = nullptr;
+    // Live (UDP/stdout) output; the rate is set from the encoder bitrate.
+    PacedOutputConfig live;
 
-    // Open input file, and allocate format context
-    if (int nRet = avformat_open_input(&pFmtCtx,
-                                       strPath.c_str(),
-                                       nullptr,
-                                       nullptr); nRet < 0)
+    // Mux with CbrTsMuxer rather than libavformat; the rates and delay are
+    // set from the encoder.
+    bool bNativeTsMux{false};
+    CbrTsMuxerConfig tsMux;
+
+    // Decoder thread count; 0 leaves it to FFmpeg.
+    int nDecodeThreads{0};
+
+    // Per-stage CPU sets and the utilisation report.
+    ThreadPlacementConfig placement;
+
+    // Read the input through libavformat's file protocol, a mapping, or a RAM copy.
+    enum class InputIo
     {
-        std::cerr << "Could not open media at path: '"
-                  << strPath
-                  << "': "
-                  << error_code_to_string(nRet)
-                  << std::endl;
+        File,
+        Mmap,
+        Ram
+    };
+    InputIo eInputIo{InputIo::File};
+
+    // Encode independent GOP segments in parallel instead of running the
+    // single-encoder pipeline. File inputs only.
+    bool bParallelSegments{false};
+    SegmentConfig segments;
+
+    // ABR ladder bitrates; empty = the single output at encoder.nBitRate.
+    std::vector<int64_t> vecLadderBitRates;
+
+    // Encode only [start, end) of the input, in microseconds from the start
+    // of its video stream; AV_NOPTS_VALUE = open. The input is entered
+    // through its keyframe index, by default "<file_in>.kfi".
+    int64_t nRangeStartUs{AV_NOPTS_VALUE};
+    int64_t nRangeEndUs{AV_NOPTS_VALUE};
+    std::string strIndexPath;
+
+    // Remux the input's other audio, subtitle and data streams unchanged
+    // alongside the encoded video; their bitrate is added to the mux rate.
+    bool bPassthrough{false};
+};
+
+//////////////////////////////////////////////////////////////////////////
+bool parse_arguments(int argc,
+                     char *argv[],
+                     TranscodeOptions &out_options)
+{
+    bool bFrameQueueSet{false};
+    bool bPacketQueueSet{false};
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string strArg = argv[i];
+        if (strArg.rfind("--", 0) != 0)
+        {
+            out_options.vecPositional.push_back(strArg);
+            continue;
+        }
+
+        std::string strKey;
+        std::string strValue;
+        split_option(strArg, strKey, strValue);
 
+        if (strKey == "--demux-queue")
+        {
+            if (!parse_unsigned("queue depth", strValue, out_options.pipeline.nDemuxQueueDepth))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--frame-queue")
+        {
+            if (!parse_unsigned("queue depth", strValue, out_options.pipeline.nFrameQueueDepth))
+            {
+                return false;
+            }
+            bFrameQueueSet = true;
+        }
+        else if (strKey == "--packet-queue")
+        {
+            if (!parse_unsigned("queue depth", strValue, out_options.pipeline.nPacketQueueDepth))
+            {
+                return false;
+            }
+            bPacketQueueSet = true;
+        }
+        else if (strKey == "--vbv-log")
+        {
+            out_options.pipeline.strVbvLogPath = strValue;
+        }
+        else if (strKey == "--vbv-fail-fast")
+        {
+            out_options.pipeline.bVbvFailFast = true;
+        }
+        else if (strKey == "--deadline")
+        {
+            out_options.pipeline.deadline.bEnabled = true;
+        }
+        else if (strKey == "--low-latency")
+        {
+            out_options.bLowLatency = true;
+            out_options.encoder.bLowLatency = true;
+            out_options.pipeline.bMeasureLatency = true;
+        }
+        else if (strKey == "--frame-latency")
+        {
+            out_options.pipeline.bMeasureLatency = true;
+        }
+        else if (strKey == "--telemetry")
+        {
+            out_options.pipeline.strTelemetryPath = strValue;
+        }
+        else if (strKey == "--latency-histograms")
+        {
+            out_options.pipeline.bLatencyHistograms = true;
+        }
+        else if (strKey == "--io-buffer")
+        {
+            if (!parse_unsigned("I/O buffer size", strValue, out_options.sink.nBufferSize))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--io-buffers")
+        {
+            if (!parse_unsigned("I/O buffer count", strValue, out_options.sink.nBufferCount))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--direct-io")
+        {
+            out_options.sink.bDirectIo = true;
+        }
+        else if (strKey == "--sync-io")
+        {
+            out_options.bSyncIo = true;
+        }
+        else if (strKey == "--input-io")
+        {
+            if (strValue == "file")
+            {
+                out_options.eInputIo = TranscodeOptions::InputIo::File;
+            }
+            else if (strValue == "mmap")
+            {
+                out_options.eInputIo = TranscodeOptions::InputIo::Mmap;
+            }
+            else if (strValue == "ram")
+            {
+                out_options.eInputIo = TranscodeOptions::InputIo::Ram;
+            }
+            else
+            {
+                std::cerr << "Invalid input I/O mode: '" << strValue << "'" << std::endl;
+                return false;
+            }
+        }
+        else if (strKey == "--decode-threads")
+        {
+            if (!parse_unsigned("decoder thread count", strValue, out_options.nDecodeThreads))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--encode-threads")
+        {
+            if (!parse_unsigned("encoder thread count", strValue, out_options.encoder.nThreads))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--cpus-demux" || strKey == "--cpus-decode" || strKey == "--cpus-encode" || strKey == "--cpus-mux")
+        {
+            const ThreadStage eStage = strKey == "--cpus-demux" ? ThreadStage::Demux
+                : strKey == "--cpus-decode"                     ? ThreadStage::Decode
+                : strKey == "--cpus-encode"                     ? ThreadStage::Encode
+                                                                : ThreadStage::Mux;
+            if (strValue.empty())
+            {
+                std::cerr << "Missing CPU set for " << strKey << std::endl;
+                return false;
+            }
+            out_options.placement.arrCpuSpecs[static_cast<std::size_t>(eStage)] = strValue;
+        }
+        else if (strKey == "--cpu-report")
+        {
+            out_options.placement.bReport = true;
+        }
+        else if (strKey == "--parallel-segments")
+        {
+            out_options.bParallelSegments = true;
+            if (!strValue.empty() && !parse_unsigned("worker count", strValue, out_options.segments.nWorkers, true))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--pre-analysis")
+        {
+            out_options.pipeline.analysis.nLookahead = 4;
+            if (!strValue.empty() && !parse_unsigned("pre-analysis lookahead", strValue, out_options.pipeline.analysis.nLookahead))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--quality")
+        {
+            out_options.pipeline.quality.nInterval = 1;
+            if (!strValue.empty() && !parse_unsigned("quality interval", strValue, out_options.pipeline.quality.nInterval))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--quality-log")
+        {
+            out_options.pipeline.quality.strLogPath = strValue;
+        }
+        else if (strKey == "--pre-analysis-strength")
+        {
+            char *pEnd = nullptr;
+            const double dStrength = std::strtod(strValue.c_str(), &pEnd);
+            if (strValue.empty() || *pEnd != '\0' || dStrength < 0.0)
+            {
+                std::cerr << "Invalid pre-analysis strength: '" << strValue << "'" << std::endl;
+                return false;
+            }
+            out_options.pipeline.analysis.dStrength = dStrength;
+        }
+        else if (strKey == "--segment-gops")
+        {
+            if (!parse_unsigned("segment length", strValue, out_options.segments.nGopsPerSegment))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--udp-batch")
+        {
+            if (!parse_unsigned("UDP batch size", strValue, out_options.live.nBatch))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--pixel-convert")
+        {
+            if (strValue == "kernels")
+            {
+                out_options.pipeline.eConvertMethod = ConvertMethod::Kernels;
+            }
+            else if (strValue == "swscale")
+            {
+                out_options.pipeline.eConvertMethod = ConvertMethod::Swscale;
+            }
+            else
+            {
+                std::cerr << "Invalid pixel conversion: '" << strValue << "'" << std::endl;
+                return false;
+            }
+        }
+        else if (strKey == "--ts-mux")
+        {
+            if (strValue == "native")
+            {
+                out_options.bNativeTsMux = true;
+            }
+            else if (strValue == "lavf")
+            {
+                out_options.bNativeTsMux = false;
+            }
+            else
+            {
+                std::cerr << "Invalid TS muxer: '" << strValue << "'" << std::endl;
+                return false;
+            }
+        }
+        else if (strKey == "--pcr-interval")
+        {
+            if (!parse_unsigned("PCR interval", strValue, out_options.tsMux.nPcrIntervalMs))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--psi-interval")
+        {
+            if (!parse_unsigned("PSI interval", strValue, out_options.tsMux.nPsiIntervalMs))
+            {
+                return false;
+            }
+        }
+        else if (strKey == "--ladder")
+        {
+            std::size_t nStart = 0;
+            while (nStart <= strValue.size())
+            {
+                const auto nComma = std::min(strValue.find(',', nStart), strValue.size());
+                int64_t nBitRate{};
+                if (!parse_unsigned("ladder bitrate", strValue.substr(nStart, nComma - nStart), nBitRate))
+                {
+                    return false;
+                }
+                out_options.vecLadderBitRates.push_back(nBitRate);
+                nStart = nComma + 1;
+            }
+        }
+        else if (strKey == "--start" || strKey == "--end")
+        {
+            int64_t &nTimeUs = strKey == "--start" ? out_options.nRangeStartUs : out_options.nRangeEndUs;
+            if (av_parse_time(&nTimeUs, strValue.c_str(), 1) < 0 || nTimeUs < 0)
+            {
+                std::cerr << "Invalid " << strKey.substr(2) << " time: '" << strValue << "'" << std::endl;
+                return false;
+            }
+        }
+        else if (strKey == "--index")
+        {
+            out_options.strIndexPath = strValue;
+        }
+        else if (strKey == "--passthrough")
+        {
+            out_options.bPassthrough = true;
+        }
+        else
+        {
+            std::cerr << "Unknown option: " << strArg << std::endl;
+            return false;
+        }
+    }
+
+    if (out_options.nRangeStartUs != AV_NOPTS_VALUE && out_options.nRangeEndUs != AV_NOPTS_VALUE
+        && out_options.nRangeEndUs <= out_options.nRangeStartUs)
+    {
+        std::cerr << "--end must be after --start" << std::endl;
         return false;
     }
 
-    out_apFmtCtx = std::unique_ptr<AVFormatContext, std::function<void(AVFormatContext *)>>{pFmtCtx,
-                                                                                            [](AVFormatContext *pFmtCtx)
-                                                                                            {
-                                                                                                // Not sure this function can take a nullptr!
-                                                                                                if (pFmtCtx != nullptr)
-                                                                                                {
-                                                                                                    avformat_close_input(&pFmtCtx);
-                                                                                                }
-                                                                                            }};
+    // Every frame queued between the stages is a frame of delay.
+    if (out_options.bLowLatency)
+    {
+        if (!bFrameQueueSet)
+        {
+            out_options.pipeline.nFrameQueueDepth = 2;
+        }
+        if (!bPacketQueueSet)
+        {
+            out_options.pipeline.nPacketQueueDepth = 2;
+        }
+    }
+
     return true;
 }
 
-///////////////////////////////////////////////////////////////////////////
-bool open_output_format_context(const std::string &strMediaPath,
-                                std::unique_ptr<AVFormatContext, std::function<void(AVFormatContext *)>> &out_apFmtCtx)
+//////////////////////////////////////////////////////////////////////////
+int run_analyze(int argc, char *argv[])
 {
-    out_apFmtCtx.reset();
+    TsAnalyzerConfig config{};
+    std::string strCsvPath;
+    std::string strJsonPath;
+    std::vector<std::string> vecPositional;
 
-    AVFormatContext *pFmtCtx = nullptr;
-    if (int nRet = avformat_alloc_output_context2(&pFmtCtx, nullptr, nullptr, strMediaPath.c_str()); nRet < 0)
+    for (int i = 2; i < argc; ++i)
     {
-        std::cerr << "Could not create media context for media at path: '"
-                  << strMediaPath
-                  << "': "
-                  << error_code_to_string(nRet);
+        const std::string strArg = argv[i];
+        if (strArg.rfind("--", 0) != 0)
+        {
+            vecPositional.push_back(strArg);
+            continue;
+        }
 
-        return false;
+        std::string strKey;
+        std::string strValue;
+        split_option(strArg, strKey, strValue);
+
+        bool bOk = true;
+        if (strKey == "--windows")
+        {
+            config.vecWindowsMs.clear();
+            std::size_t nStart = 0;
+            while (bOk && nStart <= strValue.size())
+            {
+                const std::size_t nComma = std::min(strValue.find(',', nStart), strValue.size());
+                uint32_t nWindowMs{};
+                bOk = parse_unsigned("window length", strValue.substr(nStart, nComma - nStart), nWindowMs);
+                config.vecWindowsMs.push_back(nWindowMs);
+                nStart = nComma + 1;
+            }
+        }
+        else if (strKey == "--step")
+        {
+            bOk = parse_unsigned("window step", strValue, config.nStepMs);
+        }
+        else if (strKey == "--pcr-pid")
+        {
+            bOk = parse_unsigned("PCR PID", strValue, config.nPcrPid, true);
+        }
+        else if (strKey == "--csv")
+        {
+            strCsvPath = strValue;
+            config.bKeepSeries = true;
+        }
+        else if (strKey == "--json")
+        {
+            strJsonPath = strValue;
+        }
+        else
+        {
+            std::cerr << "Unknown option: " << strArg << std::endl;
+            bOk = false;
+        }
+
+        if (!bOk)
+        {
+            print_usage();
+            return 1;
+        }
     }
 
-    out_apFmtCtx = std::unique_ptr<AVFormatContext, std::function<void(AVFormatContext *)>>{pFmtCtx,
-                                                                                            [](AVFormatContext *pFmtCtx)
-                                                                                            {
-                                                                                                // Not sure this function can take a nullptr!
-                                                                                                if (pFmtCtx != nullptr)
-                                                                                                {
-                                                                                                    avformat_free_context(pFmtCtx);
-                                                                                                }
-                                                                                            }};
+    if (vecPositional.size() != 1)
+    {
+        std::cerr << "Exactly one transport stream to analyze is required" << std::endl;
+        print_usage();
+        return 1;
+    }
 
-    return true;
+    TsAnalysisReport report{};
+    if (!analyze_transport_stream(vecPositional[0], config, report))
+    {
+        return 1;
+    }
+
+    print_ts_report(report);
+
+    if (!strCsvPath.empty() && !write_ts_report_csv(report, strCsvPath))
+    {
+        return 1;
+    }
+    if (!strJsonPath.empty() && !write_ts_report_json(report, strJsonPath))
+    {
+        return 1;
+    }
+
+    return 0;
 }
 
 //////////////////////////////////////////////////////////////////////////
-bool open_decoder_context(AVFormatContext *const in_pFmtCtx,
-                          const AVMediaType in_eMediaType,
-                          int &inout_nStreamidx,
-                          std::unique_ptr<AVCodecContext, std::function<void(AVCodecContext *)>> &inout_apCdcCtx,
-                          const std::function<bool(AVCodecContext *)> &fnInitContext)
+// x264_cbr index [file_in] [index_out]
+int run_index(int argc, char *argv[])
 {
-    const int nDesiredIdx = std::max<int>(inout_nStreamidx,-1);
+    if (argc < 3 || argc > 4)
+    {
+        std::cerr << "index takes an input file and optionally the index path" << std::endl;
+        print_usage();
+        return 1;
+    }
 
-    // Reset in case something goes wrong.
-    inout_nStreamidx = -1;
-    inout_apCdcCtx.reset();
+    const std::string strInputPath = argv[2];
+    const std::string strIndexPath = argc > 3 ? argv[3] : keyframe_index_path(strInputPath);
 
-    if (!in_pFmtCtx)
+    const auto tStart = std::chrono::steady_clock::now();
+    KeyframeIndex index;
+    if (!build_keyframe_index(strInputPath, index) || !save_keyframe_index(index, strIndexPath))
     {
-        std::cerr << "Pointer to format context is NULL" << std::endl;
-        return false;
+        return 1;
     }
 
-    int ret = av_find_best_stream(in_pFmtCtx, in_eMediaType, nDesiredIdx, -1, nullptr, 0);
-    if (ret < 0)
+    print_keyframe_index(index);
+    std::cout << "Wrote "
+              << strIndexPath
+              << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tStart).count()
+              << " ms"
+              << std::endl;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// x264_cbr shm-produce [shm options] shm:NAME
+int run_shm_produce(int argc, char *argv[])
+{
+    ShmFrameRingFormat format{};
+    uint64_t nFrames{0};
+    std::vector<std::string> vecPositional;
+
+    for (int i = 2; i < argc; ++i)
     {
-        std::cerr << "Could not find '"
-                  << av_get_media_type_string(in_eMediaType)
-                  << "' stream in input file ("
-                  << ret
-                  << "): "
-                  << error_code_to_string(ret)
-                  << std::endl;
+        const std::string strArg = argv[i];
+        if (strArg.rfind("--", 0) != 0)
+        {
+            vecPositional.push_back(strArg);
+            continue;
+        }
 
-        return false;
+        std::string strKey;
+        std::string strValue;
+        split_option(strArg, strKey, strValue);
+
+        if (strKey == "--size")
+        {
+            if (av_parse_video_size(&format.nWidth, &format.nHeight, strValue.c_str()) < 0)
+            {
+                std::cerr << "Invalid picture size: '" << strValue << "'" << std::endl;
+                return 1;
+            }
+        }
+        else if (strKey == "--slots")
+        {
+            if (!parse_unsigned("slot count", strValue, format.nSlots))
+            {
+                return 1;
+            }
+        }
+        else if (strKey == "--frames")
+        {
+            if (!parse_unsigned("frame count", strValue, nFrames))
+            {
+                return 1;
+            }
+        }
+        else
+        {
+            std::cerr << "Unknown shm-produce option: " << strArg << std::endl;
+            print_usage();
+            return 1;
+        }
     }
 
-    const int stream_index = ret;
-    AVStream *const st = in_pFmtCtx->streams[stream_index];
+    if (vecPositional.size() != 1 || !ShmFrameRing::is_ring_path(vecPositional.front()))
+    {
+        std::cerr << "shm-produce takes exactly one shm:NAME ring" << std::endl;
+        print_usage();
+        return 1;
+    }
 
-    // Find decoder for the stream
-    AVCodec *const pCdc = avcodec_find_decoder(st->codecpar->codec_id);
-    if (pCdc == nullptr)
+    return run_shm_test_producer(vecPositional.front(), format, nFrames) ? 0 : 1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Range mode: converts the requested range to the input's time base and
+// seeks to the last keyframe presented at or before its start. Only the
+// frames from that keyframe on are decoded.
+bool seek_to_range(const TranscodeOptions &options,
+                   const std::string &strSrcFilename,
+                   AVFormatContext *pFmtCtxIn,
+                   const int nStreamIdxIn,
+                   PipelineConfig &inout_pipeline)
+{
+    const std::string strIndexPath = options.strIndexPath.empty() ? keyframe_index_path(strSrcFilename) : options.strIndexPath;
+    KeyframeIndex index;
+    if (!open_keyframe_index(strSrcFilename, strIndexPath, index))
+    {
+        return false;
+    }
+    if (index.nStreamIndex != nStreamIdxIn)
     {
-        std::cerr << "Failed to find '"
-                  << av_get_media_type_string(in_eMediaType)
-                  << "' decoder codec"
+        std::cerr << "Index "
+                  << strIndexPath
+                  << " is for stream "
+                  << index.nStreamIndex
+                  << ", not "
+                  << nStreamIdxIn
                   << std::endl;
         return false;
     }
 
-    // Allocate a codec context for the decoder
-    std::unique_ptr<AVCodecContext, std::function<void(AVCodecContext *)>> apCdcCtx
-        (
-            avcodec_alloc_context3(pCdc),
-            [](AVCodecContext *pCdcCtx) mutable
-            {
-                // Not sure this function can take a nullptr!
-                if (pCdcCtx != nullptr)
-                {
-                    avcodec_free_context(&pCdcCtx);
-                }
-            }
-        );
+    const int64_t nStreamStart = index.nStartTime != AV_NOPTS_VALUE ? index.nStartTime : 0;
+    const auto to_stream_time = [&index, nStreamStart](const int64_t nTimeUs)
+    {
+        return nTimeUs == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : nStreamStart + av_rescale_q(nTimeUs, AV_TIME_BASE_Q, index.timeBase);
+    };
+    inout_pipeline.nRangeStart = to_stream_time(options.nRangeStartUs);
+    inout_pipeline.nRangeEnd = to_stream_time(options.nRangeEndUs);
 
-    if (!apCdcCtx)
+    if (inout_pipeline.nRangeStart == AV_NOPTS_VALUE)
+    {
+        return true;
+    }
+
+    const KeyframeIndexEntry *pKeyframe = index.keyframe_before(inout_pipeline.nRangeStart);
+    if (pKeyframe == nullptr)
+    {
+        pKeyframe = &index.vecKeyframes.front();
+    }
+    if (!seek_to_keyframe(pFmtCtxIn, nStreamIdxIn, *pKeyframe))
     {
-        std::cerr << "Failed to allocate the '"
-                  << av_get_media_type_string(in_eMediaType)
-                  << "' decoder codec context."
-                  << std::endl;
         return false;
     }
 
-    // Copy codec parameters from input stream to output codec context */
-    if ((ret = avcodec_parameters_to_context(apCdcCtx.get(), st->codecpar)) < 0)
+    std::cout << "Range: starting at keyframe "
+              << static_cast<double>(pKeyframe->nPts - nStreamStart) * av_q2d(index.timeBase)
+              << " s, "
+              << static_cast<double>(inout_pipeline.nRangeStart - pKeyframe->nPts) * av_q2d(index.timeBase)
+              << " s before the range"
+              << std::endl;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// One encoded output: its muxer, the I/O behind it and the encoder feeding it.
+struct OutputFile
+{
+    std::string strPath;
+    CbrEncoderSettings encoder;
+
+    OutputFormatContextPtr apFmtCtx;
+    std::unique_ptr<AvioFileSink> apSink;
+    std::unique_ptr<PacedTsOutput> apLive;
+    std::unique_ptr<CbrTsMuxer> apTsMuxer;
+    CodecContextPtr apCdcCtx;
+    AVStream *pStVideo{};
+
+    // Parallel to PipelineConfig::vecPassthroughStreams.
+    std::vector<AVStream *> vecPassthroughStreams;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// "out.ts" -> "out_6000k.ts"
+std::string ladder_output_path(const std::string &strPath, const int64_t nBitRate)
+{
+    const std::string strSuffix = "_" + std::to_string(nBitRate / 1000) + "k";
+
+    const auto nSlash = strPath.find_last_of('/');
+    const auto nDot = strPath.find_last_of('.');
+    if (nDot == std::string::npos || (nSlash != std::string::npos && nDot < nSlash))
+    {
+        return strPath + strSuffix;
+    }
+    return strPath.substr(0, nDot) + strSuffix + strPath.substr(nDot);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// The audio, subtitle and data streams of pFmtCtxIn other than its video.
+std::vector<int> find_passthrough_streams(const AVFormatContext *pFmtCtxIn, const int nStreamIdxVideo)
+{
+    std::vector<int> vecStreams;
+    for (unsigned int i = 0; i < pFmtCtxIn->nb_streams; ++i)
+    {
+        const AVMediaType eType = pFmtCtxIn->streams[i]->codecpar->codec_type;
+        if (static_cast<int>(i) != nStreamIdxVideo
+            && (eType == AVMEDIA_TYPE_AUDIO || eType == AVMEDIA_TYPE_SUBTITLE || eType == AVMEDIA_TYPE_DATA))
+        {
+            vecStreams.push_back(static_cast<int>(i));
+        }
+    }
+    return vecStreams;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Mux rate taken by the passthrough streams: their nominal bitrate plus 5%
+// for TS/PES overhead, as for the video. Streams that do not declare a
+// bitrate are budgeted at 384 kbit/s (audio) or 32 kbit/s (anything else).
+int64_t passthrough_mux_rate(const AVFormatContext *pFmtCtxIn, const std::vector<int> &vecStreams)
+{
+    int64_t nRate{0};
+    for (const int nStreamIdx : vecStreams)
+    {
+        const AVCodecParameters *pCodecPar = pFmtCtxIn->streams[nStreamIdx]->codecpar;
+        int64_t nBitRate = pCodecPar->bit_rate;
+        if (nBitRate <= 0)
+        {
+            nBitRate = pCodecPar->codec_type == AVMEDIA_TYPE_AUDIO ? 384000 : 32000;
+            std::cout << "Stream "
+                      << nStreamIdx
+                      << " has no bitrate; budgeting "
+                      << nBitRate / 1000
+                      << " kbit/s"
+                      << std::endl;
+        }
+        nRate += nBitRate + nBitRate / 20;
+    }
+    return nRate;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writes the header of a libavformat output at a constant nMuxRate.
+bool write_output_header(const TranscodeOptions &options, AVFormatContext *pFmtCtxOut, const int64_t nMuxRate, const int64_t nMaxDelay)
+{
+    AVDictionary *pDict{};
+    av_dict_set_int(&pDict, "muxrate", nMuxRate, 0);
+    av_dict_set_int(&pDict, "max_delay", nMaxDelay, 0);
+    if (options.bLowLatency)
+    {
+        // Hand every packet to the output as soon as it is muxed.
+        av_dict_set(&pDict, "flush_packets", "1", 0);
+    }
+
+    // Init muxer, write output file header
+    if (int ret = avformat_write_header(pFmtCtxOut, &pDict); ret < 0)
     {
-        std::cerr << "Failed to copy '"
-                  << av_get_media_type_string(in_eMediaType)
-                  << "' decoder codec parameters to decoder context: "
+        std::cerr << "Error occurred when opening output file: "
                   << error_code_to_string(ret)
                   << std::endl;
+        av_dict_free(&pDict);
+        return false;
+    }
+    av_dict_free(&pDict);
+
+    return true;
+}
 
+//////////////////////////////////////////////////////////////////////////
+// Opens the format context for inout_output.strPath and the I/O behind it:
+// a paced live output at nMuxRate, or a file. Live outputs and the native
+// muxer always get MPEG-TS. The I/O threads start on the mux CPUs.
+bool open_output_io(const TranscodeOptions &options, const int64_t nMuxRate, OutputFile &inout_output)
+{
+    const std::string &strPath = inout_output.strPath;
+    const bool bLive = PacedTsOutput::is_live_target(strPath);
+    if (!open_output_format_context(strPath, inout_output.apFmtCtx, bLive || options.bNativeTsMux ? "mpegts" : nullptr))
+    {
+        std::cerr << "Could not open destination file " << strPath << std::endl;
         return false;
     }
 
-    if (!!fnInitContext)
+    // Open file if required.
+    AVFormatContext *pFmtCtxOut = inout_output.apFmtCtx.get();
+    if (bLive)
     {
-        if (!fnInitContext(apCdcCtx.get()))
+        PacedOutputConfig live = options.live;
+        live.nRateBps = nMuxRate;
+        if (options.bLowLatency)
+        {
+            // 20 ms of prefill, and at most 100 ms of stream waiting to go out.
+            live.nPrefillMs = 20;
+            live.nBufferBytes = static_cast<std::size_t>(live.nRateBps / 8 / 10);
+        }
+        inout_output.apLive = std::make_unique<PacedTsOutput>(live);
+        if (!run_placed(options.pipeline.pPlacement, ThreadStage::Mux, [&]() { return inout_output.apLive->open(strPath); }))
         {
-            std::cerr << "Failed to initialise decoder codec context using custom initialisation function."
+            std::cerr << "Could not open live output "
+                      << strPath
                       << std::endl;
             return false;
         }
+        pFmtCtxOut->pb = inout_output.apLive->context();
+    }
+    else if (!(pFmtCtxOut->oformat->flags & AVFMT_NOFILE))
+    {
+        if (options.bSyncIo)
+        {
+            int ret = avio_open(&pFmtCtxOut->pb, strPath.c_str(), AVIO_FLAG_WRITE);
+            if (ret < 0)
+            {
+                std::cerr << "Could not open output file "
+                          << strPath
+                          << std::endl;
+                return false;
+            }
+        }
+        else
+        {
+            inout_output.apSink = std::make_unique<AvioFileSink>(options.sink);
+            if (!run_placed(options.pipeline.pPlacement, ThreadStage::Mux, [&]() { return inout_output.apSink->open(strPath); }))
+            {
+                std::cerr << "Could not open output file "
+                          << strPath
+                          << std::endl;
+                return false;
+            }
+            pFmtCtxOut->pb = inout_output.apSink->context();
+        }
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Opens the muxer, output file and encoder for inout_output, and writes the
+// file header. With the native muxer the format context only provides the
+// I/O and the encoder's stream; CbrTsMuxer writes the whole stream. The
+// output's I/O threads start on the mux CPUs and x264's on the encode CPUs.
+// The streams in options.pipeline.vecPassthroughStreams are copied from
+// pFmtCtxIn.
+bool open_output_file(const TranscodeOptions &options,
+                      const AVFormatContext *pFmtCtxIn,
+                      const AVCodecContext *pCdcCtxIn,
+                      OutputFile &inout_output)
+{
+    const int64_t nMuxRate = cbr_mux_rate(inout_output.encoder) + passthrough_mux_rate(pFmtCtxIn, options.pipeline.vecPassthroughStreams);
+    if (!open_output_io(options, nMuxRate, inout_output))
+    {
+        return false;
+    }
+
+    AVFormatContext *pFmtCtxOut = inout_output.apFmtCtx.get();
+    const CbrEncoderSettings &encoder = inout_output.encoder;
+    const auto open_encoder = [&]() -> bool
+    {
+        return open_encoder_context(pFmtCtxOut,
+                                    inout_output.apCdcCtx,
+                                    inout_output.pStVideo,
+                                    "libx264",
+                                    [&encoder, pCdcCtxIn](AVStream *, AVCodecContext *pCdcCtxOut, AVDictionary *&pDict) -> bool
+                                    {
+                                        return configure_cbr_encoder(encoder, pCdcCtxIn, pCdcCtxOut, pDict);
+                                    });
+    };
+    if (!run_placed(options.pipeline.pPlacement, ThreadStage::Encode, open_encoder))
+    {
+        std::cerr << "Could not open encoder output" << std::endl;
+        return false;
+    }
+
+    if (options.bNativeTsMux)
+    {
+        // Decode times trail the earliest send time by the VBV buffer.
+        const AVCodecContext *pCdcCtxOut = inout_output.apCdcCtx.get();
+        CbrTsMuxerConfig tsMux = options.tsMux;
+        tsMux.nMuxRate = cbr_mux_rate(encoder);
+        tsMux.nVideoRate = encoder.nBitRate;
+        tsMux.nMuxDelayMs = static_cast<int>(int64_t{pCdcCtxOut->rc_buffer_size} * 1000 / pCdcCtxOut->bit_rate);
+        inout_output.apTsMuxer = std::make_unique<CbrTsMuxer>(tsMux, pFmtCtxOut->pb);
+        return true;
+    }
+
+    if (!add_passthrough_streams(pFmtCtxIn, options.pipeline.vecPassthroughStreams, pFmtCtxOut, inout_output.vecPassthroughStreams))
+    {
+        return false;
+    }
+
+    return write_output_header(options, pFmtCtxOut, nMuxRate, cbr_mux_max_delay(encoder));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writes the trailer and closes the output file.
+bool close_output_file(OutputFile &inout_output)
+{
+    AVFormatContext *pFmtCtxOut = inout_output.apFmtCtx.get();
+
+    bool bClosed{true};
+    if (inout_output.apTsMuxer)
+    {
+        bClosed = inout_output.apTsMuxer->flush();
+        avio_flush(pFmtCtxOut->pb);
+        print_cbr_ts_muxer_stats(inout_output.apTsMuxer->stats());
+    }
+    else
+    {
+        av_write_trailer(pFmtCtxOut);
+    }
+
+    // close output
+    if (inout_output.apSink)
+    {
+        // The sink owns the AVIOContext; the format context must not free it.
+        pFmtCtxOut->pb = nullptr;
+        bClosed = inout_output.apSink->close() && bClosed;
+
+        const AvioSinkStats sinkStats = inout_output.apSink->stats();
+        std::cout << "Output "
+                  << inout_output.strPath
+                  << ": "
+                  << sinkStats.nBytesWritten
+                  << " bytes in "
+                  << sinkStats.nWrites
+                  << " writes, "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(sinkStats.writeTime).count()
+                  << " ms writing, "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(sinkStats.blockedTime).count()
+                  << " ms muxer blocked on I/O"
+                  << std::endl;
+    }
+    else if (inout_output.apLive)
+    {
+        // Likewise the live output; closing it drains the remaining datagrams.
+        pFmtCtxOut->pb = nullptr;
+        bClosed = inout_output.apLive->close() && bClosed;
+        print_paced_output_stats(inout_output.apLive->stats());
+    }
+    else if (pFmtCtxOut && !(pFmtCtxOut->flags & AVFMT_NOFILE))
+    {
+        avio_closep(&pFmtCtxOut->pb);
+    }
+
+    return bClosed;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Opens the decoder of the input's video stream. Its threads start on the
+// decode CPUs.
+bool open_video_decoder(const TranscodeOptions &options,
+                        AVFormatContext *pFmtCtxIn,
+                        int &out_nStreamIdx,
+                        CodecContextPtr &out_apCdcCtx)
+{
+    const auto open_decoder = [&]() -> bool
+    {
+        return open_decoder_context(pFmtCtxIn,
+                                    AVMEDIA_TYPE_VIDEO,
+                                    out_nStreamIdx,
+                                    out_apCdcCtx,
+                                    [nThreads = options.nDecodeThreads](AVCodecContext *pCdcCtx) -> bool
+                                    {
+                                        if (nThreads > 0)
+                                        {
+                                            pCdcCtx->thread_count = nThreads;
+                                        }
+                                        return true;
+                                    });
+    };
+    if (!run_placed(options.pipeline.pPlacement, ThreadStage::Decode, open_decoder))
+    {
+        std::cerr << "Failed to open decoder context" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Shared-memory input: attaches to the capture process's ring and describes
+// its pictures in a codec context of their own, which the encoders are
+// configured from in place of a decoder's.
+bool open_ring_input(const std::string &strPath, ShmFrameRing &out_ring, CodecContextPtr &out_apShape)
+{
+    if (!out_ring.open(strPath))
+    {
+        return false;
     }
 
-    // Initialise the decoders, with or without reference counting
-    AVDictionary *opts = nullptr;
-    av_dict_set(&opts, "refcounted_frames", "1", 0);
-    if ((ret = avcodec_open2(apCdcCtx.get(), pCdc, &opts)) < 0)
+    // configure_cbr_encoder() codes 25 fps.
+    const AVRational frameRate = out_ring.frame_rate();
+    if (av_cmp_q(frameRate, AVRational{25, 1}) != 0)
     {
-        std::cerr << "Failed to open '"
-                  << av_get_media_type_string(in_eMediaType)
-                  << "' decoder codec: "
-                  << error_code_to_string(ret)
+        std::cerr << "Frame ring runs at "
+                  << frameRate.num
+                  << "/"
+                  << frameRate.den
+                  << " fps; the encoder codes 25 fps"
                   << std::endl;
-
         return false;
     }
 
-    inout_apCdcCtx = std::unique_ptr<AVCodecContext, std::function<void(AVCodecContext *)>>
-        (
-            apCdcCtx.release(),
-            [](AVCodecContext *pCdcCtx) mutable
-            {
-                // Not sure this function can take a nullptr!
-                if (pCdcCtx != nullptr)
-                {
-                    avcodec_free_context(&pCdcCtx);
-                }
-            }
-        );
-    inout_nStreamidx = stream_index;
+    out_apShape.reset(avcodec_alloc_context3(nullptr));
+    if (!out_apShape)
+    {
+        return false;
+    }
+    out_apShape->width = out_ring.width();
+    out_apShape->height = out_ring.height();
+    out_apShape->pix_fmt = out_ring.pixel_format();
+    out_apShape->framerate = frameRate;
     return true;
 }
 
 //////////////////////////////////////////////////////////////////////////
-bool open_encoder_context(AVFormatContext *const in_pFmtCtx,
-                          std::unique_ptr<AVCodecContext, std::function<void(AVCodecContext *)>> &inout_apCdcCtx,
-                          AVStream *&inout_pStream,
-                          const std::string &in_strCodecId,
-                          const std::function<bool(AVStream * , AVCodecContext * , AVDictionary * &)> &fnInitContext)
+// Transcodes strSrcFilename to strDstFilename (or its ladder renditions).
+// options is taken by value as the pipeline is pointed at pPlacement, which
+// may be null. out_pFrames receives the frames written to the first output.
+bool transcode(TranscodeOptions options,
+               const std::string &strSrcFilename,
+               const std::string &strDstFilename,
+               ThreadPlacement *pPlacement,
+               uint64_t *out_pFrames = nullptr)
 {
-    inout_apCdcCtx.reset();
-    inout_pStream = nullptr;
-
-    if (!in_pFmtCtx)
+    const bool bShmInput = ShmFrameRing::is_ring_path(strSrcFilename);
+    if (bShmInput
+        && (options.bParallelSegments
+            || options.bPassthrough
+            || options.nRangeStartUs != AV_NOPTS_VALUE
+            || options.nRangeEndUs != AV_NOPTS_VALUE
+            || options.eInputIo != TranscodeOptions::InputIo::File))
     {
-        std::cerr << "Pointer to format context is NULL" << std::endl;
+        std::cerr << "shm: inputs cannot be combined with --parallel-segments, --passthrough, --start, --end or --input-io"
+                  << std::endl;
         return false;
     }
 
-    // Find the encoder
-    auto pCdc = avcodec_find_encoder_by_name(in_strCodecId.c_str());
-    if (pCdc == nullptr)
+    // Must outlive the input format context.
+    AvioMemorySource memorySource;
+    if (options.eInputIo != TranscodeOptions::InputIo::File)
     {
-        std::cerr << "Failed to find encoder codec '" << in_strCodecId << "'" << std::endl;
-        return false;
+        const auto eMode = options.eInputIo == TranscodeOptions::InputIo::Mmap
+            ? AvioMemorySource::Mode::Mmap
+            : AvioMemorySource::Mode::Ram;
+        if (!memorySource.open(strSrcFilename, eMode))
+        {
+            std::cerr << "Could not open source file " << strSrcFilename << std::endl;
+            return false;
+        }
     }
 
-    auto pStream = avformat_new_stream(in_pFmtCtx, nullptr);
-    if (pStream == nullptr)
+    InputFormatContextPtr apFmtCtxIn;
+    if (!bShmInput && !open_input_format_context(strSrcFilename, apFmtCtxIn, memorySource.context()))
     {
-        std::cerr << "Could not allocate elementary stream" << std::endl;
+        std::cerr << "Could not open source file " << strSrcFilename << std::endl;
         return false;
     }
 
-    pStream->id = in_pFmtCtx->nb_streams - 1;
-
-    // Allocate a codec context for the encoder
-    std::unique_ptr<AVCodecContext, std::function<void(AVCodecContext *)>> apCdcCtx
-        (
-            avcodec_alloc_context3(pCdc),
-            [](AVCodecContext *pCdcCtx) mutable
-            {
-                avcodec_free_context(&pCdcCtx);
-            }
-        );
-
-    // Allocate a codec context for the encoder
-    if (!apCdcCtx)
+    if (!options.bParallelSegments)
     {
-        std::cerr << "Failed to allocate the '"
-                  << av_get_media_type_string(pCdc->type)
-                  << "' encoder codec context."
-                  << std::endl;
-        return false;
+        options.pipeline.pPlacement = pPlacement;
     }
 
-    AVDictionary *pDict = nullptr;
-    if (fnInitContext)
+    // A ring input has no decoder; its picture shape goes in apCdcCtxIn
+    // instead.
+    int nStreamIdxIn{};
+    CodecContextPtr apCdcCtxIn;
+    ShmFrameRing ring;
+    if (bShmInput)
     {
-        if (!fnInitContext(pStream, apCdcCtx.get(), pDict))
+        if (!open_ring_input(strSrcFilename, ring, apCdcCtxIn))
         {
-            std::cerr << "Failed to initialise encoder codeccontext using custom initialisation function." << std::endl;
             return false;
         }
     }
+    else if (!open_video_decoder(options, apFmtCtxIn.get(), nStreamIdxIn, apCdcCtxIn))
+    {
+        return false;
+    }
 
-    // Some formats want stream headers to be separate.
-    if (in_pFmtCtx->oformat->flags & AVFMT_GLOBALHEADER)
+    if ((options.nRangeStartUs != AV_NOPTS_VALUE || options.nRangeEndUs != AV_NOPTS_VALUE)
+        && !seek_to_range(options, strSrcFilename, apFmtCtxIn.get(), nStreamIdxIn, options.pipeline))
     {
-        apCdcCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        return false;
     }
 
-    // Init the encoder
+    if (options.bPassthrough)
     {
-        const int ret = avcodec_open2(apCdcCtx.get(), pCdc, &pDict);
-        if (ret < 0)
-        {
-            std::cerr << "Failed to open '"
-                      << av_get_media_type_string(apCdcCtx->codec_type)
-                      << "' encoder codec: "
-                      << error_code_to_string(ret)
-                      << std::endl;
+        options.pipeline.vecPassthroughStreams = find_passthrough_streams(apFmtCtxIn.get(), nStreamIdxIn);
+    }
 
-            return false;
+    // One output per ladder rung, or just the one.
+    std::vector<OutputFile> vecOutputFiles;
+    if (options.vecLadderBitRates.empty())
+    {
+        vecOutputFiles.emplace_back();
+        vecOutputFiles.back().strPath = strDstFilename;
+        vecOutputFiles.back().encoder = options.encoder;
+    }
+    else
+    {
+        // Share the cores out between the encoders rather than have every
+        // x264 instance size its thread pool for the whole machine.
+        const int nRenditions = static_cast<int>(options.vecLadderBitRates.size());
+        const int nThreads = options.encoder.nThreads > 0
+            ? options.encoder.nThreads
+            : std::max(static_cast<int>(std::thread::hardware_concurrency()) / nRenditions, 1);
+
+        for (const int64_t nBitRate : options.vecLadderBitRates)
+        {
+            vecOutputFiles.emplace_back();
+            vecOutputFiles.back().strPath = ladder_output_path(strDstFilename, nBitRate);
+            vecOutputFiles.back().encoder = options.encoder;
+            vecOutputFiles.back().encoder.nBitRate = nBitRate;
+            vecOutputFiles.back().encoder.nThreads = nThreads;
         }
     }
 
-    // Fill the parameters struct based on the values from the supplied codec context. This
-    // sets the parameters in the muxer.
+    for (OutputFile &output : vecOutputFiles)
     {
-        const int ret = avcodec_parameters_from_context(pStream->codecpar, apCdcCtx.get());
-        if (ret < 0)
+        if (options.pipeline.deadline.bEnabled)
+        {
+            DeadlineController::apply_level(DeadlineController::default_level(), output.encoder);
+        }
+        if (!open_output_file(options, apFmtCtxIn.get(), apCdcCtxIn.get(), output))
         {
-            std::cerr << "Could not copy the encoder context stream parameters to the multiplexer"
-                      << std::endl;
             return false;
         }
     }
 
-    inout_apCdcCtx = std::move(apCdcCtx);
-    inout_pStream = pStream;
-    return true;
-}
-
-//////////////////////////////////////////////////////////////////////////
-int get_next_decoder_frame(AVFormatContext *pFmtCtxIn,
-                           AVCodecContext *pCdcCtxIn,
-                           int nStreamIdx,
-                           AVPacket *pPkt,
-                           bool &bPendingPkt,
-                           std::shared_ptr<AVFrame> &inout_apFrameOut)
-{
-    while (true)
+    bool bTranscoded{false};
+    if (options.bParallelSegments)
     {
-        int ret = bPendingPkt ? 0 : av_read_frame(pFmtCtxIn, pPkt);
-        if (ret < 0)
-        {
-            // This is probably EOF?? Tell our decoder EOF
-            avcodec_send_packet(pCdcCtxIn, nullptr);
-        }
-        else
+        OutputFile &output = vecOutputFiles.front();
+        bTranscoded = run_segment_parallel_encode(strSrcFilename,
+                                                  apFmtCtxIn->streams[nStreamIdxIn],
+                                                  output.encoder,
+                                                  options.segments,
+                                                  output.apFmtCtx.get(),
+                                                  output.apCdcCtx.get(),
+                                                  output.pStVideo,
+                                                  options.pipeline);
+    }
+    else
+    {
+        std::vector<PipelineOutput> vecOutputs;
+        for (const OutputFile &output : vecOutputFiles)
         {
-            // Make sure this is our video index.
-            if (!bPendingPkt && pPkt->stream_index != nStreamIdx)
+            PipelineOutput target{};
+            target.pFmtCtx = output.apFmtCtx.get();
+            target.pCdcCtx = output.apCdcCtx.get();
+            target.pStVideo = output.pStVideo;
+            target.pTsMuxer = output.apTsMuxer.get();
+            target.vecPassthroughStreams = output.vecPassthroughStreams;
+            target.fnReopenEncoder = [encoder=output.encoder, pCdcCtxIn=apCdcCtxIn.get(), pPlacement=options.pipeline.pPlacement](std::size_t nLevel,
+                                                                                                                              int64_t nInitialOccupancy,
+                                                                                                                              CodecContextPtr &out_apCdcCtx) -> bool
             {
-                av_packet_unref(pPkt);
-                continue;
-            }
+                CbrEncoderSettings settings = encoder;
+                DeadlineController::apply_level(nLevel, settings);
+                settings.nInitialOccupancy = nInitialOccupancy;
 
-            // 1. Send packet
-            if (int retInner = avcodec_send_packet(pCdcCtxIn, pPkt); ret != 0)
-            {
-                if (retInner == AVERROR(EAGAIN))
+                return run_placed(pPlacement, ThreadStage::Encode, [&]() -> bool
                 {
-                    bPendingPkt = true;
-                }
-                else
-                {
-                    std::cerr << "Unexpected error received from decoder (avcodec_send_packet): "
-                              << error_code_to_string(retInner)
-                              << ". Cannot continue."
-                              << std::endl;
-                    return retInner;
-                }
+                    AVStream *pNoStream{};
+                    return open_encoder_context(nullptr,
+                                                out_apCdcCtx,
+                                                pNoStream,
+                                                "libx264",
+                                                [&settings, pCdcCtxIn](AVStream *, AVCodecContext *pCdcCtxOut, AVDictionary *&pDict) -> bool
+                                                {
+                                                    return configure_cbr_encoder(settings, pCdcCtxIn, pCdcCtxOut, pDict);
+                                                });
+                });
+            };
+            if (!options.pipeline.strVbvLogPath.empty())
+            {
+                target.strVbvLogPath = vecOutputFiles.size() > 1
+                    ? ladder_output_path(options.pipeline.strVbvLogPath, output.encoder.nBitRate)
+                    : options.pipeline.strVbvLogPath;
             }
-            else
+            if (!options.pipeline.quality.strLogPath.empty())
             {
-                bPendingPkt = false;
+                target.strQualityLogPath = vecOutputFiles.size() > 1
+                    ? ladder_output_path(options.pipeline.quality.strLogPath, output.encoder.nBitRate)
+                    : options.pipeline.quality.strLogPath;
             }
+            vecOutputs.push_back(target);
         }
 
-        std::shared_ptr<AVFrame> apAVFrame{av_frame_alloc(),
-                                           [](AVFrame *p)
-                                           {
-                                               if (p != nullptr)
-                                               {
-                                                   av_frame_free(&p);
-                                               }
-                                           }};
-
-        // 2. Receive frame
-        if (int ret = avcodec_receive_frame(pCdcCtxIn, apAVFrame.get()); ret != 0)
+        const auto tStart = std::chrono::steady_clock::now();
+        bTranscoded = bShmInput
+            ? run_ingest_pipeline(ring, vecOutputs, options.pipeline)
+            : run_transcode_pipeline(apFmtCtxIn.get(),
+                                     apCdcCtxIn.get(),
+                                     nStreamIdxIn,
+                                     vecOutputs,
+                                     options.pipeline);
+        if (pPlacement)
         {
-            if (ret == AVERROR_EOF)
-            {
-                // We are done here.
-                return ret;
-            }
-            if (ret == AVERROR(EAGAIN))
-            {
-                // Go around again.
-            }
-            else
-            {
-                std::cerr << "Unexpected error received from decoder (avcodec_receive_frame): "
-                          << error_code_to_string(ret)
-                          << ". Cannot continue."
-                          << std::endl;
-
-                // Not sure of best error code to return, but
-                // let us go with this.
-                return AVERROR(EFAULT);
-            }
+            pPlacement->print_utilisation(std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count());
         }
-        else
-        {
-//            std::cout << "Decoded frame - PTS="
-//                      << apAVFrame->pts
-//                      << ", DTS="
-//                      << pPkt->dts
-//                      << std::endl;
+    }
 
-            apAVFrame->pts = AV_NOPTS_VALUE;
-            apAVFrame->pkt_dts = AV_NOPTS_VALUE;
-            apAVFrame->pkt_pos = -1;
-            apAVFrame->pkt_size = -1;
-            apAVFrame->pkt_duration = 0;
+    bool bClosed{true};
+    for (OutputFile &output : vecOutputFiles)
+    {
+        bClosed = close_output_file(output) && bClosed;
+    }
 
-            inout_apFrameOut = std::move(apAVFrame);
-            return 0;
-        }
+    if (out_pFrames)
+    {
+        const OutputFile &output = vecOutputFiles.front();
+        *out_pFrames = output.apTsMuxer
+            ? output.apTsMuxer->stats().nAccessUnits
+            : static_cast<uint64_t>(output.pStVideo->nb_frames);
     }
-}
 
+    return bTranscoded && bClosed;
+}
 
 //////////////////////////////////////////////////////////////////////////
-int main(int argc, char *argv[])
+// x264_cbr batch [batch options] [options] jobs.txt
+//
+// Runs every job of the list in this process, --jobs at a time, with the
+// encoder threads of the running jobs drawn from one --threads budget. The
+// remaining options apply to every job.
+int run_batch(int argc, char *argv[])
 {
-    if (argc < 1)
+    BatchSchedulerConfig config{};
+    config.nThreadBudget = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    std::size_t nWorkers{0};
+    bool bVerbose{false};
+
+    // Take out the batch options and leave the rest to parse_arguments().
+    std::vector<char *> vecArgs{argv[0]};
+    for (int i = 2; i < argc; ++i)
     {
-        std::cerr << "Argument to input AV file is required: "
-                  << "./x264_cbr [file_in] [file_out]"
-                  << std::endl;
-        return 1;
-    }
+        std::string strKey;
+        std::string strValue;
+        split_option(argv[i], strKey, strValue);
 
-    //av_log_set_level(AV_LOG_DEBUG);
+        bool bOk = true;
+        if (strKey == "--jobs")
+        {
+            bOk = parse_unsigned("job count", strValue, nWorkers);
+        }
+        else if (strKey == "--threads")
+        {
+            bOk = parse_unsigned("thread budget", strValue, config.nThreadBudget);
+        }
+        else if (strKey == "--verbose")
+        {
+            bVerbose = true;
+        }
+        else
+        {
+            vecArgs.push_back(argv[i]);
+        }
 
-    const std::string strSrcFilename = argv[1];
+        if (!bOk)
+        {
+            print_usage();
+            return 1;
+        }
+    }
 
-    std::unique_ptr<AVFormatContext, std::function<void(AVFormatContext *)>> apFmtCtxIn;
-    if (!open_input_format_context(argv[1], apFmtCtxIn))
+    TranscodeOptions options{};
+    if (!parse_arguments(static_cast<int>(vecArgs.size()), vecArgs.data(), options))
     {
-        std::cerr << "Could not open source file " << strSrcFilename << std::endl;
+        print_usage();
+        return 1;
+    }
+    if (options.vecPositional.size() != 1)
+    {
+        std::cerr << "Exactly one job list is required" << std::endl;
+        print_usage();
         return 1;
     }
 
-    std::unique_ptr<AVFormatContext, std::function<void(AVFormatContext *)>> apFmtCtxOut;
-    if (!open_output_format_context(argv[2], apFmtCtxOut))
+    // Every job would write the same logs, and per-stage placement and the
+    // segment workers assume the process to themselves.
+    if (!options.vecLadderBitRates.empty()
+        || options.bParallelSegments
+        || !options.pipeline.strVbvLogPath.empty()
+        || !options.pipeline.quality.strLogPath.empty()
+        || !options.pipeline.strTelemetryPath.empty()
+        || options.placement.bReport
+        || std::any_of(options.placement.arrCpuSpecs.begin(), options.placement.arrCpuSpecs.end(), [](const std::string &strSpec) { return !strSpec.empty(); }))
     {
-        std::cerr << "Could not open destination file " << strSrcFilename << std::endl;
+        std::cerr << "batch cannot be combined with --ladder, --parallel-segments, --vbv-log, --quality-log, --telemetry, --cpus-* or --cpu-report"
+                  << std::endl;
         return 1;
     }
 
-    // Open file if required.
-    if (!(apFmtCtxOut->oformat->flags & AVFMT_NOFILE))
+    std::vector<BatchJob> vecJobs;
+    if (!load_batch_jobs(options.vecPositional[0], vecJobs))
+    {
+        return 1;
+    }
+    for (const BatchJob &job : vecJobs)
     {
-        int ret = avio_open(&apFmtCtxOut->pb, argv[2], AVIO_FLAG_WRITE);
-        if (ret < 0)
+        if (PacedTsOutput::is_live_target(job.strOutput))
         {
-            std::cerr << "Could not open output file "
-                      << argv[2]
-                      << std::endl;
-            return ret;
+            std::cerr << "batch needs file outputs, not " << job.strOutput << std::endl;
+            return 1;
         }
     }
 
-    int nStreamIdxIn{};
-    std::unique_ptr<AVCodecContext, std::function<void(AVCodecContext *)>> apCdcCtxIn;
-    if (!open_decoder_context(apFmtCtxIn.get(), AVMEDIA_TYPE_VIDEO, nStreamIdxIn, apCdcCtxIn, {}))
+    // By default about four encoder threads per job, where x264 still
+    // scales well; more jobs than that mostly add memory.
+    config.nWorkers = nWorkers > 0 ? nWorkers : static_cast<std::size_t>(std::max(config.nThreadBudget / 4, 1));
+
+    // Frame threads would multiply across the jobs; the decoders share the
+    // machine with the encoders.
+    if (options.nDecodeThreads == 0)
     {
-        std::cerr << "Failed to open decoder context" << std::endl;
-        return 1;
+        options.nDecodeThreads = 1;
+    }
+
+    std::cout << "Batch: "
+              << vecJobs.size()
+              << " jobs, "
+              << std::min(config.nWorkers, vecJobs.size())
+              << " at a time, "
+              << config.nThreadBudget
+              << " encoder threads"
+              << std::endl;
+
+    // The per-job reports would interleave; keep only the summary.
+    std::streambuf *pCoutBuf = std::cout.rdbuf();
+    if (!bVerbose)
+    {
+        std::cout.rdbuf(nullptr);
     }
 
-    AVStream *pStVideoIn = apFmtCtxIn->streams[nStreamIdxIn];
+    const auto run_job = [&options](const BatchJob &job, const int nThreads, BatchJobResult &out_result) -> bool
+    {
+        TranscodeOptions jobOptions = options;
+        jobOptions.encoder.nThreads = nThreads;
+        if (job.nBitRate > 0)
+        {
+            jobOptions.encoder.nBitRate = job.nBitRate;
+        }
+
+        if (!transcode(jobOptions, job.strInput, job.strOutput, nullptr, &out_result.nFrames))
+        {
+            std::cerr << "Job " << job.strInput << " -> " << job.strOutput << " failed" << std::endl;
+            return false;
+        }
+        return true;
+    };
 
-    AVStream *pStVideoOut{};
-    std::unique_ptr<AVCodecContext, std::function<void(AVCodecContext *)>> apCdcCtxOut;
-    if (!open_encoder_context(apFmtCtxOut.get(),
-                              apCdcCtxOut,
-                              pStVideoOut,
-                              "libx264",
-                              [pCdcCtxIn=apCdcCtxIn.get(), pStVideoIn](AVStream *stVideoOut, AVCodecContext *pCdcCtxOut, AVDictionary *&pDict) -> bool
-                              {
-                                  av_dict_set(&pDict, "preset", "faster", 0);
-                                  av_dict_set(&pDict, "tune", "film", 0);
-                                  av_dict_set_int(&pDict, "rc-lookahead", 25, 0);
+    const auto tStart = std::chrono::steady_clock::now();
+    BatchScheduler scheduler{config};
+    std::vector<BatchJobResult> vecResults;
+    const bool bOk = scheduler.run(vecJobs, run_job, vecResults);
+    const double dWallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
 
-                                  pCdcCtxOut->width = pCdcCtxIn->width;
-                                  pCdcCtxOut->height = pCdcCtxIn->height;
-                                  pCdcCtxOut->pix_fmt = AV_PIX_FMT_YUV420P;
-                                  pCdcCtxOut->gop_size = 25;
+    std::cout.rdbuf(pCoutBuf);
+    print_batch_summary(vecJobs, vecResults, dWallSeconds);
 
-                                  // Going for 6Mbit/s
-                                  pCdcCtxOut->bit_rate = 6000000;
-                                  //pCdcCtxOut->rc_min_rate = pCdcCtxOut->bit_rate;
-                                  pCdcCtxOut->rc_max_rate = pCdcCtxOut->bit_rate;
-                                  pCdcCtxOut->rc_buffer_size = pCdcCtxOut->bit_rate;
-                                  pCdcCtxOut->rc_initial_buffer_occupancy = static_cast<int>((pCdcCtxOut->bit_rate * 9) / 10);
+    return bOk ? 0 : 1;
+}
 
-                                  std::string strParams = "vbv-maxrate="
-                                                          + std::to_string(pCdcCtxOut->bit_rate / 1000)
-                                                          + ":vbv-bufsize="
-                                                          + std::to_string(pCdcCtxOut->bit_rate / 1000)
-                                                          + ":force-cfr=1:nal-hrd=cbr";
+//////////////////////////////////////////////////////////////////////////
+// x264_cbr mpts [mpts options] [options] file_in... file_out
+//
+// Encodes every input as one program of a single constant-rate MPTS. The
+// programs share the video rate through a StatmuxController, which moves
+// bits between them every GOP. The remaining options apply to every
+// program.
+int run_mpts(int argc, char *argv[])
+{
+    int64_t nMuxRate{0};
+    StatmuxConfig statmux{};
 
-                                  av_dict_set(&pDict, "x264-params", strParams.c_str(), 0);
+    // Take out the mpts options and leave the rest to parse_arguments().
+    std::vector<char *> vecArgs{argv[0]};
+    for (int i = 2; i < argc; ++i)
+    {
+        std::string strKey;
+        std::string strValue;
+        split_option(argv[i], strKey, strValue);
 
-                                  pCdcCtxOut->field_order = AV_FIELD_TT;
-                                  pCdcCtxOut->flags = (AV_CODEC_FLAG_INTERLACED_DCT | AV_CODEC_FLAG_INTERLACED_ME | AV_CODEC_FLAG_CLOSED_GOP);
+        bool bOk = true;
+        if (strKey == "--mux-rate")
+        {
+            bOk = parse_unsigned("mux rate", strValue, nMuxRate);
+        }
+        else if (strKey == "--statmux-min")
+        {
+            bOk = parse_unsigned("statmux minimum rate", strValue, statmux.nMinRate);
+        }
+        else if (strKey == "--statmux-max")
+        {
+            bOk = parse_unsigned("statmux maximum rate", strValue, statmux.nMaxRate);
+        }
+        else
+        {
+            vecArgs.push_back(argv[i]);
+        }
 
-                                                   // WARN: Make some assumptions here!
-                                  pCdcCtxOut->time_base = AVRational{1,25};
-                                  pCdcCtxOut->framerate = AVRational{25,1};
-                                  pCdcCtxOut->sample_aspect_ratio = AVRational{64,45};
+        if (!bOk)
+        {
+            print_usage();
+            return 1;
+        }
+    }
 
-                                  return true;
-                              }))
+    TranscodeOptions options{};
+    if (!parse_arguments(static_cast<int>(vecArgs.size()), vecArgs.data(), options))
     {
-        std::cerr << "Could not open encoder output" << std::endl;
+        print_usage();
+        return 1;
+    }
+    if (options.vecPositional.size() < 3)
+    {
+        std::cerr << "mpts takes at least two inputs and an output" << std::endl;
+        print_usage();
         return 1;
     }
 
-    AVDictionary *pDict{};
-    av_dict_set(&pDict, "muxrate", "6300000", 0);
-    av_dict_set(&pDict, "max_delay", "6000000", 0);
-
-    // Init muxer, write output file header
-    if (int ret = avformat_write_header(apFmtCtxOut.get(), &pDict); ret < 0)
+    // The programs share one muxer and the statmux owns the rates.
+    if (!options.vecLadderBitRates.empty()
+        || options.bParallelSegments
+        || options.bPassthrough
+        || options.bNativeTsMux
+        || options.nRangeStartUs != AV_NOPTS_VALUE
+        || options.nRangeEndUs != AV_NOPTS_VALUE
+        || options.pipeline.deadline.bEnabled
+        || !options.pipeline.strVbvLogPath.empty()
+        || !options.pipeline.quality.strLogPath.empty()
+        || !options.pipeline.strTelemetryPath.empty()
+        || options.pipeline.bLatencyHistograms
+        || options.eInputIo != TranscodeOptions::InputIo::File)
     {
-        std::cerr << "Error occurred when opening output file: "
-                  << error_code_to_string(ret)
+        std::cerr << "mpts cannot be combined with --ladder, --parallel-segments, --passthrough, --ts-mux=native, --start, --end,"
+                  << " --deadline, --vbv-log, --quality-log, --telemetry, --latency-histograms or --input-io"
                   << std::endl;
-        return ret;
+        return 1;
     }
 
+    const std::vector<std::string> vecInputs(options.vecPositional.begin(), options.vecPositional.end() - 1);
+    const std::string strDstFilename = options.vecPositional.back();
+    for (const std::string &strInput : vecInputs)
+    {
+        if (ShmFrameRing::is_ring_path(strInput))
+        {
+            std::cerr << "mpts needs file inputs, not " << strInput << std::endl;
+            return 1;
+        }
+    }
+    if (strDstFilename == "-")
+    {
+        // stdout carries the stream; send the reports to stderr.
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
 
+    // By default every program gets the single-program CBR mux rate. The
+    // video budget is what is left once the 5% cbr_mux_rate() allows for
+    // TS/PES overhead is taken back out.
+    const auto nPrograms = static_cast<int64_t>(vecInputs.size());
+    if (nMuxRate == 0)
+    {
+        nMuxRate = nPrograms * cbr_mux_rate(options.encoder);
+    }
+    statmux.nBudget = nMuxRate * 20 / 21;
+    StatmuxController controller{statmux, vecInputs.size()};
 
-    AVPacket pktDec{};
-    av_init_packet(&pktDec);
-
-    int64_t nTimebase{0};
+    ThreadPlacement placement;
+    if (!placement.init(options.placement))
+    {
+        return 1;
+    }
+    options.pipeline.pPlacement = &placement;
+
+    // Every encoder starts at an equal share, with the cores shared out
+    // as for a ladder.
+    CbrEncoderSettings encoder = options.encoder;
+    encoder.bStatmux = true;
+    encoder.nBitRate = controller.equal_share();
+    if (encoder.nThreads == 0)
+    {
+        encoder.nThreads = std::max(static_cast<int>(std::thread::hardware_concurrency() / vecInputs.size()), 1);
+    }
 
-    bool bPendingPktDemux{false};
-    std::shared_ptr<AVFrame> apAVFrame{};
-    while (true)
+    OutputFile output{};
+    output.strPath = strDstFilename;
+    output.encoder = encoder;
+    if (!open_output_io(options, nMuxRate, output))
     {
-        const auto getNextFrame = apAVFrame
-            ? 0
-            : get_next_decoder_frame(apFmtCtxIn.get(), apCdcCtxIn.get(), nStreamIdxIn, &pktDec, bPendingPktDemux, apAVFrame);
+        return 1;
+    }
+    AVFormatContext *pFmtCtxOut = output.apFmtCtx.get();
 
-        if (getNextFrame == AVERROR_EOF)
+    std::vector<InputFormatContextPtr> vecFmtCtxIn(vecInputs.size());
+    std::vector<CodecContextPtr> vecCdcCtxIn(vecInputs.size());
+    std::vector<CodecContextPtr> vecCdcCtxOut(vecInputs.size());
+    std::vector<MptsProgram> vecPrograms(vecInputs.size());
+    for (std::size_t i = 0; i < vecInputs.size(); ++i)
+    {
+        MptsProgram &program = vecPrograms[i];
+        if (!open_input_format_context(vecInputs[i], vecFmtCtxIn[i]))
         {
-            // Signal EOF
-            avcodec_send_frame(apCdcCtxOut.get(), nullptr);
+            std::cerr << "Could not open source file " << vecInputs[i] << std::endl;
+            return 1;
         }
-        else if (getNextFrame < 0)
+        program.pFmtCtxIn = vecFmtCtxIn[i].get();
+        if (!open_video_decoder(options, program.pFmtCtxIn, program.nStreamIdxIn, vecCdcCtxIn[i]))
         {
-            break;
+            return 1;
         }
-        else if (!!apAVFrame)
+        program.pCdcCtxIn = vecCdcCtxIn[i].get();
+
+        AVStream *pStVideo{};
+        const AVCodecContext *pCdcCtxIn = program.pCdcCtxIn;
+        const auto open_encoder = [&]() -> bool
+        {
+            return open_encoder_context(pFmtCtxOut,
+                                        vecCdcCtxOut[i],
+                                        pStVideo,
+                                        "libx264",
+                                        [&encoder, pCdcCtxIn](AVStream *, AVCodecContext *pCdcCtxOut, AVDictionary *&pDict) -> bool
+                                        {
+                                            return configure_cbr_encoder(encoder, pCdcCtxIn, pCdcCtxOut, pDict);
+                                        });
+        };
+        if (!run_placed(options.pipeline.pPlacement, ThreadStage::Encode, open_encoder))
         {
-            apAVFrame->pts = nTimebase;
+            std::cerr << "Could not open encoder for " << vecInputs[i] << std::endl;
+            return 1;
+        }
 
-            apAVFrame->key_frame = 0;
-            apAVFrame->pict_type = AV_PICTURE_TYPE_NONE;
+        // Program numbers count from 1; each program is named after its input.
+        const int nProgramId = static_cast<int>(i) + 1;
+        AVProgram *pProgram = av_new_program(pFmtCtxOut, nProgramId);
+        if (pProgram == nullptr)
+        {
+            std::cerr << "Could not add program " << nProgramId << std::endl;
+            return 1;
+        }
+        av_program_add_stream_index(pFmtCtxOut, nProgramId, static_cast<unsigned int>(pStVideo->index));
+        av_dict_set(&pProgram->metadata, "service_name", vecInputs[i].c_str(), 0);
+
+        program.output.pFmtCtx = pFmtCtxOut;
+        program.output.pCdcCtx = vecCdcCtxOut[i].get();
+        program.output.pStVideo = pStVideo;
+        program.output.pStatmux = &controller;
+        program.output.nStatmuxChannel = i;
+    }
 
-            std::cout << "avcodec_send_frame: PTS="
-                      << apAVFrame->pts
-                      << std::endl;
+    if (!write_output_header(options, pFmtCtxOut, nMuxRate, cbr_mux_max_delay(encoder)))
+    {
+        return 1;
+    }
 
-            if (int ret = avcodec_send_frame(apCdcCtxOut.get(), apAVFrame.get()); ret < 0)
-            {
-                if (ret != AVERROR(EAGAIN))
-                {
-                    std::cerr << "Unexpected error detected while sending frame to encoder. Cannot continue. Error: "
-                              << error_code_to_string(ret);
-                }
-            }
-            else
-            {
-//                std::cout << "avcodec_send_frame: CONSUMED"
-//                          << std::endl;
+    std::cout << "MPTS: "
+              << vecInputs.size()
+              << " programs at "
+              << nMuxRate / 1000
+              << " kbit/s"
+              << std::endl;
 
-                nTimebase += apCdcCtxOut->time_base.num;
-                apAVFrame.reset();
-            }
-        }
+    const auto tStart = std::chrono::steady_clock::now();
+    const bool bEncoded = run_mpts_pipeline(vecPrograms, options.pipeline);
+    placement.print_utilisation(std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count());
+    print_statmux_stats(controller);
 
+    const bool bClosed = close_output_file(output);
+    return bEncoded && bClosed ? 0 : 1;
+}
 
-        AVPacket pktEnc{};
-        av_init_packet(&pktEnc);
-        if (int ret = avcodec_receive_packet(apCdcCtxOut.get(), &pktEnc); ret != 0)
-        {
-            av_packet_unref(&pktEnc);
+//////////////////////////////////////////////////////////////////////////
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && std::string{argv[1]} == "analyze")
+    {
+        return run_analyze(argc, argv);
+    }
+    if (argc > 1 && std::string{argv[1]} == "batch")
+    {
+        return run_batch(argc, argv);
+    }
+    if (argc > 1 && std::string{argv[1]} == "index")
+    {
+        return run_index(argc, argv);
+    }
+    if (argc > 1 && std::string{argv[1]} == "shm-produce")
+    {
+        return run_shm_produce(argc, argv);
+    }
+    if (argc > 1 && std::string{argv[1]} == "mpts")
+    {
+        return run_mpts(argc, argv);
+    }
 
-            if (ret == AVERROR(EAGAIN))
-            {
+    TranscodeOptions options{};
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage();
+        return 1;
+    }
 
-            }
-            else if (ret == AVERROR_EOF)
-            {
-                break;
-            }
-            else
-            {
-                std::cerr << "Unexpected error received packet from encoder. Cannot continue. Error: "
-                          << error_code_to_string(ret)
-                          << std::endl;
-                break;
-            }
-        }
-        else
-        {
-            av_packet_rescale_ts(&pktEnc, apCdcCtxOut->time_base, pStVideoOut->time_base);
+    if (options.vecPositional.size() < 2)
+    {
+        std::cerr << "Argument to input AV file is required: "
+                  << "./x264_cbr [file_in] [file_out]"
+                  << std::endl;
+        print_usage();
+        return 1;
+    }
 
-            std::cout << "Written packet, PTS= "
-                      << pktEnc.pts
-                      << ", DTS="
-                      << pktEnc.dts
-                      << std::endl;
+    if (options.bParallelSegments && !options.vecLadderBitRates.empty())
+    {
+        std::cerr << "--parallel-segments and --ladder cannot be combined" << std::endl;
+        return 1;
+    }
+    if (options.bParallelSegments && options.pipeline.deadline.bEnabled)
+    {
+        std::cerr << "--parallel-segments and --deadline cannot be combined" << std::endl;
+        return 1;
+    }
+    if (options.bParallelSegments && options.bNativeTsMux)
+    {
+        std::cerr << "--parallel-segments and --ts-mux=native cannot be combined" << std::endl;
+        return 1;
+    }
+    if (options.bParallelSegments && options.pipeline.bMeasureLatency)
+    {
+        std::cerr << "--parallel-segments cannot be combined with --low-latency or --frame-latency" << std::endl;
+        return 1;
+    }
+    if (options.bParallelSegments && (options.nRangeStartUs != AV_NOPTS_VALUE || options.nRangeEndUs != AV_NOPTS_VALUE))
+    {
+        std::cerr << "--parallel-segments cannot be combined with --start or --end" << std::endl;
+        return 1;
+    }
+    if (options.bParallelSegments && options.pipeline.analysis.nLookahead > 0)
+    {
+        std::cerr << "--parallel-segments and --pre-analysis cannot be combined" << std::endl;
+        return 1;
+    }
+    if (options.pipeline.quality.nInterval > 0 && (options.bParallelSegments || options.pipeline.deadline.bEnabled))
+    {
+        std::cerr << "--quality cannot be combined with --parallel-segments or --deadline" << std::endl;
+        return 1;
+    }
+    if (!options.pipeline.quality.strLogPath.empty() && options.pipeline.quality.nInterval == 0)
+    {
+        std::cerr << "--quality-log needs --quality" << std::endl;
+        return 1;
+    }
+    if (options.bPassthrough && (options.bParallelSegments || options.bNativeTsMux))
+    {
+        std::cerr << "--passthrough cannot be combined with --parallel-segments or --ts-mux=native" << std::endl;
+        return 1;
+    }
 
-            if (int retInner = av_interleaved_write_frame(apFmtCtxOut.get(), &pktEnc); retInner != 0)
-            {
-                av_packet_unref(&pktEnc);
+    //av_log_set_level(AV_LOG_DEBUG);
 
-                std::cerr << "Unexpected error writing packet to IO. Cannot continue. Error: "
-                          << error_code_to_string(retInner)
-                          << std::endl;
-                break;
-            }
+    const std::string strSrcFilename = options.vecPositional[0];
+    const std::string strDstFilename = options.vecPositional[1];
 
-            av_packet_unref(&pktEnc);
-        }
+    if (PacedTsOutput::is_live_target(strDstFilename) && !options.vecLadderBitRates.empty())
+    {
+        std::cerr << "--ladder needs file outputs, not " << strDstFilename << std::endl;
+        return 1;
+    }
+    if (strDstFilename == "-")
+    {
+        // stdout carries the stream; send the reports to stderr.
+        std::cout.rdbuf(std::cerr.rdbuf());
     }
 
-    av_write_trailer(apFmtCtxOut.get());
-
-    // close output
-    if (apFmtCtxOut && !(apFmtCtxOut->flags & AVFMT_NOFILE))
+    ThreadPlacement placement;
+    if (!placement.init(options.placement))
     {
-        avio_closep(&apFmtCtxOut->pb);
+        return 1;
     }
 
-    return 0;
+    return transcode(options, strSrcFilename, strDstFilename, &placement) ? 0 : 1;
 }
@@ -0,0 +1,87 @@
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////////////////////////////////
+MappedFile::~MappedFile()
+{
+    if (m_pData != nullptr)
+    {
+        munmap(m_pData, m_nSize);
+    }
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool MappedFile::open(const std::string &strPath)
+{
+    m_nPageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+
+    m_fd = ::open(strPath.c_str(), O_RDONLY);
+    if (m_fd < 0)
+    {
+        std::cerr << "Could not open '" << strPath << "': " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct stat st{};
+    if (fstat(m_fd, &st) != 0 || st.st_size <= 0)
+    {
+        std::cerr << "File '" << strPath << "' is empty or unreadable" << std::endl;
+        return false;
+    }
+    m_nSize = static_cast<std::size_t>(st.st_size);
+
+    void *pMap = mmap(nullptr, m_nSize, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (pMap == MAP_FAILED)
+    {
+        std::cerr << "Could not map '" << strPath << "': " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    m_pData = static_cast<uint8_t *>(pMap);
+
+    posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    madvise(m_pData, m_nSize, MADV_SEQUENTIAL);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void MappedFile::will_need(const std::size_t nOffset, const std::size_t nLength) const
+{
+    if (m_pData == nullptr || nOffset >= m_nSize)
+    {
+        return;
+    }
+
+    const std::size_t nStart = (nOffset / m_nPageSize) * m_nPageSize;
+    const std::size_t nEnd = std::min(nOffset + nLength, m_nSize);
+    madvise(m_pData + nStart, nEnd - nStart, MADV_WILLNEED);
+}
+
+//////////////////////////////////////////////////////////////////////////
+void MappedFile::release(const std::size_t nOffset, const std::size_t nLength) const
+{
+    if (m_pData == nullptr || nOffset >= m_nSize)
+    {
+        return;
+    }
+
+    // Only whole pages inside the range.
+    const std::size_t nStart = ((nOffset + m_nPageSize - 1) / m_nPageSize) * m_nPageSize;
+    const std::size_t nEnd = (std::min(nOffset + nLength, m_nSize) / m_nPageSize) * m_nPageSize;
+    if (nEnd > nStart)
+    {
+        madvise(m_pData + nStart, nEnd - nStart, MADV_DONTNEED);
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//////////////////////////////////////////////////////////////////////////
+// Read-only memory mapping of a whole file, advised for sequential access.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::string &strPath);
+
+    const uint8_t *data() const { return m_pData; }
+    std::size_t size() const { return m_nSize; }
+
+    // Hints that [nOffset, nOffset + nLength) will be read soon.
+    void will_need(std::size_t nOffset, std::size_t nLength) const;
+
+    // Drops [nOffset, nOffset + nLength) from our resident set; the pages
+    // are faulted back in from the file if touched again.
+    void release(std::size_t nOffset, std::size_t nLength) const;
+
+private:
+    int m_fd{-1};
+    uint8_t *m_pData{nullptr};
+    std::size_t m_nSize{0};
+    std::size_t m_nPageSize{0};
+};
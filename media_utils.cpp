@@ -0,0 +1,319 @@
+#include "media_utils.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+//////////////////////////////////////////////////////////////////////////
+std::string error_code_to_string(const int nErrCode)
+{
+    char chArray[AV_ERROR_MAX_STRING_SIZE];
+
+    // Probably better to be on the safe size and initialise the array.
+    // The docs do not state if the string is null terminated :(
+    std::fill(std::begin(chArray), std::end(chArray), '\0');
+
+    if (av_strerror(nErrCode, chArray, AV_ERROR_MAX_STRING_SIZE) != 0)
+    {
+        return "[Unknown]";
+    }
+
+    return std::string(chArray);
+}
+
+///////////////////////////////////////////////////////////////////////////
+bool open_input_format_context(const std::string &strPath,
+                               InputFormatContextPtr &out_apFmtCtx,
+                               AVIOContext *in_pCustomIo)
+{
+    out_apFmtCtx.reset();
+
+    AVFormatContext *pFmtCtx = nullptr;
+
+    // With custom I/O the path is only used as a probing hint.
+    if (in_pCustomIo != nullptr)
+    {
+        pFmtCtx = avformat_alloc_context();
+        if (pFmtCtx == nullptr)
+        {
+            std::cerr << "Could not allocate input format context" << std::endl;
+            return false;
+        }
+
+        pFmtCtx->pb = in_pCustomIo;
+        pFmtCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    // Open input file, and allocate format context
+    if (int nRet = avformat_open_input(&pFmtCtx,
+                                       strPath.c_str(),
+                                       nullptr,
+                                       nullptr); nRet < 0)
+    {
+        std::cerr << "Could not open media at path: '"
+                  << strPath
+                  << "': "
+                  << error_code_to_string(nRet)
+                  << std::endl;
+
+        return false;
+    }
+
+    out_apFmtCtx = InputFormatContextPtr{pFmtCtx};
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+bool open_output_format_context(const std::string &strMediaPath,
+                                OutputFormatContextPtr &out_apFmtCtx,
+                                const char *pszFormat)
+{
+    out_apFmtCtx.reset();
+
+    AVFormatContext *pFmtCtx = nullptr;
+    if (int nRet = avformat_alloc_output_context2(&pFmtCtx, nullptr, pszFormat, strMediaPath.c_str()); nRet < 0)
+    {
+        std::cerr << "Could not create media context for media at path: '"
+                  << strMediaPath
+                  << "': "
+                  << error_code_to_string(nRet);
+
+        return false;
+    }
+
+    out_apFmtCtx = OutputFormatContextPtr{pFmtCtx};
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool add_passthrough_streams(const AVFormatContext *in_pFmtCtxIn,
+                             const std::vector<int> &in_vecStreamIdx,
+                             AVFormatContext *inout_pFmtCtxOut,
+                             std::vector<AVStream *> &out_vecStreams)
+{
+    out_vecStreams.clear();
+    for (const int nStreamIdx : in_vecStreamIdx)
+    {
+        const AVStream *pStIn = in_pFmtCtxIn->streams[nStreamIdx];
+        AVStream *pStOut = avformat_new_stream(inout_pFmtCtxOut, nullptr);
+        if (pStOut == nullptr)
+        {
+            std::cerr << "Could not create output stream for input stream " << nStreamIdx << std::endl;
+            return false;
+        }
+
+        if (int nRet = avcodec_parameters_copy(pStOut->codecpar, pStIn->codecpar); nRet < 0)
+        {
+            std::cerr << "Could not copy codec parameters of input stream "
+                      << nStreamIdx
+                      << ": "
+                      << error_code_to_string(nRet)
+                      << std::endl;
+            return false;
+        }
+
+        // The input container's tag may mean nothing to the output's.
+        pStOut->codecpar->codec_tag = 0;
+        pStOut->time_base = pStIn->time_base;
+        pStOut->disposition = pStIn->disposition;
+        av_dict_copy(&pStOut->metadata, pStIn->metadata, 0);
+
+        out_vecStreams.push_back(pStOut);
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool open_decoder_context(AVFormatContext *const in_pFmtCtx,
+                          const AVMediaType in_eMediaType,
+                          int &inout_nStreamidx,
+                          CodecContextPtr &inout_apCdcCtx,
+                          const std::function<bool(AVCodecContext *)> &fnInitContext)
+{
+    const int nDesiredIdx = std::max<int>(inout_nStreamidx,-1);
+
+    // Reset in case something goes wrong.
+    inout_nStreamidx = -1;
+    inout_apCdcCtx.reset();
+
+    if (!in_pFmtCtx)
+    {
+        std::cerr << "Pointer to format context is NULL" << std::endl;
+        return false;
+    }
+
+    int ret = av_find_best_stream(in_pFmtCtx, in_eMediaType, nDesiredIdx, -1, nullptr, 0);
+    if (ret < 0)
+    {
+        std::cerr << "Could not find '"
+                  << av_get_media_type_string(in_eMediaType)
+                  << "' stream in input file ("
+                  << ret
+                  << "): "
+                  << error_code_to_string(ret)
+                  << std::endl;
+
+        return false;
+    }
+
+    const int stream_index = ret;
+    AVStream *const st = in_pFmtCtx->streams[stream_index];
+
+    // Find decoder for the stream
+    AVCodec *const pCdc = avcodec_find_decoder(st->codecpar->codec_id);
+    if (pCdc == nullptr)
+    {
+        std::cerr << "Failed to find '"
+                  << av_get_media_type_string(in_eMediaType)
+                  << "' decoder codec"
+                  << std::endl;
+        return false;
+    }
+
+    // Allocate a codec context for the decoder
+    CodecContextPtr apCdcCtx{avcodec_alloc_context3(pCdc)};
+
+    if (!apCdcCtx)
+    {
+        std::cerr << "Failed to allocate the '"
+                  << av_get_media_type_string(in_eMediaType)
+                  << "' decoder codec context."
+                  << std::endl;
+        return false;
+    }
+
+    // Copy codec parameters from input stream to output codec context */
+    if ((ret = avcodec_parameters_to_context(apCdcCtx.get(), st->codecpar)) < 0)
+    {
+        std::cerr << "Failed to copy '"
+                  << av_get_media_type_string(in_eMediaType)
+                  << "' decoder codec parameters to decoder context: "
+                  << error_code_to_string(ret)
+                  << std::endl;
+
+        return false;
+    }
+
+    if (!!fnInitContext)
+    {
+        if (!fnInitContext(apCdcCtx.get()))
+        {
+            std::cerr << "Failed to initialise decoder codec context using custom initialisation function."
+                      << std::endl;
+            return false;
+        }
+    }
+
+    // Initialise the decoders, with or without reference counting
+    AVDictionary *opts = nullptr;
+    av_dict_set(&opts, "refcounted_frames", "1", 0);
+    if ((ret = avcodec_open2(apCdcCtx.get(), pCdc, &opts)) < 0)
+    {
+        std::cerr << "Failed to open '"
+                  << av_get_media_type_string(in_eMediaType)
+                  << "' decoder codec: "
+                  << error_code_to_string(ret)
+                  << std::endl;
+
+        return false;
+    }
+
+    inout_apCdcCtx = std::move(apCdcCtx);
+    inout_nStreamidx = stream_index;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool open_encoder_context(AVFormatContext *const in_pFmtCtx,
+                          CodecContextPtr &inout_apCdcCtx,
+                          AVStream *&inout_pStream,
+                          const std::string &in_strCodecId,
+                          const std::function<bool(AVStream * , AVCodecContext * , AVDictionary * &)> &fnInitContext)
+{
+    inout_apCdcCtx.reset();
+    inout_pStream = nullptr;
+
+    // Find the encoder
+    auto pCdc = avcodec_find_encoder_by_name(in_strCodecId.c_str());
+    if (pCdc == nullptr)
+    {
+        std::cerr << "Failed to find encoder codec '" << in_strCodecId << "'" << std::endl;
+        return false;
+    }
+
+    // Without a format context the encoder is standalone; there is no stream to attach to.
+    AVStream *pStream = nullptr;
+    if (in_pFmtCtx)
+    {
+        pStream = avformat_new_stream(in_pFmtCtx, nullptr);
+        if (pStream == nullptr)
+        {
+            std::cerr << "Could not allocate elementary stream" << std::endl;
+            return false;
+        }
+
+        pStream->id = in_pFmtCtx->nb_streams - 1;
+    }
+
+    // Allocate a codec context for the encoder
+    CodecContextPtr apCdcCtx{avcodec_alloc_context3(pCdc)};
+
+    // Allocate a codec context for the encoder
+    if (!apCdcCtx)
+    {
+        std::cerr << "Failed to allocate the '"
+                  << av_get_media_type_string(pCdc->type)
+                  << "' encoder codec context."
+                  << std::endl;
+        return false;
+    }
+
+    AVDictionary *pDict = nullptr;
+    if (fnInitContext)
+    {
+        if (!fnInitContext(pStream, apCdcCtx.get(), pDict))
+        {
+            std::cerr << "Failed to initialise encoder codeccontext using custom initialisation function." << std::endl;
+            return false;
+        }
+    }
+
+    // Some formats want stream headers to be separate.
+    if (in_pFmtCtx && (in_pFmtCtx->oformat->flags & AVFMT_GLOBALHEADER))
+    {
+        apCdcCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    // Init the encoder
+    {
+        const int ret = avcodec_open2(apCdcCtx.get(), pCdc, &pDict);
+        if (ret < 0)
+        {
+            std::cerr << "Failed to open '"
+                      << av_get_media_type_string(apCdcCtx->codec_type)
+                      << "' encoder codec: "
+                      << error_code_to_string(ret)
+                      << std::endl;
+
+            return false;
+        }
+    }
+
+    // Fill the parameters struct based on the values from the supplied codec context. This
+    // sets the parameters in the muxer.
+    if (pStream != nullptr)
+    {
+        const int ret = avcodec_parameters_from_context(pStream->codecpar, apCdcCtx.get());
+        if (ret < 0)
+        {
+            std::cerr << "Could not copy the encoder context stream parameters to the multiplexer"
+                      << std::endl;
+            return false;
+        }
+    }
+
+    inout_apCdcCtx = std::move(apCdcCtx);
+    inout_pStream = pStream;
+    return true;
+}
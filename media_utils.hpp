@@ -0,0 +1,102 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Stateless deleters, so the owning pointers below are the size of a raw
+// pointer and need no type-erased (heap allocated) std::function.
+struct InputFormatContextDeleter
+{
+    void operator()(AVFormatContext *pFmtCtx) const
+    {
+        avformat_close_input(&pFmtCtx);
+    }
+};
+
+struct OutputFormatContextDeleter
+{
+    void operator()(AVFormatContext *pFmtCtx) const
+    {
+        avformat_free_context(pFmtCtx);
+    }
+};
+
+struct CodecContextDeleter
+{
+    void operator()(AVCodecContext *pCdcCtx) const
+    {
+        avcodec_free_context(&pCdcCtx);
+    }
+};
+
+struct PacketDeleter
+{
+    void operator()(AVPacket *pPkt) const
+    {
+        av_packet_free(&pPkt);
+    }
+};
+
+struct FrameDeleter
+{
+    void operator()(AVFrame *pFrame) const
+    {
+        av_frame_free(&pFrame);
+    }
+};
+
+using InputFormatContextPtr = std::unique_ptr<AVFormatContext, InputFormatContextDeleter>;
+using OutputFormatContextPtr = std::unique_ptr<AVFormatContext, OutputFormatContextDeleter>;
+using CodecContextPtr = std::unique_ptr<AVCodecContext, CodecContextDeleter>;
+using PacketPtr = std::unique_ptr<AVPacket, PacketDeleter>;
+using FramePtr = std::unique_ptr<AVFrame, FrameDeleter>;
+
+//////////////////////////////////////////////////////////////////////////
+std::string error_code_to_string(const int nErrCode);
+
+//////////////////////////////////////////////////////////////////////////
+// in_pCustomIo, if given, must outlive the format context.
+bool open_input_format_context(const std::string &strPath,
+                               InputFormatContextPtr &out_apFmtCtx,
+                               AVIOContext *in_pCustomIo = nullptr);
+
+//////////////////////////////////////////////////////////////////////////
+// pszFormat names the muxer; by default it is guessed from the path.
+bool open_output_format_context(const std::string &strMediaPath,
+                                OutputFormatContextPtr &out_apFmtCtx,
+                                const char *pszFormat = nullptr);
+
+//////////////////////////////////////////////////////////////////////////
+// Adds one output stream per listed input stream, with its codec
+// parameters, time base, disposition and metadata, so that its packets can
+// be remuxed unchanged. out_vecStreams runs parallel to in_vecStreamIdx.
+bool add_passthrough_streams(const AVFormatContext *in_pFmtCtxIn,
+                             const std::vector<int> &in_vecStreamIdx,
+                             AVFormatContext *inout_pFmtCtxOut,
+                             std::vector<AVStream *> &out_vecStreams);
+
+//////////////////////////////////////////////////////////////////////////
+bool open_decoder_context(AVFormatContext *const in_pFmtCtx,
+                          const AVMediaType in_eMediaType,
+                          int &inout_nStreamidx,
+                          CodecContextPtr &inout_apCdcCtx,
+                          const std::function<bool(AVCodecContext *)> &fnInitContext);
+
+//////////////////////////////////////////////////////////////////////////
+// With a null in_pFmtCtx the encoder is opened standalone: no stream is
+// created, and fnInitContext receives a null stream.
+bool open_encoder_context(AVFormatContext *const in_pFmtCtx,
+                          CodecContextPtr &inout_apCdcCtx,
+                          AVStream *&inout_pStream,
+                          const std::string &in_strCodecId,
+                          const std::function<bool(AVStream * , AVCodecContext * , AVDictionary * &)> &fnInitContext);
@@ -0,0 +1,449 @@
+#include "paced_output.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+
+#include <netdb.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+}
+
+namespace
+{
+
+// The muxer's AVIOContext buffer: one datagram, so bytes reach the ring as
+// soon as a datagram's worth has been muxed.
+constexpr int g_nAvioBufferSize = static_cast<int>(g_nTsDatagramSize);
+
+constexpr const char *g_pszUdpScheme = "udp://";
+
+//////////////////////////////////////////////////////////////////////////
+int64_t monotonic_ns()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void sleep_until_ns(const int64_t nDeadlineNs)
+{
+    timespec ts{};
+    ts.tv_sec = static_cast<time_t>(nDeadlineNs / 1000000000LL);
+    ts.tv_nsec = static_cast<long>(nDeadlineNs % 1000000000LL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+    {
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// "udp://host:port[?options]", with the host optionally in [brackets].
+bool split_udp_target(const std::string &strTarget, std::string &out_strHost, std::string &out_strPort)
+{
+    std::string strRest = strTarget.substr(std::strlen(g_pszUdpScheme));
+    strRest = strRest.substr(0, strRest.find('?'));
+
+    std::size_t nColon{};
+    if (!strRest.empty() && strRest.front() == '[')
+    {
+        const std::size_t nClose = strRest.find(']');
+        if (nClose == std::string::npos)
+        {
+            return false;
+        }
+        out_strHost = strRest.substr(1, nClose - 1);
+        nColon = nClose + 1;
+    }
+    else
+    {
+        nColon = strRest.rfind(':');
+        out_strHost = strRest.substr(0, nColon);
+    }
+
+    if (nColon == std::string::npos || nColon >= strRest.size() || strRest[nColon] != ':')
+    {
+        return false;
+    }
+    out_strPort = strRest.substr(nColon + 1);
+    return !out_strHost.empty() && !out_strPort.empty();
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+PacedTsOutput::PacedTsOutput(const PacedOutputConfig &config)
+    : m_config(config),
+      m_dGapNs(static_cast<double>(g_nTsDatagramSize) * 8.0 * 1e9 / static_cast<double>(std::max<int64_t>(config.nRateBps, 1))),
+      m_nPrefillBytes(static_cast<std::size_t>(config.nRateBps / 8 * config.nPrefillMs / 1000))
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+PacedTsOutput::~PacedTsOutput()
+{
+    close();
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool PacedTsOutput::is_live_target(const std::string &strTarget)
+{
+    return strTarget == "-" || strTarget.rfind(g_pszUdpScheme, 0) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool PacedTsOutput::open(const std::string &strTarget)
+{
+    // A vanished reader must surface as a send error, not kill us.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    if (strTarget == "-")
+    {
+        m_fd = STDOUT_FILENO;
+        m_bOwnFd = false;
+    }
+    else
+    {
+        std::string strHost;
+        std::string strPort;
+        if (!split_udp_target(strTarget, strHost, strPort))
+        {
+            std::cerr << "Invalid UDP target '" << strTarget << "', expected udp://host:port" << std::endl;
+            return false;
+        }
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo *pResult = nullptr;
+        if (int ret = getaddrinfo(strHost.c_str(), strPort.c_str(), &hints, &pResult); ret != 0)
+        {
+            std::cerr << "Could not resolve " << strHost << ": " << gai_strerror(ret) << std::endl;
+            return false;
+        }
+
+        m_fd = ::socket(pResult->ai_family, pResult->ai_socktype, pResult->ai_protocol);
+        if (m_fd >= 0)
+        {
+            // Unconnected, so that nobody listening (ICMP port unreachable)
+            // does not turn into send errors.
+            std::memcpy(&m_addr, pResult->ai_addr, pResult->ai_addrlen);
+            m_nAddrLen = static_cast<socklen_t>(pResult->ai_addrlen);
+        }
+        freeaddrinfo(pResult);
+
+        if (m_fd < 0)
+        {
+            std::cerr << "Could not create UDP socket: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        m_bOwnFd = true;
+        m_bUdp = true;
+    }
+
+    m_vecRing.resize(std::max(m_config.nBufferBytes, std::max(m_nPrefillBytes, g_nTsDatagramSize * std::max<std::size_t>(m_config.nBatch, 1)) * 2));
+
+    auto *pAvioBuffer = static_cast<uint8_t *>(av_malloc(g_nAvioBufferSize));
+    if (pAvioBuffer == nullptr)
+    {
+        return false;
+    }
+
+    m_pAvioCtx = avio_alloc_context(pAvioBuffer, g_nAvioBufferSize, 1, this, nullptr, &PacedTsOutput::write_packet, nullptr);
+    if (m_pAvioCtx == nullptr)
+    {
+        av_free(pAvioBuffer);
+        std::cerr << "Could not allocate output AVIOContext" << std::endl;
+        return false;
+    }
+
+    m_stats.dNominalGapUs = m_dGapNs * static_cast<double>(std::max<std::size_t>(m_config.nBatch, 1)) / 1000.0;
+    m_thSender = std::thread{&PacedTsOutput::sender_thread, this};
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool PacedTsOutput::close()
+{
+    if (m_pAvioCtx != nullptr)
+    {
+        avio_flush(m_pAvioCtx);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{m_mtx};
+        m_bClosing = true;
+    }
+    m_cvData.notify_one();
+
+    if (m_thSender.joinable())
+    {
+        m_thSender.join();
+    }
+
+    if (m_bOwnFd && m_fd >= 0)
+    {
+        ::close(m_fd);
+    }
+    m_fd = -1;
+
+    if (m_pAvioCtx != nullptr)
+    {
+        av_freep(&m_pAvioCtx->buffer);
+        avio_context_free(&m_pAvioCtx);
+    }
+
+    std::lock_guard<std::mutex> lock{m_mtx};
+    return !m_bError;
+}
+
+//////////////////////////////////////////////////////////////////////////
+PacedOutputStats PacedTsOutput::stats() const
+{
+    std::lock_guard<std::mutex> lock{m_mtx};
+    PacedOutputStats stats = m_stats;
+    stats.dJitterRmsUs = stats.nGaps > 0 ? std::sqrt(m_dJitterSumSq / static_cast<double>(stats.nGaps)) : 0.0;
+    return stats;
+}
+
+//////////////////////////////////////////////////////////////////////////
+int PacedTsOutput::write_packet(void *pOpaque, uint8_t *pBuf, const int nBufSize)
+{
+    return static_cast<PacedTsOutput *>(pOpaque)->write(pBuf, static_cast<std::size_t>(nBufSize));
+}
+
+//////////////////////////////////////////////////////////////////////////
+int PacedTsOutput::write(const uint8_t *pBuf, const std::size_t nSize)
+{
+    const std::size_t nCapacity = m_vecRing.size();
+
+    std::size_t nDone = 0;
+    while (nDone < nSize)
+    {
+        std::unique_lock<std::mutex> lock{m_mtx};
+        if (m_nUsed == nCapacity && !m_bError)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            m_cvSpace.wait(lock, [this, nCapacity] { return m_nUsed < nCapacity || m_bError; });
+            m_stats.blockedTime += std::chrono::steady_clock::now() - start;
+        }
+        if (m_bError)
+        {
+            return AVERROR(EIO);
+        }
+
+        // Copy into the free region, which may wrap.
+        const std::size_t nTail = (m_nHead + m_nUsed) % nCapacity;
+        const std::size_t nCopy = std::min({nSize - nDone, nCapacity - m_nUsed, nCapacity - nTail});
+        std::memcpy(m_vecRing.data() + nTail, pBuf + nDone, nCopy);
+        m_nUsed += nCopy;
+        nDone += nCopy;
+
+        lock.unlock();
+        m_cvData.notify_one();
+    }
+
+    return static_cast<int>(nSize);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool PacedTsOutput::send_datagrams(const uint8_t *pData, const std::size_t nSize)
+{
+    if (!m_bUdp)
+    {
+        std::size_t nDone = 0;
+        while (nDone < nSize)
+        {
+            const ssize_t nWritten = ::write(m_fd, pData + nDone, nSize - nDone);
+            if (nWritten < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                std::cerr << "Write to stdout failed: " << std::strerror(errno) << std::endl;
+                return false;
+            }
+            nDone += static_cast<std::size_t>(nWritten);
+        }
+        return true;
+    }
+
+    const std::size_t nDatagrams = (nSize + g_nTsDatagramSize - 1) / g_nTsDatagramSize;
+    if (nDatagrams == 1)
+    {
+        if (::sendto(m_fd, pData, nSize, 0, reinterpret_cast<const sockaddr *>(&m_addr), m_nAddrLen) < 0)
+        {
+            std::cerr << "UDP send failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // One syscall for the whole batch.
+    std::vector<iovec> vecIov(nDatagrams);
+    std::vector<mmsghdr> vecMsgs(nDatagrams);
+    for (std::size_t i = 0; i < nDatagrams; ++i)
+    {
+        const std::size_t nOffset = i * g_nTsDatagramSize;
+        vecIov[i].iov_base = const_cast<uint8_t *>(pData + nOffset);
+        vecIov[i].iov_len = std::min(g_nTsDatagramSize, nSize - nOffset);
+
+        vecMsgs[i] = mmsghdr{};
+        vecMsgs[i].msg_hdr.msg_name = &m_addr;
+        vecMsgs[i].msg_hdr.msg_namelen = m_nAddrLen;
+        vecMsgs[i].msg_hdr.msg_iov = &vecIov[i];
+        vecMsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::size_t nSent = 0;
+    while (nSent < nDatagrams)
+    {
+        const int ret = ::sendmmsg(m_fd, vecMsgs.data() + nSent, static_cast<unsigned>(nDatagrams - nSent), 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cerr << "UDP send failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        nSent += static_cast<std::size_t>(ret);
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void PacedTsOutput::sender_thread()
+{
+    const std::size_t nCapacity = m_vecRing.size();
+    const std::size_t nBatchBytes = g_nTsDatagramSize * std::max<std::size_t>(m_config.nBatch, 1);
+    std::vector<uint8_t> vecBatch(nBatchBytes);
+
+    {
+        std::unique_lock<std::mutex> lock{m_mtx};
+        m_cvData.wait(lock, [this] { return m_nUsed >= m_nPrefillBytes || m_bClosing; });
+    }
+
+    // Slot k of the current schedule is due at nAnchorNs + k * gap.
+    int64_t nAnchorNs = monotonic_ns();
+    uint64_t nSlot = 0;
+    int64_t nLastSendNs = -1;
+    double dLastNominalNs = 0.0;
+
+    while (true)
+    {
+        const int64_t nDueNs = nAnchorNs + std::llround(static_cast<double>(nSlot) * m_dGapNs);
+        sleep_until_ns(nDueNs);
+
+        std::size_t nTake = 0;
+        bool bUnderrun = false;
+        {
+            std::unique_lock<std::mutex> lock{m_mtx};
+            if (m_nUsed < nBatchBytes && !m_bClosing)
+            {
+                // Nothing to send on this slot; wait, then start a new
+                // schedule rather than bursting to catch up.
+                ++m_stats.nUnderruns;
+                bUnderrun = true;
+                m_cvData.wait(lock, [this, nBatchBytes] { return m_nUsed >= nBatchBytes || m_bClosing; });
+            }
+            if (m_nUsed == 0)
+            {
+                // Closing, and everything has gone out.
+                break;
+            }
+
+            nTake = std::min(m_nUsed, nBatchBytes);
+            const std::size_t nFirst = std::min(nTake, nCapacity - m_nHead);
+            std::memcpy(vecBatch.data(), m_vecRing.data() + m_nHead, nFirst);
+            std::memcpy(vecBatch.data() + nFirst, m_vecRing.data(), nTake - nFirst);
+            m_nHead = (m_nHead + nTake) % nCapacity;
+            m_nUsed -= nTake;
+        }
+        m_cvSpace.notify_one();
+
+        const bool bSent = send_datagrams(vecBatch.data(), nTake);
+        const int64_t nNowNs = monotonic_ns();
+        const std::size_t nDatagrams = (nTake + g_nTsDatagramSize - 1) / g_nTsDatagramSize;
+
+        {
+            std::lock_guard<std::mutex> lock{m_mtx};
+            if (!bSent)
+            {
+                m_bError = true;
+            }
+            m_stats.nDatagrams += nDatagrams;
+            m_stats.nBytes += nTake;
+
+            if (!bUnderrun)
+            {
+                if (static_cast<double>(nNowNs - nDueNs) > m_dGapNs)
+                {
+                    ++m_stats.nLateSends;
+                }
+                if (nLastSendNs >= 0)
+                {
+                    const double dJitterUs = (static_cast<double>(nNowNs - nLastSendNs) - dLastNominalNs) / 1000.0;
+                    ++m_stats.nGaps;
+                    m_dJitterSumSq += dJitterUs * dJitterUs;
+                    m_stats.dJitterMaxUs = std::max(m_stats.dJitterMaxUs, std::abs(dJitterUs));
+                }
+            }
+        }
+
+        if (!bSent)
+        {
+            m_cvSpace.notify_all();
+            break;
+        }
+
+        if (bUnderrun)
+        {
+            nAnchorNs = nNowNs;
+            nSlot = 0;
+        }
+        nSlot += nDatagrams;
+        nLastSendNs = nNowNs;
+        dLastNominalNs = static_cast<double>(nDatagrams) * m_dGapNs;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_paced_output_stats(const PacedOutputStats &stats)
+{
+    std::cout << "Paced output: "
+              << stats.nDatagrams
+              << " datagrams, "
+              << stats.nBytes
+              << " bytes, "
+              << stats.nUnderruns
+              << " underruns, "
+              << stats.nLateSends
+              << " late sends"
+              << std::endl
+              << std::fixed << std::setprecision(1)
+              << "  send gap: nominal "
+              << stats.dNominalGapUs
+              << " us, jitter rms "
+              << stats.dJitterRmsUs
+              << " us, max "
+              << stats.dJitterMaxUs
+              << " us over "
+              << stats.nGaps
+              << " gaps; muxer blocked "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(stats.blockedTime).count()
+              << " ms"
+              << std::defaultfloat
+              << std::endl;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+
+extern "C"
+{
+#include <libavformat/avio.h>
+}
+
+constexpr std::size_t g_nTsDatagramSize = 188 * 7;
+
+//////////////////////////////////////////////////////////////////////////
+struct PacedOutputConfig
+{
+    // Line rate the datagrams are paced at, i.e. the TS muxrate.
+    int64_t nRateBps{6300000};
+
+    // Bytes buffered between the muxer and the sender; the muxer blocks
+    // once it is full, which holds a file transcode to real time.
+    std::size_t nBufferBytes{g_nTsDatagramSize * 2048};
+
+    // Sending starts once this much stream has been buffered.
+    int nPrefillMs{200};
+
+    // Datagrams per send (sendmmsg for UDP). Each batch still goes out on
+    // its own slot: batch * datagram interval after the last one.
+    std::size_t nBatch{1};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct PacedOutputStats
+{
+    uint64_t nDatagrams{0};
+    uint64_t nBytes{0};
+
+    // Times the buffer ran dry at a send slot (schedule re-anchored).
+    uint64_t nUnderruns{0};
+
+    // Sends that left more than one interval after their slot.
+    uint64_t nLateSends{0};
+
+    // Deviation of each inter-send gap from the nominal one.
+    uint64_t nGaps{0};
+    double dNominalGapUs{0.0};
+    double dJitterRmsUs{0.0};
+    double dJitterMaxUs{0.0};
+
+    // Time the muxer spent waiting for buffer space.
+    std::chrono::nanoseconds blockedTime{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Live output: the muxer writes into a byte buffer through a custom
+// AVIOContext, and a sender thread sends it as 7 x 188 byte datagrams to a
+// UDP address ("udp://host:port") or writes it to stdout ("-"), one
+// datagram every 1316 * 8 / rate seconds on an absolute CLOCK_MONOTONIC
+// schedule (clock_nanosleep), so the stream leaves at line rate rather than
+// in the muxer's bursts.
+class PacedTsOutput
+{
+public:
+    explicit PacedTsOutput(const PacedOutputConfig &config);
+    ~PacedTsOutput();
+
+    PacedTsOutput(const PacedTsOutput &) = delete;
+    PacedTsOutput &operator=(const PacedTsOutput &) = delete;
+
+    static bool is_live_target(const std::string &strTarget);
+
+    bool open(const std::string &strTarget);
+
+    // Flushes the AVIOContext and sends everything still buffered.
+    // Returns false if any send failed.
+    bool close();
+
+    AVIOContext *context() const { return m_pAvioCtx; }
+
+    PacedOutputStats stats() const;
+
+private:
+    static int write_packet(void *pOpaque, uint8_t *pBuf, int nBufSize);
+
+    int write(const uint8_t *pBuf, std::size_t nSize);
+    void sender_thread();
+    bool send_datagrams(const uint8_t *pData, std::size_t nSize);
+
+    const PacedOutputConfig m_config;
+    const double m_dGapNs;
+    const std::size_t m_nPrefillBytes;
+
+    int m_fd{-1};
+    bool m_bOwnFd{false};
+    bool m_bUdp{false};
+    sockaddr_storage m_addr{};
+    socklen_t m_nAddrLen{0};
+    AVIOContext *m_pAvioCtx{nullptr};
+
+    // Ring buffer, guarded by m_mtx.
+    mutable std::mutex m_mtx;
+    std::condition_variable m_cvData;
+    std::condition_variable m_cvSpace;
+    std::vector<uint8_t> m_vecRing;
+    std::size_t m_nHead{0};
+    std::size_t m_nUsed{0};
+    bool m_bClosing{false};
+    bool m_bError{false};
+
+    PacedOutputStats m_stats;
+    double m_dJitterSumSq{0.0};
+
+    std::thread m_thSender;
+};
+
+//////////////////////////////////////////////////////////////////////////
+void print_paced_output_stats(const PacedOutputStats &stats);
@@ -0,0 +1,1736 @@
+#include "pipeline.hpp"
+#include "frame_analysis.hpp"
+#include "frame_pool.hpp"
+#include "media_utils.hpp"
+#include "pixel_convert.hpp"
+#include "quality_meter.hpp"
+#include "shm_frame_ring.hpp"
+#include "spsc_queue.hpp"
+#include "telemetry.hpp"
+#include "vbv_model.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+}
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+//////////////////////////////////////////////////////////////////////////
+int64_t elapsed_ns(const Clock::time_point tStart)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - tStart).count();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// x264 reports the picture type in the packet's quality stats side data.
+char packet_frame_type(const AVPacket *pPkt)
+{
+    int nSize{};
+    const uint8_t *pStats = av_packet_get_side_data(pPkt, AV_PKT_DATA_QUALITY_STATS, &nSize);
+    if (pStats != nullptr && nSize >= 5)
+    {
+        return av_get_picture_type_char(static_cast<AVPictureType>(pStats[4]));
+    }
+    return (pPkt->flags & AV_PKT_FLAG_KEY) ? 'I' : '?';
+}
+
+//////////////////////////////////////////////////////////////////////////
+int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Frames between the encoder input and the muxer, beyond the packet queue,
+// that the capture time table has to cover: lookahead, B-frames and frame
+// threads.
+constexpr std::size_t g_nMaxEncoderDelay = 1024;
+
+//////////////////////////////////////////////////////////////////////////
+// A sampled frame on its way to the quality meter, with its frame number.
+struct QualitySource
+{
+    int64_t nFrame{0};
+    FrameRef apFrame;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Per-output state: the decoded frames waiting for this output's encoder,
+// and its encoded packets waiting for the muxer.
+struct OutputState
+{
+    OutputState(const PipelineConfig &config, const PipelineOutput &output)
+        : target(output),
+          nQualityInterval(config.quality.nInterval),
+          encodedPool(config.nPacketQueueDepth + 2),
+          qualityPool(config.quality.nInterval > 0 ? config.nPacketQueueDepth + 2 : 1),
+          decoded(config.nFrameQueueDepth),
+          encoded(config.nPacketQueueDepth),
+          passthrough(config.vecPassthroughStreams.empty() ? 1 : config.nPassthroughQueueDepth),
+          qualitySources(config.quality.nInterval > 0 ? config.quality.nSourceQueueDepth : 1),
+          qualityPackets(config.quality.nInterval > 0 ? config.nPacketQueueDepth : 1),
+          vbv(output.pStatmux != nullptr ? VbvConfig{} : VbvModel::config_from_encoder(output.pCdcCtx, config.bVbvFailFast),
+              output.pCdcCtx->time_base)
+    {
+    }
+
+    const PipelineOutput target;
+    const int nQualityInterval;
+
+    PacketPool encodedPool;
+    PacketPool qualityPool;
+
+    SpscQueue<FrameRef> decoded;
+    SpscQueue<PacketRef> encoded;
+
+    // Passthrough packets, shared with the other outputs; mux thread only
+    // past the queue. The muxer gets a reference of its own to consume.
+    SpscQueue<PacketRef> passthrough;
+    PacketPtr apPassthroughLocal{av_packet_alloc()};
+    bool bPassthroughEos{false};
+    uint64_t nPassthroughPackets{0};
+    uint64_t nPassthroughDropped{0};
+    // Demux thread: packets that found the queue full before the first
+    // frame had fixed the output time zero.
+    std::atomic<uint64_t> nPassthroughOverflow{0};
+
+    // Quality metering only: every nQualityInterval-th frame the encoder
+    // is given, unless the queue is full, and a reference of its own to
+    // every packet it emits, for the quality thread. Its stats once done.
+    SpscQueue<QualitySource> qualitySources;
+    SpscQueue<PacketRef> qualityPackets;
+    QualityStats qualityStats;
+
+    VbvModel vbv;
+    bool bEos{false};
+
+    // Encode thread: frames encoded and the time spent in the encoder
+    // calls, which leaves out start-up and waiting for decoded frames.
+    uint64_t nEncodedFrames{0};
+    int64_t nEncodeNs{0};
+
+    uint8_t nIndex{0};
+    TelemetryChannel *pEncodeTelemetry{nullptr};
+    TelemetryChannel *pMuxTelemetry{nullptr};
+
+    // Deadline mode only; used by the encode thread. The encode-side VBV
+    // model tells a replacement encoder where to start its buffer.
+    std::unique_ptr<DeadlineController> apDeadline;
+    std::unique_ptr<VbvModel> apEncodeVbv;
+    int64_t nLastDts{0};
+
+    // Latency measurement only. The encode thread files each frame's
+    // capture time under its frame number before sending it; the mux
+    // thread looks it up once the packet with that PTS has been popped, so
+    // the queue orders the two. vecLatencyNs is the mux thread's.
+    std::vector<int64_t> vecCaptureNs;
+    std::vector<int64_t> vecLatencyNs;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// State shared between the stage threads. An empty Ref travelling through a
+// queue marks end of stream.
+//
+// Each pool holds enough shells to fill its queue plus the one item each
+// neighbouring stage may be working on, so steady state never allocates.
+// Decoded frames are shared by every output, so the frame pool only has to
+// cover the fullest frame queue plus one frame per encoder; the
+// pre-analysis adds its own queue, its window and the previous frame, and
+// each quality meter its source queue and the frame it is copying.
+struct PipelineState
+{
+    PipelineState(const PipelineConfig &config, const std::vector<PipelineOutput> &vecTargets)
+        : demuxPool(config.nDemuxQueueDepth + 2),
+          framePool(config.nFrameQueueDepth + vecTargets.size() + 1
+                    + (config.analysis.nLookahead > 0 ? config.nFrameQueueDepth + static_cast<std::size_t>(config.analysis.nLookahead) + 2 : 0)
+                    + (config.quality.nInterval > 0 ? vecTargets.size() * (config.quality.nSourceQueueDepth + 1) : 0)),
+          passthroughPool(config.vecPassthroughStreams.empty() ? 1 : config.nPassthroughQueueDepth + 2),
+          demuxed(config.nDemuxQueueDepth),
+          analysisQueue(config.analysis.nLookahead > 0 ? config.nFrameQueueDepth : 1),
+          analysisConfig(config.analysis),
+          qualityConfig(config.quality),
+          eConvertMethod(config.eConvertMethod),
+          nRangeStart(config.nRangeStart),
+          nRangeEnd(config.nRangeEnd),
+          pPlacement(config.pPlacement)
+    {
+        if (!config.strTelemetryPath.empty() || config.bLatencyHistograms)
+        {
+            TelemetryConfig telemetryConfig{};
+            telemetryConfig.strPath = config.strTelemetryPath;
+            apTelemetry = std::make_unique<Telemetry>(telemetryConfig);
+            pDemuxTelemetry = apTelemetry->add_channel();
+            pDecodeTelemetry = apTelemetry->add_channel();
+        }
+
+        for (const PipelineOutput &target : vecTargets)
+        {
+            auto apOutput = std::make_unique<OutputState>(config, target);
+            apOutput->nIndex = static_cast<uint8_t>(vecOutputs.size());
+            if (apTelemetry)
+            {
+                apOutput->pEncodeTelemetry = apTelemetry->add_channel();
+                apOutput->pMuxTelemetry = apTelemetry->add_channel();
+            }
+            if (config.bMeasureLatency)
+            {
+                apOutput->vecCaptureNs.resize(config.nPacketQueueDepth + g_nMaxEncoderDelay, AV_NOPTS_VALUE);
+            }
+            if (config.deadline.bEnabled && target.fnReopenEncoder)
+            {
+                apOutput->apDeadline = std::make_unique<DeadlineController>(config.deadline, target.pCdcCtx->framerate);
+                apOutput->apEncodeVbv = std::make_unique<VbvModel>(VbvModel::config_from_encoder(target.pCdcCtx, false),
+                                                                   target.pCdcCtx->time_base);
+            }
+            vecOutputs.push_back(std::move(apOutput));
+        }
+    }
+
+    // Frames without a timestamp are kept.
+    bool in_range(const int64_t nPts) const
+    {
+        return nPts == AV_NOPTS_VALUE
+            || ((nRangeStart == AV_NOPTS_VALUE || nPts >= nRangeStart) && (nRangeEnd == AV_NOPTS_VALUE || nPts < nRangeEnd));
+    }
+
+    // Maps the passthrough input streams to their slot in the outputs'
+    // passthrough stream lists, and starts the video timeline at the
+    // stream's start until the first frame is decoded.
+    void init_passthrough(const AVFormatContext *pFmtCtxIn, const int nStreamIdxIn, const std::vector<int> &vecStreams)
+    {
+        const AVStream *pStVideo = pFmtCtxIn->streams[nStreamIdxIn];
+        videoTimeBase = pStVideo->time_base;
+        nVideoOriginUs.store(pStVideo->start_time != AV_NOPTS_VALUE ? av_rescale_q(pStVideo->start_time, videoTimeBase, AV_TIME_BASE_Q) : 0);
+
+        vecPassthroughSlots.assign(pFmtCtxIn->nb_streams, -1);
+        for (std::size_t i = 0; i < vecStreams.size(); ++i)
+        {
+            vecPassthroughSlots[static_cast<std::size_t>(vecStreams[i])] = static_cast<int>(i);
+            vecPassthroughTimeBases.push_back(pFmtCtxIn->streams[vecStreams[i]]->time_base);
+        }
+    }
+
+    void fail()
+    {
+        bFailed.store(true);
+        demuxPool.abort();
+        framePool.abort();
+        passthroughPool.abort();
+        demuxed.abort();
+        analysisQueue.abort();
+        for (auto &apOutput : vecOutputs)
+        {
+            apOutput->encodedPool.abort();
+            apOutput->decoded.abort();
+            apOutput->encoded.abort();
+            apOutput->passthrough.abort();
+            apOutput->qualityPool.abort();
+            apOutput->qualitySources.abort();
+            apOutput->qualityPackets.abort();
+        }
+    }
+
+    // Declared ahead of the queues so that they outlive any Ref left queued.
+    PacketPool demuxPool;
+    FramePool framePool;
+    PacketPool passthroughPool;
+
+    SpscQueue<PacketRef> demuxed;
+    std::vector<std::unique_ptr<OutputState>> vecOutputs;
+
+    // Pre-analysis only: decoded frames waiting to be analysed, and the
+    // analysis thread's totals once it is done.
+    SpscQueue<FrameRef> analysisQueue;
+    const FrameAnalysisConfig analysisConfig;
+    FrameAnalysisStats analysisStats;
+
+    const QualityConfig qualityConfig;
+
+    // Null unless telemetry was asked for; the stages only record if it is set.
+    std::unique_ptr<Telemetry> apTelemetry;
+    TelemetryChannel *pDemuxTelemetry{nullptr};
+    TelemetryChannel *pDecodeTelemetry{nullptr};
+
+    // Created by the decode thread on the first frame that is not already
+    // 8-bit 4:2:0.
+    const ConvertMethod eConvertMethod;
+    std::unique_ptr<PixelConverter> apConverter;
+    FramePtr apConvertScratch;
+
+    const int64_t nRangeStart;
+    const int64_t nRangeEnd;
+
+    // Decoded frames outside the range; decode thread only.
+    uint64_t nDroppedFrames{0};
+
+    // Passthrough slot per input stream (-1 = dropped) and time bases.
+    std::vector<int> vecPassthroughSlots;
+    std::vector<AVRational> vecPassthroughTimeBases;
+
+    // Input time of the first frame to reach the encoders: output time zero
+    // for the passthrough streams. Set by the decode thread before that
+    // frame is queued; the mux threads write passthrough packets only once
+    // it is.
+    AVRational videoTimeBase{1, 1};
+    std::atomic<int64_t> nVideoOriginUs{0};
+    std::atomic<bool> bVideoOriginSet{false};
+
+    ThreadPlacement *const pPlacement;
+
+    std::atomic<bool> bFailed{false};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Hands a passthrough packet to every output, moving its payload reference
+// rather than copying it; packets of other streams are dropped. Until the
+// first frame has set the video origin the muxers cannot take passthrough
+// packets, so a full queue drops the packet instead of holding up the
+// video behind it. Returns false once the pipeline has been aborted.
+bool route_passthrough(PacketRef &inout_apPkt, PipelineState &state)
+{
+    const auto nStreamIdx = static_cast<std::size_t>(inout_apPkt->stream_index);
+    if (nStreamIdx >= state.vecPassthroughSlots.size() || state.vecPassthroughSlots[nStreamIdx] < 0)
+    {
+        return true;
+    }
+
+    PacketRef apShared = state.passthroughPool.acquire();
+    if (!apShared)
+    {
+        return false;
+    }
+    av_packet_move_ref(apShared.get(), inout_apPkt.get());
+
+    const bool bOriginSet = state.bVideoOriginSet.load();
+    for (auto &apOutput : state.vecOutputs)
+    {
+        PacketRef apRef = apShared;
+        if (!bOriginSet)
+        {
+            if (!apOutput->passthrough.try_push(apRef))
+            {
+                ++apOutput->nPassthroughOverflow;
+            }
+        }
+        else if (!apOutput->passthrough.push(apRef))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void demux_stage(AVFormatContext *pFmtCtxIn, const int nStreamIdx, PipelineState &state)
+{
+    const ThreadPlacement::Scope placement{state.pPlacement, ThreadStage::Demux};
+
+    // After a seek the decoder can only start on a keyframe.
+    bool bWaitKeyframe = state.nRangeStart != AV_NOPTS_VALUE;
+
+    while (true)
+    {
+        PacketRef apPkt = state.demuxPool.acquire();
+        if (!apPkt)
+        {
+            // Pool aborted.
+            return;
+        }
+
+        const Clock::time_point tStart = Clock::now();
+        if (int ret = av_read_frame(pFmtCtxIn, apPkt.get()); ret < 0)
+        {
+            // This is probably EOF?? Either way, tell our decoder there is nothing more.
+            if (ret != AVERROR_EOF)
+            {
+                std::cerr << "av_read_frame stopped early: "
+                          << error_code_to_string(ret)
+                          << std::endl;
+            }
+            break;
+        }
+
+        // Make sure this is our video index.
+        if (apPkt->stream_index != nStreamIdx)
+        {
+            if (!route_passthrough(apPkt, state))
+            {
+                return;
+            }
+            continue;
+        }
+
+        if (bWaitKeyframe)
+        {
+            if (!(apPkt->flags & AV_PKT_FLAG_KEY))
+            {
+                continue;
+            }
+            bWaitKeyframe = false;
+        }
+
+        // Decode order has passed the range: every frame presented before
+        // its end has a smaller DTS and has already been read.
+        if (state.nRangeEnd != AV_NOPTS_VALUE)
+        {
+            const int64_t nDts = apPkt->dts != AV_NOPTS_VALUE ? apPkt->dts : apPkt->pts;
+            if (nDts != AV_NOPTS_VALUE && nDts >= state.nRangeEnd)
+            {
+                break;
+            }
+        }
+
+        TelemetryRecord rec{};
+        if (state.pDemuxTelemetry != nullptr)
+        {
+            rec.eStage = TelemetryStage::Demux;
+            rec.nDurationNs = elapsed_ns(tStart);
+            rec.nPts = apPkt->pts;
+            rec.nDts = apPkt->dts;
+            rec.nSize = apPkt->size;
+            rec.cFrameType = (apPkt->flags & AV_PKT_FLAG_KEY) ? 'I' : '?';
+        }
+
+        if (!state.demuxed.push(apPkt))
+        {
+            return;
+        }
+
+        if (state.pDemuxTelemetry != nullptr)
+        {
+            rec.nQueueDepth = static_cast<uint16_t>(state.demuxed.size());
+            state.pDemuxTelemetry->record(rec);
+        }
+    }
+
+    for (auto &apOutput : state.vecOutputs)
+    {
+        PacketRef apPassthroughEos{};
+        apOutput->passthrough.push(apPassthroughEos);
+    }
+
+    PacketRef apEos{};
+    state.demuxed.push(apEos);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// The encoders are all configured alike; chroma is downsampled per field
+// whenever they code interlaced.
+bool create_converter(const AVFrame *pFrame, PipelineState &state)
+{
+    const AVCodecContext *pCdcCtxOut = state.vecOutputs.front()->target.pCdcCtx;
+    const bool bInterlaced = pCdcCtxOut->field_order != AV_FIELD_PROGRESSIVE && pCdcCtxOut->field_order != AV_FIELD_UNKNOWN;
+
+    const auto ePixFmt = static_cast<AVPixelFormat>(pFrame->format);
+    if (!PixelConverter::supported(ePixFmt))
+    {
+        const char *pszName = av_get_pix_fmt_name(ePixFmt);
+        std::cerr << "Unsupported decoder pixel format: " << (pszName != nullptr ? pszName : "unknown") << std::endl;
+        return false;
+    }
+
+    state.apConvertScratch.reset(av_frame_alloc());
+    state.apConverter = std::make_unique<PixelConverter>(pFrame->width, pFrame->height, bInterlaced, state.eConvertMethod);
+    if (!state.apConvertScratch)
+    {
+        return false;
+    }
+
+    std::cout << "Converting "
+              << av_get_pix_fmt_name(ePixFmt)
+              << " to yuv420p ("
+              << (bInterlaced ? "field-based chroma, " : "")
+              << state.apConverter->description()
+              << ")"
+              << std::endl;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// From here on the frame is read-only; every output gets a reference.
+bool fan_out_frame(FrameRef &inout_apFrame, PipelineState &state)
+{
+    for (auto &apOutput : state.vecOutputs)
+    {
+        FrameRef apShared = inout_apFrame;
+        if (!apOutput->decoded.push(apShared))
+        {
+            return false;
+        }
+    }
+    inout_apFrame.reset();
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Passes a decoded frame (or the end of stream) on to the pre-analysis if
+// it runs, otherwise straight to the encoders.
+bool hand_off_decoded(FrameRef &inout_apFrame, PipelineState &state)
+{
+    if (state.analysisConfig.nLookahead > 0)
+    {
+        return state.analysisQueue.push(inout_apFrame);
+    }
+    return fan_out_frame(inout_apFrame, state);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Brings a source picture into the form the encoders take (8-bit 4:2:0,
+// no timestamps or frame types of its own) and hands it off. Returns 0, or
+// a negative AVERROR.
+int hand_off_picture(FrameRef &inout_apFrame, PipelineState &state)
+{
+    if (inout_apFrame->format != AV_PIX_FMT_YUV420P)
+    {
+        if (!state.apConverter && !create_converter(inout_apFrame.get(), state))
+        {
+            return AVERROR(EINVAL);
+        }
+        if (!state.apConverter->convert_in_place(inout_apFrame.get(), state.apConvertScratch.get()))
+        {
+            return AVERROR(EINVAL);
+        }
+    }
+
+    inout_apFrame->pts = AV_NOPTS_VALUE;
+    inout_apFrame->pkt_dts = AV_NOPTS_VALUE;
+    inout_apFrame->pkt_pos = -1;
+    inout_apFrame->pkt_size = -1;
+    inout_apFrame->pkt_duration = 0;
+
+    inout_apFrame->key_frame = 0;
+    inout_apFrame->pict_type = AV_PICTURE_TYPE_NONE;
+
+    return hand_off_decoded(inout_apFrame, state) ? 0 : AVERROR_EXIT;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Pulls every frame the decoder has ready. Returns AVERROR(EAGAIN) when the
+// decoder needs more input, AVERROR_EOF once fully flushed.
+int receive_decoded_frames(AVCodecContext *pCdcCtxIn, PipelineState &state)
+{
+    while (true)
+    {
+        // On EAGAIN the frame simply goes back to the pool, so polling the
+        // decoder costs no allocation.
+        FrameRef apFrame = state.framePool.acquire();
+        if (!apFrame)
+        {
+            return AVERROR_EXIT;
+        }
+
+        if (int ret = avcodec_receive_frame(pCdcCtxIn, apFrame.get()); ret != 0)
+        {
+            return ret;
+        }
+
+        if (!state.in_range(apFrame->best_effort_timestamp))
+        {
+            ++state.nDroppedFrames;
+            continue;
+        }
+
+        if (!state.bVideoOriginSet)
+        {
+            if (apFrame->best_effort_timestamp != AV_NOPTS_VALUE)
+            {
+                state.nVideoOriginUs.store(av_rescale_q(apFrame->best_effort_timestamp, state.videoTimeBase, AV_TIME_BASE_Q));
+            }
+            state.bVideoOriginSet.store(true);
+        }
+
+        if (int ret = hand_off_picture(apFrame, state); ret < 0)
+        {
+            return ret;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void decode_stage(AVCodecContext *pCdcCtxIn, const bool bMeasureLatency, PipelineState &state)
+{
+    const ThreadPlacement::Scope placement{state.pPlacement, ThreadStage::Decode};
+
+    PacketRef apPkt{};
+    while (state.demuxed.pop(apPkt))
+    {
+        const bool bRecord = state.pDecodeTelemetry != nullptr && apPkt;
+        TelemetryRecord rec{};
+        if (bRecord)
+        {
+            rec.eStage = TelemetryStage::Decode;
+            rec.nPts = apPkt->pts;
+            rec.nDts = apPkt->dts;
+            rec.nSize = apPkt->size;
+            rec.cFrameType = (apPkt->flags & AV_PKT_FLAG_KEY) ? 'I' : '?';
+        }
+        const Clock::time_point tStart = Clock::now();
+
+        // The decoder hands reordered_opaque on to the frame decoded from
+        // this packet: that is the frame's capture time.
+        if (bMeasureLatency)
+        {
+            pCdcCtxIn->reordered_opaque = now_ns();
+        }
+
+        // An empty Ref (nullptr) puts the decoder into draining mode.
+        int ret = avcodec_send_packet(pCdcCtxIn, apPkt.get());
+        while (ret == AVERROR(EAGAIN))
+        {
+            // Decoder is full; make room and try again.
+            if (int retRecv = receive_decoded_frames(pCdcCtxIn, state); retRecv != AVERROR(EAGAIN))
+            {
+                ret = retRecv;
+                break;
+            }
+            ret = avcodec_send_packet(pCdcCtxIn, apPkt.get());
+        }
+        apPkt.reset();
+
+        if (ret < 0 && ret != AVERROR_EOF)
+        {
+            if (ret != AVERROR_EXIT)
+            {
+                std::cerr << "Unexpected error received from decoder (avcodec_send_packet): "
+                          << error_code_to_string(ret)
+                          << ". Cannot continue."
+                          << std::endl;
+            }
+            state.fail();
+            return;
+        }
+
+        ret = receive_decoded_frames(pCdcCtxIn, state);
+        if (bRecord)
+        {
+            std::size_t nDepth = 0;
+            for (const auto &apOutput : state.vecOutputs)
+            {
+                nDepth = std::max(nDepth, apOutput->decoded.size());
+            }
+            rec.nDurationNs = elapsed_ns(tStart);
+            rec.nQueueDepth = static_cast<uint16_t>(nDepth);
+            state.pDecodeTelemetry->record(rec);
+        }
+
+        if (ret == AVERROR_EOF)
+        {
+            // We are done here.
+            FrameRef apEos{};
+            hand_off_decoded(apEos, state);
+            return;
+        }
+        if (ret != AVERROR(EAGAIN))
+        {
+            if (ret != AVERROR_EXIT)
+            {
+                std::cerr << "Unexpected error received from decoder (avcodec_receive_frame): "
+                          << error_code_to_string(ret)
+                          << ". Cannot continue."
+                          << std::endl;
+            }
+            state.fail();
+            return;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Shared-memory ingest, in place of demux and decode: each picture the
+// capture process publishes is referenced in its ring slot, not copied, and
+// handed on. The slot goes back to the producer once the encoders have all
+// taken the picture in. The capture time travels in reordered_opaque, so
+// latency is measured from capture.
+void ingest_stage(ShmFrameRing &ring, PipelineState &state)
+{
+    const ThreadPlacement::Scope placement{state.pPlacement, ThreadStage::Decode};
+
+    while (true)
+    {
+        FrameRef apFrame = state.framePool.acquire();
+        if (!apFrame)
+        {
+            return;
+        }
+
+        const ShmFrameRing::Status eStatus = ring.acquire(apFrame.get(), state.bFailed);
+        if (eStatus == ShmFrameRing::Status::Eos)
+        {
+            FrameRef apEos{};
+            hand_off_decoded(apEos, state);
+            return;
+        }
+        if (eStatus != ShmFrameRing::Status::Frame)
+        {
+            state.fail();
+            return;
+        }
+
+        const bool bRecord = state.pDecodeTelemetry != nullptr;
+        TelemetryRecord rec{};
+        if (bRecord)
+        {
+            rec.eStage = TelemetryStage::Decode;
+            rec.nPts = apFrame->best_effort_timestamp;
+            rec.nDts = apFrame->best_effort_timestamp;
+            rec.cFrameType = '?';
+        }
+        const Clock::time_point tStart = Clock::now();
+
+        if (int ret = hand_off_picture(apFrame, state); ret < 0)
+        {
+            state.fail();
+            return;
+        }
+
+        if (bRecord)
+        {
+            std::size_t nDepth = 0;
+            for (const auto &apOutput : state.vecOutputs)
+            {
+                nDepth = std::max(nDepth, apOutput->decoded.size());
+            }
+            rec.nDurationNs = elapsed_ns(tStart);
+            rec.nQueueDepth = static_cast<uint16_t>(nDepth);
+            state.pDecodeTelemetry->record(rec);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Pre-analysis: costs each decoded frame as it arrives and releases it to
+// the encoders nLookahead frames later, with QP hints attached. Runs on
+// the decode CPUs; the frames are modified before anything else sees them.
+void analysis_stage(PipelineState &state)
+{
+    const ThreadPlacement::Scope placement{state.pPlacement, ThreadStage::Decode};
+    const auto nLookahead = static_cast<std::size_t>(state.analysisConfig.nLookahead);
+
+    struct WindowEntry
+    {
+        FrameRef apFrame;
+        FrameComplexity complexity;
+    };
+
+    // A ring of nLookahead + 1 entries, so the per-macroblock costs are
+    // only allocated once.
+    std::vector<WindowEntry> vecWindow(nLookahead + 1);
+    std::size_t nHead{0};
+    std::size_t nCount{0};
+    std::unique_ptr<FrameAnalyzer> apAnalyzer;
+
+    const auto release_oldest = [&]() -> bool
+    {
+        // The frames after the oldest, i.e. the ones still to come.
+        WindowEntry &oldest = vecWindow[nHead];
+        double dComingCost = static_cast<double>(oldest.complexity.nCost);
+        if (nCount > 1)
+        {
+            uint64_t nComingSum{0};
+            for (std::size_t i = 1; i < nCount; ++i)
+            {
+                nComingSum += vecWindow[(nHead + i) % vecWindow.size()].complexity.nCost;
+            }
+            dComingCost = static_cast<double>(nComingSum) / static_cast<double>(nCount - 1);
+        }
+
+        if (!apAnalyzer->attach_hints(oldest.apFrame.get(), oldest.complexity, dComingCost))
+        {
+            return false;
+        }
+        nHead = (nHead + 1) % vecWindow.size();
+        --nCount;
+        return fan_out_frame(oldest.apFrame, state);
+    };
+
+    FrameRef apFrame{};
+    bool bEos{false};
+    while (state.analysisQueue.pop(apFrame))
+    {
+        if (!apFrame)
+        {
+            bEos = true;
+            break;
+        }
+
+        if (!apAnalyzer)
+        {
+            apAnalyzer = std::make_unique<FrameAnalyzer>(apFrame->width, apFrame->height, state.analysisConfig);
+            std::cout << "Pre-analysis "
+                      << nLookahead
+                      << " frames ahead ("
+                      << simd_level_name(apAnalyzer->simd_level())
+                      << ")"
+                      << std::endl;
+        }
+
+        WindowEntry &newest = vecWindow[(nHead + nCount) % vecWindow.size()];
+        newest.apFrame = std::move(apFrame);
+        apAnalyzer->analyze(newest.apFrame.get(), newest.complexity);
+        ++nCount;
+
+        if (nCount > nLookahead && !release_oldest())
+        {
+            state.fail();
+            return;
+        }
+    }
+
+    if (bEos)
+    {
+        while (nCount > 0)
+        {
+            if (!release_oldest())
+            {
+                state.fail();
+                return;
+            }
+        }
+        FrameRef apEos{};
+        fan_out_frame(apEos, state);
+    }
+    if (apAnalyzer)
+    {
+        state.analysisStats = apAnalyzer->stats();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Hands the quality thread a reference of its own to an encoded packet.
+bool queue_for_quality(OutputState &output, const AVPacket *pPkt)
+{
+    PacketRef apRef = output.qualityPool.acquire();
+    if (!apRef)
+    {
+        return false;
+    }
+    if (int ret = av_packet_ref(apRef.get(), pPkt); ret < 0)
+    {
+        std::cerr << "Could not reference encoded packet for the quality meter: " << error_code_to_string(ret) << std::endl;
+        return false;
+    }
+    return output.qualityPackets.push(apRef);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Drains every packet the encoder has ready, rather than one per frame sent.
+int receive_encoded_packets(AVCodecContext *pCdcCtxOut, OutputState &output)
+{
+    while (true)
+    {
+        PacketRef apPkt = output.encodedPool.acquire();
+        if (!apPkt)
+        {
+            return AVERROR_EXIT;
+        }
+
+        if (int ret = avcodec_receive_packet(pCdcCtxOut, apPkt.get()); ret != 0)
+        {
+            return ret;
+        }
+
+        if (output.target.pStatmux != nullptr)
+        {
+            output.target.pStatmux->add_packet(output.target.nStatmuxChannel, apPkt.get());
+        }
+
+        if (output.nQualityInterval > 0 && !queue_for_quality(output, apPkt.get()))
+        {
+            return AVERROR_EXIT;
+        }
+
+        if (output.apEncodeVbv)
+        {
+            VbvFrameState vbvState{};
+            output.apEncodeVbv->add_frame(apPkt->dts, apPkt->size, vbvState);
+            output.nLastDts = apPkt->dts;
+        }
+
+        if (!output.encoded.push(apPkt))
+        {
+            return AVERROR_EXIT;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Deadline mode: drains the current encoder completely (its stream ends on
+// a closed GOP) and carries on with a new one at the controller's level.
+// The new encoder starts from the VBV fullness the old one left behind.
+bool swap_encoder(OutputState &output, AVCodecContext *&inout_pCdcCtxOut, CodecContextPtr &inout_apOwned)
+{
+    if (int ret = avcodec_send_frame(inout_pCdcCtxOut, nullptr); ret < 0)
+    {
+        std::cerr << "Could not flush encoder for level change: "
+                  << error_code_to_string(ret)
+                  << std::endl;
+        return false;
+    }
+    if (int ret = receive_encoded_packets(inout_pCdcCtxOut, output); ret != AVERROR_EOF)
+    {
+        if (ret != AVERROR_EXIT)
+        {
+            std::cerr << "Unexpected error flushing encoder for level change: "
+                      << error_code_to_string(ret)
+                      << std::endl;
+        }
+        return false;
+    }
+
+    const int64_t nNextDts = output.nLastDts + inout_pCdcCtxOut->time_base.num;
+    const int64_t nOccupancy = std::llround(output.apEncodeVbv->fullness_at(nNextDts));
+
+    CodecContextPtr apCdcCtx;
+    if (!output.target.fnReopenEncoder(output.apDeadline->level(), nOccupancy, apCdcCtx))
+    {
+        std::cerr << "Could not reopen encoder at level " << output.apDeadline->level() << std::endl;
+        return false;
+    }
+
+    inout_apOwned = std::move(apCdcCtx);
+    inout_pCdcCtxOut = inout_apOwned.get();
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void encode_stage(OutputState &output, PipelineState &state)
+{
+    const ThreadPlacement::Scope placement{state.pPlacement, ThreadStage::Encode};
+    AVCodecContext *pCdcCtxOut = output.target.pCdcCtx;
+    int64_t nTimebase{0};
+    int64_t nFrames{0};
+
+    // Owns the encoder once deadline mode has replaced the original one.
+    CodecContextPtr apSwapped;
+
+    // The decoded frame is shared with the other outputs, so the PTS goes on
+    // a reference of our own rather than on the frame itself.
+    FramePtr apLocal{av_frame_alloc()};
+    if (!apLocal)
+    {
+        state.fail();
+        return;
+    }
+
+    FrameRef apFrame{};
+    while (output.decoded.pop(apFrame))
+    {
+        if (apFrame && output.apDeadline && nFrames > 0 && pCdcCtxOut->gop_size > 0 && nFrames % pCdcCtxOut->gop_size == 0
+            && output.apDeadline->on_gop_boundary())
+        {
+            if (!swap_encoder(output, pCdcCtxOut, apSwapped))
+            {
+                state.fail();
+                return;
+            }
+        }
+
+        // libx264 reconfigures x264 when it sees the rate change.
+        if (apFrame && output.target.pStatmux != nullptr && pCdcCtxOut->gop_size > 0 && nFrames % pCdcCtxOut->gop_size == 0)
+        {
+            const auto nGop = static_cast<uint64_t>(nFrames / pCdcCtxOut->gop_size);
+            const int64_t nRate = output.target.pStatmux->rate_for_gop(output.target.nStatmuxChannel, nGop);
+            pCdcCtxOut->bit_rate = nRate;
+            pCdcCtxOut->rc_max_rate = nRate;
+        }
+
+        AVFrame *pSend{nullptr};
+        if (apFrame)
+        {
+            if (int ret = av_frame_ref(apLocal.get(), apFrame.get()); ret < 0)
+            {
+                std::cerr << "Could not reference decoded frame. Cannot continue. Error: "
+                          << error_code_to_string(ret)
+                          << std::endl;
+                state.fail();
+                return;
+            }
+            apLocal->pts = nTimebase;
+            pSend = apLocal.get();
+
+            // libavcodec's libx264 wrapper skips the regions of frames
+            // flagged as interlaced. x264 indexes its quant offsets by frame
+            // macroblock either way, so this output's reference drops the
+            // flag; the shared frame keeps it.
+            if (av_frame_get_side_data(apLocal.get(), AV_FRAME_DATA_REGIONS_OF_INTEREST) != nullptr)
+            {
+                apLocal->interlaced_frame = 0;
+            }
+
+            if (!output.vecCaptureNs.empty())
+            {
+                output.vecCaptureNs[static_cast<std::size_t>(nFrames) % output.vecCaptureNs.size()] = apFrame->reordered_opaque;
+            }
+
+            // Skipped rather than waited for while the meter is behind.
+            if (output.nQualityInterval > 0 && nFrames % output.nQualityInterval == 0)
+            {
+                QualitySource source{nFrames, apFrame};
+                output.qualitySources.try_push(source);
+            }
+        }
+        const Clock::time_point tStart = Clock::now();
+
+        // A null frame signals EOF to the encoder.
+        int ret = avcodec_send_frame(pCdcCtxOut, pSend);
+        while (ret == AVERROR(EAGAIN))
+        {
+            if (int retRecv = receive_encoded_packets(pCdcCtxOut, output); retRecv != AVERROR(EAGAIN))
+            {
+                ret = retRecv;
+                break;
+            }
+            ret = avcodec_send_frame(pCdcCtxOut, pSend);
+        }
+
+        if (pSend && ret == 0)
+        {
+            nTimebase += pCdcCtxOut->time_base.num;
+            ++nFrames;
+        }
+        av_frame_unref(apLocal.get());
+        apFrame.reset();
+
+        if (ret < 0 && ret != AVERROR_EOF)
+        {
+            if (ret != AVERROR_EXIT)
+            {
+                std::cerr << "Unexpected error detected while sending frame to encoder. Cannot continue. Error: "
+                          << error_code_to_string(ret)
+                          << std::endl;
+            }
+            state.fail();
+            return;
+        }
+
+        ret = receive_encoded_packets(pCdcCtxOut, output);
+        const int64_t nEncodeNs = elapsed_ns(tStart);
+        output.nEncodeNs += nEncodeNs;
+        output.nEncodedFrames = static_cast<uint64_t>(nFrames);
+        if (output.apDeadline && pSend)
+        {
+            output.apDeadline->add_frame(nEncodeNs);
+        }
+        if (output.pEncodeTelemetry != nullptr && pSend)
+        {
+            TelemetryRecord rec{};
+            rec.eStage = TelemetryStage::Encode;
+            rec.nOutput = output.nIndex;
+            rec.nDurationNs = nEncodeNs;
+            rec.nPts = nTimebase - pCdcCtxOut->time_base.num;
+            rec.nDts = rec.nPts;
+            rec.nQueueDepth = static_cast<uint16_t>(output.encoded.size());
+            output.pEncodeTelemetry->record(rec);
+        }
+
+        if (ret == AVERROR_EOF)
+        {
+            if (output.target.pStatmux != nullptr)
+            {
+                output.target.pStatmux->finish(output.target.nStatmuxChannel);
+            }
+            if (output.nQualityInterval > 0)
+            {
+                PacketRef apQualityEos{};
+                output.qualityPackets.push(apQualityEos);
+            }
+            PacketRef apEos{};
+            output.encoded.push(apEos);
+            return;
+        }
+        if (ret != AVERROR(EAGAIN))
+        {
+            if (ret != AVERROR_EXIT)
+            {
+                std::cerr << "Unexpected error received packet from encoder. Cannot continue. Error: "
+                          << error_code_to_string(ret)
+                          << std::endl;
+            }
+            state.fail();
+            return;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Quality metering for one output: decodes every packet its encoder
+// emitted and compares the sampled frames with their sources. Runs on the
+// decode CPUs.
+void quality_stage(OutputState &output, PipelineState &state)
+{
+    const ThreadPlacement::Scope placement{state.pPlacement, ThreadStage::Decode};
+    QualityMeter meter{output.target.pCdcCtx, state.qualityConfig};
+    if (!meter.open(output.target.strQualityLogPath))
+    {
+        state.fail();
+        return;
+    }
+
+    QualitySource source{};
+    PacketRef apPkt{};
+    while (output.qualityPackets.pop(apPkt))
+    {
+        // A frame's source is queued before any of its packets.
+        while (output.qualitySources.try_pop(source))
+        {
+            const bool bCopied = meter.add_source(source.nFrame, source.apFrame.get());
+            source.apFrame.reset();
+            if (!bCopied)
+            {
+                state.fail();
+                return;
+            }
+        }
+
+        // The end of stream flushes the decoder.
+        const bool bEos = !apPkt;
+        const bool bMetered = meter.add_packet(apPkt.get());
+        apPkt.reset();
+        if (!bMetered)
+        {
+            state.fail();
+            return;
+        }
+        if (bEos)
+        {
+            break;
+        }
+    }
+
+    output.qualityStats = meter.stats();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writes the queued passthrough packets, or with bUntilEos all of them up
+// to the end of stream. av_interleaved_write_frame() orders them against
+// the video. Packets from before the first encoded frame or after the end
+// of the range are dropped.
+bool write_passthrough(OutputState &output, PipelineState &state, const bool bUntilEos)
+{
+    AVPacket *pLocal = output.apPassthroughLocal.get();
+    PacketRef apPkt{};
+    while (!output.bPassthroughEos && (bUntilEos ? output.passthrough.pop(apPkt) : output.passthrough.try_pop(apPkt)))
+    {
+        if (!apPkt)
+        {
+            output.bPassthroughEos = true;
+            break;
+        }
+
+        const auto nSlot = static_cast<std::size_t>(state.vecPassthroughSlots[static_cast<std::size_t>(apPkt->stream_index)]);
+        const AVRational tbIn = state.vecPassthroughTimeBases[nSlot];
+        const int64_t nOrigin = av_rescale_q(state.nVideoOriginUs.load(), AV_TIME_BASE_Q, tbIn);
+        const int64_t nTs = apPkt->pts != AV_NOPTS_VALUE ? apPkt->pts : apPkt->dts;
+        if (nTs == AV_NOPTS_VALUE
+            || nTs < nOrigin
+            || (state.nRangeEnd != AV_NOPTS_VALUE && av_compare_ts(nTs, tbIn, state.nRangeEnd, state.videoTimeBase) >= 0))
+        {
+            ++output.nPassthroughDropped;
+            continue;
+        }
+
+        if (int ret = av_packet_ref(pLocal, apPkt.get()); ret < 0)
+        {
+            std::cerr << "Could not reference passthrough packet: " << error_code_to_string(ret) << std::endl;
+            return false;
+        }
+        apPkt.reset();
+
+        AVStream *pStOut = output.target.vecPassthroughStreams[nSlot];
+        pLocal->pts = pLocal->pts != AV_NOPTS_VALUE ? pLocal->pts - nOrigin : AV_NOPTS_VALUE;
+        pLocal->dts = pLocal->dts != AV_NOPTS_VALUE ? pLocal->dts - nOrigin : AV_NOPTS_VALUE;
+        av_packet_rescale_ts(pLocal, tbIn, pStOut->time_base);
+        pLocal->stream_index = pStOut->index;
+        pLocal->pos = -1;
+
+        if (int ret = av_interleaved_write_frame(output.target.pFmtCtx, pLocal); ret < 0)
+        {
+            std::cerr << "Unexpected error writing passthrough packet: " << error_code_to_string(ret) << std::endl;
+            av_packet_unref(pLocal);
+            return false;
+        }
+        ++output.nPassthroughPackets;
+    }
+
+    return !bUntilEos || output.bPassthroughEos;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writes one encoded packet to the output's muxer, handing it the payload
+// reference, and records the frame's latency.
+int write_video_packet(OutputState &output, PacketRef &inout_apPkt)
+{
+    const PipelineOutput &target = output.target;
+
+    // PTS is still the frame number times the time base numerator.
+    int64_t nCaptureNs = AV_NOPTS_VALUE;
+    if (!output.vecCaptureNs.empty() && inout_apPkt->pts != AV_NOPTS_VALUE && inout_apPkt->pts >= 0)
+    {
+        const int64_t nFrame = inout_apPkt->pts / target.pCdcCtx->time_base.num;
+        nCaptureNs = output.vecCaptureNs[static_cast<std::size_t>(nFrame) % output.vecCaptureNs.size()];
+    }
+
+    int ret{0};
+    if (target.pTsMuxer != nullptr)
+    {
+        ret = target.pTsMuxer->write_packet(inout_apPkt.get(), target.pCdcCtx->time_base) ? 0 : AVERROR(EIO);
+    }
+    else
+    {
+        av_packet_rescale_ts(inout_apPkt.get(), target.pCdcCtx->time_base, target.pStVideo->time_base);
+        inout_apPkt->stream_index = target.pStVideo->index;
+
+        // The muxer takes over the payload reference; the shell goes back to the pool.
+        ret = av_interleaved_write_frame(target.pFmtCtx, inout_apPkt.get());
+    }
+    inout_apPkt.reset();
+
+    if (ret == 0 && nCaptureNs != AV_NOPTS_VALUE)
+    {
+        output.vecLatencyNs.push_back(now_ns() - nCaptureNs);
+    }
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Waits for the next encoded packet, writing passthrough packets meanwhile:
+// the demuxer may be blocked on a full passthrough queue, and then the
+// decoder and encoder wait for it. Returns false once the queue has been
+// aborted or a passthrough packet could not be written.
+bool pop_encoded(OutputState &output, PipelineState &state, const bool bPassthrough, PacketRef &out_apPkt)
+{
+    while (!output.encoded.try_pop(out_apPkt))
+    {
+        if (output.encoded.aborted())
+        {
+            return false;
+        }
+        if (bPassthrough && state.bVideoOriginSet.load() && output.passthrough.size() > 0)
+        {
+            if (!write_passthrough(output, state, false))
+            {
+                state.fail();
+                return false;
+            }
+            continue;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void mux_stage(OutputState &output, PipelineState &state)
+{
+    const ThreadPlacement::Scope placement{state.pPlacement, ThreadStage::Mux};
+    const PipelineOutput &target = output.target;
+
+    const bool bPassthrough = !target.vecPassthroughStreams.empty();
+
+    PacketRef apPkt{};
+    while (pop_encoded(output, state, bPassthrough, apPkt))
+    {
+        if (!apPkt)
+        {
+            // The demuxer is done, so every passthrough packet is queued.
+            output.bEos = !bPassthrough || write_passthrough(output, state, true);
+            break;
+        }
+
+        if (bPassthrough && !write_passthrough(output, state, false))
+        {
+            state.fail();
+            break;
+        }
+
+        const Clock::time_point tStart = Clock::now();
+        TelemetryRecord rec{};
+        if (output.pMuxTelemetry != nullptr)
+        {
+            rec.eStage = TelemetryStage::Mux;
+            rec.nOutput = output.nIndex;
+            rec.nPts = apPkt->pts;
+            rec.nDts = apPkt->dts;
+            rec.nSize = apPkt->size;
+            rec.cFrameType = packet_frame_type(apPkt.get());
+        }
+
+        // Check the packet against the encoder's VBV while still in the encoder time base.
+        VbvFrameState vbvState{};
+        if (output.vbv.enabled() && !output.vbv.add_frame(apPkt->dts, apPkt->size, vbvState))
+        {
+            std::cerr << "VBV violation with fail-fast enabled. Cannot continue." << std::endl;
+            state.fail();
+            break;
+        }
+
+        if (int ret = write_video_packet(output, apPkt); ret != 0)
+        {
+            std::cerr << "Unexpected error writing packet to IO. Cannot continue. Error: "
+                      << error_code_to_string(ret)
+                      << std::endl;
+            state.fail();
+            break;
+        }
+
+        if (output.pMuxTelemetry != nullptr)
+        {
+            rec.nDurationNs = elapsed_ns(tStart);
+            rec.nQueueDepth = static_cast<uint16_t>(output.encoded.size());
+            output.pMuxTelemetry->record(rec);
+        }
+    }
+
+    // Release anything still blocked on a full queue or empty pool.
+    if (!output.bEos)
+    {
+        state.fail();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// MPTS: merges the programs' encoded packets into their shared muxer in DTS
+// order. Every program still running must have a packet ready before one is
+// written, so av_interleaved_write_frame() has little to reorder. Returns
+// once every program has ended, or one has been aborted.
+void mpts_mux_stage(std::vector<std::unique_ptr<PipelineState>> &vecStates)
+{
+    const ThreadPlacement::Scope placement{vecStates.front()->pPlacement, ThreadStage::Mux};
+    const std::size_t nPrograms = vecStates.size();
+
+    std::vector<PacketRef> vecHeads(nPrograms);
+    while (true)
+    {
+        std::size_t nNext = nPrograms;
+        for (std::size_t i = 0; i < nPrograms; ++i)
+        {
+            OutputState &output = *vecStates[i]->vecOutputs.front();
+            if (output.bEos)
+            {
+                continue;
+            }
+            if (!vecHeads[i])
+            {
+                if (!output.encoded.pop(vecHeads[i]))
+                {
+                    return;
+                }
+                if (!vecHeads[i])
+                {
+                    output.bEos = true;
+                    continue;
+                }
+            }
+
+            if (nNext == nPrograms
+                || av_compare_ts(vecHeads[i]->dts,
+                                 output.target.pCdcCtx->time_base,
+                                 vecHeads[nNext]->dts,
+                                 vecStates[nNext]->vecOutputs.front()->target.pCdcCtx->time_base) < 0)
+            {
+                nNext = i;
+            }
+        }
+        if (nNext == nPrograms)
+        {
+            return;
+        }
+
+        if (int ret = write_video_packet(*vecStates[nNext]->vecOutputs.front(), vecHeads[nNext]); ret != 0)
+        {
+            std::cerr << "Unexpected error writing packet of program "
+                      << nNext + 1
+                      << " to IO. Cannot continue. Error: "
+                      << error_code_to_string(ret)
+                      << std::endl;
+            return;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_frame_latency(std::vector<int64_t> vecLatencyNs)
+{
+    if (vecLatencyNs.empty())
+    {
+        std::cout << "Frame latency: no frames measured" << std::endl;
+        return;
+    }
+
+    std::sort(vecLatencyNs.begin(), vecLatencyNs.end());
+    const auto percentile_ms = [&vecLatencyNs](const double dFraction)
+    {
+        const auto nIdx = static_cast<std::size_t>(dFraction * static_cast<double>(vecLatencyNs.size() - 1) + 0.5);
+        return static_cast<double>(vecLatencyNs[nIdx]) / 1e6;
+    };
+
+    std::cout << "Frame latency (decoder input to TS written) over "
+              << vecLatencyNs.size()
+              << " frames: p50 "
+              << percentile_ms(0.5)
+              << " ms, p99 "
+              << percentile_ms(0.99)
+              << " ms, max "
+              << static_cast<double>(vecLatencyNs.back()) / 1e6
+              << " ms"
+              << std::endl;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool validate_outputs(const std::vector<PipelineOutput> &vecOutputs, const PipelineConfig &config)
+{
+    if (vecOutputs.empty())
+    {
+        return false;
+    }
+    for (const PipelineOutput &target : vecOutputs)
+    {
+        if (!config.vecPassthroughStreams.empty()
+            && (target.pTsMuxer != nullptr || target.vecPassthroughStreams.size() != config.vecPassthroughStreams.size()))
+        {
+            std::cerr << "Every output needs a stream for each passthrough stream, and a libavformat muxer" << std::endl;
+            return false;
+        }
+    }
+    if (config.quality.nInterval > 0 && config.deadline.bEnabled)
+    {
+        std::cerr << "The quality meter cannot follow deadline mode's encoder changes" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Starts the stages after the frame source, which fnStartSource starts on
+// threads it adds to the list. Muxes the first output on the calling
+// thread, then joins everything.
+bool run_stages(PipelineState &state,
+                const PipelineConfig &config,
+                const std::function<void(std::vector<std::thread> &)> &fnStartSource)
+{
+    for (auto &apOutput : state.vecOutputs)
+    {
+        const std::string &strLogPath = apOutput->target.strVbvLogPath;
+        if (!strLogPath.empty() && !apOutput->vbv.open_log(strLogPath))
+        {
+            return false;
+        }
+    }
+    if (state.apTelemetry
+        && !run_placed(config.pPlacement, ThreadStage::Mux, [&state]() { return state.apTelemetry->start(); }))
+    {
+        return false;
+    }
+
+    std::vector<std::thread> vecSources;
+    fnStartSource(vecSources);
+    std::thread thAnalysis;
+    if (config.analysis.nLookahead > 0)
+    {
+        thAnalysis = std::thread{analysis_stage, std::ref(state)};
+    }
+
+    std::vector<std::thread> vecEncoders;
+    std::vector<std::thread> vecMuxers;
+    std::vector<std::thread> vecMeters;
+    for (std::size_t i = 0; i < state.vecOutputs.size(); ++i)
+    {
+        vecEncoders.emplace_back(encode_stage, std::ref(*state.vecOutputs[i]), std::ref(state));
+        if (config.quality.nInterval > 0)
+        {
+            vecMeters.emplace_back(quality_stage, std::ref(*state.vecOutputs[i]), std::ref(state));
+        }
+        if (i > 0)
+        {
+            vecMuxers.emplace_back(mux_stage, std::ref(*state.vecOutputs[i]), std::ref(state));
+        }
+    }
+
+    mux_stage(*state.vecOutputs.front(), state);
+
+    for (std::thread &thMux : vecMuxers)
+    {
+        thMux.join();
+    }
+    for (std::thread &thSource : vecSources)
+    {
+        thSource.join();
+    }
+    if (thAnalysis.joinable())
+    {
+        thAnalysis.join();
+    }
+    for (std::thread &thEncode : vecEncoders)
+    {
+        thEncode.join();
+    }
+    for (std::thread &thMeter : vecMeters)
+    {
+        thMeter.join();
+    }
+
+    if (state.apTelemetry)
+    {
+        state.apTelemetry->stop();
+        if (config.bLatencyHistograms)
+        {
+            print_latency_histograms(*state.apTelemetry);
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Prints the stats every source has in common. Returns true if every
+// output reached the end of stream without a failure.
+bool report_outputs(const PipelineState &state, const PipelineConfig &config)
+{
+    if (config.analysis.nLookahead > 0)
+    {
+        print_frame_analysis_stats(state.analysisStats);
+    }
+
+    print_pool_stats("Demux packet pool", state.demuxPool.stats());
+    print_pool_stats("Decoded frame pool", state.framePool.stats());
+    if (state.apConverter)
+    {
+        print_pool_stats("Converted picture pool", state.apConverter->pool_stats());
+    }
+
+    bool bAllEos{true};
+    for (std::size_t i = 0; i < state.vecOutputs.size(); ++i)
+    {
+        const OutputState &output = *state.vecOutputs[i];
+        if (state.vecOutputs.size() > 1)
+        {
+            std::cout << "Output " << i << ":" << std::endl;
+        }
+
+        print_pool_stats("Encoded packet pool", output.encodedPool.stats());
+        const double dEncodeSeconds = static_cast<double>(output.nEncodeNs) / 1e9;
+        std::cout << "Encoder: "
+                  << output.nEncodedFrames
+                  << " frames in "
+                  << std::fixed << std::setprecision(3) << dEncodeSeconds
+                  << " s of encoder calls, "
+                  << std::setprecision(1) << (dEncodeSeconds > 0.0 ? static_cast<double>(output.nEncodedFrames) / dEncodeSeconds : 0.0)
+                  << " fps"
+                  << std::defaultfloat << std::endl;
+        if (output.vbv.enabled())
+        {
+            print_vbv_stats(output.vbv);
+        }
+        if (output.apDeadline)
+        {
+            print_deadline_stats(*output.apDeadline);
+        }
+        if (config.bMeasureLatency)
+        {
+            print_frame_latency(output.vecLatencyNs);
+        }
+        if (config.quality.nInterval > 0)
+        {
+            print_pool_stats("Quality packet pool", output.qualityPool.stats());
+            print_quality_stats(output.qualityStats);
+        }
+        if (!config.vecPassthroughStreams.empty())
+        {
+            std::cout << "Passthrough: "
+                      << output.nPassthroughPackets
+                      << " packets written, "
+                      << output.nPassthroughDropped
+                      << " outside the video dropped, "
+                      << output.nPassthroughOverflow.load()
+                      << " dropped on a full queue before the first frame"
+                      << std::endl;
+        }
+        bAllEos = bAllEos && output.bEos;
+    }
+
+    return bAllEos && !state.bFailed.load();
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+bool run_transcode_pipeline(AVFormatContext *pFmtCtxIn,
+                            AVCodecContext *pCdcCtxIn,
+                            int nStreamIdxIn,
+                            AVFormatContext *pFmtCtxOut,
+                            AVCodecContext *pCdcCtxOut,
+                            AVStream *pStVideoOut,
+                            const PipelineConfig &config)
+{
+    PipelineOutput output{};
+    output.pFmtCtx = pFmtCtxOut;
+    output.pCdcCtx = pCdcCtxOut;
+    output.pStVideo = pStVideoOut;
+    output.strVbvLogPath = config.strVbvLogPath;
+    output.strQualityLogPath = config.quality.strLogPath;
+
+    return run_transcode_pipeline(pFmtCtxIn, pCdcCtxIn, nStreamIdxIn, std::vector<PipelineOutput>{output}, config);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool run_transcode_pipeline(AVFormatContext *pFmtCtxIn,
+                            AVCodecContext *pCdcCtxIn,
+                            int nStreamIdxIn,
+                            const std::vector<PipelineOutput> &vecOutputs,
+                            const PipelineConfig &config)
+{
+    if (!validate_outputs(vecOutputs, config))
+    {
+        return false;
+    }
+
+    PipelineState state{config, vecOutputs};
+    state.init_passthrough(pFmtCtxIn, nStreamIdxIn, config.vecPassthroughStreams);
+    const auto start_source = [&](std::vector<std::thread> &out_vecThreads)
+    {
+        out_vecThreads.emplace_back(demux_stage, pFmtCtxIn, nStreamIdxIn, std::ref(state));
+        out_vecThreads.emplace_back(decode_stage, pCdcCtxIn, config.bMeasureLatency, std::ref(state));
+    };
+    if (!run_stages(state, config, start_source))
+    {
+        return false;
+    }
+
+    if (config.nRangeStart != AV_NOPTS_VALUE || config.nRangeEnd != AV_NOPTS_VALUE)
+    {
+        std::cout << "Range: "
+                  << state.nDroppedFrames
+                  << " decoded frames outside the range dropped"
+                  << std::endl;
+    }
+
+    return report_outputs(state, config);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool run_ingest_pipeline(ShmFrameRing &ring, const std::vector<PipelineOutput> &vecOutputs, const PipelineConfig &config)
+{
+    if (!validate_outputs(vecOutputs, config))
+    {
+        return false;
+    }
+    if (!config.vecPassthroughStreams.empty() || config.nRangeStart != AV_NOPTS_VALUE || config.nRangeEnd != AV_NOPTS_VALUE)
+    {
+        std::cerr << "Shared-memory ingest supports neither passthrough streams nor a range" << std::endl;
+        return false;
+    }
+
+    PipelineState state{config, vecOutputs};
+    const auto start_source = [&](std::vector<std::thread> &out_vecThreads)
+    {
+        out_vecThreads.emplace_back(ingest_stage, std::ref(ring), std::ref(state));
+    };
+    if (!run_stages(state, config, start_source))
+    {
+        return false;
+    }
+
+    std::cout << "Shared-memory ingest: "
+              << ring.frames()
+              << " frames, "
+              << ring.waits()
+              << " polls waiting for the producer, "
+              << ring.dropped()
+              << " frames dropped by the producer with the ring full"
+              << std::endl;
+
+    return report_outputs(state, config);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool run_mpts_pipeline(const std::vector<MptsProgram> &vecPrograms, const PipelineConfig &config)
+{
+    if (vecPrograms.empty())
+    {
+        return false;
+    }
+    if (!config.vecPassthroughStreams.empty()
+        || config.nRangeStart != AV_NOPTS_VALUE
+        || config.nRangeEnd != AV_NOPTS_VALUE
+        || config.deadline.bEnabled
+        || !config.strTelemetryPath.empty()
+        || config.bLatencyHistograms)
+    {
+        std::cerr << "MPTS supports neither passthrough streams, a range, deadline mode nor telemetry" << std::endl;
+        return false;
+    }
+    for (const MptsProgram &program : vecPrograms)
+    {
+        if (program.output.pTsMuxer != nullptr || program.output.pFmtCtx != vecPrograms.front().output.pFmtCtx)
+        {
+            std::cerr << "MPTS programs share one libavformat muxer" << std::endl;
+            return false;
+        }
+    }
+
+    std::vector<std::unique_ptr<PipelineState>> vecStates;
+    for (const MptsProgram &program : vecPrograms)
+    {
+        auto apState = std::make_unique<PipelineState>(config, std::vector<PipelineOutput>{program.output});
+        apState->init_passthrough(program.pFmtCtxIn, program.nStreamIdxIn, config.vecPassthroughStreams);
+        vecStates.push_back(std::move(apState));
+    }
+
+    std::vector<std::thread> vecThreads;
+    for (std::size_t i = 0; i < vecPrograms.size(); ++i)
+    {
+        const MptsProgram &program = vecPrograms[i];
+        PipelineState &state = *vecStates[i];
+        vecThreads.emplace_back(demux_stage, program.pFmtCtxIn, program.nStreamIdxIn, std::ref(state));
+        vecThreads.emplace_back(decode_stage, program.pCdcCtxIn, config.bMeasureLatency, std::ref(state));
+        if (config.analysis.nLookahead > 0)
+        {
+            vecThreads.emplace_back(analysis_stage, std::ref(state));
+        }
+        vecThreads.emplace_back(encode_stage, std::ref(*state.vecOutputs.front()), std::ref(state));
+        if (config.quality.nInterval > 0)
+        {
+            vecThreads.emplace_back(quality_stage, std::ref(*state.vecOutputs.front()), std::ref(state));
+        }
+    }
+
+    mpts_mux_stage(vecStates);
+
+    // One program failing stops them all.
+    const bool bAllEos = std::all_of(vecStates.begin(),
+                                     vecStates.end(),
+                                     [](const std::unique_ptr<PipelineState> &apState) { return apState->vecOutputs.front()->bEos; });
+    if (!bAllEos)
+    {
+        for (auto &apState : vecStates)
+        {
+            apState->fail();
+        }
+    }
+    for (std::thread &thStage : vecThreads)
+    {
+        thStage.join();
+    }
+
+    bool bOk{bAllEos};
+    for (std::size_t i = 0; i < vecStates.size(); ++i)
+    {
+        std::cout << "Program " << i + 1 << ":" << std::endl;
+        bOk = report_outputs(*vecStates[i], config) && bOk;
+    }
+    return bOk;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "cbr_ts_muxer.hpp"
+#include "cpu_topology.hpp"
+#include "deadline_controller.hpp"
+#include "frame_analysis.hpp"
+#include "media_utils.hpp"
+#include "pixel_convert.hpp"
+#include "quality_meter.hpp"
+#include "shm_frame_ring.hpp"
+#include "statmux.hpp"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Queue depths between the pipeline stages:
+//   demux -> [nDemuxQueueDepth] -> decode -> [nFrameQueueDepth] -> encode -> [nPacketQueueDepth] -> mux
+struct PipelineConfig
+{
+    std::size_t nDemuxQueueDepth{64};
+    std::size_t nFrameQueueDepth{8};
+    std::size_t nPacketQueueDepth{64};
+
+    // Every encoded packet goes through a VBV model before muxing. With
+    // bVbvFailFast an underflow/overflow aborts the transcode.
+    bool bVbvFailFast{false};
+    std::string strVbvLogPath;
+
+    // Per-frame binary telemetry (see telemetry.hpp) and/or per-stage
+    // latency histograms printed at the end.
+    std::string strTelemetryPath;
+    bool bLatencyHistograms{false};
+
+    // Time each frame from the moment its packet is handed to the decoder
+    // until its encoded packet has been written to the output, and print
+    // p50/p99/max per output at the end.
+    bool bMeasureLatency{false};
+
+    // Range mode: only frames presented in [nRangeStart, nRangeEnd) (input
+    // stream time base; AV_NOPTS_VALUE = open) are encoded. The caller seeks
+    // the input to a keyframe at or before nRangeStart. Demuxing then starts
+    // at the first keyframe read and stops at the first packet decoded after
+    // nRangeEnd; frames decoded outside the range are dropped.
+    int64_t nRangeStart{AV_NOPTS_VALUE};
+    int64_t nRangeEnd{AV_NOPTS_VALUE};
+
+    // Input streams remuxed without decoding (audio, subtitles, data). The
+    // demuxer hands their packets, by reference, to a queue per output, and
+    // the muxers write them on the video's timeline: shifted so that the
+    // input PTS of the first encoded frame becomes zero. Each queue has to
+    // hold what the demuxer reads ahead of the first decoded frame; past
+    // that, packets are dropped and counted. Once the first frame is in,
+    // the muxers drain the queues while they wait for the encoders.
+    std::vector<int> vecPassthroughStreams;
+    std::size_t nPassthroughQueueDepth{1024};
+
+    // How decoded pictures that are not 8-bit 4:2:0 are converted.
+    ConvertMethod eConvertMethod{ConvertMethod::Swscale};
+
+    // Pre-analysis stage between decode and encode, attaching per-frame QP
+    // hints (frame_analysis.hpp); off while analysis.nLookahead is 0. It
+    // runs on a thread of its own, on the decode CPUs.
+    FrameAnalysisConfig analysis;
+
+    // PSNR/SSIM of every output against its input (quality_meter.hpp); off
+    // while quality.nInterval is 0. Each output's encoder hands its
+    // packets, and every nInterval-th frame, to a metering thread of its
+    // own, on the decode CPUs. The meter decodes every packet; if it falls
+    // behind, its packet queue (as deep as the encoded packet queue) holds
+    // up the encoder. Not supported in deadline mode.
+    QualityConfig quality;
+
+    // Pins each stage thread and accounts its CPU time; may be null.
+    ThreadPlacement *pPlacement{nullptr};
+
+    // Adapt the encoder level to hold real time; needs
+    // PipelineOutput::fnReopenEncoder.
+    DeadlineConfig deadline;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// One encoder and the muxer it feeds. With several outputs each has its own
+// VBV and quality logs; PipelineConfig::strVbvLogPath and
+// PipelineConfig::quality.strLogPath only apply to the single-output
+// overload.
+struct PipelineOutput
+{
+    AVFormatContext *pFmtCtx{nullptr};
+    AVCodecContext *pCdcCtx{nullptr};
+    AVStream *pStVideo{nullptr};
+    std::string strVbvLogPath;
+
+    // Quality metering only: per-frame and per-GOP CSV; empty = none.
+    std::string strQualityLogPath;
+
+    // When set, packets go to this muxer (in the encoder time base) instead
+    // of av_interleaved_write_frame() on pFmtCtx.
+    CbrTsMuxer *pTsMuxer{nullptr};
+
+    // Output streams for PipelineConfig::vecPassthroughStreams, in the same
+    // order, in pFmtCtx. Not supported together with pTsMuxer.
+    std::vector<AVStream *> vecPassthroughStreams;
+
+    // Deadline mode: opens a standalone replacement for pCdcCtx at the given
+    // DeadlineController level, starting from the given VBV occupancy (bits).
+    // It must use the same time base and rate control settings.
+    std::function<bool(std::size_t nLevel, int64_t nInitialOccupancy, CodecContextPtr &out_apCdcCtx)> fnReopenEncoder;
+
+    // Statmux channel: the encoder reports its packets to pStatmux and
+    // takes a new rate from it at every GOP. The rate changes on the fly,
+    // so there is no CBR VBV model to check against.
+    StatmuxController *pStatmux{nullptr};
+    std::size_t nStatmuxChannel{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Runs demux, decode and encode on their own worker threads and muxes on the
+// calling thread. Returns once the encoder has been flushed and every packet
+// written (but before the trailer is written), or on the first error.
+bool run_transcode_pipeline(AVFormatContext *pFmtCtxIn,
+                            AVCodecContext *pCdcCtxIn,
+                            int nStreamIdxIn,
+                            AVFormatContext *pFmtCtxOut,
+                            AVCodecContext *pCdcCtxOut,
+                            AVStream *pStVideoOut,
+                            const PipelineConfig &config);
+
+//////////////////////////////////////////////////////////////////////////
+// ABR ladder: the input is demuxed and decoded once and every decoded frame
+// is shared, by reference, with each output's encoder. Each output has its
+// own encode thread, frame/packet queues and VBV model; the first output is
+// muxed on the calling thread and the others on threads of their own.
+// Every encoder sees exactly the same frames with the same PTS, so the
+// renditions stay frame-aligned.
+bool run_transcode_pipeline(AVFormatContext *pFmtCtxIn,
+                            AVCodecContext *pCdcCtxIn,
+                            int nStreamIdxIn,
+                            const std::vector<PipelineOutput> &vecOutputs,
+                            const PipelineConfig &config);
+
+//////////////////////////////////////////////////////////////////////////
+// Shared-memory ingest: the frames come from a capture process through
+// ring (shm_frame_ring.hpp) instead of a demuxer and decoder, and go to
+// the outputs as in the ABR overload. Passthrough streams and ranges are
+// not supported. The ring must stay open until this returns.
+bool run_ingest_pipeline(ShmFrameRing &ring, const std::vector<PipelineOutput> &vecOutputs, const PipelineConfig &config);
+
+//////////////////////////////////////////////////////////////////////////
+// One program of a multi-program transport stream: an input, decoded, and
+// the statmux channel encoding it into the shared muxer.
+struct MptsProgram
+{
+    AVFormatContext *pFmtCtxIn{nullptr};
+    AVCodecContext *pCdcCtxIn{nullptr};
+    int nStreamIdxIn{0};
+    PipelineOutput output;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// MPTS: every program runs demux, decode and encode threads of its own, as
+// a single-output pipeline would, and the calling thread muxes all their
+// packets into the one format context they share (pFmtCtx of every
+// output), in DTS order. Passthrough streams, ranges, deadline mode and
+// the native muxer are not supported, and telemetry covers one program
+// only, so it is not either.
+bool run_mpts_pipeline(const std::vector<MptsProgram> &vecPrograms, const PipelineConfig &config);
@@ -0,0 +1,523 @@
+#include "pixel_convert.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X264CBR_X86_KERNELS 1
+#endif
+
+namespace
+{
+
+//////////////////////////////////////////////////////////////////////////
+inline uint8_t average_round(const uint8_t a, const uint8_t b)
+{
+    return static_cast<uint8_t>((a + b + 1) >> 1);
+}
+
+//////////////////////////////////////////////////////////////////////////
+void average_rows_c(const uint8_t *pA, const uint8_t *pB, uint8_t *pDst, const int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        pDst[i] = average_round(pA[i], pB[i]);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void average_rows_31_c(const uint8_t *pNear, const uint8_t *pFar, uint8_t *pDst, const int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        pDst[i] = average_round(pNear[i], average_round(pNear[i], pFar[i]));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void shift_10_to_8_c(const uint16_t *pSrc, uint8_t *pDst, const int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        pDst[i] = static_cast<uint8_t>(std::min((pSrc[i] + 2) >> 2, 255));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// YUYV: Y0 U0 Y1 V0 ...; UYVY: U0 Y0 V0 Y1 ...
+void split_packed_c(const uint8_t *pSrc, uint8_t *pY, uint8_t *pU, uint8_t *pV, const int nPairs, const bool bUyvy)
+{
+    const int nY = bUyvy ? 1 : 0;
+    const int nU = bUyvy ? 0 : 1;
+    const int nV = bUyvy ? 2 : 3;
+    for (int i = 0; i < nPairs; ++i)
+    {
+        const uint8_t *pPair = pSrc + 4 * i;
+        pY[2 * i] = pPair[nY];
+        pY[2 * i + 1] = pPair[nY + 2];
+        pU[i] = pPair[nU];
+        pV[i] = pPair[nV];
+    }
+}
+
+const PixelRowKernels g_kernelsScalar = {average_rows_c, average_rows_31_c, shift_10_to_8_c, split_packed_c};
+
+#if defined(X264CBR_X86_KERNELS)
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse4.1")))
+void average_rows_sse41(const uint8_t *pA, const uint8_t *pB, uint8_t *pDst, const int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m128i vA = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pA + i));
+        const __m128i vB = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pB + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst + i), _mm_avg_epu8(vA, vB));
+    }
+    average_rows_c(pA + i, pB + i, pDst + i, n - i);
+}
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse4.1")))
+void average_rows_31_sse41(const uint8_t *pNear, const uint8_t *pFar, uint8_t *pDst, const int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m128i vNear = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pNear + i));
+        const __m128i vFar = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pFar + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst + i), _mm_avg_epu8(vNear, _mm_avg_epu8(vNear, vFar)));
+    }
+    average_rows_31_c(pNear + i, pFar + i, pDst + i, n - i);
+}
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse4.1")))
+void shift_10_to_8_sse41(const uint16_t *pSrc, uint8_t *pDst, const int n)
+{
+    const __m128i vRound = _mm_set1_epi16(2);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m128i vLo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc + i));
+        const __m128i vHi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc + i + 8));
+        const __m128i vLo8 = _mm_srli_epi16(_mm_adds_epu16(vLo, vRound), 2);
+        const __m128i vHi8 = _mm_srli_epi16(_mm_adds_epu16(vHi, vRound), 2);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pDst + i), _mm_packus_epi16(vLo8, vHi8));
+    }
+    shift_10_to_8_c(pSrc + i, pDst + i, n - i);
+}
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse4.1")))
+void split_packed_sse41(const uint8_t *pSrc, uint8_t *pY, uint8_t *pU, uint8_t *pV, const int nPairs, const bool bUyvy)
+{
+    // Each 16-byte block becomes [Y x8 | U x4 | V x4].
+    const __m128i vSplit = bUyvy
+        ? _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, 0, 4, 8, 12, 2, 6, 10, 14)
+        : _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 5, 9, 13, 3, 7, 11, 15);
+    // [U0-3 V0-3 U4-7 V4-7] -> [U0-7 | V0-7]
+    const __m128i vChroma = _mm_setr_epi8(0, 1, 2, 3, 8, 9, 10, 11, 4, 5, 6, 7, 12, 13, 14, 15);
+
+    int i = 0;
+    for (; i + 8 <= nPairs; i += 8)
+    {
+        const __m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc + 4 * i)), vSplit);
+        const __m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pSrc + 4 * i + 16)), vSplit);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pY + 2 * i), _mm_unpacklo_epi64(v0, v1));
+
+        const __m128i vUv = _mm_shuffle_epi8(_mm_unpackhi_epi64(v0, v1), vChroma);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(pU + i), vUv);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(pV + i), _mm_unpackhi_epi64(vUv, vUv));
+    }
+    split_packed_c(pSrc + 4 * i, pY + 2 * i, pU + i, pV + i, nPairs - i, bUyvy);
+}
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2")))
+void average_rows_avx2(const uint8_t *pA, const uint8_t *pB, uint8_t *pDst, const int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const __m256i vA = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pA + i));
+        const __m256i vB = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pB + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pDst + i), _mm256_avg_epu8(vA, vB));
+    }
+    average_rows_sse41(pA + i, pB + i, pDst + i, n - i);
+}
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2")))
+void average_rows_31_avx2(const uint8_t *pNear, const uint8_t *pFar, uint8_t *pDst, const int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const __m256i vNear = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pNear + i));
+        const __m256i vFar = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pFar + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pDst + i), _mm256_avg_epu8(vNear, _mm256_avg_epu8(vNear, vFar)));
+    }
+    average_rows_31_sse41(pNear + i, pFar + i, pDst + i, n - i);
+}
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2")))
+void shift_10_to_8_avx2(const uint16_t *pSrc, uint8_t *pDst, const int n)
+{
+    const __m256i vRound = _mm256_set1_epi16(2);
+    int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const __m256i vLo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pSrc + i));
+        const __m256i vHi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pSrc + i + 16));
+        const __m256i vLo8 = _mm256_srli_epi16(_mm256_adds_epu16(vLo, vRound), 2);
+        const __m256i vHi8 = _mm256_srli_epi16(_mm256_adds_epu16(vHi, vRound), 2);
+        // packus works per 128-bit lane; put the quadwords back in order.
+        const __m256i vPacked = _mm256_permute4x64_epi64(_mm256_packus_epi16(vLo8, vHi8), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pDst + i), vPacked);
+    }
+    shift_10_to_8_sse41(pSrc + i, pDst + i, n - i);
+}
+
+// The byte shuffle does not cross 128-bit lanes, so packed splitting stays
+// on the SSE4.1 kernel.
+const PixelRowKernels g_kernelsSse41 = {average_rows_sse41, average_rows_31_sse41, shift_10_to_8_sse41, split_packed_sse41};
+const PixelRowKernels g_kernelsAvx2 = {average_rows_avx2, average_rows_31_avx2, shift_10_to_8_avx2, split_packed_sse41};
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+void shift_plane(const PixelRowKernels &kernels,
+                 const uint8_t *pSrc,
+                 const int nSrcStride,
+                 uint8_t *pDst,
+                 const int nDstStride,
+                 const int nWidth,
+                 const int nHeight)
+{
+    for (int y = 0; y < nHeight; ++y)
+    {
+        kernels.pfnShift10To8(reinterpret_cast<const uint16_t *>(pSrc + static_cast<std::ptrdiff_t>(y) * nSrcStride),
+                              pDst + static_cast<std::ptrdiff_t>(y) * nDstStride,
+                              nWidth);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void copy_plane(const uint8_t *pSrc, const int nSrcStride, uint8_t *pDst, const int nDstStride, const int nWidth, const int nHeight)
+{
+    for (int y = 0; y < nHeight; ++y)
+    {
+        std::memcpy(pDst + static_cast<std::ptrdiff_t>(y) * nDstStride,
+                    pSrc + static_cast<std::ptrdiff_t>(y) * nSrcStride,
+                    static_cast<std::size_t>(nWidth));
+    }
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+const char *convert_method_name(const ConvertMethod eMethod)
+{
+    return eMethod == ConvertMethod::Kernels ? "kernels" : "swscale";
+}
+
+//////////////////////////////////////////////////////////////////////////
+const char *simd_level_name(const SimdLevel eLevel)
+{
+    switch (eLevel)
+    {
+    case SimdLevel::Avx2:
+        return "AVX2";
+    case SimdLevel::Sse41:
+        return "SSE4.1";
+    default:
+        return "scalar";
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+SimdLevel detect_simd_level()
+{
+#if defined(X264CBR_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SimdLevel::Avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return SimdLevel::Sse41;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+//////////////////////////////////////////////////////////////////////////
+const PixelRowKernels &pixel_row_kernels(const SimdLevel eLevel)
+{
+#if defined(X264CBR_X86_KERNELS)
+    switch (eLevel)
+    {
+    case SimdLevel::Avx2:
+        return g_kernelsAvx2;
+    case SimdLevel::Sse41:
+        return g_kernelsSse41;
+    default:
+        break;
+    }
+#endif
+    (void)eLevel;
+    return g_kernelsScalar;
+}
+
+//////////////////////////////////////////////////////////////////////////
+PixelConverter::PixelConverter(const int nWidth, const int nHeight, const bool bInterlaced, const ConvertMethod eMethod)
+    : m_nWidth(nWidth),
+      m_nHeight(nHeight),
+      m_bInterlaced(bInterlaced),
+      m_eMethod(eMethod),
+      m_eSimd(detect_simd_level()),
+      m_pool(nWidth, nHeight, AV_PIX_FMT_YUV420P)
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+PixelConverter::~PixelConverter()
+{
+    sws_freeContext(m_pSwsCtx);
+}
+
+//////////////////////////////////////////////////////////////////////////
+const char *PixelConverter::description() const
+{
+    return m_eMethod == ConvertMethod::Kernels ? simd_level_name(m_eSimd) : "sws_scale";
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool PixelConverter::supported(const AVPixelFormat ePixFmt)
+{
+    switch (ePixFmt)
+    {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUV420P10LE:
+    case AV_PIX_FMT_YUV422P10LE:
+    case AV_PIX_FMT_YUYV422:
+    case AV_PIX_FMT_UYVY422:
+        return true;
+    default:
+        return false;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void PixelConverter::downsample_chroma(const uint8_t *pSrc, const int nSrcStride, uint8_t *pDst, const int nDstStride) const
+{
+    const PixelRowKernels &kernels = pixel_row_kernels(m_eSimd);
+    const int nChromaWidth = (m_nWidth + 1) / 2;
+    const int nOutRows = (m_nHeight + 1) / 2;
+
+    auto fnRow = [&](int nRow) -> const uint8_t *
+    {
+        // Stay on the same field when clamping at the bottom edge.
+        while (nRow >= m_nHeight)
+        {
+            nRow -= m_bInterlaced ? 2 : 1;
+        }
+        return pSrc + static_cast<std::ptrdiff_t>(std::max(nRow, 0)) * nSrcStride;
+    };
+
+    for (int j = 0; j < nOutRows; ++j)
+    {
+        uint8_t *pOut = pDst + static_cast<std::ptrdiff_t>(j) * nDstStride;
+        if (!m_bInterlaced)
+        {
+            kernels.pfnAverage(fnRow(2 * j), fnRow(2 * j + 1), pOut, nChromaWidth);
+            continue;
+        }
+
+        // Output line j belongs to field (j & 1) and is that field's line
+        // (j >> 1); it sits between the field's 4:2:2 lines 2k and 2k+1,
+        // a quarter of the way down (top field) or up (bottom field).
+        const int k = j >> 1;
+        if ((j & 1) == 0)
+        {
+            kernels.pfnAverage31(fnRow(4 * k), fnRow(4 * k + 2), pOut, nChromaWidth);
+        }
+        else
+        {
+            kernels.pfnAverage31(fnRow(4 * k + 3), fnRow(4 * k + 1), pOut, nChromaWidth);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Interlaced pictures go through sws_scale one field at a time, as
+// alternate rows with twice the stride, so that chroma is downsampled
+// within each field.
+bool PixelConverter::scale_fields(const AVFrame *pSrc, AVFrame *pDst)
+{
+    const auto ePixFmt = static_cast<AVPixelFormat>(pSrc->format);
+    const int nFields = m_bInterlaced ? 2 : 1;
+    const int nFieldHeight = m_nHeight / nFields;
+    if (m_pSwsCtx == nullptr || m_eSwsSrcFmt != ePixFmt)
+    {
+        sws_freeContext(m_pSwsCtx);
+        m_pSwsCtx = sws_getContext(m_nWidth, nFieldHeight, ePixFmt,
+                                   m_nWidth, nFieldHeight, AV_PIX_FMT_YUV420P,
+                                   SWS_BILINEAR, nullptr, nullptr, nullptr);
+        m_eSwsSrcFmt = ePixFmt;
+        if (m_pSwsCtx == nullptr)
+        {
+            std::cerr << "Could not create sws_scale context for " << av_get_pix_fmt_name(ePixFmt) << std::endl;
+            return false;
+        }
+    }
+
+    const AVPixFmtDescriptor *pSrcDesc = av_pix_fmt_desc_get(ePixFmt);
+    const int nSrcPlanes = (pSrcDesc->flags & AV_PIX_FMT_FLAG_PLANAR) != 0 ? 3 : 1;
+    for (int nField = 0; nField < nFields; ++nField)
+    {
+        const uint8_t *arrSrc[4]{};
+        int arrSrcStride[4]{};
+        uint8_t *arrDst[4]{};
+        int arrDstStride[4]{};
+        for (int nPlane = 0; nPlane < 3; ++nPlane)
+        {
+            if (nPlane < nSrcPlanes)
+            {
+                arrSrc[nPlane] = pSrc->data[nPlane] + static_cast<std::ptrdiff_t>(nField) * pSrc->linesize[nPlane];
+                arrSrcStride[nPlane] = pSrc->linesize[nPlane] * nFields;
+            }
+            arrDst[nPlane] = pDst->data[nPlane] + static_cast<std::ptrdiff_t>(nField) * pDst->linesize[nPlane];
+            arrDstStride[nPlane] = pDst->linesize[nPlane] * nFields;
+        }
+        if (sws_scale(m_pSwsCtx, arrSrc, arrSrcStride, 0, nFieldHeight, arrDst, arrDstStride) != nFieldHeight)
+        {
+            std::cerr << "sws_scale failed on a " << av_get_pix_fmt_name(ePixFmt) << " picture" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool PixelConverter::convert(const AVFrame *pSrc, AVFrame *pDst)
+{
+    const auto ePixFmt = static_cast<AVPixelFormat>(pSrc->format);
+    if (!supported(ePixFmt))
+    {
+        const char *pszName = av_get_pix_fmt_name(ePixFmt);
+        std::cerr << "Unsupported decoder pixel format: " << (pszName != nullptr ? pszName : "unknown") << std::endl;
+        return false;
+    }
+    if (pSrc->width != m_nWidth || pSrc->height != m_nHeight)
+    {
+        std::cerr << "Decoded picture size changed to "
+                  << pSrc->width << "x" << pSrc->height
+                  << "; cannot convert"
+                  << std::endl;
+        return false;
+    }
+
+    if (!m_pool.get_buffer(pDst))
+    {
+        return false;
+    }
+
+    if (m_eMethod == ConvertMethod::Swscale && ePixFmt != AV_PIX_FMT_YUV420P)
+    {
+        if (!scale_fields(pSrc, pDst))
+        {
+            av_frame_unref(pDst);
+            return false;
+        }
+        av_frame_copy_props(pDst, pSrc);
+        return true;
+    }
+
+    const PixelRowKernels &kernels = pixel_row_kernels(m_eSimd);
+    const int nChromaWidth = (m_nWidth + 1) / 2;
+    const int nChromaHeight420 = (m_nHeight + 1) / 2;
+    const std::size_t nChroma422 = static_cast<std::size_t>(nChromaWidth) * m_nHeight;
+
+    switch (ePixFmt)
+    {
+    case AV_PIX_FMT_YUV420P:
+        copy_plane(pSrc->data[0], pSrc->linesize[0], pDst->data[0], pDst->linesize[0], m_nWidth, m_nHeight);
+        copy_plane(pSrc->data[1], pSrc->linesize[1], pDst->data[1], pDst->linesize[1], nChromaWidth, nChromaHeight420);
+        copy_plane(pSrc->data[2], pSrc->linesize[2], pDst->data[2], pDst->linesize[2], nChromaWidth, nChromaHeight420);
+        break;
+
+    case AV_PIX_FMT_YUV422P:
+        copy_plane(pSrc->data[0], pSrc->linesize[0], pDst->data[0], pDst->linesize[0], m_nWidth, m_nHeight);
+        downsample_chroma(pSrc->data[1], pSrc->linesize[1], pDst->data[1], pDst->linesize[1]);
+        downsample_chroma(pSrc->data[2], pSrc->linesize[2], pDst->data[2], pDst->linesize[2]);
+        break;
+
+    case AV_PIX_FMT_YUV420P10LE:
+        shift_plane(kernels, pSrc->data[0], pSrc->linesize[0], pDst->data[0], pDst->linesize[0], m_nWidth, m_nHeight);
+        shift_plane(kernels, pSrc->data[1], pSrc->linesize[1], pDst->data[1], pDst->linesize[1], nChromaWidth, nChromaHeight420);
+        shift_plane(kernels, pSrc->data[2], pSrc->linesize[2], pDst->data[2], pDst->linesize[2], nChromaWidth, nChromaHeight420);
+        break;
+
+    case AV_PIX_FMT_YUV422P10LE:
+        m_vecChromaU.resize(nChroma422);
+        m_vecChromaV.resize(nChroma422);
+        shift_plane(kernels, pSrc->data[0], pSrc->linesize[0], pDst->data[0], pDst->linesize[0], m_nWidth, m_nHeight);
+        shift_plane(kernels, pSrc->data[1], pSrc->linesize[1], m_vecChromaU.data(), nChromaWidth, nChromaWidth, m_nHeight);
+        shift_plane(kernels, pSrc->data[2], pSrc->linesize[2], m_vecChromaV.data(), nChromaWidth, nChromaWidth, m_nHeight);
+        downsample_chroma(m_vecChromaU.data(), nChromaWidth, pDst->data[1], pDst->linesize[1]);
+        downsample_chroma(m_vecChromaV.data(), nChromaWidth, pDst->data[2], pDst->linesize[2]);
+        break;
+
+    case AV_PIX_FMT_YUYV422:
+    case AV_PIX_FMT_UYVY422:
+        m_vecChromaU.resize(nChroma422);
+        m_vecChromaV.resize(nChroma422);
+        for (int y = 0; y < m_nHeight; ++y)
+        {
+            kernels.pfnSplitPacked(pSrc->data[0] + static_cast<std::ptrdiff_t>(y) * pSrc->linesize[0],
+                                   pDst->data[0] + static_cast<std::ptrdiff_t>(y) * pDst->linesize[0],
+                                   m_vecChromaU.data() + static_cast<std::size_t>(y) * nChromaWidth,
+                                   m_vecChromaV.data() + static_cast<std::size_t>(y) * nChromaWidth,
+                                   m_nWidth / 2,
+                                   ePixFmt == AV_PIX_FMT_UYVY422);
+        }
+        downsample_chroma(m_vecChromaU.data(), nChromaWidth, pDst->data[1], pDst->linesize[1]);
+        downsample_chroma(m_vecChromaV.data(), nChromaWidth, pDst->data[2], pDst->linesize[2]);
+        break;
+
+    default:
+        break;
+    }
+
+    av_frame_copy_props(pDst, pSrc);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool PixelConverter::convert_in_place(AVFrame *inout_pFrame, AVFrame *pScratch)
+{
+    if (!convert(inout_pFrame, pScratch))
+    {
+        av_frame_unref(pScratch);
+        return false;
+    }
+
+    av_frame_unref(inout_pFrame);
+    av_frame_move_ref(inout_pFrame, pScratch);
+    return true;
+}
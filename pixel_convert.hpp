@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "frame_pool.hpp"
+
+extern "C"
+{
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Fixed-path conversion of decoded frames to the encoder's 8-bit 4:2:0.
+//
+// Handles planar 4:2:2, 10-bit planar 4:2:0/4:2:2 and packed 4:2:2
+// (YUYV/UYVY). Each conversion first brings the planes to 8 bits. Any 4:2:2
+// chroma is then halved vertically. For interlaced output this is done
+// field by field: each field's chroma lines are combined only with lines of
+// the same field, weighted 3:1 towards the nearer line, as 4:2:0
+// interlaced chroma siting requires. Progressive output averages line
+// pairs.
+//
+// The row kernels come in AVX2, SSE4.1 and scalar versions, picked once
+// at run time. Output pictures come from a VideoBufferPool, so steady state
+// does not allocate.
+//
+// sws_scale (bilinear, handed interlaced pictures one field at a time) is
+// the default method until the kernels have been measured faster than it
+// (x264_cbr_bench --convert); ConvertMethod::Kernels opts in to them.
+
+struct SwsContext;
+
+enum class ConvertMethod
+{
+    Swscale,
+    Kernels
+};
+
+const char *convert_method_name(ConvertMethod eMethod);
+
+enum class SimdLevel
+{
+    Scalar,
+    Sse41,
+    Avx2
+};
+
+const char *simd_level_name(SimdLevel eLevel);
+
+// Highest level this CPU supports (and this build has kernels for).
+SimdLevel detect_simd_level();
+
+//////////////////////////////////////////////////////////////////////////
+// Row kernels. All versions produce bit-identical output; the 3:1 blend is
+// defined as avg(near, avg(near, far)) so that it maps straight onto pavgb.
+struct PixelRowKernels
+{
+    void (*pfnAverage)(const uint8_t *pA, const uint8_t *pB, uint8_t *pDst, int n);
+    void (*pfnAverage31)(const uint8_t *pNear, const uint8_t *pFar, uint8_t *pDst, int n);
+    void (*pfnShift10To8)(const uint16_t *pSrc, uint8_t *pDst, int n);
+    void (*pfnSplitPacked)(const uint8_t *pSrc, uint8_t *pY, uint8_t *pU, uint8_t *pV, int nPairs, bool bUyvy);
+};
+
+// The kernels of eLevel, falling back to scalar where this build has none.
+// The caller checks that the CPU supports eLevel.
+const PixelRowKernels &pixel_row_kernels(SimdLevel eLevel);
+
+//////////////////////////////////////////////////////////////////////////
+class PixelConverter
+{
+public:
+    PixelConverter(int nWidth, int nHeight, bool bInterlaced, ConvertMethod eMethod);
+    ~PixelConverter();
+
+    PixelConverter(const PixelConverter &) = delete;
+    PixelConverter &operator=(const PixelConverter &) = delete;
+
+    static bool supported(AVPixelFormat ePixFmt);
+
+    // Converts pSrc into a pooled 4:2:0 picture in pDst (which must be
+    // empty) and copies over the frame properties.
+    bool convert(const AVFrame *pSrc, AVFrame *pDst);
+
+    // Replaces the contents of inout_pFrame with the converted picture,
+    // using pScratch (empty) as the intermediate.
+    bool convert_in_place(AVFrame *inout_pFrame, AVFrame *pScratch);
+
+    ConvertMethod method() const { return m_eMethod; }
+    SimdLevel simd_level() const { return m_eSimd; }
+    const PoolStats &pool_stats() const { return m_pool.stats(); }
+
+    // "sws_scale", or the kernels' SIMD level.
+    const char *description() const;
+
+private:
+    void downsample_chroma(const uint8_t *pSrc, int nSrcStride, uint8_t *pDst, int nDstStride) const;
+    bool scale_fields(const AVFrame *pSrc, AVFrame *pDst);
+
+    const int m_nWidth;
+    const int m_nHeight;
+    const bool m_bInterlaced;
+    const ConvertMethod m_eMethod;
+    const SimdLevel m_eSimd;
+
+    // sws_scale only: made for the first source format, and again if it
+    // changes.
+    SwsContext *m_pSwsCtx{nullptr};
+    AVPixelFormat m_eSwsSrcFmt{AV_PIX_FMT_NONE};
+
+    VideoBufferPool m_pool;
+
+    // 8-bit 4:2:2 chroma planes, for the sources that need a first pass.
+    std::vector<uint8_t> m_vecChromaU;
+    std::vector<uint8_t> m_vecChromaV;
+};
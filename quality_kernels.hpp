@@ -0,0 +1,25 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "pixel_convert.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Kernels behind QualityMeter's PSNR and SSIM, in C, SSE4.1 and AVX2
+// versions. Internal to x264_cbr_core; declared here so that the unit test
+// can check each SIMD version against C.
+
+// Source, decoded, both squared and their product, over a 4x4 block.
+using BlockSums = std::array<int32_t, 4>;
+
+// Sum of squared differences over an nWidth x nHeight area.
+using SseKernel = uint64_t (*)(const uint8_t *pA, int nStrideA, const uint8_t *pB, int nStrideB, int nWidth, int nHeight);
+
+// BlockSums of nBlocks 4x4 blocks side by side.
+using BlockSumsKernel = void (*)(const uint8_t *pA, int nStrideA, const uint8_t *pB, int nStrideB, int nBlocks, BlockSums *out_pSums);
+
+// The kernels of eLevel, falling back to C where this build has none. The
+// caller checks that the CPU supports eLevel.
+SseKernel sse_kernel_for(SimdLevel eLevel);
+BlockSumsKernel block_sums_kernel_for(SimdLevel eLevel);
@@ -0,0 +1,732 @@
+#include "quality_meter.hpp"
+#include "quality_kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+
+extern "C"
+{
+#include <libavutil/mem.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X264CBR_X86_KERNELS 1
+#endif
+
+namespace
+{
+
+// What a frame identical to its source scores, as in x264.
+constexpr double g_dMaxPsnr = 100.0;
+
+//////////////////////////////////////////////////////////////////////////
+uint64_t sse_c(const uint8_t *pA, const int nStrideA, const uint8_t *pB, const int nStrideB, const int nWidth, const int nHeight)
+{
+    uint64_t nSse{0};
+    for (int y = 0; y < nHeight; ++y)
+    {
+        const uint8_t *pRowA = pA + static_cast<std::ptrdiff_t>(y) * nStrideA;
+        const uint8_t *pRowB = pB + static_cast<std::ptrdiff_t>(y) * nStrideB;
+        for (int x = 0; x < nWidth; ++x)
+        {
+            const int nDiff = pRowA[x] - pRowB[x];
+            nSse += static_cast<uint32_t>(nDiff * nDiff);
+        }
+    }
+    return nSse;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// nBlocks 4x4 blocks side by side.
+void block_sums_c(const uint8_t *pA, const int nStrideA, const uint8_t *pB, const int nStrideB, const int nBlocks, BlockSums *out_pSums)
+{
+    for (int nBlock = 0; nBlock < nBlocks; ++nBlock)
+    {
+        BlockSums sums{};
+        for (int y = 0; y < 4; ++y)
+        {
+            const uint8_t *pRowA = pA + static_cast<std::ptrdiff_t>(y) * nStrideA + nBlock * 4;
+            const uint8_t *pRowB = pB + static_cast<std::ptrdiff_t>(y) * nStrideB + nBlock * 4;
+            for (int x = 0; x < 4; ++x)
+            {
+                const int32_t nA = pRowA[x];
+                const int32_t nB = pRowB[x];
+                sums[0] += nA;
+                sums[1] += nB;
+                sums[2] += nA * nA + nB * nB;
+                sums[3] += nA * nB;
+            }
+        }
+        out_pSums[nBlock] = sums;
+    }
+}
+
+#if defined(X264CBR_X86_KERNELS)
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("sse4.1")))
+uint32_t horizontal_sum_epi32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4E));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xB1));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(v));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// A row's squared differences fit 32-bit lanes for any width x264 codes;
+// the rows are added up in 64 bits.
+__attribute__((target("sse4.1")))
+uint64_t sse_sse41(const uint8_t *pA, const int nStrideA, const uint8_t *pB, const int nStrideB, const int nWidth, const int nHeight)
+{
+    const __m128i vZero = _mm_setzero_si128();
+    uint64_t nSse{0};
+    for (int y = 0; y < nHeight; ++y)
+    {
+        const uint8_t *pRowA = pA + static_cast<std::ptrdiff_t>(y) * nStrideA;
+        const uint8_t *pRowB = pB + static_cast<std::ptrdiff_t>(y) * nStrideB;
+        __m128i vRow = vZero;
+        int x = 0;
+        for (; x + 16 <= nWidth; x += 16)
+        {
+            const __m128i vA = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pRowA + x));
+            const __m128i vB = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pRowB + x));
+            const __m128i vDiffLo = _mm_sub_epi16(_mm_unpacklo_epi8(vA, vZero), _mm_unpacklo_epi8(vB, vZero));
+            const __m128i vDiffHi = _mm_sub_epi16(_mm_unpackhi_epi8(vA, vZero), _mm_unpackhi_epi8(vB, vZero));
+            vRow = _mm_add_epi32(vRow, _mm_add_epi32(_mm_madd_epi16(vDiffLo, vDiffLo), _mm_madd_epi16(vDiffHi, vDiffHi)));
+        }
+        nSse += horizontal_sum_epi32(vRow);
+        nSse += sse_c(pRowA + x, nStrideA, pRowB + x, nStrideB, nWidth - x, 1);
+    }
+    return nSse;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Four blocks per iteration. The pixel sums stay in 16 bits over the four
+// rows; pairs of lanes are then added with madd and hadd into one 32-bit
+// lane per block, and the four sums transposed into per-block order.
+__attribute__((target("sse4.1")))
+void block_sums_sse41(const uint8_t *pA, const int nStrideA, const uint8_t *pB, const int nStrideB, const int nBlocks, BlockSums *out_pSums)
+{
+    const __m128i vZero = _mm_setzero_si128();
+    const __m128i vOnes = _mm_set1_epi16(1);
+    int nBlock = 0;
+    for (; nBlock + 4 <= nBlocks; nBlock += 4)
+    {
+        __m128i vSumALo = vZero;
+        __m128i vSumAHi = vZero;
+        __m128i vSumBLo = vZero;
+        __m128i vSumBHi = vZero;
+        __m128i vSsLo = vZero;
+        __m128i vSsHi = vZero;
+        __m128i vProdLo = vZero;
+        __m128i vProdHi = vZero;
+        for (int y = 0; y < 4; ++y)
+        {
+            const __m128i vA = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pA + static_cast<std::ptrdiff_t>(y) * nStrideA + nBlock * 4));
+            const __m128i vB = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pB + static_cast<std::ptrdiff_t>(y) * nStrideB + nBlock * 4));
+            const __m128i vALo = _mm_unpacklo_epi8(vA, vZero);
+            const __m128i vAHi = _mm_unpackhi_epi8(vA, vZero);
+            const __m128i vBLo = _mm_unpacklo_epi8(vB, vZero);
+            const __m128i vBHi = _mm_unpackhi_epi8(vB, vZero);
+            vSumALo = _mm_add_epi16(vSumALo, vALo);
+            vSumAHi = _mm_add_epi16(vSumAHi, vAHi);
+            vSumBLo = _mm_add_epi16(vSumBLo, vBLo);
+            vSumBHi = _mm_add_epi16(vSumBHi, vBHi);
+            vSsLo = _mm_add_epi32(vSsLo, _mm_add_epi32(_mm_madd_epi16(vALo, vALo), _mm_madd_epi16(vBLo, vBLo)));
+            vSsHi = _mm_add_epi32(vSsHi, _mm_add_epi32(_mm_madd_epi16(vAHi, vAHi), _mm_madd_epi16(vBHi, vBHi)));
+            vProdLo = _mm_add_epi32(vProdLo, _mm_madd_epi16(vALo, vBLo));
+            vProdHi = _mm_add_epi32(vProdHi, _mm_madd_epi16(vAHi, vBHi));
+        }
+
+        const __m128i vS1 = _mm_hadd_epi32(_mm_madd_epi16(vSumALo, vOnes), _mm_madd_epi16(vSumAHi, vOnes));
+        const __m128i vS2 = _mm_hadd_epi32(_mm_madd_epi16(vSumBLo, vOnes), _mm_madd_epi16(vSumBHi, vOnes));
+        const __m128i vSs = _mm_hadd_epi32(vSsLo, vSsHi);
+        const __m128i vS12 = _mm_hadd_epi32(vProdLo, vProdHi);
+
+        const __m128i vT0 = _mm_unpacklo_epi32(vS1, vS2);
+        const __m128i vT1 = _mm_unpacklo_epi32(vSs, vS12);
+        const __m128i vT2 = _mm_unpackhi_epi32(vS1, vS2);
+        const __m128i vT3 = _mm_unpackhi_epi32(vSs, vS12);
+        auto *pOut = reinterpret_cast<__m128i *>(out_pSums + nBlock);
+        _mm_storeu_si128(pOut + 0, _mm_unpacklo_epi64(vT0, vT1));
+        _mm_storeu_si128(pOut + 1, _mm_unpackhi_epi64(vT0, vT1));
+        _mm_storeu_si128(pOut + 2, _mm_unpacklo_epi64(vT2, vT3));
+        _mm_storeu_si128(pOut + 3, _mm_unpackhi_epi64(vT2, vT3));
+    }
+
+    block_sums_c(pA + nBlock * 4, nStrideA, pB + nBlock * 4, nStrideB, nBlocks - nBlock, out_pSums + nBlock);
+}
+
+//////////////////////////////////////////////////////////////////////////
+__attribute__((target("avx2")))
+uint64_t sse_avx2(const uint8_t *pA, const int nStrideA, const uint8_t *pB, const int nStrideB, const int nWidth, const int nHeight)
+{
+    const __m256i vZero = _mm256_setzero_si256();
+    uint64_t nSse{0};
+    for (int y = 0; y < nHeight; ++y)
+    {
+        const uint8_t *pRowA = pA + static_cast<std::ptrdiff_t>(y) * nStrideA;
+        const uint8_t *pRowB = pB + static_cast<std::ptrdiff_t>(y) * nStrideB;
+        __m256i vRow = vZero;
+        int x = 0;
+        for (; x + 32 <= nWidth; x += 32)
+        {
+            const __m256i vA = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pRowA + x));
+            const __m256i vB = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pRowB + x));
+            const __m256i vDiffLo = _mm256_sub_epi16(_mm256_unpacklo_epi8(vA, vZero), _mm256_unpacklo_epi8(vB, vZero));
+            const __m256i vDiffHi = _mm256_sub_epi16(_mm256_unpackhi_epi8(vA, vZero), _mm256_unpackhi_epi8(vB, vZero));
+            vRow = _mm256_add_epi32(vRow, _mm256_add_epi32(_mm256_madd_epi16(vDiffLo, vDiffLo), _mm256_madd_epi16(vDiffHi, vDiffHi)));
+        }
+        nSse += horizontal_sum_epi32(_mm_add_epi32(_mm256_castsi256_si128(vRow), _mm256_extracti128_si256(vRow, 1)));
+        nSse += sse_c(pRowA + x, nStrideA, pRowB + x, nStrideB, nWidth - x, 1);
+    }
+    return nSse;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Eight blocks per iteration, four in each 128-bit lane: the SSE4.1
+// kernel twice over, with the lanes put back in block order on the store.
+__attribute__((target("avx2")))
+void block_sums_avx2(const uint8_t *pA, const int nStrideA, const uint8_t *pB, const int nStrideB, const int nBlocks, BlockSums *out_pSums)
+{
+    const __m256i vZero = _mm256_setzero_si256();
+    const __m256i vOnes = _mm256_set1_epi16(1);
+    int nBlock = 0;
+    for (; nBlock + 8 <= nBlocks; nBlock += 8)
+    {
+        __m256i vSumALo = vZero;
+        __m256i vSumAHi = vZero;
+        __m256i vSumBLo = vZero;
+        __m256i vSumBHi = vZero;
+        __m256i vSsLo = vZero;
+        __m256i vSsHi = vZero;
+        __m256i vProdLo = vZero;
+        __m256i vProdHi = vZero;
+        for (int y = 0; y < 4; ++y)
+        {
+            const __m256i vA = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pA + static_cast<std::ptrdiff_t>(y) * nStrideA + nBlock * 4));
+            const __m256i vB = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pB + static_cast<std::ptrdiff_t>(y) * nStrideB + nBlock * 4));
+            const __m256i vALo = _mm256_unpacklo_epi8(vA, vZero);
+            const __m256i vAHi = _mm256_unpackhi_epi8(vA, vZero);
+            const __m256i vBLo = _mm256_unpacklo_epi8(vB, vZero);
+            const __m256i vBHi = _mm256_unpackhi_epi8(vB, vZero);
+            vSumALo = _mm256_add_epi16(vSumALo, vALo);
+            vSumAHi = _mm256_add_epi16(vSumAHi, vAHi);
+            vSumBLo = _mm256_add_epi16(vSumBLo, vBLo);
+            vSumBHi = _mm256_add_epi16(vSumBHi, vBHi);
+            vSsLo = _mm256_add_epi32(vSsLo, _mm256_add_epi32(_mm256_madd_epi16(vALo, vALo), _mm256_madd_epi16(vBLo, vBLo)));
+            vSsHi = _mm256_add_epi32(vSsHi, _mm256_add_epi32(_mm256_madd_epi16(vAHi, vAHi), _mm256_madd_epi16(vBHi, vBHi)));
+            vProdLo = _mm256_add_epi32(vProdLo, _mm256_madd_epi16(vALo, vBLo));
+            vProdHi = _mm256_add_epi32(vProdHi, _mm256_madd_epi16(vAHi, vBHi));
+        }
+
+        const __m256i vS1 = _mm256_hadd_epi32(_mm256_madd_epi16(vSumALo, vOnes), _mm256_madd_epi16(vSumAHi, vOnes));
+        const __m256i vS2 = _mm256_hadd_epi32(_mm256_madd_epi16(vSumBLo, vOnes), _mm256_madd_epi16(vSumBHi, vOnes));
+        const __m256i vSs = _mm256_hadd_epi32(vSsLo, vSsHi);
+        const __m256i vS12 = _mm256_hadd_epi32(vProdLo, vProdHi);
+
+        // Block n in the low lane, block n + 4 in the high one.
+        const __m256i vT0 = _mm256_unpacklo_epi32(vS1, vS2);
+        const __m256i vT1 = _mm256_unpacklo_epi32(vSs, vS12);
+        const __m256i vT2 = _mm256_unpackhi_epi32(vS1, vS2);
+        const __m256i vT3 = _mm256_unpackhi_epi32(vSs, vS12);
+        const __m256i vBlocks04 = _mm256_unpacklo_epi64(vT0, vT1);
+        const __m256i vBlocks15 = _mm256_unpackhi_epi64(vT0, vT1);
+        const __m256i vBlocks26 = _mm256_unpacklo_epi64(vT2, vT3);
+        const __m256i vBlocks37 = _mm256_unpackhi_epi64(vT2, vT3);
+        auto *pOut = reinterpret_cast<__m256i *>(out_pSums + nBlock);
+        _mm256_storeu_si256(pOut + 0, _mm256_permute2x128_si256(vBlocks04, vBlocks15, 0x20));
+        _mm256_storeu_si256(pOut + 1, _mm256_permute2x128_si256(vBlocks26, vBlocks37, 0x20));
+        _mm256_storeu_si256(pOut + 2, _mm256_permute2x128_si256(vBlocks04, vBlocks15, 0x31));
+        _mm256_storeu_si256(pOut + 3, _mm256_permute2x128_si256(vBlocks26, vBlocks37, 0x31));
+    }
+
+    block_sums_sse41(pA + nBlock * 4, nStrideA, pB + nBlock * 4, nStrideB, nBlocks - nBlock, out_pSums + nBlock);
+}
+
+#endif
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+SseKernel sse_kernel_for(const SimdLevel eLevel)
+{
+#if defined(X264CBR_X86_KERNELS)
+    switch (eLevel)
+    {
+    case SimdLevel::Avx2:
+        return sse_avx2;
+    case SimdLevel::Sse41:
+        return sse_sse41;
+    default:
+        break;
+    }
+#endif
+    (void)eLevel;
+    return sse_c;
+}
+
+//////////////////////////////////////////////////////////////////////////
+BlockSumsKernel block_sums_kernel_for(const SimdLevel eLevel)
+{
+#if defined(X264CBR_X86_KERNELS)
+    switch (eLevel)
+    {
+    case SimdLevel::Avx2:
+        return block_sums_avx2;
+    case SimdLevel::Sse41:
+        return block_sums_sse41;
+    default:
+        break;
+    }
+#endif
+    (void)eLevel;
+    return block_sums_c;
+}
+
+namespace
+{
+
+//////////////////////////////////////////////////////////////////////////
+double psnr(const uint64_t nSse, const uint64_t nSamples)
+{
+    if (nSse == 0)
+    {
+        return g_dMaxPsnr;
+    }
+    return std::min(g_dMaxPsnr, 10.0 * std::log10(255.0 * 255.0 * static_cast<double>(nSamples) / static_cast<double>(nSse)));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// SSIM of the 8x8 window made of four 4x4 blocks, with x264's constants
+// (scaled for sums over 64 pixels).
+double ssim_window(const BlockSums &topLeft, const BlockSums &topRight, const BlockSums &bottomLeft, const BlockSums &bottomRight)
+{
+    constexpr double dC1 = 0.01 * 0.01 * 255.0 * 255.0 * 64.0;
+    constexpr double dC2 = 0.03 * 0.03 * 255.0 * 255.0 * 64.0 * 63.0;
+
+    double arrSums[4];
+    for (std::size_t i = 0; i < 4; ++i)
+    {
+        arrSums[i] = static_cast<double>(topLeft[i]) + topRight[i] + bottomLeft[i] + bottomRight[i];
+    }
+    const double dS1 = arrSums[0];
+    const double dS2 = arrSums[1];
+    const double dVariances = arrSums[2] * 64.0 - dS1 * dS1 - dS2 * dS2;
+    const double dCovariance = arrSums[3] * 64.0 - dS1 * dS2;
+    return (2.0 * dS1 * dS2 + dC1) * (2.0 * dCovariance + dC2) / ((dS1 * dS1 + dS2 * dS2 + dC1) * (dVariances + dC2));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Mean SSIM over the 8x8 windows every 4 pixels; each row of block sums
+// is computed once and used for the windows above and below it.
+double ssim_plane(const BlockSumsKernel pfnSums,
+                  const uint8_t *pA,
+                  const int nStrideA,
+                  const uint8_t *pB,
+                  const int nStrideB,
+                  const int nWidth,
+                  const int nHeight,
+                  std::vector<BlockSums> &inout_vecSums)
+{
+    const int nBlocksX = nWidth / 4;
+    const int nBlocksY = nHeight / 4;
+    if (nBlocksX < 2 || nBlocksY < 2)
+    {
+        return 1.0;
+    }
+
+    inout_vecSums.resize(static_cast<std::size_t>(nBlocksX) * 2);
+    double dSum{0.0};
+    for (int y = 0; y < nBlocksY; ++y)
+    {
+        BlockSums *pCur = inout_vecSums.data() + static_cast<std::ptrdiff_t>(y % 2) * nBlocksX;
+        pfnSums(pA + static_cast<std::ptrdiff_t>(y) * 4 * nStrideA, nStrideA, pB + static_cast<std::ptrdiff_t>(y) * 4 * nStrideB, nStrideB, nBlocksX, pCur);
+        if (y == 0)
+        {
+            continue;
+        }
+
+        const BlockSums *pAbove = inout_vecSums.data() + static_cast<std::ptrdiff_t>((y - 1) % 2) * nBlocksX;
+        for (int x = 0; x + 1 < nBlocksX; ++x)
+        {
+            dSum += ssim_window(pAbove[x], pAbove[x + 1], pCur[x], pCur[x + 1]);
+        }
+    }
+    return dSum / (static_cast<double>(nBlocksX - 1) * (nBlocksY - 1));
+}
+
+//////////////////////////////////////////////////////////////////////////
+double ssim_to_db(const double dSsim)
+{
+    return dSsim < 1.0 ? -10.0 * std::log10(1.0 - dSsim) : g_dMaxPsnr;
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+QualityMeter::QualityMeter(const AVCodecContext *pEncoder, const QualityConfig &config)
+    : m_config(config),
+      m_eCodecId(pEncoder->codec_id),
+      m_timeBase(pEncoder->time_base),
+      m_apDecoded(av_frame_alloc())
+{
+    if (pEncoder->extradata != nullptr && pEncoder->extradata_size > 0)
+    {
+        m_vecExtradata.assign(pEncoder->extradata, pEncoder->extradata + pEncoder->extradata_size);
+    }
+
+    m_stats.nInterval = config.nInterval;
+    m_stats.eSimd = detect_simd_level();
+    m_stats.dFrameRate = pEncoder->framerate.num > 0 && pEncoder->framerate.den > 0
+        ? av_q2d(pEncoder->framerate)
+        : 1.0 / av_q2d(pEncoder->time_base);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool QualityMeter::open(const std::string &strLogPath)
+{
+    const AVCodec *pCodec = avcodec_find_decoder(m_eCodecId);
+    if (pCodec == nullptr)
+    {
+        std::cerr << "No decoder to meter the output quality with" << std::endl;
+        return false;
+    }
+
+    m_apDecoder.reset(avcodec_alloc_context3(pCodec));
+    if (!m_apDecoder || !m_apDecoded)
+    {
+        std::cerr << "Could not allocate the quality meter's decoder" << std::endl;
+        return false;
+    }
+
+    if (!m_vecExtradata.empty())
+    {
+        m_apDecoder->extradata = static_cast<uint8_t *>(av_mallocz(m_vecExtradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+        if (m_apDecoder->extradata == nullptr)
+        {
+            std::cerr << "Could not allocate the quality meter's decoder" << std::endl;
+            return false;
+        }
+        std::memcpy(m_apDecoder->extradata, m_vecExtradata.data(), m_vecExtradata.size());
+        m_apDecoder->extradata_size = static_cast<int>(m_vecExtradata.size());
+    }
+    m_apDecoder->time_base = m_timeBase;
+    m_apDecoder->pkt_timebase = m_timeBase;
+
+    // One thread, so that the frames to skip can be picked per packet.
+    m_apDecoder->thread_count = 1;
+
+    if (int ret = avcodec_open2(m_apDecoder.get(), pCodec, nullptr); ret < 0)
+    {
+        std::cerr << "Could not open the quality meter's decoder: " << error_code_to_string(ret) << std::endl;
+        return false;
+    }
+
+    if (!strLogPath.empty())
+    {
+        m_log.open(strLogPath);
+        if (!m_log)
+        {
+            std::cerr << "Could not open quality log '" << strLogPath << "'" << std::endl;
+            return false;
+        }
+        m_log << "kind,number,bits,psnr_y,psnr_u,psnr_v,psnr,ssim\n"
+              << std::fixed << std::setprecision(4);
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool QualityMeter::add_source(const int64_t nFrame, const AVFrame *pFrame)
+{
+    if (!m_apBuffers)
+    {
+        m_apBuffers = std::make_unique<VideoBufferPool>(pFrame->width, pFrame->height, AV_PIX_FMT_YUV420P);
+    }
+
+    FramePtr apCopy;
+    if (!m_vecFreeSources.empty())
+    {
+        apCopy = std::move(m_vecFreeSources.back());
+        m_vecFreeSources.pop_back();
+    }
+    else
+    {
+        apCopy.reset(av_frame_alloc());
+    }
+    if (!apCopy || !m_apBuffers->get_buffer(apCopy.get()))
+    {
+        std::cerr << "Could not allocate a quality meter source frame" << std::endl;
+        return false;
+    }
+
+    if (int ret = av_frame_copy(apCopy.get(), pFrame); ret < 0)
+    {
+        std::cerr << "Could not copy a source frame for the quality meter: " << error_code_to_string(ret) << std::endl;
+        return false;
+    }
+    m_mapSources[nFrame] = std::move(apCopy);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool QualityMeter::add_packet(const AVPacket *pPkt)
+{
+    if (pPkt != nullptr && pPkt->pts != AV_NOPTS_VALUE)
+    {
+        const int64_t nFrame = pPkt->pts / m_timeBase.num;
+        ++m_stats.nPackets;
+        m_stats.nBytes += static_cast<uint64_t>(pPkt->size);
+        m_mapFrameBytes[nFrame] = pPkt->size;
+        m_mapGops[(pPkt->flags & AV_PKT_FLAG_KEY) != 0 ? nFrame : gop_of(nFrame)].nBytes += static_cast<uint64_t>(pPkt->size);
+
+        // Frames nothing refers to are only worth decoding if they are metered.
+        m_apDecoder->skip_frame = sampled(nFrame) ? AVDISCARD_DEFAULT : AVDISCARD_NONREF;
+    }
+
+    if (int ret = avcodec_send_packet(m_apDecoder.get(), pPkt); ret < 0)
+    {
+        std::cerr << "Quality meter could not decode a packet: " << error_code_to_string(ret) << std::endl;
+        return false;
+    }
+
+    if (int ret = receive_frames(); ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+    {
+        std::cerr << "Quality meter could not decode a frame: " << error_code_to_string(ret) << std::endl;
+        return false;
+    }
+
+    if (pPkt == nullptr)
+    {
+        close_gops(INT64_MAX);
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Decoded frames come out in display order, so each one completes every
+// GOP before its own, and the sources before it can no longer be matched.
+int QualityMeter::receive_frames()
+{
+    while (true)
+    {
+        if (int ret = avcodec_receive_frame(m_apDecoder.get(), m_apDecoded.get()); ret != 0)
+        {
+            return ret;
+        }
+
+        const int64_t nPts = m_apDecoded->pts;
+        if (nPts != AV_NOPTS_VALUE)
+        {
+            const int64_t nFrame = nPts / m_timeBase.num;
+            close_gops(gop_of(nFrame));
+            if (sampled(nFrame))
+            {
+                meter_frame(nFrame, m_apDecoded.get());
+            }
+
+            m_mapFrameBytes.erase(m_mapFrameBytes.begin(), m_mapFrameBytes.upper_bound(nFrame));
+            for (auto it = m_mapSources.begin(); it != m_mapSources.end() && it->first <= nFrame; it = m_mapSources.erase(it))
+            {
+                av_frame_unref(it->second.get());
+                m_vecFreeSources.push_back(std::move(it->second));
+            }
+        }
+        av_frame_unref(m_apDecoded.get());
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void QualityMeter::meter_frame(const int64_t nFrame, const AVFrame *pDecoded)
+{
+    const auto itSource = m_mapSources.find(nFrame);
+    const AVFrame *pSource = itSource != m_mapSources.end() ? itSource->second.get() : nullptr;
+    if (pSource == nullptr
+        || pDecoded->format != AV_PIX_FMT_YUV420P
+        || pDecoded->width != pSource->width
+        || pDecoded->height != pSource->height)
+    {
+        ++m_stats.nSkipped;
+        return;
+    }
+
+    const SseKernel pfnSse = sse_kernel_for(m_stats.eSimd);
+    double arrPsnr[3];
+    uint64_t nSse{0};
+    uint64_t nSamples{0};
+    for (int nPlane = 0; nPlane < 3; ++nPlane)
+    {
+        const int nWidth = nPlane == 0 ? pSource->width : (pSource->width + 1) / 2;
+        const int nHeight = nPlane == 0 ? pSource->height : (pSource->height + 1) / 2;
+        const uint64_t nPlaneSse = pfnSse(pSource->data[nPlane],
+                                          pSource->linesize[nPlane],
+                                          pDecoded->data[nPlane],
+                                          pDecoded->linesize[nPlane],
+                                          nWidth,
+                                          nHeight);
+        const auto nPlaneSamples = static_cast<uint64_t>(nWidth) * static_cast<uint64_t>(nHeight);
+        arrPsnr[nPlane] = psnr(nPlaneSse, nPlaneSamples);
+        m_stats.arrSse[nPlane] += nPlaneSse;
+        m_stats.arrSamples[nPlane] += nPlaneSamples;
+        nSse += nPlaneSse;
+        nSamples += nPlaneSamples;
+    }
+    const double dPsnr = psnr(nSse, nSamples);
+    const double dSsim = ssim_plane(block_sums_kernel_for(m_stats.eSimd),
+                                    pSource->data[0],
+                                    pSource->linesize[0],
+                                    pDecoded->data[0],
+                                    pDecoded->linesize[0],
+                                    pSource->width,
+                                    pSource->height,
+                                    m_vecSsimSums);
+
+    if (m_stats.nFrames == 0 || arrPsnr[0] < m_stats.dMinPsnrY)
+    {
+        m_stats.dMinPsnrY = arrPsnr[0];
+        m_stats.nMinPsnrFrame = nFrame;
+    }
+    ++m_stats.nFrames;
+    m_stats.dSumPsnrY += arrPsnr[0];
+    m_stats.dSumPsnrU += arrPsnr[1];
+    m_stats.dSumPsnrV += arrPsnr[2];
+    m_stats.dSumPsnr += dPsnr;
+    m_stats.dSumSsim += dSsim;
+
+    Gop &gop = m_mapGops[gop_of(nFrame)];
+    ++gop.nFrames;
+    gop.dSumPsnrY += arrPsnr[0];
+    gop.dSumPsnrU += arrPsnr[1];
+    gop.dSumPsnrV += arrPsnr[2];
+    gop.dSumPsnr += dPsnr;
+    gop.dSumSsim += dSsim;
+
+    if (m_log.is_open())
+    {
+        const auto itBytes = m_mapFrameBytes.find(nFrame);
+        m_log << "frame,"
+              << nFrame << ","
+              << (itBytes != m_mapFrameBytes.end() ? itBytes->second * 8 : 0) << ","
+              << arrPsnr[0] << ","
+              << arrPsnr[1] << ","
+              << arrPsnr[2] << ","
+              << dPsnr << ","
+              << dSsim << "\n";
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// The GOP of the last keyframe at or before nFrame. The encoder codes
+// closed GOPs, so a frame never comes after the next keyframe in decode
+// order, and its GOP is still open. A stream that does not start with a
+// keyframe gets its first GOP at its first frame.
+int64_t QualityMeter::gop_of(const int64_t nFrame) const
+{
+    const auto it = m_mapGops.upper_bound(nFrame);
+    return it != m_mapGops.begin() ? std::prev(it)->first : nFrame;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Adds the GOPs before nBefore, now complete, to the stats and the log. A
+// GOP row has the bits of the whole GOP and the means over its metered
+// frames.
+void QualityMeter::close_gops(const int64_t nBefore)
+{
+    const auto itEnd = m_mapGops.lower_bound(nBefore);
+    for (auto it = m_mapGops.begin(); it != itEnd; ++it)
+    {
+        const Gop &gop = it->second;
+        if (gop.nFrames == 0)
+        {
+            continue;
+        }
+
+        const auto dFrames = static_cast<double>(gop.nFrames);
+        const double dPsnrY = gop.dSumPsnrY / dFrames;
+        if (m_stats.nGops == 0 || dPsnrY < m_stats.dMinGopPsnrY)
+        {
+            m_stats.dMinGopPsnrY = dPsnrY;
+            m_stats.nMinGop = it->first;
+        }
+        ++m_stats.nGops;
+
+        if (m_log.is_open())
+        {
+            m_log << "gop,"
+                  << it->first << ","
+                  << gop.nBytes * 8 << ","
+                  << dPsnrY << ","
+                  << gop.dSumPsnrU / dFrames << ","
+                  << gop.dSumPsnrV / dFrames << ","
+                  << gop.dSumPsnr / dFrames << ","
+                  << gop.dSumSsim / dFrames << "\n";
+        }
+    }
+    m_mapGops.erase(m_mapGops.begin(), itEnd);
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_quality_stats(const QualityStats &stats)
+{
+    std::cout << "Quality ("
+              << simd_level_name(stats.eSimd)
+              << "): "
+              << stats.nFrames
+              << " frames metered, one in "
+              << stats.nInterval
+              << ", "
+              << stats.nSkipped
+              << " samples skipped with the meter behind"
+              << std::endl;
+    if (stats.nFrames == 0)
+    {
+        return;
+    }
+
+    const auto dFrames = static_cast<double>(stats.nFrames);
+    const double dKbps = stats.nPackets > 0
+        ? static_cast<double>(stats.nBytes) * 8.0 * stats.dFrameRate / static_cast<double>(stats.nPackets) / 1000.0
+        : 0.0;
+    const double dSsim = stats.dSumSsim / dFrames;
+    std::cout << std::fixed << std::setprecision(2)
+              << "  PSNR Y/U/V/all "
+              << stats.dSumPsnrY / dFrames
+              << "/"
+              << stats.dSumPsnrU / dFrames
+              << "/"
+              << stats.dSumPsnrV / dFrames
+              << "/"
+              << stats.dSumPsnr / dFrames
+              << " dB mean, "
+              << psnr(stats.arrSse[0] + stats.arrSse[1] + stats.arrSse[2], stats.arrSamples[0] + stats.arrSamples[1] + stats.arrSamples[2])
+              << " dB global, Y "
+              << stats.dMinPsnrY
+              << " dB at worst (frame "
+              << stats.nMinPsnrFrame
+              << ")"
+              << std::endl
+              << "  SSIM "
+              << std::setprecision(5)
+              << dSsim
+              << std::setprecision(2)
+              << " ("
+              << ssim_to_db(dSsim)
+              << " dB) mean; "
+              << stats.nGops
+              << " GOPs, mean Y "
+              << stats.dMinGopPsnrY
+              << " dB at worst (GOP at frame "
+              << stats.nMinGop
+              << "); "
+              << dKbps
+              << " kbit/s"
+              << std::defaultfloat
+              << std::endl;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "frame_pool.hpp"
+#include "media_utils.hpp"
+#include "pixel_convert.hpp"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// In-process PSNR/SSIM of an encoder's output against its input.
+//
+// libx264 does not hand its reconstruction back through libavcodec, so the
+// meter decodes the emitted packets itself, on one thread, and compares
+// the decoded pictures with copies of the frames the encoder was given.
+// Only every nInterval-th frame is compared. The other frames that no
+// later frame refers to are skipped by the decoder. Frames are matched by
+// frame number, which is the encoder PTS over the time base numerator.
+//
+// PSNR is taken per plane and over all three (from the summed squared
+// error). SSIM is x264's: luma only, over 8x8 windows every 4 pixels.
+// GOPs run from one keyframe packet to the next, so scenecut IDRs start a
+// GOP of their own, and with intra refresh each refresh period, which x264
+// flags as a keyframe, counts as one.
+// The squared error and the 4x4 block sums behind SSIM come from C, SSE4.1
+// or AVX2 kernels.
+struct QualityConfig
+{
+    // Meter every nInterval-th frame; 0 disables the metering.
+    int nInterval{0};
+
+    // Sampled source frames on their way to the meter. A sample is skipped,
+    // rather than the encoder held up, while the queue is full.
+    std::size_t nSourceQueueDepth{4};
+
+    // Per-frame and per-GOP CSV; single-output overload only, as with
+    // PipelineConfig::strVbvLogPath.
+    std::string strLogPath;
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct QualityStats
+{
+    // Frames metered, samples that never met their source, and every
+    // packet the encoder emitted.
+    uint64_t nFrames{0};
+    uint64_t nSkipped{0};
+    uint64_t nPackets{0};
+    uint64_t nBytes{0};
+
+    double dSumPsnrY{0.0};
+    double dSumPsnrU{0.0};
+    double dSumPsnrV{0.0};
+    double dSumPsnr{0.0};
+    double dSumSsim{0.0};
+
+    // Squared error and sample count per plane, for the global PSNR.
+    uint64_t arrSse[3]{};
+    uint64_t arrSamples[3]{};
+
+    double dMinPsnrY{0.0};
+    int64_t nMinPsnrFrame{0};
+
+    // GOPs with at least one metered frame, and the one with the lowest
+    // mean luma PSNR, by the number of its keyframe.
+    uint64_t nGops{0};
+    double dMinGopPsnrY{0.0};
+    int64_t nMinGop{0};
+
+    int nInterval{0};
+    double dFrameRate{0.0};
+    SimdLevel eSimd{SimdLevel::Scalar};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Meters one output. Not thread-safe: the pipeline feeds it from one
+// thread.
+class QualityMeter
+{
+public:
+    QualityMeter(const AVCodecContext *pEncoder, const QualityConfig &config);
+
+    QualityMeter(const QualityMeter &) = delete;
+    QualityMeter &operator=(const QualityMeter &) = delete;
+
+    // Opens the decoder (with the encoder's extradata) and the log, if any.
+    bool open(const std::string &strLogPath);
+
+    bool sampled(const int64_t nFrame) const { return nFrame % m_config.nInterval == 0; }
+
+    // Copies source frame nFrame (8-bit 4:2:0), before any of its packets.
+    bool add_source(int64_t nFrame, const AVFrame *pFrame);
+
+    // Decodes an encoded packet, in the encoder time base, and meters the
+    // sampled frames it completes; null flushes the decoder.
+    bool add_packet(const AVPacket *pPkt);
+
+    const QualityStats &stats() const { return m_stats; }
+
+private:
+    struct Gop
+    {
+        uint64_t nBytes{0};
+        uint64_t nFrames{0};
+        double dSumPsnrY{0.0};
+        double dSumPsnrU{0.0};
+        double dSumPsnrV{0.0};
+        double dSumPsnr{0.0};
+        double dSumSsim{0.0};
+    };
+
+    int receive_frames();
+    void meter_frame(int64_t nFrame, const AVFrame *pDecoded);
+    void close_gops(int64_t nBefore);
+    int64_t gop_of(int64_t nFrame) const;
+
+    const QualityConfig m_config;
+    const AVCodecID m_eCodecId;
+    const AVRational m_timeBase;
+    std::vector<uint8_t> m_vecExtradata;
+
+    CodecContextPtr m_apDecoder;
+    FramePtr m_apDecoded;
+
+    // Source copies waiting for their decoded frame, and the shells of the
+    // copies already metered. Declared after the buffer pool, so that the
+    // copies go first.
+    std::unique_ptr<VideoBufferPool> m_apBuffers;
+    std::map<int64_t, FramePtr> m_mapSources;
+    std::vector<FramePtr> m_vecFreeSources;
+
+    // Encoded size per frame still to be decoded, and the GOPs still open,
+    // by the frame number of their keyframe.
+    std::map<int64_t, int> m_mapFrameBytes;
+    std::map<int64_t, Gop> m_mapGops;
+
+    // Sums of two rows of 4x4 luma blocks, for SSIM: source, decoded,
+    // both squared and their product.
+    std::vector<std::array<int32_t, 4>> m_vecSsimSums;
+
+    std::ofstream m_log;
+    QualityStats m_stats;
+};
+
+//////////////////////////////////////////////////////////////////////////
+void print_quality_stats(const QualityStats &stats);
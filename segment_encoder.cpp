@@ -0,0 +1,409 @@
+#include "segment_encoder.hpp"
+#include "cbr_transcoder.hpp"
+#include "media_utils.hpp"
+#include "vbv_model.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+//////////////////////////////////////////////////////////////////////////
+struct SegmentResult
+{
+    bool bDone{false};
+    bool bOk{false};
+    std::vector<PacketPtr> vecPackets;
+};
+
+//////////////////////////////////////////////////////////////////////////
+int64_t estimate_frame_count(const AVStream *pStVideoIn, const AVRational frameRate)
+{
+    if (pStVideoIn->nb_frames > 0)
+    {
+        return pStVideoIn->nb_frames;
+    }
+    if (pStVideoIn->duration > 0)
+    {
+        return av_rescale_q(pStVideoIn->duration, pStVideoIn->time_base, av_inv_q(frameRate));
+    }
+    return -1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Encodes output frames [nStartFrame, nEndFrame) of the input, with its own
+// demuxer, decoder and encoder.
+bool encode_segment(const std::string &strInputPath,
+                    const CbrEncoderSettings &settings,
+                    const int nThreadsPerEncoder,
+                    const bool bConvertKernels,
+                    const int64_t nStartFrame,
+                    const int64_t nEndFrame,
+                    std::vector<PacketPtr> &out_vecPackets)
+{
+    out_vecPackets.clear();
+
+    InputFormatContextPtr apFmtCtxIn;
+    if (!open_input_format_context(strInputPath, apFmtCtxIn))
+    {
+        return false;
+    }
+
+    int nStreamIdx{};
+    CodecContextPtr apCdcCtxIn;
+    if (!open_decoder_context(apFmtCtxIn.get(), AVMEDIA_TYPE_VIDEO, nStreamIdx, apCdcCtxIn, {}))
+    {
+        return false;
+    }
+
+    AVStream *pStIn = apFmtCtxIn->streams[nStreamIdx];
+    const int64_t nStreamStart = pStIn->start_time != AV_NOPTS_VALUE ? pStIn->start_time : 0;
+
+    // The segment keeps every packet, so it takes them straight from the
+    // encoder rather than through pull().
+    CbrTranscoderConfig transcoderConfig{};
+    transcoderConfig.encoder = settings;
+    transcoderConfig.encoder.nThreads = nThreadsPerEncoder;
+    transcoderConfig.bConvertKernels = bConvertKernels;
+    CbrTranscoder transcoder{transcoderConfig};
+    transcoder.set_sink([&out_vecPackets](AVPacket *pPkt) -> bool
+    {
+        PacketPtr apPkt{av_packet_alloc()};
+        if (!apPkt)
+        {
+            return false;
+        }
+        av_packet_move_ref(apPkt.get(), pPkt);
+        out_vecPackets.push_back(std::move(apPkt));
+        return true;
+    });
+    if (!transcoder.open(apCdcCtxIn->width, apCdcCtxIn->height))
+    {
+        return false;
+    }
+
+    const AVRational frameRate = transcoder.encoder()->framerate;
+    const int64_t nPtsStep = transcoder.time_base().num;
+
+    if (nStartFrame > 0)
+    {
+        const int64_t nTs = nStreamStart + av_rescale_q(nStartFrame, av_inv_q(frameRate), pStIn->time_base);
+        if (int ret = av_seek_frame(apFmtCtxIn.get(), nStreamIdx, nTs, AVSEEK_FLAG_BACKWARD); ret < 0)
+        {
+            std::cerr << "Could not seek to segment start frame "
+                      << nStartFrame
+                      << ": "
+                      << error_code_to_string(ret)
+                      << std::endl;
+            return false;
+        }
+    }
+
+    PacketPtr apPkt{av_packet_alloc()};
+    FramePtr apFrame{av_frame_alloc()};
+    if (!apPkt || !apFrame)
+    {
+        return false;
+    }
+
+    int64_t nLastIdx = std::max<int64_t>(nStartFrame, 0) - 1;
+    bool bInputDone{false};
+    while (!bInputDone)
+    {
+        if (av_read_frame(apFmtCtxIn.get(), apPkt.get()) < 0)
+        {
+            // Tell our decoder EOF
+            avcodec_send_packet(apCdcCtxIn.get(), nullptr);
+            bInputDone = true;
+        }
+        else
+        {
+            if (apPkt->stream_index != nStreamIdx)
+            {
+                av_packet_unref(apPkt.get());
+                continue;
+            }
+
+            const int ret = avcodec_send_packet(apCdcCtxIn.get(), apPkt.get());
+            av_packet_unref(apPkt.get());
+            if (ret < 0)
+            {
+                std::cerr << "Unexpected error received from segment decoder (avcodec_send_packet): "
+                          << error_code_to_string(ret)
+                          << std::endl;
+                return false;
+            }
+        }
+
+        int ret{};
+        while ((ret = avcodec_receive_frame(apCdcCtxIn.get(), apFrame.get())) == 0)
+        {
+            // Frames are numbered by timestamp, so every segment agrees on
+            // where the joins are.
+            const int64_t nTs = apFrame->best_effort_timestamp;
+            const int64_t nIdx = nTs != AV_NOPTS_VALUE
+                ? av_rescale_q(nTs - nStreamStart, pStIn->time_base, av_inv_q(frameRate))
+                : nLastIdx + 1;
+
+            if (nIdx < nStartFrame)
+            {
+                // Pre-roll from the keyframe we seeked to.
+                av_frame_unref(apFrame.get());
+                continue;
+            }
+            if (nIdx >= nEndFrame)
+            {
+                // The next segment's first frame; we are done here.
+                av_frame_unref(apFrame.get());
+                bInputDone = true;
+                break;
+            }
+            nLastIdx = nIdx;
+
+            apFrame->pts = nIdx * nPtsStep;
+            const CbrTranscoderStatus eStatus = transcoder.push(apFrame.get());
+            av_frame_unref(apFrame.get());
+            if (eStatus != CbrTranscoderStatus::Ok)
+            {
+                return false;
+            }
+        }
+
+        if (ret != 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+        {
+            std::cerr << "Unexpected error received from segment decoder (avcodec_receive_frame): "
+                      << error_code_to_string(ret)
+                      << std::endl;
+            return false;
+        }
+        if (ret == AVERROR_EOF)
+        {
+            bInputDone = true;
+        }
+    }
+
+    // Flush the encoder; a closed segment ends on a complete GOP.
+    return transcoder.flush() == CbrTranscoderStatus::Ok;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Would this segment, started at dStartFullness, violate the VBV? A quiet
+// trial: the caller reports the outcome.
+bool segment_violates_vbv(const VbvConfig &config,
+                          const AVRational timeBase,
+                          const double dStartFullness,
+                          const std::vector<PacketPtr> &vecPackets)
+{
+    VbvConfig trialConfig = config;
+    trialConfig.nInitialBits = std::llround(dStartFullness);
+    trialConfig.bFailFast = false;
+    trialConfig.bQuiet = true;
+
+    VbvModel trial{trialConfig, timeBase};
+    VbvFrameState state{};
+    for (const PacketPtr &apPkt : vecPackets)
+    {
+        trial.add_frame(apPkt->dts, apPkt->size, state);
+    }
+    return trial.stats().nUnderflows + trial.stats().nOverflows > 0;
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+bool run_segment_parallel_encode(const std::string &strInputPath,
+                                 const AVStream *pStVideoIn,
+                                 const CbrEncoderSettings &settings,
+                                 const SegmentConfig &config,
+                                 AVFormatContext *pFmtCtxOut,
+                                 AVCodecContext *pCdcCtxOut,
+                                 AVStream *pStVideoOut,
+                                 const PipelineConfig &pipelineConfig)
+{
+    const int64_t nTotalFrames = estimate_frame_count(pStVideoIn, pCdcCtxOut->framerate);
+    if (nTotalFrames <= 0)
+    {
+        std::cerr << "Segment-parallel encoding needs an input with a known duration" << std::endl;
+        return false;
+    }
+
+    const int64_t nSegmentFrames = static_cast<int64_t>(std::max(settings.nGopSize, 1)) * std::max(config.nGopsPerSegment, 1);
+    const std::size_t nSegments = static_cast<std::size_t>((nTotalFrames + nSegmentFrames - 1) / nSegmentFrames);
+
+    const std::size_t nHwThreads = std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    const std::size_t nWorkers = std::min(config.nWorkers > 0 ? config.nWorkers : nHwThreads, nSegments);
+    const int nThreadsPerEncoder = static_cast<int>(std::max<std::size_t>(nHwThreads / nWorkers, 1));
+    const bool bConvertKernels = pipelineConfig.eConvertMethod == ConvertMethod::Kernels;
+
+    // Segment k covers [start, end); the first and last are open-ended so
+    // nothing at either extreme of the input is dropped.
+    auto fnStart = [&](const std::size_t k) -> int64_t
+    {
+        return k == 0 ? std::numeric_limits<int64_t>::min() : static_cast<int64_t>(k) * nSegmentFrames;
+    };
+    auto fnEnd = [&](const std::size_t k) -> int64_t
+    {
+        return k + 1 == nSegments ? std::numeric_limits<int64_t>::max() : static_cast<int64_t>(k + 1) * nSegmentFrames;
+    };
+
+    std::vector<SegmentResult> vecResults(nSegments);
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::size_t nNextSegment{0};
+    std::size_t nMuxedSegments{0};
+    bool bAbort{false};
+
+    // Limit how far encoding may run ahead of muxing, to bound memory.
+    const std::size_t nWindow = 2 * nWorkers;
+
+    auto fnWorker = [&]()
+    {
+        while (true)
+        {
+            std::size_t k{};
+            {
+                std::unique_lock<std::mutex> lock{mtx};
+                cv.wait(lock, [&] { return bAbort || nNextSegment < nMuxedSegments + nWindow; });
+                if (bAbort || nNextSegment >= nSegments)
+                {
+                    return;
+                }
+                k = nNextSegment++;
+            }
+
+            std::vector<PacketPtr> vecPackets;
+            const bool bOk = encode_segment(strInputPath, settings, nThreadsPerEncoder, bConvertKernels, fnStart(k), fnEnd(k), vecPackets);
+
+            {
+                std::lock_guard<std::mutex> lock{mtx};
+                vecResults[k].vecPackets = std::move(vecPackets);
+                vecResults[k].bOk = bOk;
+                vecResults[k].bDone = true;
+            }
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> vecWorkers;
+    for (std::size_t i = 0; i < nWorkers; ++i)
+    {
+        vecWorkers.emplace_back(fnWorker);
+    }
+
+    VbvModel vbv{VbvModel::config_from_encoder(pCdcCtxOut, pipelineConfig.bVbvFailFast), pCdcCtxOut->time_base};
+    bool bOk = pipelineConfig.strVbvLogPath.empty() || vbv.open_log(pipelineConfig.strVbvLogPath);
+
+    std::size_t nRepairs{0};
+    for (std::size_t k = 0; bOk && k < nSegments; ++k)
+    {
+        std::vector<PacketPtr> vecPackets;
+        {
+            std::unique_lock<std::mutex> lock{mtx};
+            cv.wait(lock, [&] { return vecResults[k].bDone; });
+            bOk = vecResults[k].bOk;
+            vecPackets = std::move(vecResults[k].vecPackets);
+        }
+        if (!bOk)
+        {
+            std::cerr << "Encoding of segment " << k << " failed. Cannot continue." << std::endl;
+            break;
+        }
+
+        // Re-encode the segment if the buffer level the previous one left
+        // behind would make it under/overflow. The first encode is
+        // optimistic: it starts from the default initial occupancy, and only
+        // the repair is told the real one. A repair that still violates
+        // fails the encode.
+        if (k > 0 && vbv.enabled() && !vecPackets.empty())
+        {
+            const double dStartFullness = vbv.fullness_at(vecPackets.front()->dts);
+            if (segment_violates_vbv(vbv.config(), pCdcCtxOut->time_base, dStartFullness, vecPackets))
+            {
+                CbrEncoderSettings repairSettings = settings;
+                repairSettings.nInitialOccupancy = std::llround(dStartFullness);
+
+                // The workers are still encoding the segments ahead, so the
+                // repair takes a worker's share of the threads, not all.
+                ++nRepairs;
+                if (!encode_segment(strInputPath, repairSettings, nThreadsPerEncoder, bConvertKernels, fnStart(k), fnEnd(k), vecPackets))
+                {
+                    std::cerr << "Re-encoding of segment " << k << " failed. Cannot continue." << std::endl;
+                    bOk = false;
+                    break;
+                }
+                if (segment_violates_vbv(vbv.config(), pCdcCtxOut->time_base, dStartFullness, vecPackets))
+                {
+                    std::cerr << "Segment " << k << " still violates the VBV after re-encoding. Cannot continue." << std::endl;
+                    bOk = false;
+                    break;
+                }
+            }
+        }
+
+        for (PacketPtr &apPkt : vecPackets)
+        {
+            VbvFrameState vbvState{};
+            if (vbv.enabled() && !vbv.add_frame(apPkt->dts, apPkt->size, vbvState))
+            {
+                std::cerr << "VBV violation with fail-fast enabled. Cannot continue." << std::endl;
+                bOk = false;
+                break;
+            }
+
+            av_packet_rescale_ts(apPkt.get(), pCdcCtxOut->time_base, pStVideoOut->time_base);
+            apPkt->stream_index = pStVideoOut->index;
+
+            if (int ret = av_interleaved_write_frame(pFmtCtxOut, apPkt.get()); ret != 0)
+            {
+                std::cerr << "Unexpected error writing packet to IO. Cannot continue. Error: "
+                          << error_code_to_string(ret)
+                          << std::endl;
+                bOk = false;
+                break;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{mtx};
+            nMuxedSegments = k + 1;
+        }
+        cv.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock{mtx};
+        bAbort = true;
+    }
+    cv.notify_all();
+
+    for (std::thread &thWorker : vecWorkers)
+    {
+        thWorker.join();
+    }
+
+    std::cout << "Segment-parallel encode: "
+              << nSegments
+              << " segments of "
+              << nSegmentFrames
+              << " frames on "
+              << nWorkers
+              << " workers, "
+              << nRepairs
+              << " re-encoded for VBV continuity"
+              << std::endl;
+    if (vbv.enabled())
+    {
+        print_vbv_stats(vbv);
+    }
+
+    return bOk;
+}
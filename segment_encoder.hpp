@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "encoder_settings.hpp"
+#include "pipeline.hpp"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// GOP-parallel encoding for file (non-live) jobs.
+//
+// The input is cut into segments of nGopsPerSegment closed GOPs. Each
+// segment is decoded and encoded by an independent decoder/x264 pair on a
+// worker thread (seeking to the nearest keyframe before the segment and
+// discarding pre-roll). Segments are then muxed in order by the single
+// output muxer, so continuity counters and PCR run on unbroken, and since
+// every encoder stamps PTS from the global frame index, PTS/DTS continue
+// seamlessly across the joins.
+//
+// VBV: every segment encoder starts from the default initial occupancy. As
+// segments are stitched, each one is checked against the buffer level the
+// previous segment actually left behind; if that would under/overflow,
+// the segment is re-encoded with its initial occupancy set to that level.
+struct SegmentConfig
+{
+    // Number of concurrent segment encoders; 0 = one per hardware thread.
+    std::size_t nWorkers{0};
+    int nGopsPerSegment{10};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// pCdcCtxOut/pStVideoOut are the already opened reference encoder and its
+// output stream (header written); they supply the time bases and VBV
+// settings, the reference encoder itself is never fed.
+bool run_segment_parallel_encode(const std::string &strInputPath,
+                                 const AVStream *pStVideoIn,
+                                 const CbrEncoderSettings &settings,
+                                 const SegmentConfig &config,
+                                 AVFormatContext *pFmtCtxOut,
+                                 AVCodecContext *pCdcCtxOut,
+                                 AVStream *pStVideoOut,
+                                 const PipelineConfig &pipelineConfig);
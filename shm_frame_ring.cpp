@@ -0,0 +1,476 @@
+#include "shm_frame_ring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavutil/buffer.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/pixdesc.h>
+}
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "the ring counters are shared between processes");
+
+namespace
+{
+
+// "X264SHM1", read as a little-endian uint64_t.
+constexpr uint64_t g_nRingMagic = 0x314D485334363258ull;
+constexpr char g_szPathPrefix[] = "shm:";
+
+// Consumer poll interval while the ring is empty; small next to a frame.
+constexpr std::chrono::microseconds g_pollInterval{200};
+
+std::atomic<bool> g_bStopProducer{false};
+
+//////////////////////////////////////////////////////////////////////////
+// A header the consumer can trust: 8-bit 4:2:0, as the producer writes,
+// with every plane inside its slot and every slot inside the mapping.
+bool valid_ring_header(const ShmFrameRingHeader &header, const std::size_t nMapSize)
+{
+    if (header.nSlots == 0
+        || header.nWidth <= 0
+        || header.nHeight <= 0
+        || header.nPixFmt != AV_PIX_FMT_YUV420P
+        || header.nFrameRateNum <= 0
+        || header.nFrameRateDen <= 0
+        || header.nSlotsOffset < sizeof(ShmFrameRingHeader) + header.nSlots * sizeof(ShmFrameSlotInfo)
+        || header.nSlotsOffset > nMapSize
+        || header.nSlotSize > (nMapSize - header.nSlotsOffset) / header.nSlots)
+    {
+        return false;
+    }
+
+    const uint64_t arrWidth[3] = {static_cast<uint64_t>(header.nWidth),
+                                  static_cast<uint64_t>(header.nWidth + 1) / 2,
+                                  static_cast<uint64_t>(header.nWidth + 1) / 2};
+    const uint64_t arrHeight[3] = {static_cast<uint64_t>(header.nHeight),
+                                   static_cast<uint64_t>(header.nHeight + 1) / 2,
+                                   static_cast<uint64_t>(header.nHeight + 1) / 2};
+    for (int i = 0; i < 3; ++i)
+    {
+        const auto nLinesize = static_cast<uint64_t>(header.arrLinesize[i]);
+        if (header.arrLinesize[i] <= 0
+            || nLinesize < arrWidth[i]
+            || header.arrPlaneOffset[i] > header.nSlotSize
+            || nLinesize * arrHeight[i] > header.nSlotSize - header.arrPlaneOffset[i])
+        {
+            return false;
+        }
+    }
+    return header.arrLinesize[3] == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// "shm:capture0" -> "/capture0"
+std::string shm_name(const std::string &strPath)
+{
+    const std::string strName = strPath.substr(sizeof(g_szPathPrefix) - 1);
+    return strName.empty() || strName.front() == '/' ? strName : "/" + strName;
+}
+
+//////////////////////////////////////////////////////////////////////////
+std::size_t align_up(const std::size_t n, const std::size_t nAlign)
+{
+    return (n + nAlign - 1) / nAlign * nAlign;
+}
+
+//////////////////////////////////////////////////////////////////////////
+int64_t monotonic_ns()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+//////////////////////////////////////////////////////////////////////////
+extern "C" void stop_producer(int)
+{
+    g_bStopProducer.store(true);
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+ShmFrameRing::~ShmFrameRing()
+{
+    if (m_pMap != nullptr)
+    {
+        munmap(m_pMap, m_nMapSize);
+    }
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool ShmFrameRing::is_ring_path(const std::string &strPath)
+{
+    return strPath.rfind(g_szPathPrefix, 0) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool ShmFrameRing::open(const std::string &strPath)
+{
+    const std::string strName = shm_name(strPath);
+    m_fd = shm_open(strName.c_str(), O_RDWR, 0);
+    if (m_fd < 0)
+    {
+        std::cerr << "Could not open shared memory '" << strName << "': " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct stat st{};
+    if (fstat(m_fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(ShmFrameRingHeader))
+    {
+        std::cerr << "Shared memory '" << strName << "' is not a frame ring" << std::endl;
+        return false;
+    }
+    m_nMapSize = static_cast<std::size_t>(st.st_size);
+
+    void *pMap = mmap(nullptr, m_nMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (pMap == MAP_FAILED)
+    {
+        std::cerr << "Could not map shared memory '" << strName << "': " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    m_pMap = static_cast<uint8_t *>(pMap);
+    m_pHeader = reinterpret_cast<ShmFrameRingHeader *>(m_pMap);
+
+    // The acquire pairs with the producer's release of the magic, so the
+    // rest of the header is complete once it is seen.
+    const ShmFrameRingHeader &header = *m_pHeader;
+    if (header.nMagic.load(std::memory_order_acquire) != g_nRingMagic || !valid_ring_header(header, m_nMapSize))
+    {
+        std::cerr << "Shared memory '" << strName << "' has no valid frame ring header" << std::endl;
+        m_pHeader = nullptr;
+        return false;
+    }
+    m_pSlotInfo = reinterpret_cast<const ShmFrameSlotInfo *>(m_pMap + sizeof(ShmFrameRingHeader));
+
+    m_vecSlotRelease.resize(header.nSlots);
+    m_vecReleased.assign(header.nSlots, false);
+
+    // Whatever is queued from before we attached is stale; hand it back.
+    m_nFirst = m_pHeader->nPublished.load(std::memory_order_acquire);
+    m_nNext = m_nFirst;
+    m_nReleased = m_nFirst;
+    m_pHeader->nReleased.store(m_nFirst, std::memory_order_release);
+
+    const char *pszPixFmt = av_get_pix_fmt_name(pixel_format());
+    std::cout << "Attached to frame ring "
+              << strName
+              << ": "
+              << header.nWidth
+              << "x"
+              << header.nHeight
+              << " "
+              << (pszPixFmt != nullptr ? pszPixFmt : "unknown")
+              << " at "
+              << header.nFrameRateNum
+              << "/"
+              << header.nFrameRateDen
+              << " fps, "
+              << header.nSlots
+              << " slots"
+              << std::endl;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+ShmFrameRing::Status ShmFrameRing::acquire(AVFrame *out_pFrame, const std::atomic<bool> &bAbort)
+{
+    ShmFrameRingHeader &header = *m_pHeader;
+    while (header.nPublished.load(std::memory_order_acquire) <= m_nNext)
+    {
+        // Published frames are drained before the end of stream counts.
+        if (header.nClosed.load(std::memory_order_acquire) != 0
+            && header.nPublished.load(std::memory_order_acquire) <= m_nNext)
+        {
+            return Status::Eos;
+        }
+        if (bAbort.load())
+        {
+            return Status::Aborted;
+        }
+        ++m_nWaits;
+        std::this_thread::sleep_for(g_pollInterval);
+    }
+
+    const std::size_t nSlot = static_cast<std::size_t>(m_nNext % header.nSlots);
+    uint8_t *pSlot = m_pMap + header.nSlotsOffset + nSlot * header.nSlotSize;
+
+    SlotRelease &slotRelease = m_vecSlotRelease[nSlot];
+    slotRelease = SlotRelease{this, m_nNext};
+    AVBufferRef *pBuf = av_buffer_create(pSlot,
+                                         static_cast<int>(header.nSlotSize),
+                                         &ShmFrameRing::release_slot,
+                                         &slotRelease,
+                                         AV_BUFFER_FLAG_READONLY);
+    if (pBuf == nullptr)
+    {
+        std::cerr << "Could not wrap frame ring slot" << std::endl;
+        return Status::Error;
+    }
+
+    out_pFrame->buf[0] = pBuf;
+    for (int i = 0; i < 4; ++i)
+    {
+        out_pFrame->data[i] = header.arrLinesize[i] > 0 ? pSlot + header.arrPlaneOffset[i] : nullptr;
+        out_pFrame->linesize[i] = header.arrLinesize[i];
+    }
+    out_pFrame->width = header.nWidth;
+    out_pFrame->height = header.nHeight;
+    out_pFrame->format = header.nPixFmt;
+    out_pFrame->interlaced_frame = header.nFieldOrder != AV_FIELD_PROGRESSIVE && header.nFieldOrder != AV_FIELD_UNKNOWN;
+    out_pFrame->top_field_first = header.nFieldOrder == AV_FIELD_TT || header.nFieldOrder == AV_FIELD_TB;
+
+    const int64_t nCaptureNs = m_pSlotInfo[nSlot].nCaptureNs;
+    out_pFrame->reordered_opaque = nCaptureNs;
+    out_pFrame->best_effort_timestamp = nCaptureNs / 1000;
+    out_pFrame->pts = out_pFrame->best_effort_timestamp;
+
+    ++m_nNext;
+    return Status::Frame;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void ShmFrameRing::release_slot(void *pOpaque, uint8_t *)
+{
+    const SlotRelease *pSlotRelease = static_cast<const SlotRelease *>(pOpaque);
+    pSlotRelease->pRing->release(pSlotRelease->nFrame);
+}
+
+//////////////////////////////////////////////////////////////////////////
+void ShmFrameRing::release(const uint64_t nFrame)
+{
+    const std::lock_guard<std::mutex> lock{m_mutexRelease};
+    const uint32_t nSlots = m_pHeader->nSlots;
+    m_vecReleased[static_cast<std::size_t>(nFrame % nSlots)] = true;
+
+    // The producer gets slots back in order only.
+    const uint64_t nReleasedBefore = m_nReleased;
+    while (m_nReleased < nFrame + nSlots && m_vecReleased[static_cast<std::size_t>(m_nReleased % nSlots)])
+    {
+        m_vecReleased[static_cast<std::size_t>(m_nReleased % nSlots)] = false;
+        ++m_nReleased;
+    }
+    if (m_nReleased != nReleasedBefore)
+    {
+        m_pHeader->nReleased.store(m_nReleased, std::memory_order_release);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+ShmFrameRingProducer::~ShmFrameRingProducer()
+{
+    if (m_pMap != nullptr)
+    {
+        munmap(m_pMap, m_nMapSize);
+    }
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        shm_unlink(m_strName.c_str());
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool ShmFrameRingProducer::create(const std::string &strPath, const ShmFrameRingFormat &format)
+{
+    if (format.nWidth <= 0 || format.nHeight <= 0 || format.nWidth % 2 != 0 || format.nHeight % 2 != 0 || format.nSlots == 0)
+    {
+        std::cerr << "Invalid frame ring format" << std::endl;
+        return false;
+    }
+
+    // 4:2:0 planes with 64-byte aligned rows; every slot starts on a page.
+    const auto nPageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    const std::size_t nLumaStride = align_up(static_cast<std::size_t>(format.nWidth), 64);
+    const std::size_t nChromaStride = align_up(static_cast<std::size_t>(format.nWidth / 2), 64);
+    const std::size_t nLumaSize = nLumaStride * static_cast<std::size_t>(format.nHeight);
+    const std::size_t nChromaSize = nChromaStride * static_cast<std::size_t>(format.nHeight / 2);
+    const std::size_t nSlotSize = align_up(nLumaSize + 2 * nChromaSize, nPageSize);
+    const std::size_t nSlotsOffset = align_up(sizeof(ShmFrameRingHeader) + format.nSlots * sizeof(ShmFrameSlotInfo), nPageSize);
+    m_nMapSize = nSlotsOffset + format.nSlots * nSlotSize;
+
+    m_strName = shm_name(strPath);
+    shm_unlink(m_strName.c_str());
+    m_fd = shm_open(m_strName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (m_fd < 0)
+    {
+        std::cerr << "Could not create shared memory '" << m_strName << "': " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (ftruncate(m_fd, static_cast<off_t>(m_nMapSize)) != 0)
+    {
+        std::cerr << "Could not size shared memory '" << m_strName << "': " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    void *pMap = mmap(nullptr, m_nMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (pMap == MAP_FAILED)
+    {
+        std::cerr << "Could not map shared memory '" << m_strName << "': " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    m_pMap = static_cast<uint8_t *>(pMap);
+
+    // The new mapping is zero-filled, so the counters start at zero; the
+    // magic goes in last.
+    m_pHeader = new (m_pMap) ShmFrameRingHeader{};
+    m_pSlotInfo = reinterpret_cast<ShmFrameSlotInfo *>(m_pMap + sizeof(ShmFrameRingHeader));
+    ShmFrameRingHeader &header = *m_pHeader;
+    header.nSlots = format.nSlots;
+    header.nWidth = format.nWidth;
+    header.nHeight = format.nHeight;
+    header.nPixFmt = AV_PIX_FMT_YUV420P;
+    header.nFieldOrder = format.eFieldOrder;
+    header.nFrameRateNum = format.frameRate.num;
+    header.nFrameRateDen = format.frameRate.den;
+    header.arrLinesize[0] = static_cast<int32_t>(nLumaStride);
+    header.arrLinesize[1] = static_cast<int32_t>(nChromaStride);
+    header.arrLinesize[2] = static_cast<int32_t>(nChromaStride);
+    header.arrPlaneOffset[1] = nLumaSize;
+    header.arrPlaneOffset[2] = nLumaSize + nChromaSize;
+    header.nSlotSize = nSlotSize;
+    header.nSlotsOffset = nSlotsOffset;
+    header.nMagic.store(g_nRingMagic, std::memory_order_release);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool ShmFrameRingProducer::begin_frame(uint8_t *(&out_arrData)[4], int (&out_arrLinesize)[4])
+{
+    ShmFrameRingHeader &header = *m_pHeader;
+    if (m_nNext - header.nReleased.load(std::memory_order_acquire) >= header.nSlots)
+    {
+        header.nDropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint8_t *pSlot = m_pMap + header.nSlotsOffset + static_cast<std::size_t>(m_nNext % header.nSlots) * header.nSlotSize;
+    for (int i = 0; i < 4; ++i)
+    {
+        out_arrData[i] = header.arrLinesize[i] > 0 ? pSlot + header.arrPlaneOffset[i] : nullptr;
+        out_arrLinesize[i] = header.arrLinesize[i];
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void ShmFrameRingProducer::publish(const int64_t nCaptureNs)
+{
+    ShmFrameSlotInfo &info = m_pSlotInfo[m_nNext % m_pHeader->nSlots];
+    info.nCaptureNs = nCaptureNs;
+    info.nSequence = m_nNext;
+
+    ++m_nNext;
+    m_pHeader->nPublished.store(m_nNext, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////
+void ShmFrameRingProducer::close()
+{
+    m_pHeader->nClosed.store(1, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool run_shm_test_producer(const std::string &strPath, const ShmFrameRingFormat &format, const uint64_t nFrames)
+{
+    ShmFrameRingProducer producer;
+    if (!producer.create(strPath, format))
+    {
+        return false;
+    }
+
+    g_bStopProducer.store(false);
+    std::signal(SIGINT, stop_producer);
+    std::signal(SIGTERM, stop_producer);
+
+    std::cout << "Producing "
+              << format.nWidth
+              << "x"
+              << format.nHeight
+              << " frames into "
+              << shm_name(strPath)
+              << " until "
+              << (nFrames > 0 ? std::to_string(nFrames) + " frames" : std::string{"interrupted"})
+              << std::endl;
+
+    // A diagonal luma ramp and a chroma bar, both moving, so the encoder
+    // has motion to code.
+    const int64_t nFrameNs = av_rescale(1000000000, format.frameRate.den, format.frameRate.num);
+    const int64_t nStartNs = monotonic_ns();
+    uint64_t nFrame{0};
+    uint64_t nPublished{0};
+    for (; (nFrames == 0 || nFrame < nFrames) && !g_bStopProducer.load(); ++nFrame)
+    {
+        const int64_t nDueNs = nStartNs + static_cast<int64_t>(nFrame) * nFrameNs;
+        if (const int64_t nWaitNs = nDueNs - monotonic_ns(); nWaitNs > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(nWaitNs));
+        }
+
+        uint8_t *arrData[4]{};
+        int arrLinesize[4]{};
+        if (!producer.begin_frame(arrData, arrLinesize))
+        {
+            continue;
+        }
+
+        const auto nShift = static_cast<int>(nFrame * 4);
+        for (int y = 0; y < format.nHeight; ++y)
+        {
+            uint8_t *pRow = arrData[0] + static_cast<std::ptrdiff_t>(y) * arrLinesize[0];
+            for (int x = 0; x < format.nWidth; ++x)
+            {
+                pRow[x] = static_cast<uint8_t>(16 + (x + y + nShift) % 220);
+            }
+        }
+        for (int y = 0; y < format.nHeight / 2; ++y)
+        {
+            uint8_t *pU = arrData[1] + static_cast<std::ptrdiff_t>(y) * arrLinesize[1];
+            uint8_t *pV = arrData[2] + static_cast<std::ptrdiff_t>(y) * arrLinesize[2];
+            for (int x = 0; x < format.nWidth / 2; ++x)
+            {
+                const bool bBar = ((x + nShift / 2) / 32) % 4 == 0;
+                pU[x] = bBar ? 200 : 128;
+                pV[x] = bBar ? 60 : 128;
+            }
+        }
+
+        producer.publish(monotonic_ns());
+        ++nPublished;
+    }
+
+    // The consumer keeps its mapping once the ring is unlinked, so it can
+    // drain what is published after we are gone.
+    producer.close();
+
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+
+    std::cout << "Published "
+              << nPublished
+              << " frames, "
+              << nFrame - nPublished
+              << " dropped with the ring full"
+              << std::endl;
+    return true;
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libavutil/rational.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Raw frame ingest from a capture process through a POSIX shared-memory
+// ring of fixed-size frame slots ("shm:<name>" as the input).
+//
+// The mapping starts with ShmFrameRingHeader, followed by one
+// ShmFrameSlotInfo per slot. The slots themselves start at the next page
+// boundary, each holding one picture laid out as arrPlaneOffset and
+// arrLinesize describe.
+//
+// Exactly one producer and one consumer, and no locks between them. Two
+// monotonic frame counters, each written by one side only, do the
+// synchronisation:
+//   - The producer fills slot nPublished % nSlots and its info once
+//     nPublished - nReleased < nSlots, then publishes it by incrementing
+//     nPublished (release).
+//   - The consumer wraps each published slot as an AVFrame, without a
+//     copy. Once the last reference to a slot is dropped (the encoder has
+//     copied it in), nReleased is advanced over every released slot in
+//     order, which hands them back to the producer.
+// Capture times are CLOCK_MONOTONIC nanoseconds, the clock the pipeline's
+// latency measurement uses.
+struct ShmFrameRingHeader
+{
+    // "X264SHM1" as a little-endian integer, stored (release) once the rest
+    // of the header is filled in.
+    std::atomic<uint64_t> nMagic;
+    uint32_t nSlots;
+    int32_t nWidth;
+    int32_t nHeight;
+    int32_t nPixFmt;
+    int32_t nFieldOrder;
+    int32_t nFrameRateNum;
+    int32_t nFrameRateDen;
+    int32_t arrLinesize[4];
+    uint64_t arrPlaneOffset[4];
+    uint64_t nSlotSize;
+    uint64_t nSlotsOffset;
+
+    // Producer side: frames published, frames it had no free slot for, and
+    // whether it has finished.
+    alignas(64) std::atomic<uint64_t> nPublished;
+    std::atomic<uint64_t> nDropped;
+    std::atomic<uint32_t> nClosed;
+
+    // Consumer side.
+    alignas(64) std::atomic<uint64_t> nReleased;
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct ShmFrameSlotInfo
+{
+    int64_t nCaptureNs;
+    uint64_t nSequence;
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct ShmFrameRingFormat
+{
+    int nWidth{720};
+    int nHeight{576};
+    AVFieldOrder eFieldOrder{AV_FIELD_TT};
+    AVRational frameRate{25, 1};
+    uint32_t nSlots{8};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Consumer end. Must outlive every frame it has handed out.
+class ShmFrameRing
+{
+public:
+    enum class Status
+    {
+        Frame,
+        Eos,
+        Aborted,
+        Error
+    };
+
+    ShmFrameRing() = default;
+    ~ShmFrameRing();
+
+    ShmFrameRing(const ShmFrameRing &) = delete;
+    ShmFrameRing &operator=(const ShmFrameRing &) = delete;
+
+    // "shm:<name>" inputs.
+    static bool is_ring_path(const std::string &strPath);
+
+    // Attaches to the ring strPath ("shm:<name>"). Frames already waiting
+    // are skipped: the consumer starts at the producer's next frame.
+    bool open(const std::string &strPath);
+
+    int width() const { return m_pHeader->nWidth; }
+    int height() const { return m_pHeader->nHeight; }
+    AVPixelFormat pixel_format() const { return static_cast<AVPixelFormat>(m_pHeader->nPixFmt); }
+    AVRational frame_rate() const { return AVRational{m_pHeader->nFrameRateNum, m_pHeader->nFrameRateDen}; }
+
+    // Waits for the next frame and references its slot from out_pFrame
+    // (empty). best_effort_timestamp is the capture time in microseconds,
+    // reordered_opaque in nanoseconds. Returns Aborted once bAbort is set.
+    Status acquire(AVFrame *out_pFrame, const std::atomic<bool> &bAbort);
+
+    uint64_t frames() const { return m_nNext - m_nFirst; }
+    uint64_t waits() const { return m_nWaits; }
+    uint64_t dropped() const { return m_pHeader != nullptr ? m_pHeader->nDropped.load() : 0; }
+
+private:
+    struct SlotRelease
+    {
+        ShmFrameRing *pRing;
+        uint64_t nFrame;
+    };
+
+    static void release_slot(void *pOpaque, uint8_t *pData);
+    void release(uint64_t nFrame);
+
+    int m_fd{-1};
+    uint8_t *m_pMap{nullptr};
+    std::size_t m_nMapSize{0};
+    ShmFrameRingHeader *m_pHeader{nullptr};
+    const ShmFrameSlotInfo *m_pSlotInfo{nullptr};
+
+    uint64_t m_nFirst{0};
+    uint64_t m_nNext{0};
+    uint64_t m_nWaits{0};
+
+    // Slots are released from the encode threads, in any order.
+    std::mutex m_mutexRelease;
+    std::vector<SlotRelease> m_vecSlotRelease;
+    std::vector<bool> m_vecReleased;
+    uint64_t m_nReleased{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Producer end, creating the ring. 8-bit 4:2:0 only.
+class ShmFrameRingProducer
+{
+public:
+    ShmFrameRingProducer() = default;
+    ~ShmFrameRingProducer();
+
+    ShmFrameRingProducer(const ShmFrameRingProducer &) = delete;
+    ShmFrameRingProducer &operator=(const ShmFrameRingProducer &) = delete;
+
+    bool create(const std::string &strPath, const ShmFrameRingFormat &format);
+
+    // The next free slot, laid out as out_arrData/out_arrLinesize, or false
+    // when the consumer has every slot (the frame counts as dropped).
+    bool begin_frame(uint8_t *(&out_arrData)[4], int (&out_arrLinesize)[4]);
+
+    // Publishes the slot from begin_frame().
+    void publish(int64_t nCaptureNs);
+
+    // End of stream; the consumer drains what is published and stops.
+    void close();
+
+private:
+    std::string m_strName;
+    int m_fd{-1};
+    uint8_t *m_pMap{nullptr};
+    std::size_t m_nMapSize{0};
+    ShmFrameRingHeader *m_pHeader{nullptr};
+    ShmFrameSlotInfo *m_pSlotInfo{nullptr};
+    uint64_t m_nNext{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Test producer: creates the ring and publishes nFrames frames of a moving
+// pattern at the format's frame rate (0 = until interrupted), capturing
+// each frame's time as it is published.
+bool run_shm_test_producer(const std::string &strPath, const ShmFrameRingFormat &format, uint64_t nFrames);
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////
+// Bounded, lock-free, single-producer/single-consumer queue.
+//
+// Exactly one thread may push and exactly one thread may pop. The blocking
+// variants spin (yielding) while the queue is full/empty and give up once
+// abort() has been called, so a failing stage can unblock its neighbours.
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(const std::size_t nCapacity)
+        : m_vecSlots(nCapacity > 0 ? nCapacity : 1)
+    {
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    bool try_push(T &item)
+    {
+        const std::size_t nTail = m_nTail.load(std::memory_order_relaxed);
+        if (nTail - m_nHead.load(std::memory_order_acquire) == m_vecSlots.size())
+        {
+            return false;
+        }
+
+        m_vecSlots[nTail % m_vecSlots.size()] = std::move(item);
+        m_nTail.store(nTail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &out_item)
+    {
+        const std::size_t nHead = m_nHead.load(std::memory_order_relaxed);
+        if (nHead == m_nTail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        out_item = std::move(m_vecSlots[nHead % m_vecSlots.size()]);
+        m_nHead.store(nHead + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the queue was aborted before the item could be queued,
+    // in which case the caller still owns 'item'.
+    bool push(T &item)
+    {
+        while (!try_push(item))
+        {
+            if (m_bAborted.load(std::memory_order_relaxed))
+            {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    // Returns false if the queue was aborted while empty.
+    bool pop(T &out_item)
+    {
+        while (!try_pop(out_item))
+        {
+            if (m_bAborted.load(std::memory_order_relaxed))
+            {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    void abort()
+    {
+        m_bAborted.store(true, std::memory_order_relaxed);
+    }
+
+    bool aborted() const
+    {
+        return m_bAborted.load(std::memory_order_relaxed);
+    }
+
+    std::size_t size() const
+    {
+        return m_nTail.load(std::memory_order_acquire) - m_nHead.load(std::memory_order_acquire);
+    }
+
+    std::size_t capacity() const
+    {
+        return m_vecSlots.size();
+    }
+
+private:
+    std::vector<T> m_vecSlots;
+
+    // Keep producer and consumer indices on separate cache lines.
+    alignas(64) std::atomic<std::size_t> m_nHead{0};
+    alignas(64) std::atomic<std::size_t> m_nTail{0};
+    alignas(64) std::atomic<bool> m_bAborted{false};
+};
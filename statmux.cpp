@@ -0,0 +1,236 @@
+#include "statmux.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+extern "C"
+{
+#include <libavutil/intreadwrite.h>
+}
+
+namespace
+{
+
+//////////////////////////////////////////////////////////////////////////
+// x264's qp2qscale().
+double qp_to_qscale(const double dQp)
+{
+    return 0.85 * std::exp2((dQp - 12.0) / 6.0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+int64_t resolve_limit(const int64_t nLimit, const int64_t nDefault)
+{
+    return nLimit > 0 ? nLimit : nDefault;
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+StatmuxController::StatmuxController(const StatmuxConfig &config, const std::size_t nChannels)
+    : m_config(config),
+      m_nMinRate(std::min(resolve_limit(config.nMinRate, config.nBudget / static_cast<int64_t>(nChannels) / 3),
+                          config.nBudget / static_cast<int64_t>(nChannels))),
+      m_nMaxRate(std::max(resolve_limit(config.nMaxRate, config.nBudget / static_cast<int64_t>(nChannels) * 3),
+                          config.nBudget / static_cast<int64_t>(nChannels))),
+      m_vecChannels(nChannels)
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+void StatmuxController::add_packet(const std::size_t nChannel, const AVPacket *pPkt)
+{
+    // Without stats (not x264) every packet counts at QP 12.
+    double dQp = 12.0;
+    int nSize{};
+    const uint8_t *pStats = av_packet_get_side_data(pPkt, AV_PKT_DATA_QUALITY_STATS, &nSize);
+    if (pStats != nullptr && nSize >= 4)
+    {
+        dQp = static_cast<double>(AV_RL32(pStats)) / FF_QP2LAMBDA;
+    }
+
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    Channel &channel = m_vecChannels[nChannel];
+    channel.dWindowComplexity += static_cast<double>(pPkt->size) * 8.0 * qp_to_qscale(dQp);
+    ++channel.nWindowFrames;
+}
+
+//////////////////////////////////////////////////////////////////////////
+int64_t StatmuxController::rate_for_gop(const std::size_t nChannel, const uint64_t nGop)
+{
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    Channel &channel = m_vecChannels[nChannel];
+    if (channel.nWindowFrames > 0)
+    {
+        const double dWindow = channel.dWindowComplexity / static_cast<double>(channel.nWindowFrames);
+        channel.dComplexity = channel.dComplexity > 0.0 ? (channel.dComplexity + dWindow) / 2.0 : dWindow;
+        channel.dWindowComplexity = 0.0;
+        channel.nWindowFrames = 0;
+    }
+    channel.nGop = nGop;
+
+    auto it = m_mapGopRates.find(nGop);
+    if (it == m_mapGopRates.end())
+    {
+        it = m_mapGopRates.emplace(nGop, allocate()).first;
+    }
+    const int64_t nRate = it->second[nChannel];
+
+    drop_old_gops();
+
+    StatmuxChannelStats &stats = channel.stats;
+    stats.nMinRate = stats.nGops == 0 ? nRate : std::min(stats.nMinRate, nRate);
+    stats.nMaxRate = stats.nGops == 0 ? nRate : std::max(stats.nMaxRate, nRate);
+    stats.dSumRate += static_cast<double>(nRate);
+    ++stats.nGops;
+    return nRate;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void StatmuxController::finish(const std::size_t nChannel)
+{
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    m_vecChannels[nChannel].bFinished = true;
+    drop_old_gops();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Nobody needs the rates of the GOPs every running channel is past.
+void StatmuxController::drop_old_gops()
+{
+    uint64_t nOldest = UINT64_MAX;
+    for (const Channel &channel : m_vecChannels)
+    {
+        if (!channel.bFinished)
+        {
+            nOldest = std::min(nOldest, channel.nGop);
+        }
+    }
+    m_mapGopRates.erase(m_mapGopRates.begin(), m_mapGopRates.lower_bound(nOldest));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Shares the budget out in proportion to complexity, fixing the channels
+// that hit a limit at it and sharing what is left among the others, until
+// none does.
+std::vector<int64_t> StatmuxController::allocate() const
+{
+    const std::size_t nChannels = m_vecChannels.size();
+
+    double dKnownSum{0.0};
+    std::size_t nKnown{0};
+    for (const Channel &channel : m_vecChannels)
+    {
+        if (!channel.bFinished && channel.dComplexity > 0.0)
+        {
+            dKnownSum += channel.dComplexity;
+            ++nKnown;
+        }
+    }
+    const double dAverage = nKnown > 0 ? dKnownSum / static_cast<double>(nKnown) : 1.0;
+
+    // Finished channels get nothing.
+    std::vector<double> vecWeight(nChannels);
+    std::vector<bool> vecFixed(nChannels, false);
+    for (std::size_t i = 0; i < nChannels; ++i)
+    {
+        vecWeight[i] = m_vecChannels[i].dComplexity > 0.0 ? m_vecChannels[i].dComplexity : dAverage;
+        vecFixed[i] = m_vecChannels[i].bFinished;
+    }
+
+    std::vector<int64_t> vecRates(nChannels, 0);
+    double dBudget = static_cast<double>(m_config.nBudget);
+    while (true)
+    {
+        double dWeightSum{0.0};
+        for (std::size_t i = 0; i < nChannels; ++i)
+        {
+            dWeightSum += vecFixed[i] ? 0.0 : vecWeight[i];
+        }
+        if (dWeightSum <= 0.0)
+        {
+            break;
+        }
+
+        // Channels below the minimum are settled first: raising them takes
+        // bits from the rest, which may bring those back under the maximum.
+        bool bBelow{false};
+        bool bAbove{false};
+        for (std::size_t i = 0; i < nChannels; ++i)
+        {
+            const double dShare = dBudget * vecWeight[i] / dWeightSum;
+            bBelow = bBelow || (!vecFixed[i] && dShare < static_cast<double>(m_nMinRate));
+            bAbove = bAbove || (!vecFixed[i] && dShare > static_cast<double>(m_nMaxRate));
+        }
+        if (!bBelow && !bAbove)
+        {
+            for (std::size_t i = 0; i < nChannels; ++i)
+            {
+                if (!vecFixed[i])
+                {
+                    vecRates[i] = static_cast<int64_t>(dBudget * vecWeight[i] / dWeightSum);
+                }
+            }
+            break;
+        }
+
+        for (std::size_t i = 0; i < nChannels; ++i)
+        {
+            const double dShare = dBudget * vecWeight[i] / dWeightSum;
+            const int64_t nLimit = bBelow ? m_nMinRate : m_nMaxRate;
+            if (!vecFixed[i] && (bBelow ? dShare < static_cast<double>(nLimit) : dShare > static_cast<double>(nLimit)))
+            {
+                vecRates[i] = nLimit;
+                vecFixed[i] = true;
+                dBudget -= static_cast<double>(nLimit);
+            }
+        }
+    }
+
+    return vecRates;
+}
+
+//////////////////////////////////////////////////////////////////////////
+StatmuxChannelStats StatmuxController::stats(const std::size_t nChannel) const
+{
+    const std::lock_guard<std::mutex> lock{m_mutex};
+    StatmuxChannelStats stats = m_vecChannels[nChannel].stats;
+    stats.dComplexity = m_vecChannels[nChannel].dComplexity;
+    return stats;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_statmux_stats(const StatmuxController &controller)
+{
+    std::cout << "Statmux: "
+              << controller.budget() / 1000
+              << " kbit/s of video over "
+              << controller.channels()
+              << " programs, "
+              << controller.min_rate() / 1000
+              << "-"
+              << controller.max_rate() / 1000
+              << " kbit/s each"
+              << std::endl;
+
+    for (std::size_t i = 0; i < controller.channels(); ++i)
+    {
+        const StatmuxChannelStats stats = controller.stats(i);
+        const double dMeanRate = stats.nGops > 0 ? stats.dSumRate / static_cast<double>(stats.nGops) : 0.0;
+        std::cout << "  program "
+                  << i + 1
+                  << ": "
+                  << stats.nGops
+                  << " GOPs at "
+                  << stats.nMinRate / 1000
+                  << "/"
+                  << std::llround(dMeanRate / 1000.0)
+                  << "/"
+                  << stats.nMaxRate / 1000
+                  << " kbit/s min/mean/max, complexity "
+                  << std::llround(stats.dComplexity / 1000.0)
+                  << "k per frame"
+                  << std::endl;
+    }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Statistical multiplexing of several encoders under one video budget.
+//
+// Every encoder reports the packets it produces. The complexity of a
+// packet is its size times x264's quantiser scale for its QP
+// (0.85 x 2^((QP - 12) / 6)), i.e. roughly the bits it would have taken at
+// a fixed quality. Each channel keeps a running complexity per frame. It is
+// updated with the packets since the channel's last GOP boundary, half
+// old and half new.
+//
+// All channels code GOPs of the same length at the same frame rate, so GOP
+// k of every channel covers the same stretch of time. The first channel to
+// reach GOP k fixes the rates for it: the budget is shared out in
+// proportion to complexity, within [nMinRate, nMaxRate] per channel. Every
+// channel then codes GOP k at its share, so the rates of one GOP always add
+// up to the budget. Until a channel has reported anything, it counts as
+// being of average complexity.
+struct StatmuxConfig
+{
+    // Video bit/s shared by all channels.
+    int64_t nBudget{0};
+
+    // Per-channel limits; 0 = a third of, or three times, an equal share.
+    int64_t nMinRate{0};
+    int64_t nMaxRate{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct StatmuxChannelStats
+{
+    uint64_t nGops{0};
+    int64_t nMinRate{0};
+    int64_t nMaxRate{0};
+    double dSumRate{0.0};
+    double dComplexity{0.0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Thread-safe; each channel is driven by one encode thread.
+class StatmuxController
+{
+public:
+    StatmuxController(const StatmuxConfig &config, std::size_t nChannels);
+
+    StatmuxController(const StatmuxController &) = delete;
+    StatmuxController &operator=(const StatmuxController &) = delete;
+
+    // Equal share of the budget, the rate every encoder starts at.
+    int64_t equal_share() const { return m_config.nBudget / static_cast<int64_t>(m_vecChannels.size()); }
+
+    // One encoded packet of nChannel, with x264's quality stats side data.
+    void add_packet(std::size_t nChannel, const AVPacket *pPkt);
+
+    // Called before nChannel's first frame of GOP nGop: closes its
+    // complexity window and returns its rate for that GOP.
+    int64_t rate_for_gop(std::size_t nChannel, uint64_t nGop);
+
+    // nChannel's input has ended; the others share its bits from the next
+    // GOP on.
+    void finish(std::size_t nChannel);
+
+    std::size_t channels() const { return m_vecChannels.size(); }
+    int64_t budget() const { return m_config.nBudget; }
+    int64_t min_rate() const { return m_nMinRate; }
+    int64_t max_rate() const { return m_nMaxRate; }
+
+    // Only once the encoders are done.
+    StatmuxChannelStats stats(std::size_t nChannel) const;
+
+private:
+    struct Channel
+    {
+        // Complexity of the packets since the last GOP boundary.
+        double dWindowComplexity{0.0};
+        uint64_t nWindowFrames{0};
+
+        // Running complexity per frame; 0 = nothing reported yet.
+        double dComplexity{0.0};
+
+        uint64_t nGop{0};
+        bool bFinished{false};
+        StatmuxChannelStats stats;
+    };
+
+    std::vector<int64_t> allocate() const;
+    void drop_old_gops();
+
+    const StatmuxConfig m_config;
+    const int64_t m_nMinRate;
+    const int64_t m_nMaxRate;
+
+    mutable std::mutex m_mutex;
+    std::vector<Channel> m_vecChannels;
+
+    // Rates per GOP, dropped once every channel is past it.
+    std::map<uint64_t, std::vector<int64_t>> m_mapGopRates;
+};
+
+//////////////////////////////////////////////////////////////////////////
+void print_statmux_stats(const StatmuxController &controller);
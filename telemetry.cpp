@@ -0,0 +1,266 @@
+#include "telemetry.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+namespace
+{
+
+constexpr char g_szTelemetryMagic[8] = {'X', '2', '6', '4', 'T', 'L', 'M', '1'};
+
+// Drain thread poll interval when every channel is empty.
+constexpr auto g_drainIdle = std::chrono::milliseconds(2);
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+const char *telemetry_stage_name(const TelemetryStage eStage)
+{
+    switch (eStage)
+    {
+    case TelemetryStage::Demux:
+        return "demux";
+    case TelemetryStage::Decode:
+        return "decode";
+    case TelemetryStage::Encode:
+        return "encode";
+    case TelemetryStage::Mux:
+        return "mux";
+    default:
+        return "?";
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+TelemetryChannel::TelemetryChannel(const std::size_t nCapacity)
+    : m_ring(nCapacity)
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+void TelemetryChannel::record(TelemetryRecord &rec)
+{
+    rec.nTimestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+    if (!m_ring.try_push(rec))
+    {
+        m_nDropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void LatencyHistogram::add(const int64_t nDurationNs)
+{
+    const uint64_t nUs = nDurationNs > 0 ? static_cast<uint64_t>(nDurationNs) / 1000 : 0;
+
+    std::size_t nBucket = 0;
+    for (uint64_t n = nUs; n > 1 && nBucket + 1 < g_nBuckets; n >>= 1)
+    {
+        ++nBucket;
+    }
+
+    ++arrBuckets[nBucket];
+    ++nCount;
+    nTotalNs += nDurationNs;
+    nMaxNs = std::max(nMaxNs, nDurationNs);
+}
+
+//////////////////////////////////////////////////////////////////////////
+double LatencyHistogram::quantile_us(const double dQuantile) const
+{
+    const uint64_t nTarget = static_cast<uint64_t>(dQuantile * static_cast<double>(nCount));
+    uint64_t nSeen = 0;
+    for (std::size_t i = 0; i < g_nBuckets; ++i)
+    {
+        nSeen += arrBuckets[i];
+        if (nSeen > nTarget)
+        {
+            return static_cast<double>(uint64_t{2} << i);
+        }
+    }
+    return static_cast<double>(nMaxNs) / 1000.0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+Telemetry::Telemetry(const TelemetryConfig &config)
+    : m_config(config),
+      m_start(std::chrono::steady_clock::now())
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+Telemetry::~Telemetry()
+{
+    stop();
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool Telemetry::start()
+{
+    if (!m_config.strPath.empty())
+    {
+        m_file.open(m_config.strPath, std::ios::binary | std::ios::trunc);
+        if (!m_file)
+        {
+            std::cerr << "Could not open telemetry file " << m_config.strPath << std::endl;
+            return false;
+        }
+
+        const uint32_t nRecordSize = sizeof(TelemetryRecord);
+        m_file.write(g_szTelemetryMagic, sizeof(g_szTelemetryMagic));
+        m_file.write(reinterpret_cast<const char *>(&nRecordSize), sizeof(nRecordSize));
+    }
+
+    m_bStop.store(false);
+    m_thDrain = std::thread{&Telemetry::drain_loop, this};
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void Telemetry::stop()
+{
+    if (!m_thDrain.joinable())
+    {
+        return;
+    }
+
+    m_bStop.store(true);
+    m_thDrain.join();
+
+    if (m_file.is_open())
+    {
+        m_file.close();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+TelemetryChannel *Telemetry::add_channel()
+{
+    auto apChannel = std::make_unique<TelemetryChannel>(m_config.nRingCapacity);
+    apChannel->m_start = m_start;
+
+    std::lock_guard<std::mutex> lock{m_mtxChannels};
+    m_vecChannels.push_back(std::move(apChannel));
+    return m_vecChannels.back().get();
+}
+
+//////////////////////////////////////////////////////////////////////////
+const LatencyHistogram &Telemetry::histogram(const TelemetryStage eStage) const
+{
+    return m_arrHistograms[static_cast<std::size_t>(eStage)];
+}
+
+//////////////////////////////////////////////////////////////////////////
+uint64_t Telemetry::dropped() const
+{
+    uint64_t nDropped = 0;
+    for (const auto &apChannel : m_vecChannels)
+    {
+        nDropped += apChannel->dropped();
+    }
+    return nDropped;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void Telemetry::drain_loop()
+{
+    while (!m_bStop.load())
+    {
+        if (drain_once() == 0)
+        {
+            std::this_thread::sleep_for(g_drainIdle);
+        }
+    }
+
+    // Producers are done by the time stop() is called; pick up the rest.
+    while (drain_once() > 0)
+    {
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+std::size_t Telemetry::drain_once()
+{
+    std::lock_guard<std::mutex> lock{m_mtxChannels};
+
+    std::size_t nDrained = 0;
+    TelemetryRecord rec{};
+    for (auto &apChannel : m_vecChannels)
+    {
+        while (apChannel->m_ring.try_pop(rec))
+        {
+            if (rec.eStage < TelemetryStage::Count)
+            {
+                m_arrHistograms[static_cast<std::size_t>(rec.eStage)].add(rec.nDurationNs);
+            }
+            if (m_file.is_open())
+            {
+                m_file.write(reinterpret_cast<const char *>(&rec), sizeof(rec));
+            }
+            ++nDrained;
+        }
+    }
+
+    m_nRecords += nDrained;
+    return nDrained;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_latency_histograms(const Telemetry &telemetry)
+{
+    std::cout << "Telemetry: "
+              << telemetry.records()
+              << " records, "
+              << telemetry.dropped()
+              << " dropped"
+              << std::endl;
+
+    for (std::size_t s = 0; s < static_cast<std::size_t>(TelemetryStage::Count); ++s)
+    {
+        const auto eStage = static_cast<TelemetryStage>(s);
+        const LatencyHistogram &histogram = telemetry.histogram(eStage);
+        if (histogram.nCount == 0)
+        {
+            continue;
+        }
+
+        std::cout << "  "
+                  << telemetry_stage_name(eStage)
+                  << " latency: "
+                  << histogram.nCount
+                  << " items, mean "
+                  << std::fixed << std::setprecision(1)
+                  << static_cast<double>(histogram.nTotalNs) / static_cast<double>(histogram.nCount) / 1000.0
+                  << " us, p50 < "
+                  << histogram.quantile_us(0.50)
+                  << " us, p99 < "
+                  << histogram.quantile_us(0.99)
+                  << " us, max "
+                  << static_cast<double>(histogram.nMaxNs) / 1000.0
+                  << " us"
+                  << std::defaultfloat
+                  << std::endl;
+
+        const uint64_t nPeak = *std::max_element(histogram.arrBuckets.begin(), histogram.arrBuckets.end());
+        for (std::size_t i = 0; i < LatencyHistogram::g_nBuckets; ++i)
+        {
+            const uint64_t nBucket = histogram.arrBuckets[i];
+            if (nBucket == 0)
+            {
+                continue;
+            }
+
+            const uint64_t nLow = i == 0 ? 0 : uint64_t{1} << i;
+            const uint64_t nHigh = uint64_t{2} << i;
+            std::cout << "    ["
+                      << std::setw(8) << nLow
+                      << ", "
+                      << std::setw(8) << nHigh
+                      << ") us "
+                      << std::setw(8) << nBucket
+                      << " "
+                      << std::string(static_cast<std::size_t>((nBucket * 40 + nPeak - 1) / nPeak), '#')
+                      << std::endl;
+        }
+    }
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "spsc_queue.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// Per-frame telemetry for the pipeline stages.
+//
+// Every stage thread owns a TelemetryChannel: a lock-free SPSC ring of
+// fixed-size binary records. Recording is a single try_push (a record is
+// dropped, and counted, if the ring is full); nothing is formatted or
+// written on the stage thread. A background thread drains all channels,
+// appends the records to an optional binary file and keeps a latency
+// histogram per stage.
+//
+// Binary file layout: the 8-byte magic "X264TLM1", a uint32_t record size,
+// then raw TelemetryRecords in host byte order.
+
+enum class TelemetryStage : uint8_t
+{
+    Demux,
+    Decode,
+    Encode,
+    Mux,
+    Count
+};
+
+const char *telemetry_stage_name(TelemetryStage eStage);
+
+//////////////////////////////////////////////////////////////////////////
+struct TelemetryRecord
+{
+    // Steady clock, nanoseconds since the telemetry was started.
+    int64_t nTimestampNs{0};
+
+    // Time the stage spent on this item (library call(s) included).
+    int64_t nDurationNs{0};
+
+    int64_t nPts{0};
+    int64_t nDts{0};
+    int32_t nSize{0};
+
+    // Items waiting in the queue the stage feeds (mux: the queue it drains).
+    uint16_t nQueueDepth{0};
+
+    TelemetryStage eStage{TelemetryStage::Demux};
+
+    // 'I', 'P', 'B', ... or '?' if unknown.
+    char cFrameType{'?'};
+
+    uint8_t nOutput{0};
+    uint8_t pad[7]{};
+};
+
+static_assert(sizeof(TelemetryRecord) == 48, "TelemetryRecord is written to disk as-is");
+
+//////////////////////////////////////////////////////////////////////////
+struct TelemetryConfig
+{
+    // Binary record file; empty = histograms only.
+    std::string strPath;
+
+    // Records each channel can hold before the drain thread catches up.
+    std::size_t nRingCapacity{4096};
+};
+
+//////////////////////////////////////////////////////////////////////////
+class TelemetryChannel
+{
+public:
+    explicit TelemetryChannel(std::size_t nCapacity);
+
+    // Fills in the timestamp and queues the record. Never blocks.
+    void record(TelemetryRecord &rec);
+
+    uint64_t dropped() const { return m_nDropped.load(std::memory_order_relaxed); }
+
+private:
+    friend class Telemetry;
+
+    SpscQueue<TelemetryRecord> m_ring;
+    std::chrono::steady_clock::time_point m_start;
+    std::atomic<uint64_t> m_nDropped{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Stage durations bucketed by powers of two: bucket i counts durations in
+// [2^i, 2^(i+1)) microseconds, bucket 0 also takes everything below 1 us.
+struct LatencyHistogram
+{
+    static constexpr std::size_t g_nBuckets = 32;
+
+    std::array<uint64_t, g_nBuckets> arrBuckets{};
+    uint64_t nCount{0};
+    int64_t nTotalNs{0};
+    int64_t nMaxNs{0};
+
+    void add(int64_t nDurationNs);
+
+    // Upper bound of the bucket holding the given quantile, in microseconds.
+    double quantile_us(double dQuantile) const;
+};
+
+//////////////////////////////////////////////////////////////////////////
+class Telemetry
+{
+public:
+    explicit Telemetry(const TelemetryConfig &config);
+    ~Telemetry();
+
+    Telemetry(const Telemetry &) = delete;
+    Telemetry &operator=(const Telemetry &) = delete;
+
+    // Opens the record file (if any) and starts the drain thread.
+    bool start();
+
+    // Drains whatever is left and stops the drain thread.
+    void stop();
+
+    // One channel per producing thread. Channels live as long as the
+    // Telemetry object.
+    TelemetryChannel *add_channel();
+
+    const LatencyHistogram &histogram(TelemetryStage eStage) const;
+    uint64_t records() const { return m_nRecords; }
+    uint64_t dropped() const;
+
+private:
+    void drain_loop();
+    std::size_t drain_once();
+
+    const TelemetryConfig m_config;
+    const std::chrono::steady_clock::time_point m_start;
+
+    std::mutex m_mtxChannels;
+    std::vector<std::unique_ptr<TelemetryChannel>> m_vecChannels;
+
+    // Only touched by the drain thread while it runs.
+    std::ofstream m_file;
+    std::array<LatencyHistogram, static_cast<std::size_t>(TelemetryStage::Count)> m_arrHistograms{};
+    uint64_t m_nRecords{0};
+
+    std::atomic<bool> m_bStop{false};
+    std::thread m_thDrain;
+};
+
+//////////////////////////////////////////////////////////////////////////
+void print_latency_histograms(const Telemetry &telemetry);
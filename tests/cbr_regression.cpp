@@ -0,0 +1,705 @@
+#include "encoder_settings.hpp"
+#include "media_utils.hpp"
+#include "ts_analyzer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+extern char **environ;
+
+//////////////////////////////////////////////////////////////////////////
+// CBR regression test: generates a synthetic clip, encodes it by running
+// the x264_cbr executable (the main() path, with whatever extra options the
+// case passes), measures the result and checks every metric against the
+// limits in the thresholds file. One CTest case per invocation.
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int g_nClipWidth = 720;
+constexpr int g_nClipHeight = 576;
+
+//////////////////////////////////////////////////////////////////////////
+enum class ClipKind
+{
+    // Moving gradient with a panning noise texture.
+    Pattern,
+    // The texture standing still: almost nothing to code, so the encoder
+    // has to pad up to the rate.
+    Static,
+    // Fresh noise every frame: far more than the rate can carry.
+    Noise,
+    // Pattern and noise alternating every 2 seconds: scene cuts.
+    Cuts
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct RegressionOptions
+{
+    std::string strX264Cbr;
+    std::string strCase;
+    std::string strThresholdsPath;
+    std::string strWorkDir{"."};
+    ClipKind eClip{ClipKind::Pattern};
+    std::string strClip{"pattern"};
+    int nFrames{250};
+
+    // Passed to x264_cbr ahead of the generated ones.
+    std::vector<std::string> vecExtraArgs;
+
+    // Also encode the clip without vecExtraArgs and report the case's
+    // bitrate spread and VBV low point against that baseline.
+    bool bBaseline{false};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct Threshold
+{
+    std::string strCasePattern;
+    std::string strMetric;
+    bool bMin{false};
+    double dLimit{0.0};
+    // Not yet calibrated on a real run: a miss is reported, not failed.
+    bool bProvisional{false};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Deterministic source pictures; the same clip on every run.
+class ClipSource
+{
+public:
+    explicit ClipSource(const ClipKind eKind)
+        : m_eKind(eKind),
+          m_vecTexture(static_cast<std::size_t>(g_nClipWidth) * g_nClipHeight)
+    {
+        fill_noise(m_vecTexture, 0x2545F491);
+    }
+
+    void next(AVFrame *pFrame, const int nIndex)
+    {
+        const bool bNoise = m_eKind == ClipKind::Noise || (m_eKind == ClipKind::Cuts && (nIndex / 50) % 2 == 1);
+        if (bNoise)
+        {
+            fill_noise(m_vecTexture, static_cast<uint32_t>(nIndex) * 2654435761u + 1);
+        }
+        const int nMotion = m_eKind == ClipKind::Static ? 0 : nIndex;
+
+        for (int y = 0; y < g_nClipHeight; ++y)
+        {
+            uint8_t *pRow = pFrame->data[0] + static_cast<std::ptrdiff_t>(y) * pFrame->linesize[0];
+            const uint8_t *pTexRow = m_vecTexture.data() + static_cast<std::size_t>(y) * g_nClipWidth;
+            for (int x = 0; x < g_nClipWidth; ++x)
+            {
+                const int nTex = bNoise ? pTexRow[x] : pTexRow[(x + 4 * nMotion) % g_nClipWidth] >> 2;
+                pRow[x] = static_cast<uint8_t>(16 + (((x + y + 2 * nMotion) & 0x7F) + nTex) % 220);
+            }
+        }
+
+        for (int y = 0; y < g_nClipHeight / 2; ++y)
+        {
+            uint8_t *pRowU = pFrame->data[1] + static_cast<std::ptrdiff_t>(y) * pFrame->linesize[1];
+            uint8_t *pRowV = pFrame->data[2] + static_cast<std::ptrdiff_t>(y) * pFrame->linesize[2];
+            for (int x = 0; x < g_nClipWidth / 2; ++x)
+            {
+                pRowU[x] = static_cast<uint8_t>(112 + ((x + nMotion) & 0x1F));
+                pRowV[x] = static_cast<uint8_t>(112 + ((y - nMotion) & 0x1F));
+            }
+        }
+    }
+
+private:
+    static void fill_noise(std::vector<uint8_t> &out_vecTexture, const uint32_t nSeed)
+    {
+        // xorshift32
+        uint32_t nState = nSeed != 0 ? nSeed : 1;
+        for (uint8_t &nTexel : out_vecTexture)
+        {
+            nState ^= nState << 13;
+            nState ^= nState >> 17;
+            nState ^= nState << 5;
+            nTexel = static_cast<uint8_t>(nState >> 24);
+        }
+    }
+
+    const ClipKind m_eKind;
+    std::vector<uint8_t> m_vecTexture;
+};
+
+//////////////////////////////////////////////////////////////////////////
+bool file_exists(const std::string &strPath)
+{
+    struct stat st{};
+    return stat(strPath.c_str(), &st) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Sends one frame (or the flush) and writes every packet that comes out.
+bool encode_clip_frame(AVCodecContext *pCdcCtx, AVFormatContext *pFmtCtx, const AVStream *pStream, const AVFrame *pFrame, AVPacket *pPkt)
+{
+    if (int ret = avcodec_send_frame(pCdcCtx, pFrame); ret < 0)
+    {
+        std::cerr << "Clip encoder rejected a frame: " << error_code_to_string(ret) << std::endl;
+        return false;
+    }
+
+    int ret{};
+    while ((ret = avcodec_receive_packet(pCdcCtx, pPkt)) == 0)
+    {
+        av_packet_rescale_ts(pPkt, pCdcCtx->time_base, pStream->time_base);
+        pPkt->stream_index = pStream->index;
+        if (int retWrite = av_interleaved_write_frame(pFmtCtx, pPkt); retWrite < 0)
+        {
+            std::cerr << "Could not write clip packet: " << error_code_to_string(retWrite) << std::endl;
+            return false;
+        }
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Writes nFrames of the clip as high-rate MPEG-2 in a transport stream, so
+// that x264_cbr reads it through the same demux/decode path as real input.
+bool generate_clip(const std::string &strPath, const ClipKind eKind, const int nFrames)
+{
+    OutputFormatContextPtr apFmtCtx;
+    if (!open_output_format_context(strPath, apFmtCtx, "mpegts"))
+    {
+        return false;
+    }
+
+    AVStream *pStream{};
+    CodecContextPtr apCdcCtx;
+    if (!open_encoder_context(apFmtCtx.get(),
+                              apCdcCtx,
+                              pStream,
+                              "mpeg2video",
+                              [](AVStream *, AVCodecContext *pCdcCtx, AVDictionary *&) -> bool
+                              {
+                                  pCdcCtx->width = g_nClipWidth;
+                                  pCdcCtx->height = g_nClipHeight;
+                                  pCdcCtx->pix_fmt = AV_PIX_FMT_YUV420P;
+                                  pCdcCtx->time_base = AVRational{1, 25};
+                                  pCdcCtx->framerate = AVRational{25, 1};
+                                  pCdcCtx->bit_rate = 40000000;
+                                  pCdcCtx->gop_size = 12;
+                                  pCdcCtx->max_b_frames = 2;
+                                  return true;
+                              }))
+    {
+        return false;
+    }
+
+    if (int ret = avio_open(&apFmtCtx->pb, strPath.c_str(), AVIO_FLAG_WRITE); ret < 0)
+    {
+        std::cerr << "Could not create clip " << strPath << ": " << error_code_to_string(ret) << std::endl;
+        return false;
+    }
+
+    FramePtr apFrame{av_frame_alloc()};
+    PacketPtr apPkt{av_packet_alloc()};
+    bool bOk = apFrame && apPkt;
+    if (bOk)
+    {
+        apFrame->format = AV_PIX_FMT_YUV420P;
+        apFrame->width = g_nClipWidth;
+        apFrame->height = g_nClipHeight;
+        bOk = av_frame_get_buffer(apFrame.get(), 32) >= 0 && avformat_write_header(apFmtCtx.get(), nullptr) >= 0;
+    }
+
+    ClipSource source{eKind};
+    for (int i = 0; bOk && i < nFrames; ++i)
+    {
+        bOk = av_frame_make_writable(apFrame.get()) >= 0;
+        if (bOk)
+        {
+            source.next(apFrame.get(), i);
+            apFrame->pts = i;
+            bOk = encode_clip_frame(apCdcCtx.get(), apFmtCtx.get(), pStream, apFrame.get(), apPkt.get());
+        }
+    }
+    bOk = bOk
+        && encode_clip_frame(apCdcCtx.get(), apFmtCtx.get(), pStream, nullptr, apPkt.get())
+        && av_write_trailer(apFmtCtx.get()) >= 0;
+
+    avio_closep(&apFmtCtx->pb);
+    return bOk;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Runs x264_cbr on strInput with vecExtraArgs and waits for it;
+// out_dSeconds is its wall time. Its stdout and stderr go to strReport,
+// which is then echoed, so that the reports can be measured too.
+bool run_x264_cbr(const RegressionOptions &options,
+                  const std::vector<std::string> &vecExtraArgs,
+                  const std::string &strInput,
+                  const std::string &strOutput,
+                  const std::string &strVbvLog,
+                  const std::string &strReport,
+                  double &out_dSeconds)
+{
+    std::vector<std::string> vecArgs{options.strX264Cbr};
+    vecArgs.insert(vecArgs.end(), vecExtraArgs.begin(), vecExtraArgs.end());
+    vecArgs.push_back("--vbv-log=" + strVbvLog);
+    vecArgs.push_back(strInput);
+    vecArgs.push_back(strOutput);
+
+    std::vector<char *> vecArgv;
+    std::cout << "Running";
+    for (std::string &strArg : vecArgs)
+    {
+        std::cout << " " << strArg;
+        vecArgv.push_back(&strArg[0]);
+    }
+    std::cout << std::endl;
+    vecArgv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, strReport.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    const Clock::time_point tStart = Clock::now();
+    pid_t nPid{};
+    const int retSpawn = posix_spawn(&nPid, options.strX264Cbr.c_str(), &actions, nullptr, vecArgv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (retSpawn != 0)
+    {
+        std::cerr << "Could not run " << options.strX264Cbr << ": error " << retSpawn << std::endl;
+        return false;
+    }
+
+    int nStatus{};
+    if (waitpid(nPid, &nStatus, 0) != nPid)
+    {
+        return false;
+    }
+    out_dSeconds = std::chrono::duration<double>(Clock::now() - tStart).count();
+
+    std::ifstream report{strReport};
+    std::cout << report.rdbuf() << std::flush;
+
+    if (!WIFEXITED(nStatus) || WEXITSTATUS(nStatus) != 0)
+    {
+        std::cerr << "x264_cbr failed with status " << nStatus << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Frames, VBV fullness range (percent of the buffer) and violations from
+// the --vbv-log CSV.
+bool read_vbv_log(const std::string &strPath, const double dBufferBits, std::map<std::string, double> &inout_mapMetrics)
+{
+    std::ifstream file{strPath};
+    std::string strLine;
+    if (!std::getline(file, strLine))
+    {
+        std::cerr << "Could not read VBV log " << strPath << std::endl;
+        return false;
+    }
+
+    double dMinBits = dBufferBits;
+    double dMaxBits = 0.0;
+    uint64_t nFrames = 0;
+    uint64_t nUnderflows = 0;
+    uint64_t nOverflows = 0;
+    while (std::getline(file, strLine))
+    {
+        // dts,frame_bits,fullness_before_bits,fullness_after_bits,event
+        std::istringstream line{strLine};
+        std::string strDts;
+        std::string strFrameBits;
+        std::string strBefore;
+        std::string strAfter;
+        std::string strEvent;
+        if (!std::getline(line, strDts, ',') || !std::getline(line, strFrameBits, ',')
+            || !std::getline(line, strBefore, ',') || !std::getline(line, strAfter, ','))
+        {
+            std::cerr << "Malformed VBV log line: " << strLine << std::endl;
+            return false;
+        }
+        std::getline(line, strEvent);
+
+        ++nFrames;
+        dMaxBits = std::max(dMaxBits, std::atof(strBefore.c_str()));
+        dMinBits = std::min(dMinBits, std::atof(strAfter.c_str()));
+        nUnderflows += strEvent == "underflow" ? 1 : 0;
+        nOverflows += strEvent == "overflow" ? 1 : 0;
+    }
+
+    inout_mapMetrics["frames"] = static_cast<double>(nFrames);
+    inout_mapMetrics["vbv_min_pct"] = 100.0 * dMinBits / dBufferBits;
+    inout_mapMetrics["vbv_max_pct"] = 100.0 * dMaxBits / dBufferBits;
+    inout_mapMetrics["vbv_underflows"] = static_cast<double>(nUnderflows);
+    inout_mapMetrics["vbv_overflows"] = static_cast<double>(nOverflows);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Windowed bitrate of the video PID and of the whole multiplex, PCR
+// interval and jitter, and continuity errors.
+bool analyze_output(const std::string &strPath, std::map<std::string, double> &inout_mapMetrics)
+{
+    TsAnalyzerConfig config{};
+    config.vecWindowsMs = {100, 1000};
+    TsAnalysisReport report{};
+    if (!analyze_transport_stream(strPath, config, report))
+    {
+        return false;
+    }
+
+    // The video PID is the busiest one that is not PSI or stuffing.
+    uint16_t nVideoPid = g_nTsNullPid;
+    uint64_t nContinuityErrors = 0;
+    for (const auto &[nPid, pidReport] : report.mapPids)
+    {
+        nContinuityErrors += pidReport.nContinuityErrors;
+        if (nPid >= 0x20 && nPid != g_nTsNullPid && nPid != g_nTsAllPids
+            && (nVideoPid == g_nTsNullPid || pidReport.nPackets > report.mapPids.at(nVideoPid).nPackets))
+        {
+            nVideoPid = nPid;
+        }
+    }
+
+    for (const TsWindowReport &window : report.vecWindows)
+    {
+        const std::string strWindow = std::to_string(window.nWindowMs) + "ms";
+        for (const auto &[strName, nPid] : {std::make_pair(std::string{"video"}, nVideoPid), std::make_pair(std::string{"total"}, g_nTsAllPids)})
+        {
+            const auto it = window.mapSummaries.find(nPid);
+            if (it == window.mapSummaries.end() || it->second.dMeanBps <= 0.0)
+            {
+                std::cerr << "No " << strName << " bitrate over " << strWindow << " windows" << std::endl;
+                return false;
+            }
+            const TsRateSummary &summary = it->second;
+            inout_mapMetrics[strName + "_" + strWindow + "_min_ratio"] = summary.dMinBps / summary.dMeanBps;
+            inout_mapMetrics[strName + "_" + strWindow + "_max_ratio"] = summary.dMaxBps / summary.dMeanBps;
+            inout_mapMetrics[strName + "_" + strWindow + "_stddev_pct"] = 100.0 * summary.dStdDevBps / summary.dMeanBps;
+        }
+    }
+
+    inout_mapMetrics["cc_errors"] = static_cast<double>(nContinuityErrors);
+    inout_mapMetrics["pcr_max_interval_ms"] = report.pcr.dMaxIntervalMs;
+    inout_mapMetrics["pcr_max_offset_ns"] = report.pcr.dMaxAbsOffsetNs;
+    inout_mapMetrics["pcr_rms_offset_ns"] = report.pcr.dRmsOffsetNs;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Metrics from x264_cbr's own report: the encoder's throughput (the
+// slowest output's), the QP hint regions the pre-analysis attached, when
+// it ran, and how many frames libavcodec encoded without them.
+bool read_report(const std::string &strPath, std::map<std::string, double> &inout_mapMetrics)
+{
+    std::ifstream file{strPath};
+    if (!file)
+    {
+        std::cerr << "Could not read x264_cbr report " << strPath << std::endl;
+        return false;
+    }
+
+    double dRoiSkipped{0.0};
+    std::string strLine;
+    while (std::getline(file, strLine))
+    {
+        if (strLine.find("skipping ROI") != std::string::npos)
+        {
+            ++dRoiSkipped;
+        }
+
+        // "Encoder: <n> frames in <s> s of encoder calls, <fps> fps"
+        if (strLine.rfind("Encoder: ", 0) == 0)
+        {
+            const auto nComma = strLine.rfind(", ");
+            if (nComma != std::string::npos)
+            {
+                const double dFps = std::atof(strLine.c_str() + nComma + 2);
+                const auto it = inout_mapMetrics.find("encode_fps");
+                inout_mapMetrics["encode_fps"] = it == inout_mapMetrics.end() ? dFps : std::min(it->second, dFps);
+            }
+        }
+
+        // "Pre-analysis: <n> frames, frame QP offset min/mean/max <a>/<b>/<c>, <n> regions"
+        if (strLine.rfind("Pre-analysis: ", 0) == 0)
+        {
+            const auto nComma = strLine.rfind(", ");
+            if (nComma != std::string::npos)
+            {
+                inout_mapMetrics["preanalysis_regions"] = std::atof(strLine.c_str() + nComma + 2);
+            }
+        }
+    }
+    inout_mapMetrics["roi_skipped"] = dRoiSkipped;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Encodes strClip with vecExtraArgs into <strName>.ts and measures it.
+bool encode_and_measure(const RegressionOptions &options,
+                        const std::vector<std::string> &vecExtraArgs,
+                        const std::string &strClip,
+                        const std::string &strName,
+                        std::map<std::string, double> &out_mapMetrics)
+{
+    const std::string strBase = options.strWorkDir + "/" + strName;
+    const std::string strOutput = strBase + ".ts";
+    const std::string strVbvLog = strBase + "_vbv.csv";
+    const std::string strReport = strBase + "_report.txt";
+    double dSeconds{0.0};
+    if (!run_x264_cbr(options, vecExtraArgs, strClip, strOutput, strVbvLog, strReport, dSeconds))
+    {
+        return false;
+    }
+
+    CbrEncoderSettings settings{};
+    settings.bLowLatency = std::find(vecExtraArgs.begin(), vecExtraArgs.end(), "--low-latency") != vecExtraArgs.end();
+
+    if (!read_vbv_log(strVbvLog, static_cast<double>(cbr_vbv_buffer_bits(settings)), out_mapMetrics)
+        || !analyze_output(strOutput, out_mapMetrics)
+        || !read_report(strReport, out_mapMetrics))
+    {
+        return false;
+    }
+    out_mapMetrics["fps"] = dSeconds > 0.0 ? out_mapMetrics["frames"] / dSeconds : 0.0;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// "<case pattern> <metric> min|max <limit>" per line; '#' starts a comment.
+bool load_thresholds(const std::string &strPath, std::vector<Threshold> &out_vecThresholds)
+{
+    std::ifstream file{strPath};
+    if (!file)
+    {
+        std::cerr << "Could not open thresholds " << strPath << std::endl;
+        return false;
+    }
+
+    std::string strLine;
+    for (int nLine = 1; std::getline(file, strLine); ++nLine)
+    {
+        strLine = strLine.substr(0, strLine.find('#'));
+        std::istringstream line{strLine};
+        Threshold threshold;
+        std::string strOp;
+        if (!(line >> threshold.strCasePattern))
+        {
+            continue;
+        }
+        std::string strSeverity;
+        if (!(line >> threshold.strMetric >> strOp >> threshold.dLimit) || (strOp != "min" && strOp != "max")
+            || ((line >> strSeverity) && strSeverity != "provisional"))
+        {
+            std::cerr << strPath << ":" << nLine << ": expected \"case metric min|max limit [provisional]\"" << std::endl;
+            return false;
+        }
+        threshold.bMin = strOp == "min";
+        threshold.bProvisional = strSeverity == "provisional";
+        out_vecThresholds.push_back(threshold);
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Prints every metric with the limits that apply to this case; false if
+// any is out of bounds or a limit names an unknown metric.
+bool check_thresholds(const RegressionOptions &options,
+                      const std::map<std::string, double> &mapMetrics,
+                      const std::vector<Threshold> &vecThresholds)
+{
+    bool bPass{true};
+    for (const Threshold &threshold : vecThresholds)
+    {
+        if (fnmatch(threshold.strCasePattern.c_str(), options.strCase.c_str(), 0) == 0 && mapMetrics.count(threshold.strMetric) == 0)
+        {
+            std::cerr << "Unknown metric in thresholds: " << threshold.strMetric << std::endl;
+            bPass = false;
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    for (const auto &[strMetric, dValue] : mapMetrics)
+    {
+        std::cout << "  " << std::left << std::setw(26) << strMetric << std::right << std::setw(14) << dValue;
+        for (const Threshold &threshold : vecThresholds)
+        {
+            if (threshold.strMetric != strMetric || fnmatch(threshold.strCasePattern.c_str(), options.strCase.c_str(), 0) != 0)
+            {
+                continue;
+            }
+
+            const bool bOk = threshold.bMin ? dValue >= threshold.dLimit : dValue <= threshold.dLimit;
+            std::cout << "  " << (threshold.bMin ? ">= " : "<= ") << threshold.dLimit
+                      << (bOk ? " ok" : threshold.bProvisional ? " missed (provisional)" : " FAILED");
+            bPass = bPass && (bOk || threshold.bProvisional);
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::defaultfloat;
+    return bPass;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_usage()
+{
+    std::cerr << "Usage: x264_cbr_regress --x264-cbr=PATH --case=NAME --thresholds=PATH [options] [-- x264_cbr options]" << std::endl
+              << "  --clip=KIND        pattern (default), static, noise or cuts" << std::endl
+              << "  --frames=N         Clip length at 25 fps (default 250)" << std::endl
+              << "  --work-dir=DIR     Where clips and outputs go (default .)" << std::endl
+              << "  --baseline         Also encode without the x264_cbr options and compare" << std::endl;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool parse_arguments(int argc, char *argv[], RegressionOptions &out_options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string strArg = argv[i];
+        if (strArg == "--")
+        {
+            out_options.vecExtraArgs.assign(argv + i + 1, argv + argc);
+            break;
+        }
+
+        const auto nEq = strArg.find('=');
+        const std::string strKey = strArg.substr(0, nEq);
+        const std::string strValue = nEq == std::string::npos ? std::string{} : strArg.substr(nEq + 1);
+        if (strKey == "--x264-cbr")
+        {
+            out_options.strX264Cbr = strValue;
+        }
+        else if (strKey == "--case")
+        {
+            out_options.strCase = strValue;
+        }
+        else if (strKey == "--thresholds")
+        {
+            out_options.strThresholdsPath = strValue;
+        }
+        else if (strKey == "--work-dir")
+        {
+            out_options.strWorkDir = strValue;
+        }
+        else if (strKey == "--frames")
+        {
+            out_options.nFrames = std::atoi(strValue.c_str());
+        }
+        else if (strKey == "--baseline")
+        {
+            out_options.bBaseline = true;
+        }
+        else if (strKey == "--clip")
+        {
+            static const std::map<std::string, ClipKind> mapClips{{"pattern", ClipKind::Pattern},
+                                                                  {"static", ClipKind::Static},
+                                                                  {"noise", ClipKind::Noise},
+                                                                  {"cuts", ClipKind::Cuts}};
+            const auto it = mapClips.find(strValue);
+            if (it == mapClips.end())
+            {
+                std::cerr << "Unknown clip: " << strValue << std::endl;
+                return false;
+            }
+            out_options.eClip = it->second;
+            out_options.strClip = strValue;
+        }
+        else
+        {
+            std::cerr << "Unknown option: " << strArg << std::endl;
+            return false;
+        }
+    }
+
+    return !out_options.strX264Cbr.empty() && !out_options.strCase.empty() && !out_options.strThresholdsPath.empty()
+        && out_options.nFrames > 0;
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+int main(int argc, char *argv[])
+{
+    RegressionOptions options{};
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage();
+        return 1;
+    }
+
+    std::vector<Threshold> vecThresholds;
+    if (!load_thresholds(options.strThresholdsPath, vecThresholds))
+    {
+        return 1;
+    }
+
+    // Cases share clips. Each is written under a temporary name and renamed
+    // into place, so cases running in parallel never read a partial clip.
+    const std::string strBase = options.strWorkDir + "/";
+    const std::string strClip = strBase + "clip_" + options.strClip + "_" + std::to_string(options.nFrames) + ".ts";
+    if (!file_exists(strClip))
+    {
+        const std::string strTemp = strClip + "." + std::to_string(getpid());
+        if (!generate_clip(strTemp, options.eClip, options.nFrames) || std::rename(strTemp.c_str(), strClip.c_str()) != 0)
+        {
+            std::cerr << "Could not generate clip " << strClip << std::endl;
+            std::remove(strTemp.c_str());
+            return 1;
+        }
+    }
+
+    std::map<std::string, double> mapMetrics;
+    if (!encode_and_measure(options, options.vecExtraArgs, strClip, options.strCase, mapMetrics))
+    {
+        return 1;
+    }
+
+    // The plain encode of the same clip, as the lavf_* cases run it: the
+    // case has to do better than that, whatever the absolute numbers are
+    // on this machine.
+    if (options.bBaseline)
+    {
+        std::map<std::string, double> mapBaseline;
+        if (!encode_and_measure(options, {}, strClip, options.strCase + "_baseline", mapBaseline))
+        {
+            return 1;
+        }
+        const double dBaselineSpread = mapBaseline["video_100ms_stddev_pct"];
+        mapMetrics["video_100ms_stddev_baseline_ratio"] = dBaselineSpread > 0.0 ? mapMetrics["video_100ms_stddev_pct"] / dBaselineSpread : 1.0;
+        mapMetrics["vbv_min_pct_baseline_delta"] = mapMetrics["vbv_min_pct"] - mapBaseline["vbv_min_pct"];
+    }
+
+    std::cout << "Case " << options.strCase << " (" << options.strClip << " clip):" << std::endl;
+    if (!check_thresholds(options, mapMetrics, vecThresholds))
+    {
+        std::cout << "Case " << options.strCase << " FAILED" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,323 @@
+#include "cbr_transcoder.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CbrTranscoder test, in two parts.
+//
+// Push/pull: generated frames go through the embeddable encoder with a
+// small pending limit, pulling only when push() asks for it. Checks that
+// Again takes nothing and comes exactly at the limit, that flush() hands
+// out the rest, and that pull() then reports Eof.
+//
+// End to end: the H.264 packets of the first part are pushed as packets
+// into a second transcoder, which decodes and re-encodes them, and its
+// sink muxes them into an MPEG-TS at cbr_mux_rate() as x264_cbr does. The
+// file is read back, and must hold every frame in decode order.
+
+namespace
+{
+
+constexpr int g_nWidth = 352;
+constexpr int g_nHeight = 288;
+constexpr int g_nFrames = 100;
+constexpr std::size_t g_nMaxPending = 3;
+constexpr const char *g_pszTsPath = "cbr_transcoder_test.ts";
+
+//////////////////////////////////////////////////////////////////////////
+struct FrameDeleter
+{
+    void operator()(AVFrame *pFrame) const
+    {
+        av_frame_free(&pFrame);
+    }
+};
+
+struct PacketDeleter
+{
+    void operator()(AVPacket *pPkt) const
+    {
+        av_packet_free(&pPkt);
+    }
+};
+
+struct CodecParDeleter
+{
+    void operator()(AVCodecParameters *pPar) const
+    {
+        avcodec_parameters_free(&pPar);
+    }
+};
+
+struct OutputDeleter
+{
+    void operator()(AVFormatContext *pFmtCtx) const
+    {
+        if (pFmtCtx->pb != nullptr)
+        {
+            avio_closep(&pFmtCtx->pb);
+        }
+        avformat_free_context(pFmtCtx);
+    }
+};
+
+struct InputDeleter
+{
+    void operator()(AVFormatContext *pFmtCtx) const
+    {
+        avformat_close_input(&pFmtCtx);
+    }
+};
+
+using PacketPtr = std::unique_ptr<AVPacket, PacketDeleter>;
+
+//////////////////////////////////////////////////////////////////////////
+// What the push/pull part encoded: the input of the end-to-end part.
+struct EncodedStream
+{
+    std::unique_ptr<AVCodecParameters, CodecParDeleter> apPar{avcodec_parameters_alloc()};
+    AVRational timeBase{1, 1};
+    std::vector<PacketPtr> vecPackets;
+};
+
+//////////////////////////////////////////////////////////////////////////
+bool expect(const bool bCondition, const char *pszWhat)
+{
+    if (!bCondition)
+    {
+        std::cout << "FAILED: " << pszWhat << std::endl;
+    }
+    return bCondition;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// A moving gradient, so that the encoder has something to code.
+bool make_frame(AVFrame *pFrame, const int nIndex)
+{
+    pFrame->format = AV_PIX_FMT_YUV420P;
+    pFrame->width = g_nWidth;
+    pFrame->height = g_nHeight;
+    if (av_frame_get_buffer(pFrame, 0) < 0)
+    {
+        return false;
+    }
+
+    for (int nPlane = 0; nPlane < 3; ++nPlane)
+    {
+        const int nShift = nPlane == 0 ? 0 : 1;
+        for (int y = 0; y < g_nHeight >> nShift; ++y)
+        {
+            uint8_t *pRow = pFrame->data[nPlane] + static_cast<std::ptrdiff_t>(y) * pFrame->linesize[nPlane];
+            for (int x = 0; x < g_nWidth >> nShift; ++x)
+            {
+                pRow[x] = static_cast<uint8_t>(nPlane == 0 ? 16 + (x + y + 3 * nIndex) % 220 : 128 + ((x - nIndex) & 0x0F));
+            }
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Moves a pulled packet into the stream kept for the end-to-end part.
+void keep_packet(EncodedStream &inout_stream, AVPacket *inout_pPkt)
+{
+    PacketPtr apKept{av_packet_alloc()};
+    av_packet_move_ref(apKept.get(), inout_pPkt);
+    inout_stream.vecPackets.push_back(std::move(apKept));
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool test_push_pull(EncodedStream &out_stream)
+{
+    CbrTranscoderConfig config{};
+    config.nMaxPendingPackets = g_nMaxPending;
+
+    CbrTranscoder transcoder{config};
+    if (!expect(transcoder.open(g_nWidth, g_nHeight), "open()"))
+    {
+        return false;
+    }
+
+    std::unique_ptr<AVFrame, FrameDeleter> apFrame{av_frame_alloc()};
+    PacketPtr apPkt{av_packet_alloc()};
+    if (!apFrame || !apPkt || !out_stream.apPar
+        || avcodec_parameters_from_context(out_stream.apPar.get(), transcoder.encoder()) < 0)
+    {
+        return false;
+    }
+    out_stream.timeBase = transcoder.time_base();
+
+    bool bOk{true};
+    uint64_t nPulled{0};
+    int nAgain{0};
+    for (int i = 0; bOk && i < g_nFrames; ++i)
+    {
+        bOk = make_frame(apFrame.get(), i);
+
+        CbrTranscoderStatus eStatus{};
+        while (bOk && (eStatus = transcoder.push(apFrame.get())) == CbrTranscoderStatus::Again)
+        {
+            // Backpressure: only at the limit, and nothing was taken.
+            ++nAgain;
+            bOk = expect(transcoder.pending() == g_nMaxPending, "Again exactly at nMaxPendingPackets")
+                && expect(!transcoder.writable(), "not writable while Again")
+                && expect(transcoder.frames_encoded() == static_cast<uint64_t>(i), "Again takes no frame")
+                && expect(transcoder.pull(apPkt.get()) == CbrTranscoderStatus::Ok, "pull() after Again");
+            keep_packet(out_stream, apPkt.get());
+            ++nPulled;
+        }
+        bOk = bOk
+            && expect(eStatus == CbrTranscoderStatus::Ok, "push()")
+            && expect(transcoder.pending() <= g_nMaxPending, "pending() within nMaxPendingPackets");
+        av_frame_unref(apFrame.get());
+    }
+
+    bOk = bOk
+        && expect(nAgain > 0, "push() returned Again at least once")
+        && expect(transcoder.flush() == CbrTranscoderStatus::Ok, "flush()")
+        && expect(transcoder.push(apFrame.get()) == CbrTranscoderStatus::Error, "push() after flush() fails");
+
+    // The encoder is flushed: the rest comes out, then Eof, and stays so.
+    CbrTranscoderStatus eStatus{CbrTranscoderStatus::Ok};
+    while (bOk && (eStatus = transcoder.pull(apPkt.get())) == CbrTranscoderStatus::Ok)
+    {
+        keep_packet(out_stream, apPkt.get());
+        ++nPulled;
+    }
+    bOk = bOk
+        && expect(eStatus == CbrTranscoderStatus::Eof, "pull() ends with Eof")
+        && expect(transcoder.pull(apPkt.get()) == CbrTranscoderStatus::Eof, "pull() after Eof")
+        && expect(transcoder.frames_encoded() == static_cast<uint64_t>(g_nFrames), "every frame encoded")
+        && expect(transcoder.packets_encoded() == static_cast<uint64_t>(g_nFrames), "one packet per frame")
+        && expect(nPulled == transcoder.packets_encoded(), "every packet pulled");
+
+    std::cout << "CbrTranscoder: " << transcoder.frames_encoded() << " frames, "
+              << nPulled << " packets pulled, Again " << nAgain << " times" << std::endl;
+    return bOk;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Opens the MPEG-TS output for the transcoder's stream and writes its
+// header at the CBR mux rate.
+bool open_ts_output(const CbrTranscoderConfig &config,
+                    const CbrTranscoder &transcoder,
+                    std::unique_ptr<AVFormatContext, OutputDeleter> &out_apFmtCtx)
+{
+    AVFormatContext *pFmtCtx = nullptr;
+    if (avformat_alloc_output_context2(&pFmtCtx, nullptr, "mpegts", g_pszTsPath) < 0)
+    {
+        return false;
+    }
+    out_apFmtCtx.reset(pFmtCtx);
+
+    AVStream *pSt = avformat_new_stream(pFmtCtx, nullptr);
+    if (pSt == nullptr
+        || avcodec_parameters_from_context(pSt->codecpar, transcoder.encoder()) < 0
+        || avio_open(&pFmtCtx->pb, g_pszTsPath, AVIO_FLAG_WRITE) < 0)
+    {
+        return false;
+    }
+    pSt->time_base = transcoder.time_base();
+
+    AVDictionary *pDict{};
+    av_dict_set_int(&pDict, "muxrate", cbr_mux_rate(config.encoder), 0);
+    av_dict_set_int(&pDict, "max_delay", cbr_mux_max_delay(config.encoder), 0);
+    const int ret = avformat_write_header(pFmtCtx, &pDict);
+    av_dict_free(&pDict);
+    return ret >= 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Reads the MPEG-TS back: one H.264 stream of the encoded size, holding
+// every frame with rising DTS.
+bool check_ts_output(const uint64_t nExpectedFrames)
+{
+    AVFormatContext *pFmtCtx = nullptr;
+    if (!expect(avformat_open_input(&pFmtCtx, g_pszTsPath, nullptr, nullptr) >= 0, "reopen the MPEG-TS"))
+    {
+        return false;
+    }
+    std::unique_ptr<AVFormatContext, InputDeleter> apFmtCtx{pFmtCtx};
+    if (!expect(avformat_find_stream_info(pFmtCtx, nullptr) >= 0, "stream info of the MPEG-TS")
+        || !expect(pFmtCtx->nb_streams == 1, "one stream in the MPEG-TS"))
+    {
+        return false;
+    }
+
+    const AVCodecParameters *pPar = pFmtCtx->streams[0]->codecpar;
+    bool bOk = expect(pPar->codec_id == AV_CODEC_ID_H264, "H.264 in the MPEG-TS")
+        && expect(pPar->width == g_nWidth && pPar->height == g_nHeight, "picture size in the MPEG-TS");
+
+    PacketPtr apPkt{av_packet_alloc()};
+    uint64_t nPackets{0};
+    int64_t nLastDts = AV_NOPTS_VALUE;
+    while (bOk && av_read_frame(pFmtCtx, apPkt.get()) >= 0)
+    {
+        bOk = expect(apPkt->dts != AV_NOPTS_VALUE && (nLastDts == AV_NOPTS_VALUE || apPkt->dts > nLastDts),
+                     "rising DTS in the MPEG-TS");
+        nLastDts = apPkt->dts;
+        ++nPackets;
+        av_packet_unref(apPkt.get());
+    }
+
+    std::cout << "MPEG-TS: " << nPackets << " video packets read back" << std::endl;
+    return bOk && expect(nPackets == nExpectedFrames, "every frame in the MPEG-TS");
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool test_transcode_to_ts(const EncodedStream &stream)
+{
+    CbrTranscoderConfig config{};
+    CbrTranscoder transcoder{config};
+    if (!expect(transcoder.open(stream.apPar.get(), stream.timeBase), "open() for packets"))
+    {
+        return false;
+    }
+
+    std::unique_ptr<AVFormatContext, OutputDeleter> apFmtCtx;
+    if (!expect(open_ts_output(config, transcoder, apFmtCtx), "MPEG-TS output"))
+    {
+        return false;
+    }
+
+    AVFormatContext *pFmtCtx = apFmtCtx.get();
+    const AVRational tbEncoder = transcoder.time_base();
+    transcoder.set_sink([pFmtCtx, tbEncoder](AVPacket *pPkt) {
+        av_packet_rescale_ts(pPkt, tbEncoder, pFmtCtx->streams[0]->time_base);
+        pPkt->stream_index = 0;
+        return av_interleaved_write_frame(pFmtCtx, pPkt) == 0;
+    });
+
+    bool bOk{true};
+    for (const PacketPtr &apPkt : stream.vecPackets)
+    {
+        bOk = bOk && expect(transcoder.push(apPkt.get()) == CbrTranscoderStatus::Ok, "push() of a packet");
+    }
+    bOk = bOk
+        && expect(transcoder.flush() == CbrTranscoderStatus::Ok, "flush() with a sink")
+        && expect(transcoder.pending() == 0, "nothing pending with a sink")
+        && expect(transcoder.frames_encoded() == stream.vecPackets.size(), "every packet decoded and re-encoded")
+        && expect(av_write_trailer(pFmtCtx) == 0, "MPEG-TS trailer");
+    apFmtCtx.reset();
+
+    return bOk && check_ts_output(stream.vecPackets.size());
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+int main()
+{
+    EncodedStream stream;
+    const bool bOk = test_push_pull(stream) && test_transcode_to_ts(stream);
+    return bOk ? 0 : 1;
+}
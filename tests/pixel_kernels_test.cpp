@@ -0,0 +1,175 @@
+#include "pixel_convert.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////
+// Pixel conversion kernel test: runs every SIMD row kernel this CPU
+// supports on random rows and checks its output against the scalar kernel
+// byte for byte. Widths cover the odd ones and every tail length after the
+// 16- and 32-byte blocks, and the rows start off any alignment.
+
+namespace
+{
+
+// Bytes past the row that no kernel may write.
+constexpr int g_nGuard = 64;
+constexpr uint8_t g_nGuardByte = 0xA5;
+
+//////////////////////////////////////////////////////////////////////////
+struct KernelTest
+{
+    const PixelRowKernels &reference;
+    const PixelRowKernels &kernels;
+    const char *pszLevel;
+    std::mt19937 random{20240601};
+    int nFailures{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+void fill_random(KernelTest &test, std::vector<uint8_t> &inout_vecBytes)
+{
+    std::uniform_int_distribution<int> distribution{0, 255};
+    for (uint8_t &nByte : inout_vecBytes)
+    {
+        nByte = static_cast<uint8_t>(distribution(test.random));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Compares the n bytes the kernels wrote and the guard bytes after them.
+void check_row(KernelTest &test,
+               const char *pszKernel,
+               const int n,
+               const std::vector<uint8_t> &vecExpected,
+               const std::vector<uint8_t> &vecActual,
+               const int nOffset)
+{
+    for (int i = 0; i < n + g_nGuard; ++i)
+    {
+        const uint8_t nExpected = i < n ? vecExpected[static_cast<std::size_t>(i)] : g_nGuardByte;
+        const uint8_t nActual = vecActual[static_cast<std::size_t>(nOffset + i)];
+        if (nExpected != nActual)
+        {
+            std::cout << test.pszLevel << " " << pszKernel << ", width " << n << ", offset " << nOffset
+                      << ": byte " << i << " is " << static_cast<int>(nActual)
+                      << ", scalar gives " << static_cast<int>(nExpected) << std::endl;
+            ++test.nFailures;
+            return;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void test_average(KernelTest &test, const int n, const int nOffset)
+{
+    std::vector<uint8_t> vecA(static_cast<std::size_t>(nOffset + n));
+    std::vector<uint8_t> vecB(static_cast<std::size_t>(nOffset + n));
+    fill_random(test, vecA);
+    fill_random(test, vecB);
+
+    std::vector<uint8_t> vecExpected(static_cast<std::size_t>(n));
+    std::vector<uint8_t> vecActual(static_cast<std::size_t>(nOffset + n + g_nGuard), g_nGuardByte);
+
+    test.reference.pfnAverage(vecA.data() + nOffset, vecB.data() + nOffset, vecExpected.data(), n);
+    test.kernels.pfnAverage(vecA.data() + nOffset, vecB.data() + nOffset, vecActual.data() + nOffset, n);
+    check_row(test, "average", n, vecExpected, vecActual, nOffset);
+
+    std::fill(vecActual.begin(), vecActual.end(), g_nGuardByte);
+    test.reference.pfnAverage31(vecA.data() + nOffset, vecB.data() + nOffset, vecExpected.data(), n);
+    test.kernels.pfnAverage31(vecA.data() + nOffset, vecB.data() + nOffset, vecActual.data() + nOffset, n);
+    check_row(test, "average 3:1", n, vecExpected, vecActual, nOffset);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// 10-bit samples, plus out-of-range ones, which must saturate alike.
+void test_shift(KernelTest &test, const int n, const int nOffset)
+{
+    std::uniform_int_distribution<int> distribution10{0, 1023};
+    std::uniform_int_distribution<int> distribution16{0, 65535};
+    std::vector<uint16_t> vecSrc(static_cast<std::size_t>(nOffset + n));
+    for (std::size_t i = 0; i < vecSrc.size(); ++i)
+    {
+        vecSrc[i] = static_cast<uint16_t>(i % 8 == 7 ? distribution16(test.random) : distribution10(test.random));
+    }
+
+    std::vector<uint8_t> vecExpected(static_cast<std::size_t>(n));
+    std::vector<uint8_t> vecActual(static_cast<std::size_t>(nOffset + n + g_nGuard), g_nGuardByte);
+
+    test.reference.pfnShift10To8(vecSrc.data() + nOffset, vecExpected.data(), n);
+    test.kernels.pfnShift10To8(vecSrc.data() + nOffset, vecActual.data() + nOffset, n);
+    check_row(test, "shift 10 to 8", n, vecExpected, vecActual, nOffset);
+}
+
+//////////////////////////////////////////////////////////////////////////
+void test_split_packed(KernelTest &test, const int nPairs, const int nOffset, const bool bUyvy)
+{
+    std::vector<uint8_t> vecSrc(static_cast<std::size_t>(nOffset + 4 * nPairs));
+    fill_random(test, vecSrc);
+
+    const auto nPlane = static_cast<std::size_t>(nOffset + 2 * nPairs + g_nGuard);
+    std::vector<uint8_t> vecExpectedY(static_cast<std::size_t>(2 * nPairs));
+    std::vector<uint8_t> vecExpectedU(static_cast<std::size_t>(nPairs));
+    std::vector<uint8_t> vecExpectedV(static_cast<std::size_t>(nPairs));
+    std::vector<uint8_t> vecY(nPlane, g_nGuardByte);
+    std::vector<uint8_t> vecU(nPlane, g_nGuardByte);
+    std::vector<uint8_t> vecV(nPlane, g_nGuardByte);
+
+    test.reference.pfnSplitPacked(vecSrc.data() + nOffset, vecExpectedY.data(), vecExpectedU.data(), vecExpectedV.data(), nPairs, bUyvy);
+    test.kernels.pfnSplitPacked(vecSrc.data() + nOffset, vecY.data() + nOffset, vecU.data() + nOffset, vecV.data() + nOffset, nPairs, bUyvy);
+
+    const char *pszKernel = bUyvy ? "split UYVY" : "split YUYV";
+    check_row(test, pszKernel, 2 * nPairs, vecExpectedY, vecY, nOffset);
+    check_row(test, pszKernel, nPairs, vecExpectedU, vecU, nOffset);
+    check_row(test, pszKernel, nPairs, vecExpectedV, vecV, nOffset);
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+int main()
+{
+    // Every width up to a few blocks, so that each tail length is hit after
+    // zero, one and two whole blocks, and the picture widths in use.
+    std::vector<int> vecWidths;
+    for (int n = 0; n <= 100; ++n)
+    {
+        vecWidths.push_back(n);
+    }
+    for (const int n : {359, 360, 719, 720, 959, 960, 1919, 1920, 3839})
+    {
+        vecWidths.push_back(n);
+    }
+
+    const SimdLevel eBest = detect_simd_level();
+    std::cout << "CPU kernels: " << simd_level_name(eBest) << std::endl;
+
+    int nFailures{0};
+    for (const SimdLevel eLevel : {SimdLevel::Sse41, SimdLevel::Avx2})
+    {
+        if (eLevel > eBest)
+        {
+            std::cout << simd_level_name(eLevel) << ": not supported here, skipped" << std::endl;
+            continue;
+        }
+
+        KernelTest test{pixel_row_kernels(SimdLevel::Scalar), pixel_row_kernels(eLevel), simd_level_name(eLevel)};
+        for (const int n : vecWidths)
+        {
+            for (const int nOffset : {0, 1, 3})
+            {
+                test_average(test, n, nOffset);
+                test_shift(test, n, nOffset);
+                test_split_packed(test, n, nOffset, false);
+                test_split_packed(test, n, nOffset, true);
+            }
+        }
+        std::cout << simd_level_name(eLevel) << ": " << vecWidths.size() << " widths, "
+                  << (test.nFailures == 0 ? "all match scalar" : "MISMATCH") << std::endl;
+        nFailures += test.nFailures;
+    }
+    return nFailures == 0 ? 0 : 1;
+}
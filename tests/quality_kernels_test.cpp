@@ -0,0 +1,178 @@
+#include "quality_kernels.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////
+// Quality kernel test: runs every SIMD squared-error and SSIM block-sum
+// kernel this CPU supports on random pictures and checks the result
+// against the C kernel. Widths cover the odd ones and every tail length
+// after the 16- and 32-byte blocks, the two pictures have different odd
+// strides, and the rows start off any alignment. A full-range HD plane
+// checks that the sums do not overflow.
+
+namespace
+{
+
+//////////////////////////////////////////////////////////////////////////
+struct KernelTest
+{
+    SseKernel pfnSseReference;
+    SseKernel pfnSse;
+    BlockSumsKernel pfnBlockSumsReference;
+    BlockSumsKernel pfnBlockSums;
+    const char *pszLevel;
+    std::mt19937 random{20240815};
+    int nFailures{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+// A picture of nHeight rows of nStride bytes, the first row at nOffset.
+struct Picture
+{
+    std::vector<uint8_t> vecBytes;
+    int nStride{0};
+    int nOffset{0};
+
+    const uint8_t *data() const { return vecBytes.data() + nOffset; }
+};
+
+//////////////////////////////////////////////////////////////////////////
+Picture make_picture(KernelTest &test, const int nStride, const int nHeight, const int nOffset)
+{
+    Picture picture;
+    picture.nStride = nStride;
+    picture.nOffset = nOffset;
+    picture.vecBytes.resize(static_cast<std::size_t>(nOffset) + static_cast<std::size_t>(nStride) * nHeight);
+
+    std::uniform_int_distribution<int> distribution{0, 255};
+    for (uint8_t &nByte : picture.vecBytes)
+    {
+        nByte = static_cast<uint8_t>(distribution(test.random));
+    }
+    return picture;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void test_sse(KernelTest &test, const int nWidth, const int nHeight, const int nPad, const int nOffset)
+{
+    // Odd and unequal strides: the kernels must not assume either.
+    const Picture a = make_picture(test, nWidth + nPad, nHeight, nOffset);
+    const Picture b = make_picture(test, nWidth + nPad + 3, nHeight, nOffset + 1);
+
+    const uint64_t nExpected = test.pfnSseReference(a.data(), a.nStride, b.data(), b.nStride, nWidth, nHeight);
+    const uint64_t nActual = test.pfnSse(a.data(), a.nStride, b.data(), b.nStride, nWidth, nHeight);
+    if (nExpected != nActual)
+    {
+        std::cout << test.pszLevel << " sse, " << nWidth << "x" << nHeight << ", strides " << a.nStride << "/" << b.nStride
+                  << ", offset " << nOffset << ": " << nActual << ", C gives " << nExpected << std::endl;
+        ++test.nFailures;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void test_block_sums(KernelTest &test, const int nBlocks, const int nPad, const int nOffset)
+{
+    const Picture a = make_picture(test, 4 * nBlocks + nPad, 4, nOffset);
+    const Picture b = make_picture(test, 4 * nBlocks + nPad + 3, 4, nOffset + 1);
+
+    // One extra entry that no kernel may write.
+    const BlockSums guard{-1, -1, -1, -1};
+    std::vector<BlockSums> vecExpected(static_cast<std::size_t>(nBlocks) + 1, guard);
+    std::vector<BlockSums> vecActual(static_cast<std::size_t>(nBlocks) + 1, guard);
+    test.pfnBlockSumsReference(a.data(), a.nStride, b.data(), b.nStride, nBlocks, vecExpected.data());
+    test.pfnBlockSums(a.data(), a.nStride, b.data(), b.nStride, nBlocks, vecActual.data());
+
+    for (int i = 0; i <= nBlocks; ++i)
+    {
+        const BlockSums &expected = vecExpected[static_cast<std::size_t>(i)];
+        const BlockSums &actual = vecActual[static_cast<std::size_t>(i)];
+        if (expected != actual)
+        {
+            std::cout << test.pszLevel << " block sums, " << nBlocks << " blocks, strides " << a.nStride << "/" << b.nStride
+                      << ", offset " << nOffset << ": block " << i << " is {"
+                      << actual[0] << ", " << actual[1] << ", " << actual[2] << ", " << actual[3] << "}, C gives {"
+                      << expected[0] << ", " << expected[1] << ", " << expected[2] << ", " << expected[3] << "}" << std::endl;
+            ++test.nFailures;
+            return;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Black against white over a whole 1080-line plane: the largest error a
+// frame can have, which must not wrap in the kernels' lane sums.
+void test_sse_full_range(KernelTest &test)
+{
+    constexpr int nWidth = 1920;
+    constexpr int nHeight = 1088;
+    const std::vector<uint8_t> vecBlack(static_cast<std::size_t>(nWidth) * nHeight, 0);
+    const std::vector<uint8_t> vecWhite(static_cast<std::size_t>(nWidth) * nHeight, 255);
+
+    constexpr uint64_t nExpected = static_cast<uint64_t>(nWidth) * nHeight * 255 * 255;
+    const uint64_t nActual = test.pfnSse(vecBlack.data(), nWidth, vecWhite.data(), nWidth, nWidth, nHeight);
+    if (nActual != nExpected)
+    {
+        std::cout << test.pszLevel << " sse, full range " << nWidth << "x" << nHeight << ": " << nActual
+                  << ", expected " << nExpected << std::endl;
+        ++test.nFailures;
+    }
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+int main()
+{
+    // Every width up to a few blocks, so that each tail length is hit after
+    // zero, one and two whole blocks, and the picture widths in use.
+    std::vector<int> vecWidths;
+    for (int n = 0; n <= 100; ++n)
+    {
+        vecWidths.push_back(n);
+    }
+    for (const int n : {359, 360, 719, 720, 959, 960, 1919, 1920, 3839})
+    {
+        vecWidths.push_back(n);
+    }
+
+    const SimdLevel eBest = detect_simd_level();
+    std::cout << "CPU kernels: " << simd_level_name(eBest) << std::endl;
+
+    int nFailures{0};
+    for (const SimdLevel eLevel : {SimdLevel::Sse41, SimdLevel::Avx2})
+    {
+        if (eLevel > eBest)
+        {
+            std::cout << simd_level_name(eLevel) << ": not supported here, skipped" << std::endl;
+            continue;
+        }
+
+        KernelTest test{sse_kernel_for(SimdLevel::Scalar),
+                        sse_kernel_for(eLevel),
+                        block_sums_kernel_for(SimdLevel::Scalar),
+                        block_sums_kernel_for(eLevel),
+                        simd_level_name(eLevel)};
+        for (const int n : vecWidths)
+        {
+            for (const int nOffset : {0, 1, 3})
+            {
+                test_sse(test, n, 1, 0, nOffset);
+                test_sse(test, n, 5, 7, nOffset);
+
+                // Up to 100 blocks, then the blocks across a picture width.
+                const int nBlocks = n <= 100 ? n : n / 4;
+                test_block_sums(test, nBlocks, 0, nOffset);
+                test_block_sums(test, nBlocks, 5, nOffset);
+            }
+        }
+        test_sse_full_range(test);
+
+        std::cout << simd_level_name(eLevel) << ": " << vecWidths.size() << " widths, "
+                  << (test.nFailures == 0 ? "all match C" : "MISMATCH") << std::endl;
+        nFailures += test.nFailures;
+    }
+    return nFailures == 0 ? 0 : 1;
+}
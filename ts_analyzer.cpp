@@ -0,0 +1,744 @@
+#include "ts_analyzer.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+
+constexpr int64_t g_nPcrHz = 27000000;
+constexpr int64_t g_nPcrWrap = (int64_t{1} << 33) * 300;
+
+// Any PCR step outside (0, 1 s] is treated as a timebase discontinuity.
+constexpr int64_t g_nMaxPcrStep = g_nPcrHz;
+
+// Pages behind the read position are dropped in chunks of this size.
+constexpr std::size_t g_nReleaseChunk = 64 * 1024 * 1024;
+
+// Packets held waiting for a PCR to time them: about 200 MB of stream.
+// Beyond that the stream is taken to have no usable PCR, and packets are
+// left out of the bitrate windows until one comes.
+constexpr std::size_t g_nMaxPendingPackets = 1024 * 1024;
+
+//////////////////////////////////////////////////////////////////////////
+struct PcrSample
+{
+    uint64_t nOffset;
+    int64_t nTime;
+    uint32_t nSegment;
+};
+
+struct PendingPacket
+{
+    uint64_t nOffset;
+    uint16_t nPid;
+};
+
+//////////////////////////////////////////////////////////////////////////
+class TsWalker
+{
+public:
+    TsWalker(const TsAnalyzerConfig &config, TsAnalysisReport &report)
+        : m_config(config),
+          m_report(report),
+          m_nStepTicks(static_cast<int64_t>(std::max<uint32_t>(config.nStepMs, 1)) * (g_nPcrHz / 1000))
+    {
+        m_arrPidIdx.fill(-1);
+        m_arrLastCc.fill(-1);
+        m_report.pcr.nPid = config.nPcrPid;
+    }
+
+    void on_packet(const uint8_t *p, const uint64_t nOffset)
+    {
+        const uint16_t nPid = static_cast<uint16_t>(((p[1] & 0x1F) << 8) | p[2]);
+        const uint8_t nAfc = (p[3] >> 4) & 0x3;
+        const bool bHasAf = (nAfc & 0x2) != 0 && p[4] > 0;
+        const bool bDiscontinuity = bHasAf && (p[5] & 0x80) != 0;
+
+        ++m_report.nPackets;
+        TsPidReport &pidReport = pid_report(nPid);
+        ++pidReport.nPackets;
+
+        // Continuity counter: only advances on packets carrying payload; a
+        // single duplicate is legal.
+        if (nPid != g_nTsNullPid && (nAfc & 0x1) != 0)
+        {
+            const int nCc = p[3] & 0xF;
+            const int nLast = m_arrLastCc[nPid];
+            if (nLast >= 0 && !bDiscontinuity && nCc != nLast && nCc != ((nLast + 1) & 0xF))
+            {
+                ++pidReport.nContinuityErrors;
+            }
+            m_arrLastCc[nPid] = static_cast<int8_t>(nCc);
+        }
+
+        if (m_vecPending.size() < g_nMaxPendingPackets)
+        {
+            m_vecPending.push_back(PendingPacket{nOffset, nPid});
+        }
+        else
+        {
+            ++m_report.nUntimedPackets;
+        }
+
+        if (bHasAf && p[4] >= 7 && (p[5] & 0x10) != 0)
+        {
+            ++pidReport.nPcrCount;
+            if (m_report.pcr.nPid < 0)
+            {
+                m_report.pcr.nPid = nPid;
+            }
+
+            if (nPid == m_report.pcr.nPid)
+            {
+                const int64_t nBase = (static_cast<int64_t>(p[6]) << 25)
+                                      | (static_cast<int64_t>(p[7]) << 17)
+                                      | (static_cast<int64_t>(p[8]) << 9)
+                                      | (static_cast<int64_t>(p[9]) << 1)
+                                      | (p[10] >> 7);
+                const int64_t nExt = ((p[10] & 0x1) << 8) | p[11];
+
+                // The PCR refers to the byte holding the last bit of its base.
+                on_pcr(nOffset + 10, nBase * 300 + nExt, bDiscontinuity);
+            }
+        }
+    }
+
+    void finish(const uint64_t nEndOffset)
+    {
+        if (m_bHaveRate)
+        {
+            flush_pending();
+            m_nEndTime = time_at(nEndOffset);
+        }
+        else
+        {
+            m_report.pcr.bNoPcr = true;
+            std::cerr << "Fewer than two usable PCRs found; bitrate cannot be derived." << std::endl;
+        }
+        if (m_report.nUntimedPackets > 0)
+        {
+            std::cerr << "No PCR within " << g_nMaxPendingPackets << " packets; "
+                      << m_report.nUntimedPackets << " packets left out of the bitrate windows." << std::endl;
+        }
+
+        finish_pcr_report();
+        finish_windows();
+    }
+
+private:
+    TsPidReport &pid_report(const uint16_t nPid)
+    {
+        if (m_arrPidIdx[nPid] < 0)
+        {
+            m_arrPidIdx[nPid] = static_cast<int32_t>(m_vecPidReports.size());
+            m_vecPidReports.push_back(&m_report.mapPids[nPid]);
+            m_vecPidOfIndex.push_back(nPid);
+            m_vecBins.emplace_back();
+        }
+        return *m_vecPidReports[m_arrPidIdx[nPid]];
+    }
+
+    int64_t time_at(const uint64_t nOffset) const
+    {
+        const double dBytes = static_cast<double>(nOffset) - static_cast<double>(m_nLastOffset);
+        return m_nLastTime + static_cast<int64_t>(std::llround(dBytes * m_dTicksPerByte));
+    }
+
+    void on_pcr(const uint64_t nOffset, const int64_t nRaw, const bool bDiscontinuity)
+    {
+        ++m_report.pcr.nCount;
+
+        if (!m_bHavePcr)
+        {
+            m_bHavePcr = true;
+            m_nLastOffset = nOffset;
+            m_nLastTime = nRaw;
+            m_nLastRaw = nRaw;
+            m_vecPcr.push_back(PcrSample{nOffset, nRaw, m_nSegment});
+            return;
+        }
+
+        int64_t nDelta = nRaw - m_nLastRaw;
+        if (nDelta < -g_nPcrWrap / 2)
+        {
+            nDelta += g_nPcrWrap;
+        }
+
+        int64_t nTime{};
+        if (bDiscontinuity || nDelta <= 0 || nDelta > g_nMaxPcrStep)
+        {
+            ++m_report.pcr.nDiscontinuities;
+            ++m_nSegment;
+
+            if (!m_bHaveRate)
+            {
+                // Nothing to bridge the gap with yet; start over from here.
+                m_nLastOffset = nOffset;
+                m_nLastTime = nRaw;
+                m_nLastRaw = nRaw;
+                m_vecPcr.push_back(PcrSample{nOffset, nRaw, m_nSegment});
+                return;
+            }
+
+            // Carry the timeline across at the last known rate.
+            nTime = time_at(nOffset);
+        }
+        else
+        {
+            nTime = m_nLastTime + nDelta;
+            m_dTicksPerByte = static_cast<double>(nDelta) / static_cast<double>(nOffset - m_nLastOffset);
+            m_bHaveRate = true;
+        }
+
+        flush_pending();
+
+        m_nLastOffset = nOffset;
+        m_nLastTime = nTime;
+        m_nLastRaw = nRaw;
+        m_vecPcr.push_back(PcrSample{nOffset, nTime, m_nSegment});
+    }
+
+    // Assigns a time to every packet seen since the last PCR, interpolating
+    // (or, before the first PCR, extrapolating) along the current segment.
+    void flush_pending()
+    {
+        if (!m_bHaveOrigin && !m_vecPending.empty())
+        {
+            m_nOrigin = time_at(m_vecPending.front().nOffset);
+            m_bHaveOrigin = true;
+        }
+
+        for (const PendingPacket &pkt : m_vecPending)
+        {
+            const int64_t nTime = std::max<int64_t>(time_at(pkt.nOffset) - m_nOrigin, 0);
+            const std::size_t nBin = static_cast<std::size_t>(nTime / m_nStepTicks);
+
+            std::vector<uint32_t> &vecBins = m_vecBins[m_arrPidIdx[pkt.nPid]];
+            if (vecBins.size() <= nBin)
+            {
+                vecBins.resize(nBin + 1, 0);
+            }
+            ++vecBins[nBin];
+        }
+        m_vecPending.clear();
+    }
+
+    void finish_pcr_report()
+    {
+        TsPcrReport &pcr = m_report.pcr;
+
+        double dSumInterval{0.0};
+        uint64_t nIntervals{0};
+        double dSumSq{0.0};
+        uint64_t nOffsets{0};
+
+        std::size_t nBegin = 0;
+        while (nBegin < m_vecPcr.size())
+        {
+            std::size_t nEnd = nBegin;
+            while (nEnd < m_vecPcr.size() && m_vecPcr[nEnd].nSegment == m_vecPcr[nBegin].nSegment)
+            {
+                ++nEnd;
+            }
+
+            // Intervals.
+            for (std::size_t i = nBegin + 1; i < nEnd; ++i)
+            {
+                const double dMs = static_cast<double>(m_vecPcr[i].nTime - m_vecPcr[i - 1].nTime) * 1000.0 / g_nPcrHz;
+                pcr.dMinIntervalMs = nIntervals == 0 ? dMs : std::min(pcr.dMinIntervalMs, dMs);
+                pcr.dMaxIntervalMs = std::max(pcr.dMaxIntervalMs, dMs);
+                dSumInterval += dMs;
+                ++nIntervals;
+                if (dMs > 40.0)
+                {
+                    ++pcr.nIntervalsOver40Ms;
+                }
+            }
+
+            // Accuracy against a least-squares constant-rate line.
+            if (nEnd - nBegin >= 3)
+            {
+                const double dN = static_cast<double>(nEnd - nBegin);
+                const double dX0 = static_cast<double>(m_vecPcr[nBegin].nOffset);
+                const double dY0 = static_cast<double>(m_vecPcr[nBegin].nTime);
+
+                double dMeanX{0.0};
+                double dMeanY{0.0};
+                for (std::size_t i = nBegin; i < nEnd; ++i)
+                {
+                    dMeanX += static_cast<double>(m_vecPcr[i].nOffset) - dX0;
+                    dMeanY += static_cast<double>(m_vecPcr[i].nTime) - dY0;
+                }
+                dMeanX /= dN;
+                dMeanY /= dN;
+
+                double dSxy{0.0};
+                double dSxx{0.0};
+                for (std::size_t i = nBegin; i < nEnd; ++i)
+                {
+                    const double dX = static_cast<double>(m_vecPcr[i].nOffset) - dX0 - dMeanX;
+                    const double dY = static_cast<double>(m_vecPcr[i].nTime) - dY0 - dMeanY;
+                    dSxy += dX * dY;
+                    dSxx += dX * dX;
+                }
+                const double dSlope = dSxx > 0.0 ? dSxy / dSxx : 0.0;
+
+                for (std::size_t i = nBegin; i < nEnd; ++i)
+                {
+                    const double dX = static_cast<double>(m_vecPcr[i].nOffset) - dX0 - dMeanX;
+                    const double dY = static_cast<double>(m_vecPcr[i].nTime) - dY0 - dMeanY;
+                    const double dNs = (dY - dSlope * dX) * 1.0e9 / g_nPcrHz;
+
+                    pcr.dMaxAbsOffsetNs = std::max(pcr.dMaxAbsOffsetNs, std::fabs(dNs));
+                    dSumSq += dNs * dNs;
+                    ++nOffsets;
+                    if (std::fabs(dNs) > 500.0)
+                    {
+                        ++pcr.nOffsetsOver500Ns;
+                    }
+                }
+            }
+
+            nBegin = nEnd;
+        }
+
+        pcr.dMeanIntervalMs = nIntervals > 0 ? dSumInterval / static_cast<double>(nIntervals) : 0.0;
+        pcr.dRmsOffsetNs = nOffsets > 0 ? std::sqrt(dSumSq / static_cast<double>(nOffsets)) : 0.0;
+    }
+
+    void finish_windows()
+    {
+        m_report.nStepMs = std::max<uint32_t>(m_config.nStepMs, 1);
+        if (!m_bHaveRate || !m_bHaveOrigin)
+        {
+            return;
+        }
+
+        const int64_t nDuration = std::max<int64_t>(m_nEndTime - m_nOrigin, 0);
+        m_report.dDurationSec = static_cast<double>(nDuration) / g_nPcrHz;
+        if (m_report.dDurationSec > 0.0)
+        {
+            m_report.dMuxRateBps = static_cast<double>(m_report.nPackets * g_nTsPacketSize * 8) / m_report.dDurationSec;
+        }
+
+        // Only whole steps; the last, partial one would read low.
+        const std::size_t nBins = static_cast<std::size_t>(nDuration / m_nStepTicks);
+
+        std::vector<uint32_t> vecTotal(nBins, 0);
+        for (std::vector<uint32_t> &vecBins : m_vecBins)
+        {
+            vecBins.resize(nBins, 0);
+            for (std::size_t i = 0; i < nBins; ++i)
+            {
+                vecTotal[i] += vecBins[i];
+            }
+        }
+
+        for (const uint32_t nWindowMsIn : m_config.vecWindowsMs)
+        {
+            const std::size_t nSteps = std::max<std::size_t>((nWindowMsIn + m_report.nStepMs - 1) / m_report.nStepMs, 1);
+
+            TsWindowReport window{};
+            window.nWindowMs = static_cast<uint32_t>(nSteps * m_report.nStepMs);
+
+            const double dScale = static_cast<double>(g_nTsPacketSize * 8) * 1000.0 / window.nWindowMs;
+
+            auto fnSlide = [&](const uint16_t nPid, const std::vector<uint32_t> &vecBins)
+            {
+                TsRateSummary summary{};
+                std::vector<double> vecSeries;
+                if (nBins >= nSteps)
+                {
+                    uint64_t nSum = 0;
+                    for (std::size_t i = 0; i < nSteps; ++i)
+                    {
+                        nSum += vecBins[i];
+                    }
+
+                    double dSum{0.0};
+                    double dSumSq{0.0};
+                    for (std::size_t i = 0; i + nSteps <= nBins; ++i)
+                    {
+                        if (i > 0)
+                        {
+                            nSum += vecBins[i + nSteps - 1];
+                            nSum -= vecBins[i - 1];
+                        }
+
+                        const double dBps = static_cast<double>(nSum) * dScale;
+                        summary.dMinBps = summary.nSamples == 0 ? dBps : std::min(summary.dMinBps, dBps);
+                        summary.dMaxBps = std::max(summary.dMaxBps, dBps);
+                        dSum += dBps;
+                        dSumSq += dBps * dBps;
+                        ++summary.nSamples;
+
+                        if (m_config.bKeepSeries)
+                        {
+                            vecSeries.push_back(dBps);
+                        }
+                    }
+
+                    const double dN = static_cast<double>(summary.nSamples);
+                    summary.dMeanBps = dSum / dN;
+                    summary.dStdDevBps = std::sqrt(std::max(dSumSq / dN - summary.dMeanBps * summary.dMeanBps, 0.0));
+                }
+
+                window.mapSummaries[nPid] = summary;
+                if (m_config.bKeepSeries)
+                {
+                    window.mapSeries[nPid] = std::move(vecSeries);
+                }
+            };
+
+            fnSlide(g_nTsAllPids, vecTotal);
+            for (std::size_t i = 0; i < m_vecBins.size(); ++i)
+            {
+                fnSlide(m_vecPidOfIndex[i], m_vecBins[i]);
+            }
+
+            m_report.vecWindows.push_back(std::move(window));
+        }
+    }
+
+    const TsAnalyzerConfig &m_config;
+    TsAnalysisReport &m_report;
+    const int64_t m_nStepTicks;
+
+    std::array<int32_t, 8192> m_arrPidIdx{};
+    std::array<int8_t, 8192> m_arrLastCc{};
+    std::vector<TsPidReport *> m_vecPidReports;
+    std::vector<uint16_t> m_vecPidOfIndex;
+    std::vector<std::vector<uint32_t>> m_vecBins;
+
+    std::vector<PendingPacket> m_vecPending;
+    std::vector<PcrSample> m_vecPcr;
+
+    bool m_bHavePcr{false};
+    bool m_bHaveRate{false};
+    bool m_bHaveOrigin{false};
+    uint32_t m_nSegment{0};
+    uint64_t m_nLastOffset{0};
+    int64_t m_nLastTime{0};
+    int64_t m_nLastRaw{0};
+    int64_t m_nOrigin{0};
+    int64_t m_nEndTime{0};
+    double m_dTicksPerByte{0.0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+bool is_sync_run(const uint8_t *pData, const std::size_t nSize, const std::size_t nPos)
+{
+    for (std::size_t i = 1; i < 3; ++i)
+    {
+        const std::size_t nNext = nPos + i * g_nTsPacketSize;
+        if (nNext >= nSize)
+        {
+            break;
+        }
+        if (pData[nNext] != g_nTsSyncByte)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool walk_transport_stream(const uint8_t *const pData,
+                           const std::size_t nSize,
+                           const TsAnalyzerConfig &config,
+                           TsAnalysisReport &out_report,
+                           const MappedFile *pMappedFile)
+{
+    out_report = TsAnalysisReport{};
+    out_report.nFileBytes = nSize;
+
+    TsWalker walker{config, out_report};
+
+    std::size_t nPos = find_ts_sync(pData, nSize);
+    if (nPos == nSize)
+    {
+        std::cerr << "No MPEG-TS sync found" << std::endl;
+        return false;
+    }
+    if (nPos > 0)
+    {
+        ++out_report.nSyncLosses;
+    }
+
+    std::size_t nReleased = 0;
+
+    while (nPos + g_nTsPacketSize <= nSize)
+    {
+        if (pData[nPos] != g_nTsSyncByte)
+        {
+            ++out_report.nSyncLosses;
+            nPos += 1 + find_ts_sync(pData + nPos + 1, nSize - nPos - 1);
+            continue;
+        }
+
+        walker.on_packet(pData + nPos, nPos);
+        nPos += g_nTsPacketSize;
+
+        // Drop mapped pages well behind us, so a multi-GB capture does not
+        // end up in our resident set.
+        if (pMappedFile != nullptr && nPos - nReleased >= 2 * g_nReleaseChunk)
+        {
+            pMappedFile->release(nReleased, g_nReleaseChunk);
+            nReleased += g_nReleaseChunk;
+        }
+    }
+
+    walker.finish(nPos);
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+std::string pid_name(const uint16_t nPid)
+{
+    return nPid == g_nTsAllPids ? std::string{"all"} : std::to_string(nPid);
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+double TsAnalysisReport::null_share() const
+{
+    const auto it = mapPids.find(g_nTsNullPid);
+    if (it == mapPids.end() || nPackets == 0)
+    {
+        return 0.0;
+    }
+    return static_cast<double>(it->second.nPackets) / static_cast<double>(nPackets);
+}
+
+//////////////////////////////////////////////////////////////////////////
+std::size_t find_ts_sync(const uint8_t *pData, const std::size_t nSize)
+{
+    std::size_t i = 0;
+
+#if defined(__SSE2__)
+    // 16 candidate positions per compare; most blocks hold no 0x47 at all.
+    const __m128i vSync = _mm_set1_epi8(static_cast<char>(g_nTsSyncByte));
+    for (; i + 16 <= nSize; i += 16)
+    {
+        const __m128i vData = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pData + i));
+        unsigned nMask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(vData, vSync)));
+        while (nMask != 0)
+        {
+            const std::size_t nPos = i + static_cast<std::size_t>(__builtin_ctz(nMask));
+            if (is_sync_run(pData, nSize, nPos))
+            {
+                return nPos;
+            }
+            nMask &= nMask - 1;
+        }
+    }
+#endif
+
+    for (; i < nSize; ++i)
+    {
+        if (pData[i] == g_nTsSyncByte && is_sync_run(pData, nSize, i))
+        {
+            return i;
+        }
+    }
+    return nSize;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool analyze_transport_stream(const uint8_t *pData,
+                              const std::size_t nSize,
+                              const TsAnalyzerConfig &config,
+                              TsAnalysisReport &out_report)
+{
+    return walk_transport_stream(pData, nSize, config, out_report, nullptr);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool analyze_transport_stream(const std::string &strPath,
+                              const TsAnalyzerConfig &config,
+                              TsAnalysisReport &out_report)
+{
+    MappedFile file;
+    if (!file.open(strPath))
+    {
+        return false;
+    }
+
+    file.will_need(0, 2 * g_nReleaseChunk);
+    return walk_transport_stream(file.data(), file.size(), config, out_report, &file);
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_ts_report(const TsAnalysisReport &report)
+{
+    std::cout << std::fixed << std::setprecision(3)
+              << "Bytes:         " << report.nFileBytes << std::endl
+              << "Packets:       " << report.nPackets << std::endl
+              << "Sync losses:   " << report.nSyncLosses << std::endl
+              << "Duration:      " << report.dDurationSec << " s" << std::endl
+              << "Mux rate:      " << report.dMuxRateBps << " bit/s" << std::endl
+              << "Null share:    " << report.null_share() * 100.0 << " %" << std::endl;
+
+    const TsPcrReport &pcr = report.pcr;
+    if (pcr.bNoPcr)
+    {
+        std::cout << "PCR PID:       no PCR (" << pcr.nCount << " PCRs, fewer than two usable)" << std::endl;
+    }
+    else
+    {
+        std::cout << "PCR PID:       " << pcr.nPid << " (" << pcr.nCount << " PCRs, "
+                  << pcr.nDiscontinuities << " discontinuities)" << std::endl;
+    }
+    if (report.nUntimedPackets > 0)
+    {
+        std::cout << "Untimed:       " << report.nUntimedPackets << " packets, no PCR to time them" << std::endl;
+    }
+    std::cout << "PCR interval:  min " << pcr.dMinIntervalMs
+              << " / mean " << pcr.dMeanIntervalMs
+              << " / max " << pcr.dMaxIntervalMs << " ms, "
+              << pcr.nIntervalsOver40Ms << " over 40 ms" << std::endl
+              << "PCR accuracy:  max " << pcr.dMaxAbsOffsetNs
+              << " / rms " << pcr.dRmsOffsetNs << " ns, "
+              << pcr.nOffsetsOver500Ns << " over 500 ns" << std::endl;
+
+    std::cout << std::endl << "PID        packets    CC errors  PCRs" << std::endl;
+    for (const auto &[nPid, pidReport] : report.mapPids)
+    {
+        std::cout << std::left << std::setw(11) << nPid
+                  << std::setw(11) << pidReport.nPackets
+                  << std::setw(11) << pidReport.nContinuityErrors
+                  << pidReport.nPcrCount
+                  << std::right << std::endl;
+    }
+
+    for (const TsWindowReport &window : report.vecWindows)
+    {
+        std::cout << std::endl << "Window " << window.nWindowMs << " ms (bit/s):" << std::endl
+                  << "PID        min            mean           max            stddev" << std::endl;
+        for (const auto &[nPid, summary] : window.mapSummaries)
+        {
+            std::cout << std::left << std::setw(11) << pid_name(nPid)
+                      << std::setw(15) << summary.dMinBps
+                      << std::setw(15) << summary.dMeanBps
+                      << std::setw(15) << summary.dMaxBps
+                      << summary.dStdDevBps
+                      << std::right << std::endl;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool write_ts_report_csv(const TsAnalysisReport &report, const std::string &strPath)
+{
+    std::ofstream file{strPath};
+    if (!file)
+    {
+        std::cerr << "Could not open CSV output '" << strPath << "'" << std::endl;
+        return false;
+    }
+
+    file << "window_ms,start_s,pid,bitrate_bps\n";
+    for (const TsWindowReport &window : report.vecWindows)
+    {
+        for (const auto &[nPid, vecSeries] : window.mapSeries)
+        {
+            const std::string strPid = pid_name(nPid);
+            for (std::size_t i = 0; i < vecSeries.size(); ++i)
+            {
+                file << window.nWindowMs << ','
+                     << static_cast<double>(i * report.nStepMs) / 1000.0 << ','
+                     << strPid << ','
+                     << std::llround(vecSeries[i]) << '\n';
+            }
+        }
+    }
+
+    return static_cast<bool>(file);
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool write_ts_report_json(const TsAnalysisReport &report, const std::string &strPath)
+{
+    std::ofstream file{strPath};
+    if (!file)
+    {
+        std::cerr << "Could not open JSON output '" << strPath << "'" << std::endl;
+        return false;
+    }
+
+    const TsPcrReport &pcr = report.pcr;
+
+    file << std::fixed << std::setprecision(3)
+         << "{\n"
+         << "  \"file_bytes\": " << report.nFileBytes << ",\n"
+         << "  \"packets\": " << report.nPackets << ",\n"
+         << "  \"sync_losses\": " << report.nSyncLosses << ",\n"
+         << "  \"duration_s\": " << report.dDurationSec << ",\n"
+         << "  \"mux_rate_bps\": " << report.dMuxRateBps << ",\n"
+         << "  \"null_share\": " << report.null_share() << ",\n"
+         << "  \"untimed_packets\": " << report.nUntimedPackets << ",\n"
+         << "  \"pcr\": {\n"
+         << "    \"no_pcr\": " << (pcr.bNoPcr ? "true" : "false") << ",\n"
+         << "    \"pid\": " << pcr.nPid << ",\n"
+         << "    \"count\": " << pcr.nCount << ",\n"
+         << "    \"discontinuities\": " << pcr.nDiscontinuities << ",\n"
+         << "    \"interval_min_ms\": " << pcr.dMinIntervalMs << ",\n"
+         << "    \"interval_mean_ms\": " << pcr.dMeanIntervalMs << ",\n"
+         << "    \"interval_max_ms\": " << pcr.dMaxIntervalMs << ",\n"
+         << "    \"intervals_over_40ms\": " << pcr.nIntervalsOver40Ms << ",\n"
+         << "    \"accuracy_max_ns\": " << pcr.dMaxAbsOffsetNs << ",\n"
+         << "    \"accuracy_rms_ns\": " << pcr.dRmsOffsetNs << ",\n"
+         << "    \"accuracy_over_500ns\": " << pcr.nOffsetsOver500Ns << "\n"
+         << "  },\n"
+         << "  \"pids\": [";
+
+    bool bFirst = true;
+    for (const auto &[nPid, pidReport] : report.mapPids)
+    {
+        file << (bFirst ? "\n" : ",\n")
+             << "    {\"pid\": " << nPid
+             << ", \"packets\": " << pidReport.nPackets
+             << ", \"cc_errors\": " << pidReport.nContinuityErrors
+             << ", \"pcr_count\": " << pidReport.nPcrCount << "}";
+        bFirst = false;
+    }
+
+    file << "\n  ],\n  \"windows\": [";
+
+    bFirst = true;
+    for (const TsWindowReport &window : report.vecWindows)
+    {
+        file << (bFirst ? "\n" : ",\n")
+             << "    {\"window_ms\": " << window.nWindowMs << ", \"pids\": [";
+        bool bFirstPid = true;
+        for (const auto &[nPid, summary] : window.mapSummaries)
+        {
+            file << (bFirstPid ? "\n" : ",\n")
+                 << "      {\"pid\": " << nPid
+                 << ", \"min_bps\": " << summary.dMinBps
+                 << ", \"mean_bps\": " << summary.dMeanBps
+                 << ", \"max_bps\": " << summary.dMaxBps
+                 << ", \"stddev_bps\": " << summary.dStdDevBps
+                 << ", \"samples\": " << summary.nSamples << "}";
+            bFirstPid = false;
+        }
+        file << "\n    ]}";
+        bFirst = false;
+    }
+
+    file << "\n  ]\n}\n";
+    return static_cast<bool>(file);
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ts_constants.hpp"
+
+//////////////////////////////////////////////////////////////////////////
+// MPEG-TS bitrate/PCR analyzer. Walks a transport stream file (memory
+// mapped) packet by packet, using the PCR of a single programme as the
+// time base, and reports:
+//   * per-PID bitrate over one or more sliding windows,
+//   * null-packet share,
+//   * PCR interval and PCR accuracy (offset from the least-squares
+//     constant-rate line through all PCRs in a segment).
+//
+// Cost is O(1) per packet; only one PCR sample per PCR and one counter per
+// PID per time step are stored.
+
+// Pseudo PID used for the whole-multiplex totals.
+constexpr uint16_t g_nTsAllPids = 0x2000;
+
+//////////////////////////////////////////////////////////////////////////
+struct TsAnalyzerConfig
+{
+    // Window lengths, in milliseconds. Each is rounded up to a multiple of
+    // nStepMs, which is also the distance the windows slide by.
+    std::vector<uint32_t> vecWindowsMs{10, 100, 1000};
+    uint32_t nStepMs{10};
+
+    // PID whose PCR drives the time base; -1 = first PID seen carrying a PCR.
+    int nPcrPid{-1};
+
+    // Keep the full per-window series (needed for CSV export).
+    bool bKeepSeries{false};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct TsRateSummary
+{
+    double dMinBps{0.0};
+    double dMaxBps{0.0};
+    double dMeanBps{0.0};
+    double dStdDevBps{0.0};
+    std::size_t nSamples{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct TsWindowReport
+{
+    uint32_t nWindowMs{0};
+    std::map<uint16_t, TsRateSummary> mapSummaries;
+
+    // Only populated when TsAnalyzerConfig::bKeepSeries is set. Sample i
+    // covers [i * nStepMs, i * nStepMs + nWindowMs).
+    std::map<uint16_t, std::vector<double>> mapSeries;
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct TsPidReport
+{
+    uint64_t nPackets{0};
+    uint64_t nContinuityErrors{0};
+    uint64_t nPcrCount{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct TsPcrReport
+{
+    // Fewer than two usable PCRs: there is no time base, so no bitrates.
+    bool bNoPcr{false};
+
+    int nPid{-1};
+    uint64_t nCount{0};
+    uint64_t nDiscontinuities{0};
+
+    double dMinIntervalMs{0.0};
+    double dMaxIntervalMs{0.0};
+    double dMeanIntervalMs{0.0};
+
+    // Intervals above the 40 ms DVB (ETSI TR 101 290) limit.
+    uint64_t nIntervalsOver40Ms{0};
+
+    // PCR accuracy, against the constant-rate fit. ISO/IEC 13818-1 allows
+    // +/-500 ns.
+    double dMaxAbsOffsetNs{0.0};
+    double dRmsOffsetNs{0.0};
+    uint64_t nOffsetsOver500Ns{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct TsAnalysisReport
+{
+    uint64_t nFileBytes{0};
+    uint64_t nPackets{0};
+    uint64_t nSyncLosses{0};
+    double dDurationSec{0.0};
+    double dMuxRateBps{0.0};
+    uint32_t nStepMs{0};
+
+    // Packets left out of the bitrate windows because too many came
+    // before a PCR could time them.
+    uint64_t nUntimedPackets{0};
+
+    std::map<uint16_t, TsPidReport> mapPids;
+    TsPcrReport pcr;
+    std::vector<TsWindowReport> vecWindows;
+
+    double null_share() const;
+};
+
+//////////////////////////////////////////////////////////////////////////
+bool analyze_transport_stream(const std::string &strPath,
+                              const TsAnalyzerConfig &config,
+                              TsAnalysisReport &out_report);
+
+// Same analysis, over a stream already in memory.
+bool analyze_transport_stream(const uint8_t *pData,
+                              std::size_t nSize,
+                              const TsAnalyzerConfig &config,
+                              TsAnalysisReport &out_report);
+
+//////////////////////////////////////////////////////////////////////////
+// Offset of the first byte at or after pData that begins three consecutive
+// 188-byte packets (or a final partial run), or nSize if there is none.
+std::size_t find_ts_sync(const uint8_t *pData, std::size_t nSize);
+
+//////////////////////////////////////////////////////////////////////////
+void print_ts_report(const TsAnalysisReport &report);
+bool write_ts_report_csv(const TsAnalysisReport &report, const std::string &strPath);
+bool write_ts_report_json(const TsAnalysisReport &report, const std::string &strPath);
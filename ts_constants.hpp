@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//////////////////////////////////////////////////////////////////////////
+// MPEG-TS packet constants shared by the analyzer and the native muxer.
+
+constexpr std::size_t g_nTsPacketSize = 188;
+constexpr uint8_t g_nTsSyncByte = 0x47;
+constexpr uint16_t g_nTsNullPid = 0x1FFF;
@@ -0,0 +1,159 @@
+#include "vbv_model.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+//////////////////////////////////////////////////////////////////////////
+VbvModel::VbvModel(const VbvConfig &config, const AVRational timeBase)
+    : m_config(config),
+      m_timeBase(timeBase)
+{
+}
+
+//////////////////////////////////////////////////////////////////////////
+VbvConfig VbvModel::config_from_encoder(const AVCodecContext *pCdcCtx, const bool bFailFast)
+{
+    VbvConfig config{};
+    config.nBufferBits = pCdcCtx->rc_buffer_size;
+    config.nRateBps = pCdcCtx->rc_max_rate > 0 ? pCdcCtx->rc_max_rate : pCdcCtx->bit_rate;
+    config.nInitialBits = pCdcCtx->rc_initial_buffer_occupancy > 0
+        ? pCdcCtx->rc_initial_buffer_occupancy
+        : pCdcCtx->rc_buffer_size;
+    config.bFailFast = bFailFast;
+    return config;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool VbvModel::open_log(const std::string &strPath)
+{
+    m_log.open(strPath);
+    if (!m_log)
+    {
+        std::cerr << "Could not open VBV log '" << strPath << "'" << std::endl;
+        return false;
+    }
+
+    m_log << "dts,frame_bits,fullness_before_bits,fullness_after_bits,event\n";
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+bool VbvModel::add_frame(const int64_t nDts, const int nFrameBytes, VbvFrameState &out_state)
+{
+    const int64_t nDen = m_timeBase.den;
+    const int64_t nBufferScaled = m_config.nBufferBits * nDen;
+
+    if (!m_bStarted)
+    {
+        m_nFullnessScaled = std::min(m_config.nInitialBits, m_config.nBufferBits) * nDen;
+        m_bStarted = true;
+    }
+    else
+    {
+        // rate [bit/s] * ticks * num / den [s], kept scaled by den.
+        const int64_t nTicks = std::max<int64_t>(nDts - m_nLastDts, 0);
+        m_nFullnessScaled += m_config.nRateBps * nTicks * m_timeBase.num;
+    }
+    m_nLastDts = nDts;
+
+    out_state = VbvFrameState{};
+    out_state.nDts = nDts;
+    out_state.nFrameBits = nFrameBytes * 8;
+
+    if (m_nFullnessScaled > nBufferScaled)
+    {
+        out_state.bOverflow = true;
+        ++m_stats.nOverflows;
+        m_nFullnessScaled = nBufferScaled;
+    }
+
+    out_state.dFullnessBeforeBits = static_cast<double>(m_nFullnessScaled) / nDen;
+
+    const int64_t nFrameScaled = static_cast<int64_t>(out_state.nFrameBits) * nDen;
+    if (nFrameScaled > m_nFullnessScaled)
+    {
+        out_state.bUnderflow = true;
+        ++m_stats.nUnderflows;
+        m_nFullnessScaled = 0;
+    }
+    else
+    {
+        m_nFullnessScaled -= nFrameScaled;
+    }
+
+    out_state.dFullnessAfterBits = static_cast<double>(m_nFullnessScaled) / nDen;
+
+    if (m_stats.nFrames == 0)
+    {
+        m_stats.dMinFullnessBits = out_state.dFullnessAfterBits;
+        m_stats.dMaxFullnessBits = out_state.dFullnessBeforeBits;
+    }
+    else
+    {
+        m_stats.dMinFullnessBits = std::min(m_stats.dMinFullnessBits, out_state.dFullnessAfterBits);
+        m_stats.dMaxFullnessBits = std::max(m_stats.dMaxFullnessBits, out_state.dFullnessBeforeBits);
+    }
+    ++m_stats.nFrames;
+
+    if (m_log.is_open())
+    {
+        m_log << nDts << ','
+              << out_state.nFrameBits << ','
+              << out_state.dFullnessBeforeBits << ','
+              << out_state.dFullnessAfterBits << ','
+              << (out_state.bUnderflow ? "underflow" : out_state.bOverflow ? "overflow" : "")
+              << '\n';
+    }
+
+    if (out_state.bUnderflow || out_state.bOverflow)
+    {
+        if (!m_config.bQuiet)
+        {
+            std::cerr << "VBV "
+                      << (out_state.bUnderflow ? "underflow" : "overflow")
+                      << " at DTS="
+                      << nDts
+                      << ": frame="
+                      << out_state.nFrameBits
+                      << " bits, fullness="
+                      << out_state.dFullnessBeforeBits
+                      << "/"
+                      << m_config.nBufferBits
+                      << " bits"
+                      << std::endl;
+        }
+
+        return !m_config.bFailFast;
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+double VbvModel::fullness_at(const int64_t nDts) const
+{
+    const int64_t nTicks = std::max<int64_t>(nDts - m_nLastDts, 0);
+    const int64_t nScaled = std::min(m_nFullnessScaled + m_config.nRateBps * nTicks * m_timeBase.num,
+                                     m_config.nBufferBits * m_timeBase.den);
+    return static_cast<double>(nScaled) / m_timeBase.den;
+}
+
+//////////////////////////////////////////////////////////////////////////
+void print_vbv_stats(const VbvModel &model)
+{
+    const VbvStats &stats = model.stats();
+    const double dBuffer = static_cast<double>(std::max<int64_t>(model.config().nBufferBits, 1));
+
+    std::cout << "VBV: frames="
+              << stats.nFrames
+              << ", underflows="
+              << stats.nUnderflows
+              << ", overflows="
+              << stats.nOverflows
+              << ", fullness min="
+              << stats.dMinFullnessBits * 100.0 / dBuffer
+              << "%, max="
+              << stats.dMaxFullnessBits * 100.0 / dBuffer
+              << "%"
+              << std::endl;
+}
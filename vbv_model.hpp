@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Decoder-side VBV (H.264 HRD CPB) model for a constant-rate channel.
+//
+// Bits arrive at nRateBps from the moment the first frame starts arriving;
+// the first frame is removed once nInitialBits are buffered, and each
+// subsequent frame is removed instantaneously at its DTS. A frame larger
+// than the buffer fullness at its removal time is an underflow; fullness
+// that would exceed nBufferBits is an overflow (the CBR HRD does not allow
+// arrival to stall).
+//
+// Fullness is tracked exactly, in bits scaled by the time base denominator,
+// so each frame costs O(1) integer arithmetic.
+struct VbvConfig
+{
+    int64_t nBufferBits{0};
+    int64_t nRateBps{0};
+    int64_t nInitialBits{0};
+
+    // Report a violation as a failure from add_frame() rather than just
+    // counting it.
+    bool bFailFast{false};
+
+    // Count violations without printing them, for trial runs whose caller
+    // reports the outcome itself.
+    bool bQuiet{false};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct VbvFrameState
+{
+    int64_t nDts{0};
+    int nFrameBits{0};
+    double dFullnessBeforeBits{0.0};
+    double dFullnessAfterBits{0.0};
+    bool bUnderflow{false};
+    bool bOverflow{false};
+};
+
+//////////////////////////////////////////////////////////////////////////
+struct VbvStats
+{
+    uint64_t nFrames{0};
+    uint64_t nUnderflows{0};
+    uint64_t nOverflows{0};
+    double dMinFullnessBits{0.0};
+    double dMaxFullnessBits{0.0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+class VbvModel
+{
+public:
+    VbvModel(const VbvConfig &config, AVRational timeBase);
+
+    // Configures the model from an opened encoder's rate control settings.
+    static VbvConfig config_from_encoder(const AVCodecContext *pCdcCtx, bool bFailFast);
+
+    bool enabled() const { return m_config.nBufferBits > 0 && m_config.nRateBps > 0; }
+
+    // Optional per-frame CSV trace.
+    bool open_log(const std::string &strPath);
+
+    // Runs one encoded frame (DTS in the encoder time base) through the
+    // buffer. Returns false only on a violation in fail-fast mode.
+    bool add_frame(int64_t nDts, int nFrameBytes, VbvFrameState &out_state);
+
+    // Fullness (bits) a frame removed at nDts would find, i.e. where a
+    // stream continuing this one has to start. Only meaningful once at
+    // least one frame has been added.
+    double fullness_at(int64_t nDts) const;
+
+    const VbvStats &stats() const { return m_stats; }
+    const VbvConfig &config() const { return m_config; }
+
+private:
+    const VbvConfig m_config;
+    const AVRational m_timeBase;
+
+    // Buffer fullness in bits * m_timeBase.den.
+    int64_t m_nFullnessScaled{0};
+    int64_t m_nLastDts{0};
+    bool m_bStarted{false};
+
+    VbvStats m_stats;
+    std::ofstream m_log;
+};
+
+//////////////////////////////////////////////////////////////////////////
+void print_vbv_stats(const VbvModel &model);